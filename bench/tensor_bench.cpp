@@ -0,0 +1,433 @@
+#include "../include/tensor.h"
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Google Benchmark suite for the hot paths of tensor.h.
+//
+// Each operation is run for float and double, ranks 1-5, and sizes from L1-resident to larger
+// than the last level cache, as are the kernels that widen 16-bit storage (half, bfloat16 and
+// packed int16). Operations along an axis are run for every axis. Names are
+// "<operation><type>/rank:R/n:N[/axis:A]", and each result reports bytes/s (bytes read and
+// written by the operation once) and elements/s.
+//
+// run:       ./tensor_bench [--tensor_max_elements=N] [benchmark options]
+// baseline:  ./tensor_bench --benchmark_out=baseline.json --benchmark_out_format=json
+
+namespace {
+
+const double elem_scale = 1e-3;	// keeps sums and products far from overflow
+
+/// Near-cubic dimensions of the given rank with (about) n elements in total.
+std::vector<std::ptrdiff_t> bench_dim(int rank, std::ptrdiff_t n){
+	std::vector<std::ptrdiff_t> dim(rank, std::max<std::ptrdiff_t>(1, std::ptrdiff_t(std::round(std::pow(double(n), 1.0/rank)))));
+	std::ptrdiff_t rest = n;
+	for (int i=1; i<rank; ++i) rest /= dim[i];
+	dim[0] = std::max<std::ptrdiff_t>(1, rest);
+	return dim;
+}
+
+template <class T>
+Tensor<T> bench_tensor(const std::vector<std::ptrdiff_t>& dim){
+	Tensor<T> t(dim);
+	t.fill_sequence();
+	t *= T(elem_scale);
+	return t;
+}
+
+/// Dimensions after removing 'axis'.
+std::vector<std::ptrdiff_t> reduced(std::vector<std::ptrdiff_t> dim, int axis){
+	dim.erase(dim.begin() + (dim.size()-1-axis));
+	return dim;
+}
+
+std::ptrdiff_t bench_size(const std::vector<std::ptrdiff_t>& dim){
+	std::ptrdiff_t n = 1;
+	for (std::ptrdiff_t d : dim) n *= d;
+	return n;
+}
+
+void set_throughput(benchmark::State& state, std::ptrdiff_t elements, std::ptrdiff_t bytes){
+	state.SetItemsProcessed(state.iterations()*elements);
+	state.SetBytesProcessed(state.iterations()*bytes);
+}
+
+template <class T> const char* type_name();
+template <> const char* type_name<float>(){ return "<float>"; }
+template <> const char* type_name<double>(){ return "<double>"; }
+template <> const char* type_name<TensorHalf>(){ return "<half>"; }
+template <> const char* type_name<TensorBFloat16>(){ return "<bfloat16>"; }
+
+
+// ---- operations along an axis ----
+
+template <class T>
+void bm_accumulate(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	Tensor<T> out(reduced(dim, axis));
+	for (auto _ : state){
+		t.accumulate(out, 0, axis, std::plus<double>());
+		benchmark::DoNotOptimize(out.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(t.dim), (bench_size(t.dim) + bench_size(out.dim))*sizeof(T));
+}
+
+template <class T>
+void bm_avg_dim(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::vector<double> w(dim[dim.size()-1-axis], 0.5);
+	Tensor<T> out(reduced(dim, axis));
+	for (auto _ : state){
+		t.avg_dim(out, axis, w);
+		benchmark::DoNotOptimize(out.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(t.dim), (bench_size(t.dim) + bench_size(out.dim))*sizeof(T));
+}
+
+template <class T>
+void bm_max_dim(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	Tensor<T> out(reduced(dim, axis));
+	for (auto _ : state){
+		t.max_dim(out, axis);
+		benchmark::DoNotOptimize(out.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(t.dim), (bench_size(t.dim) + bench_size(out.dim))*sizeof(T));
+}
+
+template <class T>
+void bm_transform(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::vector<double> w(dim[dim.size()-1-axis], 1.0);
+	for (auto _ : state){
+		t.transform(axis, std::multiplies<double>(), w);
+		benchmark::DoNotOptimize(t.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(t.dim), 2*bench_size(t.dim)*sizeof(T));
+}
+
+// visit every plane along the axis, as user code does with the returned indices
+template <class T>
+void bm_plane(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::vector<std::ptrdiff_t> locs;
+	std::ptrdiff_t n = dim[dim.size()-1-axis];
+	for (auto _ : state){
+		double s = 0;
+		for (std::ptrdiff_t k=0; k<n; ++k){
+			t.plane(locs, axis, k);
+			for (std::ptrdiff_t loc : locs) s += t[loc];
+		}
+		benchmark::DoNotOptimize(s);
+	}
+	set_throughput(state, bench_size(t.dim), bench_size(t.dim)*(sizeof(T) + sizeof(std::ptrdiff_t)));
+}
+
+template <class T>
+void bm_sum_axes(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::vector<int> axes;
+	for (int i=0; i<int(dim.size()); ++i) if (i != axis) axes.push_back(i);
+	for (auto _ : state){
+		Tensor<T> s = t.sum(axes);
+		benchmark::DoNotOptimize(s.vec.data());
+	}
+	set_throughput(state, bench_size(t.dim), (bench_size(t.dim) + dim[dim.size()-1-axis])*sizeof(T));
+}
+
+
+// running reductions over windows of (up to) 16 steps along the axis
+template <class T>
+void bm_rolling_mean(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::ptrdiff_t w = std::min<std::ptrdiff_t>(16, dim[dim.size()-1-axis]);
+	for (auto _ : state){
+		Tensor<T> r = t.rolling_mean(axis, w);
+		benchmark::DoNotOptimize(r.vec.data());
+	}
+	set_throughput(state, bench_size(t.dim), 2*bench_size(t.dim)*sizeof(T));
+}
+
+template <class T>
+void bm_rolling_max(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	std::ptrdiff_t w = std::min<std::ptrdiff_t>(16, dim[dim.size()-1-axis]);
+	for (auto _ : state){
+		Tensor<T> r = t.rolling_max(axis, w);
+		benchmark::DoNotOptimize(r.vec.data());
+	}
+	set_throughput(state, bench_size(t.dim), 2*bench_size(t.dim)*sizeof(T));
+}
+
+// contract the axis with a {16, n} matrix, as in vertical interpolation
+template <class T>
+void bm_contract(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	Tensor<T> t = bench_tensor<T>(dim);
+	Tensor<T> m = bench_tensor<T>({16, dim[dim.size()-1-axis]});
+	for (auto _ : state){
+		Tensor<T> c = contract(t, axis, m, 0);
+		benchmark::DoNotOptimize(c.vec.data());
+	}
+	set_throughput(state, bench_size(t.dim), (bench_size(t.dim) + 16*bench_size(reduced(dim, axis)))*sizeof(T));
+}
+
+
+// ---- elementwise operators ----
+
+template <class T>
+void bm_add_assign(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim), b = bench_tensor<T>(dim);
+	for (auto _ : state){
+		a += b;
+		benchmark::DoNotOptimize(a.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(a.dim), 3*bench_size(a.dim)*sizeof(T));
+}
+
+template <class T>
+void bm_scale(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	for (auto _ : state){
+		a *= T(1);
+		benchmark::DoNotOptimize(a.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(a.dim), 2*bench_size(a.dim)*sizeof(T));
+}
+
+template <class T>
+void bm_expr(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim), b = bench_tensor<T>(dim), c = bench_tensor<T>(dim);
+	Tensor<T> r(dim);
+	for (auto _ : state){
+		r = a*b + c*T(2);
+		benchmark::DoNotOptimize(r.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(r.dim), 4*bench_size(r.dim)*sizeof(T));
+}
+
+// a tensor combined with a broadcast operand that has the inner rank-1 dimensions
+template <class T>
+void bm_broadcast_outer(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	Tensor<T> f = bench_tensor<T>(std::vector<std::ptrdiff_t>(dim.begin()+1, dim.end()));
+	for (auto _ : state){
+		a += f;
+		benchmark::DoNotOptimize(a.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(a.dim), (2*bench_size(a.dim) + bench_size(f.dim))*sizeof(T));
+}
+
+template <class T>
+void bm_permute_copy(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	std::vector<int> order;
+	for (int i=int(dim.size())-1; i>=0; --i) order.push_back(i);
+	for (auto _ : state){
+		Tensor<T> p(a.view().permute(order));
+		benchmark::DoNotOptimize(p.vec.data());
+	}
+	set_throughput(state, bench_size(a.dim), 2*bench_size(a.dim)*sizeof(T));
+}
+
+// the tiles of a matrix transposed in the order of strided_copy(), with the vector kernel or 
+// (LOOP) with the plain loop over the tile that it replaces
+template <class T, bool LOOP>
+void bm_transpose_tiles(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	Tensor<T> b({dim[1], dim[0]});
+	const std::ptrdiff_t m = dim[0], n = dim[1], t = tensor_detail::copy_tile;
+	for (auto _ : state){
+		for (std::ptrdiff_t ic=0; ic<n; ic += t){
+			for (std::ptrdiff_t il=0; il<m; il += t){
+				const T* src = a.vec.data() + il*n + ic;
+				T* dst = b.vec.data() + ic*m + il;
+				std::ptrdiff_t rows = std::min(t, m-il), cols = std::min(t, n-ic);
+				if (LOOP) for (std::ptrdiff_t i=0; i<rows; ++i) for (std::ptrdiff_t j=0; j<cols; ++j) dst[j*m + i] = src[i*n + j];
+				else tensor_detail::simd::transpose_tile(src, n, dst, m, rows, cols);
+			}
+		}
+		benchmark::DoNotOptimize(b.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(a.dim), 2*bench_size(a.dim)*sizeof(T));
+}
+
+
+// sweep with coordinates, as user code that needs the position of each element does
+template <class T>
+void bm_indices(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	for (auto _ : state){
+		double s = 0;
+		for (const auto& c : a.indices()) s += c.ix[0]*a[c.loc];
+		benchmark::DoNotOptimize(s);
+	}
+	set_throughput(state, bench_size(a.dim), bench_size(a.dim)*sizeof(T));
+}
+
+// a timestep of many small operations: 64 tensors with the elements of dim between them, each 
+// updated, scaled and reduced, one operation at a time or recorded once on a TensorGraph
+template <class T, bool DEFERRED>
+void bm_small_ops(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	const int ntensors = 64;
+	std::vector<std::ptrdiff_t> d = {std::max<std::ptrdiff_t>(1, bench_size(dim)/ntensors)};
+	std::vector<Tensor<T>> a(ntensors, bench_tensor<T>(d)), b(ntensors, bench_tensor<T>(d));
+	std::vector<Tensor<T>> s(ntensors, Tensor<T>(std::vector<std::ptrdiff_t>()));
+	TensorGraph g;
+	for (int k=0; k<ntensors; ++k) g.add(a[k], b[k]).mul(a[k], T(0.5)).accumulate(s[k], a[k], T(0), 0, std::plus<double>());
+	for (auto _ : state){
+		if (DEFERRED) g.eval();
+		else for (int k=0; k<ntensors; ++k){
+			a[k] += b[k];
+			a[k] *= T(0.5);
+			a[k].accumulate(s[k], T(0), 0, std::plus<double>());
+		}
+		benchmark::DoNotOptimize(s.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, ntensors*d[0], 4*ntensors*d[0]*sizeof(T));
+}
+
+// ---- reduced-precision storage ----
+
+// avg_dim of a float tensor packed as int16 (bytes are those of the packed data)
+void bm_packed_avg_dim(benchmark::State& state, std::vector<std::ptrdiff_t> dim, int axis){
+	PackedTensor<float> t(bench_tensor<float>(dim));
+	std::vector<double> w(dim[dim.size()-1-axis], 0.5);
+	for (auto _ : state){
+		Tensor<float> out = t.avg_dim(axis, w);
+		benchmark::DoNotOptimize(out.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(t.dim()), bench_size(t.dim())*sizeof(std::int16_t));
+}
+
+// a *= s with a float scalar, computed in float
+template <class T>
+void bm_scale_float(benchmark::State& state, std::vector<std::ptrdiff_t> dim){
+	Tensor<T> a = bench_tensor<T>(dim);
+	for (auto _ : state){
+		a *= 1.f;
+		benchmark::DoNotOptimize(a.vec.data());
+		benchmark::ClobberMemory();
+	}
+	set_throughput(state, bench_size(a.dim), 2*bench_size(a.dim)*sizeof(T));
+}
+
+// ---- registration ----
+
+typedef void (*axis_bench)(benchmark::State&, std::vector<std::ptrdiff_t>, int);
+typedef void (*elementwise_bench)(benchmark::State&, std::vector<std::ptrdiff_t>);
+
+template <class T>
+void register_shapes(const std::vector<std::pair<const char*, axis_bench>>& axis_benches, 
+                     const std::vector<std::pair<const char*, elementwise_bench>>& elementwise_benches, std::ptrdiff_t max_elements){
+	for (int rank=1; rank<=5; ++rank){
+		for (std::ptrdiff_t n=std::ptrdiff_t(1)<<8; n<=max_elements; n <<= 4){	// 2 KB of float to beyond the LLC
+			std::vector<std::ptrdiff_t> dim = bench_dim(rank, n);
+			std::string shape = std::string(type_name<T>()) + "/rank:" + std::to_string(rank) + "/n:" + std::to_string(bench_size(dim));
+			for (const auto& b : axis_benches){
+				for (int axis=0; axis<rank; ++axis){
+					std::string name = b.first + shape + "/axis:" + std::to_string(axis);
+					benchmark::RegisterBenchmark(name.c_str(), b.second, dim, axis);
+				}
+			}
+			for (const auto& b : elementwise_benches){
+				if (rank == 1 && b.second == &bm_broadcast_outer<T>) continue;
+				std::string name = b.first + shape;
+				benchmark::RegisterBenchmark(name.c_str(), b.second, dim);
+			}
+		}
+	}
+}
+
+template <class T>
+void register_all(std::ptrdiff_t max_elements){
+	const std::vector<std::pair<const char*, axis_bench>> axis_benches = {
+		{"accumulate", &bm_accumulate<T>},
+		{"avg_dim", &bm_avg_dim<T>},
+		{"max_dim", &bm_max_dim<T>},
+		{"transform", &bm_transform<T>},
+		{"plane", &bm_plane<T>},
+		{"sum_other_axes", &bm_sum_axes<T>},
+		{"contract", &bm_contract<T>},
+		{"rolling_mean", &bm_rolling_mean<T>},
+		{"rolling_max", &bm_rolling_max<T>},
+	};
+	const std::vector<std::pair<const char*, elementwise_bench>> elementwise_benches = {
+		{"add_assign", &bm_add_assign<T>},
+		{"scale", &bm_scale<T>},
+		{"expr", &bm_expr<T>},
+		{"broadcast_outer", &bm_broadcast_outer<T>},
+		{"permute_copy", &bm_permute_copy<T>},
+		{"indices", &bm_indices<T>},
+		{"small_ops", &bm_small_ops<T,false>},
+		{"small_ops_graph", &bm_small_ops<T,true>},
+	};
+
+	register_shapes<T>(axis_benches, elementwise_benches, max_elements);
+}
+
+// 16-bit element types: the reductions and arithmetic that widen to float
+template <class T>
+void register_storage(std::ptrdiff_t max_elements){
+	const std::vector<std::pair<const char*, axis_bench>> axis_benches = {
+		{"accumulate", &bm_accumulate<T>},
+		{"avg_dim", &bm_avg_dim<T>},
+		{"max_dim", &bm_max_dim<T>},
+	};
+	const std::vector<std::pair<const char*, elementwise_bench>> elementwise_benches = {
+		{"add_assign", &bm_add_assign<T>},
+		{"scale_float", &bm_scale_float<T>},
+	};
+	register_shapes<T>(axis_benches, elementwise_benches, max_elements);
+}
+
+template <class T>
+void register_transpose(std::ptrdiff_t max_elements){
+	for (std::ptrdiff_t n=std::ptrdiff_t(1)<<8; n<=max_elements; n <<= 4){
+		std::vector<std::ptrdiff_t> dim = bench_dim(2, n);
+		std::string shape = std::string(type_name<T>()) + "/rank:2/n:" + std::to_string(bench_size(dim));
+		benchmark::RegisterBenchmark(("transpose_tiles" + shape).c_str(), &bm_transpose_tiles<T,false>, dim);
+		benchmark::RegisterBenchmark(("transpose_tiles_loop" + shape).c_str(), &bm_transpose_tiles<T,true>, dim);
+	}
+}
+
+} // namespace
+
+
+int main(int argc, char** argv){
+	// sizes go up to 2^24 elements (64 MB of float, 128 MB of double) unless capped
+	std::ptrdiff_t max_elements = std::ptrdiff_t(1) << 24;
+	const char* flag = "--tensor_max_elements=";
+	int nargs = 0;
+	for (int i=0; i<argc; ++i){
+		if (std::strncmp(argv[i], flag, std::strlen(flag)) == 0) max_elements = std::atoll(argv[i] + std::strlen(flag));
+		else argv[nargs++] = argv[i];
+	}
+	argc = nargs;
+
+	register_all<float>(max_elements);
+	register_all<double>(max_elements);
+	register_storage<TensorHalf>(max_elements);
+	register_storage<TensorBFloat16>(max_elements);
+	register_shapes<float>({{"packed_avg_dim", &bm_packed_avg_dim}}, {}, max_elements);
+	register_transpose<float>(max_elements);
+	register_transpose<double>(max_elements);
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
@@ -4,10 +4,39 @@
 #include <iostream>
 #include <cassert>
 #include <vector>
+#include <array>
 #include <functional>
 #include <algorithm>
 
 #include <numeric>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <cstdio>
+#include <chrono>
+#include <map>
+#include <deque>
+#include <exception>
+
+#ifdef TENSOR_BLAS
+#include <cblas.h>
+#endif
 
 
 /**
@@ -50,342 +79,6733 @@
  */
 
 
-template <class T>
-class Tensor{
-	private:
-	std::vector<int> offsets;
-	int nelem;
-	
-	public:
-	std::vector<int> dim;
-	std::vector<T> vec;
+/// Rank parameter of a Tensor whose number of dimensions is only known at runtime.
+constexpr int dynamic_rank = -1;
 
-	/// Create a tensor with specified dimensions.
-	/// This function also allocates space for the tensor, and calculates the offsets used for indexing.
-	Tensor(std::vector<int> _dim){
-		dim = _dim;
-		nelem = std::accumulate(dim.begin(), dim.end(), 1, std::multiplies<int>());
-		vec.resize(nelem);
+template <class T, int N = dynamic_rank, class Alloc = std::allocator<T>> class Tensor;
+template <class T> class TensorView;
+template <class E> class TensorExpr;
 
-		int ndim = dim.size();
-		offsets.resize(ndim,0);
-		int p = 1;
-		for (int i=ndim-1; i>=0; --i){
-			offsets[i] = p;
-			p *= dim[i];
-		}
-		
-	}
+namespace tensor_detail{
 
+/// True for types that can appear as tensor operands of the arithmetic operators 
+/// (tensors, views and expressions), as opposed to scalars.
+template <class X> struct is_tensor_operand_impl : std::is_base_of<TensorExpr<X>, X> {};
+template <class T, int N, class A> struct is_tensor_operand_impl<Tensor<T,N,A>> : std::true_type {};
+template <class T> struct is_tensor_operand_impl<TensorView<T>> : std::true_type {};
 
-	/// Print the tensor.
-	/// If vals is true, then values are also printed. Otherwise, only metadata is printed.
-	void print(bool vals = true){
-	    std::cout << "Tensor:\n";
-	    std::cout << "   dims = "; for (auto d : dim) std::cout << d << " "; std::cout << "\n";
-	    std::cout << "   offs = "; for (auto d : offsets) std::cout << d << " "; std::cout << "\n";
-		if (vals){
-			std::cout << "   vals = \n      "; std::cout.flush();
-			for (int i=0; i<nelem; ++i){
-				std::cout << vec[i] << " "; 
-				bool flag = true;
-				for (int axis=dim.size()-1; axis>0; --axis){
-					flag = flag && (index(i)[axis] == dim[axis]-1);
-					if (flag) std::cout << "\n      ";
-				}
-			}
+template <class X> 
+struct is_tensor_operand : is_tensor_operand_impl<typename std::decay<X>::type> {};
+
+template <class T, class E, class F> 
+void assign_expr(const TensorView<T>& dst, const TensorExpr<E>& e, F f);
+
+template <class Ev, class U, class BinOp>
+void reduce_expr(const Ev& bound, const std::vector<std::ptrdiff_t>& dim, int a, const double* w, U* out, double v0, BinOp binary_op);
+
+/// Plain assignment for assign_expr(). Being a distinct type, it lets assign_expr() write whole rows directly.
+struct assign_value{
+	template <class A, class B>
+	void operator()(A& a, const B& b) const { a = b; }
+};
+
+/// Call f(a[oa]) over the index space 'dim', where the offset oa advances by the 
+/// (possibly zero or negative) strides 'sa'. The innermost axis runs as a tight loop.
+template <class A, class F>
+void strided_for_each(const std::vector<std::ptrdiff_t>& dim, A* a, const std::vector<std::ptrdiff_t>& sa, F f){
+	int ndim = dim.size();
+	for (std::ptrdiff_t d : dim) if (d == 0) return;
+	if (ndim == 0){ f(*a); return; }
+
+	std::ptrdiff_t n0 = dim[ndim-1], s0 = sa[ndim-1];
+	std::vector<std::ptrdiff_t> ix(ndim, 0);
+	std::ptrdiff_t oa = 0;
+	while (true){
+		for (std::ptrdiff_t i=0, o=oa; i<n0; ++i, o+=s0) f(a[o]);
+		int k = ndim-2;
+		for (; k>=0; --k){	// advance the odometer over the outer axes
+			oa += sa[k];
+			if (++ix[k] < dim[k]) break;
+			oa -= sa[k]*dim[k];
+			ix[k] = 0;
 		}
-		std::cout << "\n";
+		if (k < 0) return;
 	}
-	
-//	TODO: 
-//	This function can be private
-	/// Convert coordinates (specified as a vector of indices) to 1D index where the value resides in the underlying vector.
-	int location(std::vector <int> ix){
-		int loc = 0;
-		int ndim = dim.size();
-		for (int i=ndim-1; i>=0; --i){
-			loc += offsets[i]*ix[i];
+}
+
+/// Same as strided_for_each(), but walks two operands in lockstep, calling f(a[oa], b[ob]).
+template <class A, class B, class F>
+void strided_zip(const std::vector<std::ptrdiff_t>& dim, A* a, const std::vector<std::ptrdiff_t>& sa, B* b, const std::vector<std::ptrdiff_t>& sb, F f){
+	int ndim = dim.size();
+	for (std::ptrdiff_t d : dim) if (d == 0) return;
+	if (ndim == 0){ f(*a, *b); return; }
+
+	std::ptrdiff_t n0 = dim[ndim-1], s0a = sa[ndim-1], s0b = sb[ndim-1];
+	std::vector<std::ptrdiff_t> ix(ndim, 0);
+	std::ptrdiff_t oa = 0, ob = 0;
+	while (true){
+		for (std::ptrdiff_t i=0, pa=oa, pb=ob; i<n0; ++i, pa+=s0a, pb+=s0b) f(a[pa], b[pb]);
+		int k = ndim-2;
+		for (; k>=0; --k){
+			oa += sa[k]; ob += sb[k];
+			if (++ix[k] < dim[k]) break;
+			oa -= sa[k]*dim[k]; ob -= sb[k]*dim[k];
+			ix[k] = 0;
 		}
-		return loc;
+		if (k < 0) return;
 	}
+}
 
-	template<class... ARGS>
-	int location(ARGS... ids){
-		return location({ids...});
+/// @brief Visit the rows (lines along the innermost axis) r0 <= r < r1 of the index space 'dim' 
+/// in row-major order, calling f(ix) with the coordinates of the first element of each row.
+template <class F>
+void for_each_row(const std::vector<std::ptrdiff_t>& dim, std::ptrdiff_t r0, std::ptrdiff_t r1, F f){
+	int ndim = dim.size();
+	std::vector<std::ptrdiff_t> ix(ndim, 0);
+	std::ptrdiff_t r = r0;
+	for (int k=ndim-2; k>=0; --k){
+		ix[k] = r % dim[k];
+		r /= dim[k];
+	}
+	for (std::ptrdiff_t row=r0; row<r1; ++row){
+		f(ix);
+		for (int k=ndim-2; k>=0; --k){
+			if (++ix[k] < dim[k]) break;
+			ix[k] = 0;
+		}
 	}
+}
 
+/// Visit all rows of the index space 'dim' (see above).
+template <class F>
+void for_each_row(const std::vector<std::ptrdiff_t>& dim, F f){
+	for (std::ptrdiff_t d : dim) if (d == 0) return;
+	std::ptrdiff_t nrows = 1;
+	for (int k=0; k<int(dim.size())-1; ++k) nrows *= dim[k];
+	for_each_row(dim, 0, nrows, f);
+}
 
-	/// @brief Get the value at coordinates specified as a comma separated list. 
-	///        The order of coordinates is \f$\{i_n, i_{n-1}, ..., i_0\}\f$
-	template<class... ARGS>
-	double& operator() (ARGS... ids){
-		return vec[location({ids...})];
+/// Number of elements of a tensor with the given dimensions.
+/// Throws std::length_error if a dimension is negative or if the product overflows.
+inline std::ptrdiff_t checked_size(const std::vector<std::ptrdiff_t>& dim){
+	std::ptrdiff_t n = 1;
+	for (std::ptrdiff_t d : dim){
+		if (d < 0) throw std::length_error("Tensor: negative dimension " + std::to_string(d));
+		if (d > 0 && n > std::numeric_limits<std::ptrdiff_t>::max()/d) throw std::length_error("Tensor: number of elements overflows std::ptrdiff_t");
+		n *= d;
 	}
+	return n;
+}
 
-	/// @brief Get the value at coordinates specified as an integer vector. 
-	///        The order of coordinates is \f$\{i_n, i_{n-1}, ..., i_0\}\f$.
-	double& operator() (std::vector<int> ix){
-		return vec[location(ix)];
+/// Row-major (contiguous) strides for the given dimensions.
+inline std::vector<std::ptrdiff_t> contiguous_strides(const std::vector<std::ptrdiff_t>& dim){
+	std::vector<std::ptrdiff_t> off(dim.size());
+	std::ptrdiff_t p = 1;
+	for (int i=dim.size()-1; i>=0; --i){
+		off[i] = p;
+		p *= dim[i];
 	}
+	return off;
+}
 
+} // namespace tensor_detail
 
-	/// Convert 1D index to coordinates (Inverse of location())
-	std::vector<int> index(int loc){
-		int ndim = dim.size();
-		std::vector<int> id(ndim);
-		for (int i=ndim-1; i>=0; --i){
-			int ix = loc % dim[i];
-			loc = (loc-ix)/dim[i];
-			id[i]=ix;
-		}
-		return id;
-	}
 
-	/// A utility function for testing purposes. Fills the tensor with incremental integers. 
-	void fill_sequence(){
-		for(int i=0; i<vec.size(); ++i) vec[i]=i;
+/// Instruction sets for which the built-in elementwise and reduction kernels are compiled.
+enum class TensorSimd {scalar, neon, avx2, avx512};
+
+#if !defined(TENSOR_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+#define TENSOR_HAVE_SIMD 1
+#endif
+
+/// Best instruction set supported by the CPU at runtime.
+inline TensorSimd tensor_simd_detect(){
+#if defined(TENSOR_HAVE_SIMD) && (defined(__x86_64__) || defined(__i386__))
+	if (__builtin_cpu_supports("avx512f")) return TensorSimd::avx512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return TensorSimd::avx2;
+#elif defined(TENSOR_HAVE_SIMD) && defined(__aarch64__)
+	return TensorSimd::neon;
+#endif
+	return TensorSimd::scalar;
+}
+
+/// True if kernels for the given instruction set can run on this CPU.
+inline bool tensor_simd_supported(TensorSimd level){
+	TensorSimd best = tensor_simd_detect();
+	return level == TensorSimd::scalar || level == best || (level == TensorSimd::avx2 && best == TensorSimd::avx512);
+}
+
+namespace tensor_detail{
+inline TensorSimd& simd_active(){
+	static TensorSimd level = tensor_simd_detect();
+	return level;
+}
+} // namespace tensor_detail
+
+/// Instruction set currently used by the kernels (by default, the best available one).
+inline TensorSimd tensor_simd_level(){
+	return tensor_detail::simd_active();
+}
+
+/// Select the instruction set used by the kernels (e.g. to compare against the scalar path).
+inline void tensor_set_simd_level(TensorSimd level){
+	assert(tensor_simd_supported(level));
+	tensor_detail::simd_active() = level;
+}
+
+
+// ---- reduced-precision storage ----
+
+namespace tensor_detail{
+
+inline std::uint32_t float_bits(float f){
+	std::uint32_t u;
+	std::memcpy(&u, &f, 4);
+	return u;
+}
+
+inline float bits_float(std::uint32_t u){
+	float f;
+	std::memcpy(&f, &u, 4);
+	return f;
+}
+
+/// @brief IEEE binary16 bits to float (exact). Subnormal halves are renormalised by a float 
+/// subtraction; the vector kernels (simd::widen_half) do the same operations lane by lane.
+inline float half_to_float(std::uint16_t h){
+	std::uint32_t o = std::uint32_t(h & 0x7fff) << 13;
+	std::uint32_t e = o & (0x7c00u << 13);
+	o += (127u - 15u) << 23;
+	if (e == (0x7c00u << 13)) o += (128u - 16u) << 23;  // Inf and NaN keep an all-ones exponent
+	else if (e == 0) o = float_bits(bits_float(o + (1u << 23)) - bits_float(113u << 23));
+	return bits_float(o | (std::uint32_t(h & 0x8000) << 16));
+}
+
+/// @brief Float to IEEE binary16 bits, rounded to nearest even. Overflow gives Inf and NaN a quiet NaN.
+inline std::uint16_t float_to_half(float f){
+	std::uint32_t u = float_bits(f), sign = u & 0x80000000u, o;
+	u ^= sign;
+	if (u >= (127u + 16u) << 23) o = (u > 0x7f800000u)? 0x7e00 : 0x7c00;
+	else if (u < 113u << 23) o = float_bits(bits_float(u) + 0.5f) - float_bits(0.5f);  // aligns the subnormal mantissa, rounding in the FPU
+	else o = (u + (std::uint32_t(15 - 127) << 23) + 0xfff + ((u >> 13) & 1)) >> 13;
+	return std::uint16_t(o | (sign >> 16));
+}
+
+/// bfloat16 bits to float (exact).
+inline float bf16_to_float(std::uint16_t h){
+	return bits_float(std::uint32_t(h) << 16);
+}
+
+/// @brief Float to bfloat16 bits, rounded to nearest even. NaN gives a quiet NaN.
+inline std::uint16_t float_to_bf16(float f){
+	std::uint32_t u = float_bits(f);
+	if ((u & 0x7fffffffu) > 0x7f800000u) return std::uint16_t((u >> 16) | 0x40);
+	return std::uint16_t((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+} // namespace tensor_detail
+
+/**
+ TensorHalf. IEEE 754 half precision (binary16) element type
+
+ A 16-bit storage type for tensors that tolerate 11 significant bits and a range of 
+ 6e-8 to 65504, at half the memory and bandwidth of float. It converts implicitly to and 
+ from float (rounding to nearest even), so arithmetic on elements is done in float. 
+ 
+ The kernels of Tensor<TensorHalf> convert blocks of 256 elements to float in a stack buffer 
+ and run the float kernels on it: reductions accumulate in double, and +, -, *, / with another half tensor or with a float or 
+ integer scalar are done in float and rounded back, giving the same bits as the element loops. 
+ Tensor files and .npy files store the elements as '<f2'.
+ */
+struct TensorHalf{
+	std::uint16_t bits;
+
+	TensorHalf() = default;
+	TensorHalf(float f) : bits(tensor_detail::float_to_half(f)) {}
+	operator float() const { return tensor_detail::half_to_float(bits); }
+
+	static TensorHalf from_bits(std::uint16_t b){ TensorHalf h; h.bits = b; return h; }
+
+	TensorHalf& operator += (float x){ return *this = float(*this) + x; }
+	TensorHalf& operator -= (float x){ return *this = float(*this) - x; }
+	TensorHalf& operator *= (float x){ return *this = float(*this) * x; }
+	TensorHalf& operator /= (float x){ return *this = float(*this) / x; }
+};
+
+/**
+ TensorBFloat16. bfloat16 element type
+
+ Like TensorHalf, with 8 exponent bits and 8 significant bits: the range of float at 1/65536 
+ of its precision, for data that needs range more than digits. Narrowing is a rounding of the 
+ float bits to nearest even and widening is a shift. Tensor files and .npy files store the 
+ elements as opaque 2-byte values ('V').
+ */
+struct TensorBFloat16{
+	std::uint16_t bits;
+
+	TensorBFloat16() = default;
+	TensorBFloat16(float f) : bits(tensor_detail::float_to_bf16(f)) {}
+	operator float() const { return tensor_detail::bf16_to_float(bits); }
+
+	static TensorBFloat16 from_bits(std::uint16_t b){ TensorBFloat16 h; h.bits = b; return h; }
+
+	TensorBFloat16& operator += (float x){ return *this = float(*this) + x; }
+	TensorBFloat16& operator -= (float x){ return *this = float(*this) - x; }
+	TensorBFloat16& operator *= (float x){ return *this = float(*this) * x; }
+	TensorBFloat16& operator /= (float x){ return *this = float(*this) / x; }
+};
+
+static_assert(sizeof(TensorHalf) == 2 && sizeof(TensorBFloat16) == 2, "the kernels treat arrays of 16-bit floats as arrays of their bits");
+
+namespace tensor_detail{
+
+/// std::numeric_limits of a 16-bit float type H, given the bit patterns of its special values.
+template <class H, int DIGITS, std::uint16_t MAX_BITS, std::uint16_t MIN_BITS, std::uint16_t EPS_BITS, std::uint16_t INF_BITS, std::uint16_t NAN_BITS>
+struct float16_limits{
+	static constexpr bool is_specialized = true;
+	static constexpr bool is_signed = true;
+	static constexpr bool is_integer = false;
+	static constexpr bool is_exact = false;
+	static constexpr bool has_infinity = true;
+	static constexpr bool has_quiet_NaN = true;
+	static constexpr bool has_signaling_NaN = false;
+	static constexpr int digits = DIGITS;
+	static constexpr int radix = 2;
+	static H min() noexcept { return H::from_bits(MIN_BITS); }
+	static H max() noexcept { return H::from_bits(MAX_BITS); }
+	static H lowest() noexcept { return H::from_bits(MAX_BITS | 0x8000); }
+	static H epsilon() noexcept { return H::from_bits(EPS_BITS); }
+	static H infinity() noexcept { return H::from_bits(INF_BITS); }
+	static H quiet_NaN() noexcept { return H::from_bits(NAN_BITS); }
+};
+
+} // namespace tensor_detail
+
+namespace std{
+template <> class numeric_limits<TensorHalf> : public tensor_detail::float16_limits<TensorHalf, 11, 0x7bff, 0x0400, 0x1400, 0x7c00, 0x7e00> {};
+template <> class numeric_limits<TensorBFloat16> : public tensor_detail::float16_limits<TensorBFloat16, 8, 0x7f7f, 0x0080, 0x3c00, 0x7f80, 0x7fc0> {};
+} // namespace std
+
+
+namespace tensor_detail{
+
+/// Functor used by max_dim(). Reductions with it are recognised by the SIMD kernels.
+template <class T>
+struct max_op{
+	T operator() (T a, T b) const {
+		return std::max(a,b);
 	}
+};
 
-	
-	/// @brief generate a list of 1D indices corresponding to all points on the hyperplane 
-	/// perpendicular to 'axis' located at index 'k' on the axis. The axis is specified
-	/// as the index of the corresponding dimension, i.e., between [0, n-1].
-	std::vector<int> plane(int axis, int k = 0){
-		axis = dim.size()-1-axis;
-		std::vector<int> locs;
-		locs.reserve(nelem);
-		for (int i=0; i<nelem; ++i){
-			if (index(i)[axis] == 0) locs.push_back(i + k*offsets[axis]);
-		}
-		return locs;
+/// Functor used by min(). Reductions with it are recognised by the SIMD kernels.
+template <class T>
+struct min_op{
+	T operator() (T a, T b) const {
+		return std::min(a,b);
 	}
+};
 
-	// axis is counted from the right
-	// [..., 2, 1, 0]
-	//          ^
-	//           axis
-	template <class BinOp>
-	void transform_dim(int loc, int axis, BinOp binary_op, std::vector<double> w){
-		assert(w.size() == dim[dim.size()-1-axis]);
-		
-		axis = dim.size()-1-axis;
-		int off = offsets[axis];
-		
-		for (int i=loc, count=0; count<dim[axis]; i+= off, ++count){
-			vec[i] = binary_op(vec[i], w[count]);	// this order is important, because the operator may not be commutative
-		}
-		
+namespace simd{
+
+/// @brief Built-in kernels on contiguous arrays of float or double.
+/// The loops are written once on GCC vector types of B bytes and inlined into one entry point 
+/// per instruction set (compiled with the corresponding target attribute), which is selected 
+/// at runtime. Reductions accumulate in double, like Tensor::accumulate_dim().
+enum Op {add, sub, mul, div};
+
+#define TENSOR_SIMD_INLINE inline __attribute__((always_inline))
+
+template <class T, int B>
+struct vec{
+	typedef T type __attribute__((vector_size(B)));
+};
+
+template <int OP, class X, class Y>
+TENSOR_SIMD_INLINE void apply(X& x, const Y& y){
+	if      (OP == add) x += y;
+	else if (OP == sub) x -= y;
+	else if (OP == mul) x *= y;
+	else                x /= y;
+}
+
+// a[i] op= b[i]
+template <int B, int OP, class T>
+TENSOR_SIMD_INLINE void binary_vv(T* a, const T* b, size_t n){
+	typedef typename vec<T,B>::type V;
+	const size_t W = B/sizeof(T);
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		V x, y;
+		std::memcpy(&x, a+i, B);
+		std::memcpy(&y, b+i, B);
+		apply<OP>(x, y);
+		std::memcpy(a+i, &x, B);
 	}
+	for (; i<n; ++i) apply<OP>(a[i], b[i]);
+}
 
-	// axis is counted from the right
-	// [..., 2, 1, 0]
-	//          ^
-	//           axis
-	template <class BinOp>
-	void transform(int axis, BinOp binary_op, std::vector<double> w){
-		std::vector<int> locs = plane(axis);
-		for (int i=0; i<locs.size(); ++i){
-			transform_dim(locs[i], axis, binary_op, w);
-		}
+// a[i] op= s
+template <int B, int OP, class T>
+TENSOR_SIMD_INLINE void binary_vs(T* a, T s, size_t n){
+	typedef typename vec<T,B>::type V;
+	const size_t W = B/sizeof(T);
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		V x;
+		std::memcpy(&x, a+i, B);
+		apply<OP>(x, s);
+		std::memcpy(a+i, &x, B);
 	}
-	
-	
-	// axis is counted from the right
-	// [..., 2, 1, 0]
-	//          ^
-	//           axis
-	template <class BinOp>
-	double accumulate_dim(double v0, int loc, int axis, BinOp binary_op, std::vector<double> weights={}){
-		assert(weights.size() == 0 || weights.size() == dim[dim.size()-1-axis]);
-		
-		axis = dim.size()-1-axis;
-		int off = offsets[axis];
-		
-		double v = 0;
-		for (int i=loc, count=0; count<dim[axis]; i+= off, ++count){
-			double w = (weights.size()>0)? weights[count] : 1;
-			v = binary_op(v, w*vec[i]);
+	for (; i<n; ++i) apply<OP>(a[i], s);
+}
+
+// sum_i w[i]*a[i] (or sum_i a[i] if w is null), in double with two independent accumulators
+template <int B, class T>
+TENSOR_SIMD_INLINE double dot(const T* a, const double* w, size_t n){
+	typedef typename vec<double,B>::type VD;
+	typedef typename vec<T,B/8*sizeof(T)>::type VT;
+	const size_t L = B/8;
+	VD s0 = {}, s1 = {};
+	size_t i = 0;
+	for (; i+2*L <= n; i += 2*L){
+		VT x0, x1;
+		std::memcpy(&x0, a+i, sizeof(VT));
+		std::memcpy(&x1, a+i+L, sizeof(VT));
+		VD y0 = __builtin_convertvector(x0, VD), y1 = __builtin_convertvector(x1, VD);
+		if (w){
+			VD w0, w1;
+			std::memcpy(&w0, w+i, B);
+			std::memcpy(&w1, w+i+L, B);
+			y0 *= w0; y1 *= w1;
 		}
-		
-		return v;
+		s0 += y0; s1 += y1;
 	}
+	s0 += s1;
+	double r = 0;
+	for (size_t k=0; k<L; ++k) r += s0[k];
+	for (; i<n; ++i) r += (w? w[i] : 1)*a[i];
+	return r;
+}
 
+// the larger (smaller if !MAX) of a and b, elementwise for vector types
+#define TENSOR_SIMD_EXTREMUM(MAX, a, b) ((MAX)? (((b) > (a))? (b) : (a)) : (((b) < (a))? (b) : (a)))
 
-	// axis is counted from the right
-	// [..., 2, 1, 0]
-	//          ^
-	//           axis
-	template <class BinOp>
-	Tensor<T> accumulate(T v0, int axis, BinOp binary_op, std::vector<double> weights={}){
-		std::vector<int> dim_new = dim;
-		dim_new.erase(dim_new.begin()+dim_new.size()-1-axis);
-		Tensor<T> tens(dim_new);
-		
-		std::vector<int> locs = plane(axis);
-		
-		for (int i=0; i<locs.size(); ++i){
-			tens.vec[i] = accumulate_dim(v0, locs[i], axis, binary_op, weights);
+// max_i a[i] (or min_i a[i] if !MAX)
+template <int B, bool MAX, class T>
+TENSOR_SIMD_INLINE double max(const T* a, size_t n){
+	typedef typename vec<T,B>::type V;
+	const size_t W = B/sizeof(T);
+	T r = a[0];
+	size_t i = 0;
+	if (n >= W){
+		V m;
+		std::memcpy(&m, a, B);
+		for (i = W; i+W <= n; i += W){
+			V x;
+			std::memcpy(&x, a+i, B);
+			m = TENSOR_SIMD_EXTREMUM(MAX, m, x);
 		}
-		
-		return tens;
+		for (size_t k=0; k<W; ++k) r = TENSOR_SIMD_EXTREMUM(MAX, r, T(m[k]));
 	}
+	for (; i<n; ++i) r = TENSOR_SIMD_EXTREMUM(MAX, r, a[i]);
+	return r;
+}
 
+// acc[i] += w*x[i] in double
+template <int B, class T>
+TENSOR_SIMD_INLINE void axpy(double* acc, const T* x, double w, size_t n){
+	typedef typename vec<double,B>::type VD;
+	typedef typename vec<T,B/8*sizeof(T)>::type VT;
+	const size_t L = B/8;
+	size_t i = 0;
+	for (; i+L <= n; i += L){
+		VD a;
+		VT y;
+		std::memcpy(&a, acc+i, B);
+		std::memcpy(&y, x+i, sizeof(VT));
+		a += w*__builtin_convertvector(y, VD);
+		std::memcpy(acc+i, &a, B);
+	}
+	for (; i<n; ++i) acc[i] += w*x[i];
+}
 
-	Tensor<T> max_dim(int axis){
-		T v0 = vec[1];
-		return accumulate(v0, axis, [](T a, T b){return std::max(a,b);});
+// c[i] += a*b[i] in T (the inner loop of the built-in matrix product)
+template <int B, class T>
+TENSOR_SIMD_INLINE void madd(T* c, const T* b, T a, size_t n){
+	typedef typename vec<T,B>::type V;
+	const size_t W = B/sizeof(T);
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		V x, y;
+		std::memcpy(&x, c+i, B);
+		std::memcpy(&y, b+i, B);
+		x += a*y;
+		std::memcpy(c+i, &x, B);
 	}
+	for (; i<n; ++i) c[i] += a*b[i];
+}
 
-	Tensor<T> avg_dim(int axis, std::vector<double> weights={}){
-		Tensor tens = accumulate(0, axis, std::plus<T>(), weights);
-		tens /= double(dim[dim.size()-1-axis]);
-		return tens;
+// acc[i] = max(acc[i], x[i]) (or min if !MAX) in double
+template <int B, bool MAX, class T>
+TENSOR_SIMD_INLINE void rmax(double* acc, const T* x, size_t n){
+	typedef typename vec<double,B>::type VD;
+	typedef typename vec<T,B/8*sizeof(T)>::type VT;
+	const size_t L = B/8;
+	size_t i = 0;
+	for (; i+L <= n; i += L){
+		VD a;
+		VT y;
+		std::memcpy(&a, acc+i, B);
+		std::memcpy(&y, x+i, sizeof(VT));
+		VD b = __builtin_convertvector(y, VD);
+		a = TENSOR_SIMD_EXTREMUM(MAX, a, b);
+		std::memcpy(acc+i, &a, B);
 	}
+	for (; i<n; ++i) acc[i] = TENSOR_SIMD_EXTREMUM(MAX, acc[i], double(x[i]));
+}
 
+// lane e of the shuffle that interleaves blocks of H lanes of a and b of width W: even blocks of 
+// the result are the even (HI = false) or odd (HI = true) blocks of a, odd blocks those of b
+template <size_t W, size_t H, bool HI>
+constexpr int trn_lane(size_t e){
+	return int((e/(2*H))*2*H + (HI? H : 0) + e%H + ((e/H)%2? W : 0));
+}
 
-	Tensor<T> repeat_inner(int n) const {
-		std::vector<int> dim_new = dim;
-		dim_new.push_back(n);
-		
-		Tensor<T> tout(dim_new);
-		int count = 0;
-		for (int i=0; i<nelem; ++i){
-			for (int j=0; j<n; ++j){
-				tout.vec[count++] = vec[i];
+template <size_t W, size_t H, bool HI, class V, class M, size_t... E>
+TENSOR_SIMD_INLINE void trn(V& out, const V& a, const V& b, M*, std::index_sequence<E...>){
+	out = __builtin_shuffle(a, b, M{trn_lane<W,H,HI>(E)...});
+}
+
+// transpose the W x W block held in the vectors r[0..W), in log2(W) stages of W shuffles: 
+// stage H swaps the off-diagonal H x H blocks of each 2H x 2H block (unpacklo/unpackhi for H = 1)
+template <class V, class M, size_t W, size_t H = 1>
+struct transpose_regs{
+	static TENSOR_SIMD_INLINE void run(V* r){
+		for (size_t k=0; k<W; k += 2*H){
+			for (size_t l=k; l<k+H; ++l){
+				V lo, hi;
+				trn<W,H,false>(lo, r[l], r[l+H], (M*)nullptr, std::make_index_sequence<W>());
+				trn<W,H,true>(hi, r[l], r[l+H], (M*)nullptr, std::make_index_sequence<W>());
+				r[l] = lo;
+				r[l+H] = hi;
 			}
 		}
-
-		return tout;
+		transpose_regs<V,M,W,2*H>::run(r);
 	}
+};
 
-	Tensor<T> repeat_outer(int n) const {
-		std::vector<int> dim_new = dim;
-		dim_new.insert(dim_new.begin(), n);
-		
-		Tensor<T> tout(dim_new);
-		int count = 0;
-		for (int j=0; j<n; ++j){
-			for (int i=0; i<nelem; ++i){
-				tout.vec[count++] = vec[i];
-			}
-		}
+template <class V, class M, size_t W>
+struct transpose_regs<V,M,W,W>{
+	static TENSOR_SIMD_INLINE void run(V*){}
+};
 
-		return tout;
+// b[j*ldb + i] = a[i*lda + j] for i < rows, j < cols: W x W blocks are loaded as W vectors along 
+// the rows of a, transposed in registers and stored as W vectors along the rows of b, then the 
+// edges are done elementwise
+template <int B, class T>
+TENSOR_SIMD_INLINE void transpose_blocks(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){
+	typedef typename vec<T,B>::type V;
+	typedef typename std::conditional<sizeof(T) == 8, std::int64_t, std::int32_t>::type I;
+	typedef typename vec<I,B>::type M;
+	const size_t W = B/sizeof(T);
+	size_t i = 0;
+	for (; i+W <= rows; i += W){
+		size_t j = 0;
+		for (; j+W <= cols; j += W){
+			V r[W];
+			for (size_t k=0; k<W; ++k) std::memcpy(&r[k], a + (i+k)*lda + j, B);
+			transpose_regs<V,M,W>::run(r);
+			for (size_t l=0; l<W; ++l) std::memcpy(b + (j+l)*ldb + i, &r[l], B);
+		}
+		for (; j<cols; ++j) for (size_t k=i; k<i+W; ++k) b[j*ldb + k] = a[k*lda + j];
 	}
+	for (; i<rows; ++i) for (size_t j=0; j<cols; ++j) b[j*ldb + i] = a[i*lda + j];
+}
 
+// transpose_blocks() with the widest vectors of at most B bytes to which the rows of a and b are 
+// aligned, or a plain loop if they are not aligned to 16 bytes: unaligned loads and stores of 
+// whole rows of the block cross pages often enough to make the kernel slower than the loop
+template <int B, class T>
+TENSOR_SIMD_INLINE void transpose(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){
+	std::uintptr_t m = reinterpret_cast<std::uintptr_t>(a) | reinterpret_cast<std::uintptr_t>(b) | lda*sizeof(T) | ldb*sizeof(T);
+	if (m % B == 0) transpose_blocks<B>(a, lda, b, ldb, rows, cols);
+	else if (B > 32 && m % 32 == 0) transpose_blocks<(B > 32? 32 : B)>(a, lda, b, ldb, rows, cols);
+	else if (B > 16 && m % 16 == 0) transpose_blocks<16>(a, lda, b, ldb, rows, cols);
+	else for (size_t i=0; i<rows; ++i) for (size_t j=0; j<cols; ++j) b[j*ldb + i] = a[i*lda + j];
+}
 
-	// operators
-	public: 	
-	// see https://stackoverflow.com/questions/4421706/what-are-the-basic-rules-and-idioms-for-operator-overloading/4421719#4421719
-	template <class S>
-	Tensor<T>& operator += (const Tensor<S>& rhs){
-		assert(dim == rhs.dim);
-		std::transform(vec.begin(), vec.end(), rhs.vec.begin(), vec.begin(), std::plus<T>());
-		return *this;
-	}
-	
-	template <class S>
-	Tensor<T>& operator -= (const Tensor<S>& rhs){
-		assert(dim == rhs.dim);
-		std::transform(vec.begin(), vec.end(), rhs.vec.begin(), vec.begin(), std::minus<double>());
-		return *this;
+// out[i] = float(a[i]) for IEEE binary16 bits a, with the operations of half_to_float() on each lane
+template <int B>
+TENSOR_SIMD_INLINE void widen_half(float* out, const std::uint16_t* a, size_t n){
+	typedef typename vec<std::uint16_t,B/2>::type VH;
+	typedef typename vec<std::uint32_t,B>::type VU;
+	typedef typename vec<float,B>::type VF;
+	const size_t W = B/4;
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		VH h;
+		std::memcpy(&h, a+i, B/2);
+		VU u = __builtin_convertvector(h, VU);
+		VU o = (u & 0x7fffu) << 13;
+		VU e = o & (0x7c00u << 13);
+		o += (127u - 15u) << 23;
+		VU inf = (VU)(e == (0x7c00u << 13)), sub = (VU)(e == 0u);
+		o += inf & ((128u - 16u) << 23);
+		VU d = o + (1u << 23);
+		VF f;
+		std::memcpy(&f, &d, B);
+		f -= bits_float(113u << 23);
+		std::memcpy(&d, &f, B);
+		o = (sub & d) | (~sub & o);
+		o |= (u & 0x8000u) << 16;
+		std::memcpy(out+i, &o, B);
 	}
+	for (; i<n; ++i) out[i] = half_to_float(a[i]);
+}
 
-	template <class S>
-	Tensor<T>& operator *= (const Tensor<S>& rhs){
-		assert(dim == rhs.dim);
-		std::transform(vec.begin(), vec.end(), rhs.vec.begin(), vec.begin(), std::multiplies<T>());
-		return *this;
+// out[i] = binary16 bits of a[i], rounded as in float_to_half()
+template <int B>
+TENSOR_SIMD_INLINE void narrow_half(std::uint16_t* out, const float* a, size_t n){
+	typedef typename vec<std::uint16_t,B/2>::type VH;
+	typedef typename vec<std::uint32_t,B>::type VU;
+	typedef typename vec<float,B>::type VF;
+	const size_t W = B/4;
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		VU u;
+		std::memcpy(&u, a+i, B);
+		VU sign = u & 0x80000000u;
+		u ^= sign;
+		VU big = (VU)(u >= ((127u + 16u) << 23)), small = (VU)(u < (113u << 23));
+		VU special = 0x7c00u | ((VU)(u > 0x7f800000u) & 0x0200u);
+		VF f;
+		std::memcpy(&f, &u, B);
+		f += 0.5f;
+		VU s;
+		std::memcpy(&s, &f, B);
+		s -= float_bits(0.5f);
+		VU r = (u + (std::uint32_t(15 - 127) << 23) + 0xfffu + ((u >> 13) & 1u)) >> 13;
+		VU o = (big & special) | (~big & ((small & s) | (~small & r)));
+		o |= sign >> 16;
+		VH h = __builtin_convertvector(o, VH);
+		std::memcpy(out+i, &h, B/2);
 	}
+	for (; i<n; ++i) out[i] = float_to_half(a[i]);
+}
 
-	template<class S>	
-	Tensor<T>& operator += (S s){
-		std::transform(vec.begin(), vec.end(), vec.begin(), [&s](const T& x){return x+s;});
-		return *this;
+// out[i] = float(a[i]) for bfloat16 bits a
+template <int B>
+TENSOR_SIMD_INLINE void widen_bf16(float* out, const std::uint16_t* a, size_t n){
+	typedef typename vec<std::uint16_t,B/2>::type VH;
+	typedef typename vec<std::uint32_t,B>::type VU;
+	const size_t W = B/4;
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		VH h;
+		std::memcpy(&h, a+i, B/2);
+		VU o = __builtin_convertvector(h, VU) << 16;
+		std::memcpy(out+i, &o, B);
 	}
+	for (; i<n; ++i) out[i] = bf16_to_float(a[i]);
+}
 
-	template <class S>
-	Tensor<T>& operator -= (S s){
-		std::transform(vec.begin(), vec.end(), vec.begin(), [&s](const T& x){return x-s;});
-		return *this;
+// out[i] = bfloat16 bits of a[i], rounded as in float_to_bf16()
+template <int B>
+TENSOR_SIMD_INLINE void narrow_bf16(std::uint16_t* out, const float* a, size_t n){
+	typedef typename vec<std::uint16_t,B/2>::type VH;
+	typedef typename vec<std::uint32_t,B>::type VU;
+	const size_t W = B/4;
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		VU u;
+		std::memcpy(&u, a+i, B);
+		VU nan = (VU)((u & 0x7fffffffu) > 0x7f800000u);
+		VU o = (nan & ((u >> 16) | 0x40u)) | (~nan & ((u + 0x7fffu + ((u >> 16) & 1u)) >> 16));
+		VH h = __builtin_convertvector(o, VH);
+		std::memcpy(out+i, &h, B/2);
 	}
+	for (; i<n; ++i) out[i] = float_to_bf16(a[i]);
+}
 
-	template <class S>
-	Tensor<T>& operator *= (S s){
-		std::transform(vec.begin(), vec.end(), vec.begin(), [&s](const T& x){return x*s;});
-		return *this;
+// out[i] = float(a[i]) for 16-bit integers
+template <int B>
+TENSOR_SIMD_INLINE void widen_i16(float* out, const std::int16_t* a, size_t n){
+	typedef typename vec<std::int16_t,B/2>::type VS;
+	typedef typename vec<float,B>::type VF;
+	const size_t W = B/4;
+	size_t i = 0;
+	for (; i+W <= n; i += W){
+		VS x;
+		std::memcpy(&x, a+i, B/2);
+		VF f = __builtin_convertvector(x, VF);
+		std::memcpy(out+i, &f, B);
 	}
+	for (; i<n; ++i) out[i] = a[i];
+}
 
-	template<class S>
-	Tensor<T>& operator /= (S s){
-		std::transform(vec.begin(), vec.end(), vec.begin(), [&s](const T& x){return x/s;});
-		return *this;
-	}
+struct isa_scalar{
+	template <int OP, class T> static void vv(T* a, const T* b, size_t n){ for (size_t i=0; i<n; ++i) apply<OP>(a[i], b[i]); }
+	template <int OP, class T> static void vs(T* a, T s, size_t n){ for (size_t i=0; i<n; ++i) apply<OP>(a[i], s); }
+	template <class T> static double wsum(const T* a, const double* w, size_t n){ double r = 0; for (size_t i=0; i<n; ++i) r += (w? w[i] : 1)*a[i]; return r; }
+	template <class T> static double vmax(const T* a, size_t n){ T r = a[0]; for (size_t i=1; i<n; ++i) r = std::max(r, a[i]); return r; }
+	template <class T> static double vmin(const T* a, size_t n){ T r = a[0]; for (size_t i=1; i<n; ++i) r = std::min(r, a[i]); return r; }
+	template <class T> static void axpy(double* acc, const T* x, double w, size_t n){ for (size_t i=0; i<n; ++i) acc[i] += w*x[i]; }
+	template <class T> static void madd(T* c, const T* b, T a, size_t n){ for (size_t i=0; i<n; ++i) c[i] += a*b[i]; }
+	template <class T> static void rmax(double* acc, const T* x, size_t n){ for (size_t i=0; i<n; ++i) acc[i] = std::max(acc[i], double(x[i])); }
+	template <class T> static void rmin(double* acc, const T* x, size_t n){ for (size_t i=0; i<n; ++i) acc[i] = std::min(acc[i], double(x[i])); }
+	template <class T> static void transpose(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){ for (size_t i=0; i<rows; ++i) for (size_t j=0; j<cols; ++j) b[j*ldb + i] = a[i*lda + j]; }
+	static void from_half(float* out, const std::uint16_t* a, size_t n){ for (size_t i=0; i<n; ++i) out[i] = half_to_float(a[i]); }
+	static void from_bf16(float* out, const std::uint16_t* a, size_t n){ for (size_t i=0; i<n; ++i) out[i] = bf16_to_float(a[i]); }
+	static void from_i16(float* out, const std::int16_t* a, size_t n){ for (size_t i=0; i<n; ++i) out[i] = a[i]; }
+	static void to_half(std::uint16_t* out, const float* a, size_t n){ for (size_t i=0; i<n; ++i) out[i] = float_to_half(a[i]); }
+	static void to_bf16(std::uint16_t* out, const float* a, size_t n){ for (size_t i=0; i<n; ++i) out[i] = float_to_bf16(a[i]); }
+};
+
+#if defined(TENSOR_HAVE_SIMD) && (defined(__x86_64__) || defined(__i386__))
+struct isa_avx2{
+	template <int OP, class T> __attribute__((target("avx2,fma"))) static void vv(T* a, const T* b, size_t n){ binary_vv<32,OP>(a, b, n); }
+	template <int OP, class T> __attribute__((target("avx2,fma"))) static void vs(T* a, T s, size_t n){ binary_vs<32,OP>(a, s, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static double wsum(const T* a, const double* w, size_t n){ return dot<32>(a, w, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static double vmax(const T* a, size_t n){ return max<32,true>(a, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static double vmin(const T* a, size_t n){ return max<32,false>(a, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static void axpy(double* acc, const T* x, double w, size_t n){ simd::axpy<32>(acc, x, w, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static void madd(T* c, const T* b, T a, size_t n){ simd::madd<32>(c, b, a, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static void rmax(double* acc, const T* x, size_t n){ simd::rmax<32,true>(acc, x, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static void rmin(double* acc, const T* x, size_t n){ simd::rmax<32,false>(acc, x, n); }
+	template <class T> __attribute__((target("avx2,fma"))) static void transpose(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){ simd::transpose<32>(a, lda, b, ldb, rows, cols); }
+	__attribute__((target("avx2,fma"))) static void from_half(float* out, const std::uint16_t* a, size_t n){ widen_half<32>(out, a, n); }
+	__attribute__((target("avx2,fma"))) static void from_bf16(float* out, const std::uint16_t* a, size_t n){ widen_bf16<32>(out, a, n); }
+	__attribute__((target("avx2,fma"))) static void from_i16(float* out, const std::int16_t* a, size_t n){ widen_i16<32>(out, a, n); }
+	__attribute__((target("avx2,fma"))) static void to_half(std::uint16_t* out, const float* a, size_t n){ narrow_half<32>(out, a, n); }
+	__attribute__((target("avx2,fma"))) static void to_bf16(std::uint16_t* out, const float* a, size_t n){ narrow_bf16<32>(out, a, n); }
+};
 
+struct isa_avx512{
+	template <int OP, class T> __attribute__((target("avx512f"))) static void vv(T* a, const T* b, size_t n){ binary_vv<64,OP>(a, b, n); }
+	template <int OP, class T> __attribute__((target("avx512f"))) static void vs(T* a, T s, size_t n){ binary_vs<64,OP>(a, s, n); }
+	template <class T> __attribute__((target("avx512f"))) static double wsum(const T* a, const double* w, size_t n){ return dot<64>(a, w, n); }
+	template <class T> __attribute__((target("avx512f"))) static double vmax(const T* a, size_t n){ return max<64,true>(a, n); }
+	template <class T> __attribute__((target("avx512f"))) static double vmin(const T* a, size_t n){ return max<64,false>(a, n); }
+	template <class T> __attribute__((target("avx512f"))) static void axpy(double* acc, const T* x, double w, size_t n){ simd::axpy<64>(acc, x, w, n); }
+	template <class T> __attribute__((target("avx512f"))) static void madd(T* c, const T* b, T a, size_t n){ simd::madd<64>(c, b, a, n); }
+	template <class T> __attribute__((target("avx512f"))) static void rmax(double* acc, const T* x, size_t n){ simd::rmax<64,true>(acc, x, n); }
+	template <class T> __attribute__((target("avx512f"))) static void rmin(double* acc, const T* x, size_t n){ simd::rmax<64,false>(acc, x, n); }
+	template <class T> __attribute__((target("avx512f"))) static void transpose(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){ simd::transpose<64>(a, lda, b, ldb, rows, cols); }
+	__attribute__((target("avx512f"))) static void from_half(float* out, const std::uint16_t* a, size_t n){ widen_half<64>(out, a, n); }
+	__attribute__((target("avx512f"))) static void from_bf16(float* out, const std::uint16_t* a, size_t n){ widen_bf16<64>(out, a, n); }
+	__attribute__((target("avx512f"))) static void from_i16(float* out, const std::int16_t* a, size_t n){ widen_i16<64>(out, a, n); }
+	__attribute__((target("avx512f"))) static void to_half(std::uint16_t* out, const float* a, size_t n){ narrow_half<64>(out, a, n); }
+	__attribute__((target("avx512f"))) static void to_bf16(std::uint16_t* out, const float* a, size_t n){ narrow_bf16<64>(out, a, n); }
 };
+#endif
+
+#if defined(TENSOR_HAVE_SIMD) && defined(__aarch64__)
+struct isa_neon{
+	template <int OP, class T> static void vv(T* a, const T* b, size_t n){ binary_vv<16,OP>(a, b, n); }
+	template <int OP, class T> static void vs(T* a, T s, size_t n){ binary_vs<16,OP>(a, s, n); }
+	template <class T> static double wsum(const T* a, const double* w, size_t n){ return dot<16>(a, w, n); }
+	template <class T> static double vmax(const T* a, size_t n){ return max<16,true>(a, n); }
+	template <class T> static double vmin(const T* a, size_t n){ return max<16,false>(a, n); }
+	template <class T> static void axpy(double* acc, const T* x, double w, size_t n){ simd::axpy<16>(acc, x, w, n); }
+	template <class T> static void madd(T* c, const T* b, T a, size_t n){ simd::madd<16>(c, b, a, n); }
+	template <class T> static void rmax(double* acc, const T* x, size_t n){ simd::rmax<16,true>(acc, x, n); }
+	template <class T> static void rmin(double* acc, const T* x, size_t n){ simd::rmax<16,false>(acc, x, n); }
+	template <class T> static void transpose(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){ simd::transpose<16>(a, lda, b, ldb, rows, cols); }
+	static void from_half(float* out, const std::uint16_t* a, size_t n){ widen_half<16>(out, a, n); }
+	static void from_bf16(float* out, const std::uint16_t* a, size_t n){ widen_bf16<16>(out, a, n); }
+	static void from_i16(float* out, const std::int16_t* a, size_t n){ widen_i16<16>(out, a, n); }
+	static void to_half(std::uint16_t* out, const float* a, size_t n){ narrow_half<16>(out, a, n); }
+	static void to_bf16(std::uint16_t* out, const float* a, size_t n){ narrow_bf16<16>(out, a, n); }
+};
+#endif
 
-template<class T>
-Tensor<T> operator + (Tensor<T> lhs, const Tensor<T>& rhs){
-	assert(lhs.dim == rhs.dim);
-	lhs += rhs;
-	return lhs;
+template <class T>
+struct kernel_table{
+	void (*vv[4])(T*, const T*, size_t);
+	void (*vs[4])(T*, T, size_t);
+	double (*wsum)(const T*, const double*, size_t);
+	double (*vmax)(const T*, size_t);
+	double (*vmin)(const T*, size_t);
+	void (*axpy)(double*, const T*, double, size_t);
+	void (*madd)(T*, const T*, T, size_t);
+	void (*rmax)(double*, const T*, size_t);
+	void (*rmin)(double*, const T*, size_t);
+	void (*transpose)(const T*, std::ptrdiff_t, T*, std::ptrdiff_t, size_t, size_t);
+};
+
+template <class ISA, class T>
+kernel_table<T> make_table(){
+	return {
+		{&ISA::template vv<add,T>, &ISA::template vv<sub,T>, &ISA::template vv<mul,T>, &ISA::template vv<div,T>},
+		{&ISA::template vs<add,T>, &ISA::template vs<sub,T>, &ISA::template vs<mul,T>, &ISA::template vs<div,T>},
+		&ISA::template wsum<T>,
+		&ISA::template vmax<T>,
+		&ISA::template vmin<T>,
+		&ISA::template axpy<T>,
+		&ISA::template madd<T>,
+		&ISA::template rmax<T>,
+		&ISA::template rmin<T>,
+		&ISA::template transpose<T>
+	};
 }
 
-template<class T>
-Tensor<T> operator - (Tensor<T> lhs, const Tensor<T>& rhs){
-	assert(lhs.dim == rhs.dim);
-	lhs -= rhs;
-	return lhs;
+/// Kernels for the active instruction set.
+template <class T>
+const kernel_table<T>& kernels(){
+	static const kernel_table<T> scalar = make_table<isa_scalar,T>();
+#if defined(TENSOR_HAVE_SIMD) && (defined(__x86_64__) || defined(__i386__))
+	static const kernel_table<T> avx2 = make_table<isa_avx2,T>();
+	static const kernel_table<T> avx512 = make_table<isa_avx512,T>();
+	if (simd_active() == TensorSimd::avx512) return avx512;
+	if (simd_active() == TensorSimd::avx2) return avx2;
+#elif defined(TENSOR_HAVE_SIMD) && defined(__aarch64__)
+	static const kernel_table<T> neon = make_table<isa_neon,T>();
+	if (simd_active() == TensorSimd::neon) return neon;
+#endif
+	return scalar;
 }
 
-template<class T>
-Tensor<T> operator * (Tensor<T> lhs, const Tensor<T>& rhs){
-	assert(lhs.dim == rhs.dim);
-	lhs *= rhs;
-	return lhs;
+/// Conversions between float and the 16-bit storage types, per instruction set.
+struct convert_table{
+	void (*from_half)(float*, const std::uint16_t*, size_t);
+	void (*from_bf16)(float*, const std::uint16_t*, size_t);
+	void (*from_i16)(float*, const std::int16_t*, size_t);
+	void (*to_half)(std::uint16_t*, const float*, size_t);
+	void (*to_bf16)(std::uint16_t*, const float*, size_t);
+};
+
+template <class ISA>
+convert_table make_convert_table(){
+	return {&ISA::from_half, &ISA::from_bf16, &ISA::from_i16, &ISA::to_half, &ISA::to_bf16};
 }
 
-template<class T, class S>
-Tensor<T> operator + (Tensor<T> lhs, S s){
-	lhs += s;
-	return lhs;
+/// Conversions for the active instruction set.
+inline const convert_table& converters(){
+	static const convert_table scalar = make_convert_table<isa_scalar>();
+#if defined(TENSOR_HAVE_SIMD) && (defined(__x86_64__) || defined(__i386__))
+	static const convert_table avx2 = make_convert_table<isa_avx2>();
+	static const convert_table avx512 = make_convert_table<isa_avx512>();
+	if (simd_active() == TensorSimd::avx512) return avx512;
+	if (simd_active() == TensorSimd::avx2) return avx2;
+#elif defined(TENSOR_HAVE_SIMD) && defined(__aarch64__)
+	static const convert_table neon = make_convert_table<isa_neon>();
+	if (simd_active() == TensorSimd::neon) return neon;
+#endif
+	return scalar;
 }
 
-template<class T, class S>
-Tensor<T> operator - (Tensor<T> lhs, S s){
-	lhs -= s;
-	return lhs;
+template <class T> struct is_simd_type : std::integral_constant<bool, std::is_same<T,double>::value || std::is_same<T,float>::value> {};
+
+/// @brief 16-bit storage types whose kernels widen to float: reductions run the float kernels 
+/// on blocks of widen_block elements converted into a float buffer on the stack, and for the two float types, 
+/// so do +, -, *, / (narrowing the float results back to storage).
+template <class T> struct is_widened_type : std::integral_constant<bool, std::is_same<T,TensorHalf>::value || std::is_same<T,TensorBFloat16>::value || std::is_same<T,std::int16_t>::value> {};
+template <class T> struct is_float16_type : std::integral_constant<bool, std::is_same<T,TensorHalf>::value || std::is_same<T,TensorBFloat16>::value> {};
+
+const size_t widen_block = 256;
+
+inline void widen(float* out, const TensorHalf* a, size_t n){ converters().from_half(out, &a->bits, n); }
+inline void widen(float* out, const TensorBFloat16* a, size_t n){ converters().from_bf16(out, &a->bits, n); }
+inline void widen(float* out, const std::int16_t* a, size_t n){ converters().from_i16(out, a, n); }
+inline void narrow(TensorHalf* out, const float* a, size_t n){ converters().to_half(&out->bits, a, n); }
+inline void narrow(TensorBFloat16* out, const float* a, size_t n){ converters().to_bf16(&out->bits, a, n); }
+
+/// @brief a[i] op= b[i] with the vector kernels. Returns false (and does nothing) if the 
+/// operand types don't have kernels, so that the caller can fall back to the generic path.
+template <int OP, class T, class S>
+bool binary(T*, const S*, size_t){
+	return false;
 }
 
-template<class T, class S>
-Tensor<T> operator / (Tensor<T> lhs, S s){
-	lhs /= s;
-	return lhs;
+template <int OP, class T>
+typename std::enable_if<is_simd_type<T>::value, bool>::type binary(T* a, const T* b, size_t n){
+	kernels<T>().vv[OP](a, b, n);
+	return true;
 }
 
-template<class T, class S>
-Tensor<T> operator * (Tensor<T> lhs, S s){
-	lhs *= s;
-	return lhs;
+// float16 types: the float result of a op b, rounded to 16 bits, is the correctly rounded result
+template <int OP, class T>
+typename std::enable_if<is_float16_type<T>::value, bool>::type binary(T* a, const T* b, size_t n){
+	float x[widen_block], y[widen_block];
+	for (size_t i=0; i<n; i += widen_block){
+		size_t m = std::min(widen_block, n-i);
+		widen(x, a+i, m);
+		widen(y, b+i, m);
+		kernels<float>().vv[OP](x, y, m);
+		narrow(a+i, x, m);
+	}
+	return true;
 }
 
-template<class T, class S>
-Tensor<T> operator + (S s, Tensor<T> t){	// TODO: can passing be ref be used for these?
-	return t+s;
+/// @brief Whether a[i] op= s has a vector kernel. Only if the arithmetic is done in T anyway, 
+/// (i.e., T op S has type T), or in float for the float16 types, so that results are identical 
+/// to the generic path.
+template <class T, class S, bool = is_simd_type<T>::value && std::is_arithmetic<S>::value> 
+struct has_scalar_kernel : std::integral_constant<bool, is_float16_type<T>::value && (std::is_same<S,float>::value || std::is_integral<S>::value)> {};
+
+template <class T, class S>
+struct has_scalar_kernel<T,S,true> : std::is_same<typename std::common_type<T,S>::type, T> {};
+
+/// @brief a[i] op= s with the vector kernels, if has_scalar_kernel<T,S>.
+template <int OP, class T, class S>
+typename std::enable_if<!has_scalar_kernel<T,S>::value, bool>::type binary_scalar(T*, S, size_t){
+	return false;
 }
 
-template<class T, class S>
-Tensor<T> operator - (S s, Tensor<T> t){
-	return t-s;
+template <int OP, class T, class S>
+typename std::enable_if<is_simd_type<T>::value && has_scalar_kernel<T,S>::value, bool>::type binary_scalar(T* a, S s, size_t n){
+	kernels<T>().vs[OP](a, T(s), n);
+	return true;
 }
 
-template<class T, class S>
-Tensor<T> operator * (S s, Tensor<T> t){
-	return t*s;
+template <int OP, class T, class S>
+typename std::enable_if<is_float16_type<T>::value && has_scalar_kernel<T,S>::value, bool>::type binary_scalar(T* a, S s, size_t n){
+	float x[widen_block];
+	for (size_t i=0; i<n; i += widen_block){
+		size_t m = std::min(widen_block, n-i);
+		widen(x, a+i, m);
+		kernels<float>().vs[OP](x, float(s), m);
+		narrow(a+i, x, m);
+	}
+	return true;
 }
 
+/// @brief b[j*ldb + i] = a[i*lda + j] for a rows x cols block with the vector kernels. Returns false 
+/// (and does nothing) if T has no kernels.
+template <class T>
+typename std::enable_if<!is_simd_type<T>::value, bool>::type transpose_tile(const T*, std::ptrdiff_t, T*, std::ptrdiff_t, size_t, size_t){
+	return false;
+}
 
+template <class T>
+typename std::enable_if<is_simd_type<T>::value, bool>::type transpose_tile(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, size_t rows, size_t cols){
+	kernels<T>().transpose(a, lda, b, ldb, rows, cols);
+	return true;
+}
+
+/// @brief c[i] += a*b[i] with the vector kernels, or a plain loop if T has none.
+template <class T>
+typename std::enable_if<!is_simd_type<T>::value>::type madd_row(T* c, const T* b, T a, size_t n){
+	for (size_t i=0; i<n; ++i) c[i] += a*b[i];
+}
+
+template <class T>
+typename std::enable_if<is_simd_type<T>::value>::type madd_row(T* c, const T* b, T a, size_t n){
+	kernels<T>().madd(c, b, a, n);
+}
+
+/// @brief Which vector kernel (simd::Op) BinOp applied to elements of type T corresponds to, 
+/// or -1 if none. Operators on double also qualify for float, since rounding the double result 
+/// of +, -, * or / to float gives the correctly rounded float result.
+template <class U, class T> 
+struct op_exact : std::integral_constant<bool, std::is_same<U,void>::value || std::is_same<U,T>::value || std::is_same<U,double>::value> {};
+
+template <class BinOp, class T> struct op_kind : std::integral_constant<int, -1> {};
+template <class U, class T> struct op_kind<std::plus<U>, T> : std::integral_constant<int, op_exact<U,T>::value? add : -1> {};
+template <class U, class T> struct op_kind<std::minus<U>, T> : std::integral_constant<int, op_exact<U,T>::value? sub : -1> {};
+template <class U, class T> struct op_kind<std::multiplies<U>, T> : std::integral_constant<int, op_exact<U,T>::value? mul : -1> {};
+template <class U, class T> struct op_kind<std::divides<U>, T> : std::integral_constant<int, op_exact<U,T>::value? div : -1> {};
+
+/// @brief Which built-in reduction (if any) a BinOp corresponds to: 1 = sum, 2 = max, 3 = min. 
+/// Sums in float and in the 16-bit float types count too, since the kernels accumulate in double.
+template <class BinOp, class T> struct reduction_kind : std::integral_constant<int, 0> {};
+template <class T> struct reduction_kind<std::plus<>, T> : std::integral_constant<int, 1> {};
+template <class T> struct reduction_kind<std::plus<double>, T> : std::integral_constant<int, 1> {};
+template <> struct reduction_kind<std::plus<float>, float> : std::integral_constant<int, 1> {};
+template <> struct reduction_kind<std::plus<TensorHalf>, TensorHalf> : std::integral_constant<int, 1> {};
+template <> struct reduction_kind<std::plus<TensorBFloat16>, TensorBFloat16> : std::integral_constant<int, 1> {};
+template <class T> struct reduction_kind<max_op<T>, T> : std::integral_constant<int, 2> {};
+template <class T> struct reduction_kind<min_op<T>, T> : std::integral_constant<int, 3> {};
+
+/// @brief Combine the contiguous line a[0..n-1] (weighted by the contiguous w[0..n-1], if w is 
+/// not null) with a built-in reduction. Returns false if BinOp/T/weights don't map onto a kernel.
+template <class BinOp, class T>
+typename std::enable_if<!is_simd_type<T>::value && !is_widened_type<T>::value, bool>::type reduce(const T*, size_t, const double*, double&){
+	return false;
+}
+
+template <class BinOp, class T>
+typename std::enable_if<is_simd_type<T>::value, bool>::type reduce(const T* a, size_t n, const double* w, double& r){
+	const int kind = reduction_kind<BinOp,T>::value;
+	if (kind == 0 || n == 0) return false;
+	if (kind == 1) r = kernels<T>().wsum(a, w, n);
+	else if (kind == 2 && !w) r = kernels<T>().vmax(a, n);
+	else if (kind == 3 && !w) r = kernels<T>().vmin(a, n);
+	else return false;
+	return true;
+}
+
+template <class BinOp, class T>
+typename std::enable_if<is_widened_type<T>::value, bool>::type reduce(const T* a, size_t n, const double* w, double& r){
+	const int kind = reduction_kind<BinOp,T>::value;
+	if (kind == 0 || n == 0 || (kind != 1 && w)) return false;
+	const kernel_table<float>& k = kernels<float>();
+	float x[widen_block];
+	for (size_t i=0; i<n; i += widen_block){
+		size_t m = std::min(widen_block, n-i);
+		widen(x, a+i, m);
+		double v = (kind == 1)? k.wsum(x, w? w+i : nullptr, m) : (kind == 2)? k.vmax(x, m) : k.vmin(x, m);
+		if (i == 0) r = v;
+		else r = (kind == 1)? r+v : (kind == 2)? std::max(r, v) : std::min(r, v);
+	}
+	return true;
+}
+
+/// @brief Combine a contiguous row x (weighted by w) into the row accumulator acc with a 
+/// built-in reduction. Returns false if BinOp/T/weights don't map onto a kernel.
+template <class BinOp, class T>
+typename std::enable_if<!is_simd_type<T>::value && !is_widened_type<T>::value, bool>::type reduce_row(double*, const T*, double, bool, size_t){
+	return false;
+}
+
+template <class BinOp, class T>
+typename std::enable_if<is_simd_type<T>::value, bool>::type reduce_row(double* acc, const T* x, double w, bool weighted, size_t n){
+	const int kind = reduction_kind<BinOp,T>::value;
+	if (kind == 1) kernels<T>().axpy(acc, x, w, n);
+	else if (kind == 2 && !weighted) kernels<T>().rmax(acc, x, n);
+	else if (kind == 3 && !weighted) kernels<T>().rmin(acc, x, n);
+	else return false;
+	return true;
+}
+
+template <class BinOp, class T>
+typename std::enable_if<is_widened_type<T>::value, bool>::type reduce_row(double* acc, const T* x, double w, bool weighted, size_t n){
+	const int kind = reduction_kind<BinOp,T>::value;
+	if (kind == 0 || (kind != 1 && weighted)) return false;
+	const kernel_table<float>& k = kernels<float>();
+	float y[widen_block];
+	for (size_t i=0; i<n; i += widen_block){
+		size_t m = std::min(widen_block, n-i);
+		widen(y, x+i, m);
+		if (kind == 1) k.axpy(acc+i, y, w, m);
+		else if (kind == 2) k.rmax(acc+i, y, m);
+		else k.rmin(acc+i, y, m);
+	}
+	return true;
+}
+
+} // namespace simd
+} // namespace tensor_detail
+
+
+namespace tensor_detail{
+
+/// @brief A fixed set of worker threads that execute the chunks of one parallel loop at a time.
+/// The calling thread works on the chunks too, and run() returns only when all chunks are done.
+class ThreadPool{
+	public:
+	explicit ThreadPool(int nthreads){
+		for (int i=0; i<nthreads-1; ++i) workers.emplace_back([this](){work_loop();});
+	}
+
+	~ThreadPool(){
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stop = true;
+		}
+		cv.notify_all();
+		for (auto& t : workers) t.join();
+	}
+
+	int size() const {
+		return workers.size()+1;
+	}
+
+	/// @brief Call f(c) for each c in [0, nchunks), distributing chunks over the threads. If a chunk 
+	/// throws, the chunks not yet started are skipped and the first exception is rethrown once all 
+	/// threads are done.
+	void run(int nchunks, const std::function<void(int)>& f){
+		std::lock_guard<std::mutex> run_lk(run_mutex);	// one parallel loop at a time
+		{
+			std::lock_guard<std::mutex> lk(m);
+			job = &f;
+			njob = nchunks;
+			next = 0;
+			pending = nchunks;
+			failed = false;
+			++generation;
+		}
+		cv.notify_all();
+		execute(f, nchunks);
+
+		std::unique_lock<std::mutex> lk(m);
+		done_cv.wait(lk, [this](){return pending == 0 && active == 0;});
+		job = nullptr;
+		std::exception_ptr e = error;
+		error = nullptr;
+		lk.unlock();
+		if (e) std::rethrow_exception(e);
+	}
+
+	/// True when called from inside a chunk, so that nested loops can run serially.
+	static bool& in_worker(){
+		static thread_local bool flag = false;
+		return flag;
+	}
+
+	private:
+	std::vector<std::thread> workers;
+	std::mutex m, run_mutex;
+	std::condition_variable cv, done_cv;
+	const std::function<void(int)>* job = nullptr;
+	int njob = 0;
+	int pending = 0;
+	int active = 0;
+	std::atomic<int> next{0};
+	std::atomic<bool> failed{false};
+	std::exception_ptr error;	// first exception thrown by a chunk of the current loop
+	size_t generation = 0;
+	bool stop = false;
+
+	void execute(const std::function<void(int)>& f, int nchunks){
+		bool outer = in_worker();
+		in_worker() = true;
+		int c, ndone = 0;
+		while ((c = next++) < nchunks){
+			if (!failed){
+				try { f(c); }
+				catch (...){
+					std::lock_guard<std::mutex> lk(m);
+					if (!error) error = std::current_exception();
+					failed = true;
+				}
+			}
+			++ndone;	// chunks skipped after a failure still count as done
+		}
+		in_worker() = outer;
+		if (ndone > 0){
+			std::lock_guard<std::mutex> lk(m);
+			pending -= ndone;
+			if (pending == 0) done_cv.notify_all();
+		}
+	}
+
+	void work_loop(){
+		size_t seen = 0;
+		while (true){
+			std::unique_lock<std::mutex> lk(m);
+			cv.wait(lk, [&](){return stop || (generation != seen && job != nullptr);});
+			if (stop) return;
+			seen = generation;
+			const std::function<void(int)>* f = job;
+			int n = njob;
+			++active;
+			lk.unlock();
+
+			execute(*f, n);
+
+			lk.lock();
+			if (--active == 0) done_cv.notify_all();
+		}
+	}
+};
+
+struct ParallelSettings{
+	std::atomic<int> nthreads{std::max(1, int(std::thread::hardware_concurrency()))};
+	std::atomic<std::ptrdiff_t> grain{32768};
+	std::mutex pool_mutex;	// guards pool
+	std::shared_ptr<ThreadPool> pool;
+
+	/// @brief The pool of nthreads threads, created by the first parallel call from any thread. 
+	/// The returned reference keeps it alive if tensor_set_num_threads() replaces it meanwhile.
+	std::shared_ptr<ThreadPool> get_pool(){
+		std::lock_guard<std::mutex> lk(pool_mutex);
+		if (!pool) pool = std::make_shared<ThreadPool>(int(nthreads));
+		return pool;
+	}
+};
+
+inline ParallelSettings& parallel_settings(){
+	static ParallelSettings settings;
+	return settings;
+}
+
+} // namespace tensor_detail
+
+/// Set the number of threads used by tensor operations (1 runs everything serially).
+inline void tensor_set_num_threads(int n){
+	auto& ps = tensor_detail::parallel_settings();
+	std::lock_guard<std::mutex> lk(ps.pool_mutex);
+	ps.nthreads = std::max(1, n);
+	ps.pool.reset();
+}
+
+/// Number of threads used by tensor operations. Defaults to the number of hardware threads.
+inline int tensor_num_threads(){
+	return tensor_detail::parallel_settings().nthreads;
+}
+
+/// @brief Set the minimum amount of work (roughly, in elements touched) per parallel task.
+/// Operations on tensors smaller than twice this run serially, avoiding threading overheads.
+inline void tensor_set_grain_size(std::ptrdiff_t elements){
+	tensor_detail::parallel_settings().grain = std::max<std::ptrdiff_t>(1, elements);
+}
+
+inline std::ptrdiff_t tensor_grain_size(){
+	return tensor_detail::parallel_settings().grain;
+}
+
+namespace tensor_detail{
+
+/// @brief Call f(begin, end) on contiguous subranges covering [0, n), in parallel if the total 
+/// work n*cost (elements touched) is large enough. Different subranges must write disjoint data.
+template <class F>
+void parallel_for(std::ptrdiff_t n, std::ptrdiff_t cost, F f){
+	auto& ps = parallel_settings();
+	std::ptrdiff_t work = n*std::max<std::ptrdiff_t>(1, cost);
+#ifndef TENSOR_NO_THREADS
+	std::ptrdiff_t grain = ps.grain;
+	if (ps.nthreads > 1 && n > 1 && work >= 2*grain && !ThreadPool::in_worker()){
+		std::shared_ptr<ThreadPool> pool = ps.get_pool();
+		int nchunks = std::min<std::ptrdiff_t>({n, work/grain, 4*std::ptrdiff_t(pool->size())});
+		auto chunk = [&](int c){
+			f(n*c/nchunks, n*(c+1)/nchunks);
+		};
+		pool->run(nchunks, std::ref(chunk));	// std::function holds a reference without allocating
+		return;
+	}
+#endif
+	if (n > 0) f(std::ptrdiff_t(0), n);
+}
+
+} // namespace tensor_detail
+
+namespace tensor_detail{
+
+/// Lowest (MAX) or highest value of T, from which max and min reductions start.
+template <class T, bool MAX>
+T extreme_value(){
+	typedef std::numeric_limits<T> L;
+	if (L::has_infinity) return MAX? T(-L::infinity()) : L::infinity();
+	return MAX? L::lowest() : L::max();
+}
+
+/// Elements per leaf of the pairwise reductions: leaves are reduced by the vector kernels.
+const std::ptrdiff_t reduce_leaf = 4096;
+
+/// @brief Combine two partial results of the built-in reduction of BinOp (see simd::reduction_kind), 
+/// or apply BinOp itself otherwise.
+template <class BinOp, class T>
+double reduce_combine(BinOp binary_op, double a, double b){
+	const int kind = simd::reduction_kind<BinOp,T>::value;
+	if (kind == 1) return a+b;
+	if (kind == 2) return std::max(a,b);
+	if (kind == 3) return std::min(a,b);
+	return binary_op(a,b);
+}
+
+/// @brief Built-in reduction of the contiguous line a[0..n-1], n > 0, by pairwise recursion over 
+/// leaves. If w is not null, the elements are weighted by the contiguous w[0..n-1] (sums only).
+template <class BinOp, class T>
+double reduce_pairwise(BinOp binary_op, const T* a, const double* w, std::ptrdiff_t n){
+	if (n > reduce_leaf){
+		std::ptrdiff_t h = n/2;
+		return reduce_combine<BinOp,T>(binary_op, reduce_pairwise(binary_op, a, w, h), reduce_pairwise(binary_op, a+h, w? w+h : w, n-h));
+	}
+	double r;
+	if (simd::reduce<BinOp>(a, n, w, r)) return r;
+	r = (w? w[0] : 1)*a[0];
+	for (std::ptrdiff_t i=1; i<n; ++i) r = reduce_combine<BinOp,T>(binary_op, r, (w? w[i] : 1)*a[i]);
+	return r;
+}
+
+/// @brief Same as reduce_pairwise(), but the top levels of the recursion are spread over the threads: 
+/// the subtrees are reduced into per-thread partials, which are then combined in the same tree 
+/// order, so that the result does not depend on the number of threads.
+template <class BinOp, class T>
+double reduce_pairwise_parallel(BinOp binary_op, const T* a, const double* w, std::ptrdiff_t n){
+	const int depth = 8, nparts = 1 << depth;
+	if (n < nparts*reduce_leaf) return reduce_pairwise(binary_op, a, w, n);
+
+	double part[nparts];
+	parallel_for(nparts, n/nparts, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+		for (std::ptrdiff_t k=b; k<e; ++k){
+			std::ptrdiff_t start = 0, len = n;	// follow the halving of reduce_pairwise() down to subtree k
+			for (int bit=depth-1; bit>=0; --bit){
+				std::ptrdiff_t h = len/2;
+				if ((k >> bit) & 1){ start += h; len -= h; }
+				else len = h;
+			}
+			part[k] = reduce_pairwise(binary_op, a+start, w? w+start : w, len);
+		}
+	});
+	for (int width=1; width<nparts; width *= 2){
+		for (int k=0; k<nparts; k += 2*width) part[k] = reduce_combine<BinOp,T>(binary_op, part[k], part[k+width]);
+	}
+	return part[0];
+}
+
+/// @brief Fold the contiguous line a[0..n-1] into v. In the WEIGHTED version, element i is 
+/// weighted by w[i*sw]. Built-in sums use the (weighted) vector kernels when the weights are 
+/// contiguous or constant along the line, other reductions fold w[i*sw]*a[i] elementwise.
+template <bool WEIGHTED, class BinOp, class T>
+double reduce_line(BinOp binary_op, double v, const T* a, const double* w, std::ptrdiff_t sw, std::ptrdiff_t n){
+	const int kind = simd::reduction_kind<BinOp,T>::value;
+	if (!WEIGHTED && kind != 0) return reduce_combine<BinOp,T>(binary_op, v, reduce_pairwise(binary_op, a, nullptr, n));
+	if (WEIGHTED && kind == 1 && sw == 1) return v + reduce_pairwise(binary_op, a, w, n);
+	if (WEIGHTED && kind == 1 && sw == 0) return v + w[0]*reduce_pairwise(binary_op, a, nullptr, n);
+	for (std::ptrdiff_t i=0; i<n; ++i) v = reduce_combine<BinOp,T>(binary_op, v, WEIGHTED? w[i*sw]*a[i] : double(a[i]));
+	return v;
+}
+
+/// Scratch space of rolling_line(), reused for the lines processed by a thread.
+struct rolling_buffers{
+	std::vector<double> v;
+	std::vector<std::ptrdiff_t> i;
+};
+
+/// @brief y[k*ys] = scale * the reduction of x[k*xs], ..., x[(k+w-1)*xs], for k = 0, ..., n-w. 
+/// Built-in sums are differences of prefix sums (in double), and maxima and minima are kept at 
+/// the front of a monotonic queue of candidates, so that both take O(1) per element. Other 
+/// reductions fold each window, in O(w) per element.
+template <class BinOp, class T>
+void rolling_line(BinOp binary_op, const T* x, std::ptrdiff_t xs, std::ptrdiff_t n, std::ptrdiff_t w, T* y, std::ptrdiff_t ys, double scale, rolling_buffers& buf){
+	const int kind = simd::reduction_kind<BinOp,T>::value;
+	if (kind == 1){
+		buf.v.resize(n+1);
+		double* p = buf.v.data();
+		p[0] = 0;
+		for (std::ptrdiff_t i=0; i<n; ++i) p[i+1] = p[i] + x[i*xs];
+		for (std::ptrdiff_t k=0; k+w<=n; ++k) y[k*ys] = T((p[k+w] - p[k])*scale);
+	}
+	else if (kind == 2 || kind == 3){
+		// values and positions of the elements that can still be the extremum of a window
+		buf.v.resize(n);
+		buf.i.resize(n);
+		double* qv = buf.v.data();
+		std::ptrdiff_t* qi = buf.i.data();
+		std::ptrdiff_t head = 0, tail = 0;
+		for (std::ptrdiff_t i=0; i<n; ++i){
+			double v = x[i*xs];
+			while (tail > head && ((kind == 2)? qv[tail-1] <= v : qv[tail-1] >= v)) --tail;
+			qv[tail] = v;
+			qi[tail++] = i;
+			if (qi[head] <= i-w) ++head;
+			if (i >= w-1) y[(i-w+1)*ys] = T(qv[head]*scale);
+		}
+	}
+	else {
+		for (std::ptrdiff_t k=0; k+w<=n; ++k){
+			double v = x[k*xs];
+			for (std::ptrdiff_t j=1; j<w; ++j) v = binary_op(v, x[(k+j)*xs]);
+			y[k*ys] = T(v*scale);
+		}
+	}
+}
+
+/// Highest rank supported by reduce_axes(), whose axis sets are bit masks.
+const int max_reduce_rank = 64;
+
+/// Whether odim is dim without the axes whose bits are set in 'reduced' (bit i for dim[i]).
+inline bool is_reduced_shape(const std::vector<std::ptrdiff_t>& dim, std::uint64_t reduced, const std::vector<std::ptrdiff_t>& odim){
+	size_t k = 0;
+	for (size_t i=0; i<dim.size(); ++i){
+		if ((reduced >> i) & 1) continue;
+		if (k >= odim.size() || odim[k++] != dim[i]) return false;
+	}
+	return k == odim.size();
+}
+
+/// Axes of the same kind merged by reduce_axes(): extent, strides in the input, output and weights.
+struct reduce_group{ 
+	std::ptrdiff_t n, s, so, sw; 
+	bool red; 
+};
+
+template <bool WEIGHTED, class T, class U, class BinOp>
+void reduce_groups(const T* data, const double* w, const reduce_group* kept, int nkept, const reduce_group* red, int nred_groups,
+                   reduce_group last, U* out, std::ptrdiff_t nout, double v0, BinOp binary_op, double div){
+	const int kind = simd::reduction_kind<BinOp,T>::value;
+
+	// offsets of element k of the kept groups, in the input, output and weights
+	auto kept_offset = [&](std::ptrdiff_t k, std::ptrdiff_t& oi, std::ptrdiff_t& oo, std::ptrdiff_t& ow){
+		oi = oo = ow = 0;
+		for (int i=nkept-1; i>=0; --i){
+			std::ptrdiff_t ik = k % kept[i].n;
+			k /= kept[i].n;
+			oi += ik*kept[i].s;
+			oo += ik*kept[i].so;
+			ow += ik*kept[i].sw;
+		}
+	};
+	std::ptrdiff_t nred = 1;
+	for (int i=0; i<nred_groups; ++i) nred *= red[i].n;
+	// call f(input, weights) at each element of the reduced groups
+	auto for_each_reduced = [&](std::ptrdiff_t oi, std::ptrdiff_t ow, auto f){
+		std::ptrdiff_t ix[max_reduce_rank] = {};
+		for (std::ptrdiff_t c=0; c<nred; ++c){
+			f(data + oi, w + ow);
+			for (int i=nred_groups-1; i>=0; --i){	// advance the odometer
+				oi += red[i].s;
+				ow += red[i].sw;
+				if (++ix[i] < red[i].n) break;
+				oi -= red[i].s*red[i].n;
+				ow -= red[i].sw*red[i].n;
+				ix[i] = 0;
+			}
+		}
+	};
+
+	if (last.red){
+		// each output element is a combination of nred contiguous lines of length last.n
+		std::ptrdiff_t n = last.n;
+		parallel_for(nout, nred*n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t k=b; k<e; ++k){
+				std::ptrdiff_t oi, oo, ow;
+				kept_offset(k, oi, oo, ow);
+				double v = v0;
+				if (kind != 0 && nout == 1 && nred == 1 && (!WEIGHTED || last.sw == 1)){
+					double r = reduce_pairwise_parallel(binary_op, data+oi, WEIGHTED? w+ow : nullptr, n);
+					v = reduce_combine<BinOp,T>(binary_op, v, r);
+				}
+				else {
+					for_each_reduced(oi, ow, [&](const T* line, const double* wl){ v = reduce_line<WEIGHTED>(binary_op, v, line, wl, last.sw, n); });
+				}
+				out[oo] = v/div;
+			}
+		});
+	}
+	else {
+		// the innermost axis is kept: accumulate whole rows, one tile at a time
+		std::ptrdiff_t inner = last.n;
+		std::ptrdiff_t nouter = nout/inner;
+		const std::ptrdiff_t tile = 1024;
+		std::ptrdiff_t ntiles = (inner+tile-1)/tile;
+		parallel_for(nouter*ntiles, nred*std::min(inner, tile), [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			double acc[tile];
+			for (std::ptrdiff_t t=b; t<e; ++t){
+				std::ptrdiff_t j0 = (t%ntiles)*tile, len = std::min(tile, inner-j0);
+				std::ptrdiff_t oi, oo, ow;
+				kept_offset(t/ntiles, oi, oo, ow);
+				std::fill(acc, acc+len, v0);
+				for_each_reduced(oi + j0, ow + j0*last.sw, [&](const T* row, const double* wr){
+					if (!WEIGHTED || last.sw == 0){
+						if (simd::reduce_row<BinOp>(acc, row, WEIGHTED? wr[0] : 1, WEIGHTED, len)) return;
+						double wj = WEIGHTED? wr[0] : 1;
+						for (std::ptrdiff_t j=0; j<len; ++j) acc[j] = reduce_combine<BinOp,T>(binary_op, acc[j], WEIGHTED? wj*row[j] : double(row[j]));
+					}
+					else {
+						for (std::ptrdiff_t j=0; j<len; ++j) acc[j] = reduce_combine<BinOp,T>(binary_op, acc[j], wr[j*last.sw]*row[j]);
+					}
+				});
+				for (std::ptrdiff_t j=0; j<len; ++j) out[oo + (j0+j)*last.so] = acc[j]/div;
+			}
+		});
+	}
+}
+
+/// @brief Reduce the strided array (data, dim, str) over the axes whose bits are set in 'reduced' 
+/// (bit i for dim[i]) into the strided array (out, odim, ostr), whose dimensions are those of the 
+/// kept axes, in a single pass. Results start from v0 and are divided by div before they are 
+/// stored (e.g. by the number of elements reduced, for means). If w is not null, 
+/// each element is multiplied by its weight w[offset], where the offset advances by the strides 
+/// wstr (which are 0 along axes over which the weights are broadcast). Nothing is allocated.
+/// Adjacent axes of the same kind are merged first. If the innermost axis is reduced, each output 
+/// element reduces contiguous lines (pairwise, and in parallel for a full reduction); otherwise 
+/// contiguous rows are accumulated into a tile of accumulators per output block, like 
+/// Tensor::accumulate() does along an outer axis. Built-in reductions (sum, max, min) accumulate 
+/// in double with the vector kernels; other operators are folded elementwise in storage order.
+/// The weighted and unweighted loops are separate instantiations, chosen once per call.
+template <class T, class U, class BinOp>
+void reduce_axes(const T* data, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str, std::uint64_t reduced,
+                 const double* w, const std::ptrdiff_t* wstr, U* out, const std::vector<std::ptrdiff_t>& odim, const std::vector<std::ptrdiff_t>& ostr, 
+                 double v0, BinOp binary_op, double div){
+	assert(dim.size() <= size_t(max_reduce_rank));
+	std::ptrdiff_t nout = checked_size(odim);
+	if (nout == 0) return;
+	if (checked_size(dim) == 0){
+		strided_for_each(odim, out, ostr, [&](U& x){x = v0/div;});
+		return;
+	}
+
+	// merge axes into groups, outermost first
+	reduce_group g[max_reduce_rank+1];
+	int ng = 0;
+	for (size_t i=0, ko=0; i<dim.size(); ++i){
+		bool r = (reduced >> i) & 1;
+		std::ptrdiff_t so = r? 0 : ostr[ko++];
+		std::ptrdiff_t sw = w? wstr[i] : 0;
+		if (dim[i] == 1) continue;
+		if (ng > 0){
+			reduce_group& b = g[ng-1];
+			if (b.red == r && b.s == str[i]*dim[i] && b.so == so*dim[i] && b.sw == sw*dim[i]){
+				b.n *= dim[i];
+				b.s = str[i];
+				b.so = so;
+				b.sw = sw;
+				continue;
+			}
+		}
+		g[ng++] = {dim[i], str[i], so, sw, r};
+	}
+	if (ng == 0 || g[ng-1].s != 1) g[ng++] = {1, 1, 1, 0, false};	// make the innermost group contiguous
+	reduce_group last = g[--ng];
+	reduce_group kept[max_reduce_rank], red[max_reduce_rank];
+	int nkept = 0, nred = 0;
+	for (int i=0; i<ng; ++i){
+		if (g[i].red) red[nred++] = g[i];
+		else kept[nkept++] = g[i];
+	}
+
+	if (w) reduce_groups<true>(data, w, kept, nkept, red, nred, last, out, nout, v0, binary_op, div);
+	else   reduce_groups<false>(data, w, kept, nkept, red, nred, last, out, nout, v0, binary_op, div);
+}
+
+/// @brief Shape of the result of broadcasting shapes a and b against each other (NumPy rules): 
+/// dimensions are aligned from the right, and each pair must be equal or contain a 1.
+inline std::vector<std::ptrdiff_t> broadcast_shape(const std::vector<std::ptrdiff_t>& a, const std::vector<std::ptrdiff_t>& b){
+	const std::vector<std::ptrdiff_t>& big = (a.size() >= b.size())? a : b;
+	const std::vector<std::ptrdiff_t>& small = (a.size() >= b.size())? b : a;
+	std::vector<std::ptrdiff_t> dim = big;
+	int lead = big.size()-small.size();
+	for (size_t i=0; i<small.size(); ++i){
+		assert(small[i] == big[lead+i] || small[i] == 1 || big[lead+i] == 1);
+		if (big[lead+i] == 1) dim[lead+i] = small[i];
+	}
+	return dim;
+}
+
+/// Strides of the weights w aligned to the axes of dim, to which they must be broadcastable 
+/// (dimensions are right-aligned, and missing or 1-sized dimensions get stride 0).
+template <class V>
+void broadcast_strides(const V& w, const std::vector<std::ptrdiff_t>& dim, std::ptrdiff_t* str){
+	int nd = dim.size(), nw = w.dim.size();
+	assert(nw <= nd);
+	for (int i=0; i<nd; ++i){
+		int k = i - (nd-nw);
+		str[i] = 0;
+		if (k < 0 || w.dim[k] == 1) continue;
+		assert(w.dim[k] == dim[i]);
+		str[i] = w.offsets[k];
+	}
+}
+
+/// @brief Set a[i*s] = binary_op(a[i*s], w[i*sw]) for i in [0, n). Rows that are contiguous use 
+/// the vector kernels if BinOp is a built-in arithmetic operator on T (see simd::op_kind), either 
+/// elementwise (sw == 1) or with the single operand w[0] (sw == 0).
+template <class BinOp, class T, class S>
+void transform_row(BinOp binary_op, T* a, std::ptrdiff_t s, const S* w, std::ptrdiff_t sw, std::ptrdiff_t n){
+	const int op = simd::op_kind<BinOp,T>::value;
+	const int k = (op < 0)? 0 : op;
+	if (s == 1 && sw == 1 && op >= 0 && simd::binary<k>(a, w, n)) return;
+	if (s == 1 && sw == 0 && op >= 0 && simd::binary_scalar<k>(a, w[0], n)) return;
+	if (s == 1 && sw == 0){
+		S x = w[0];
+		for (std::ptrdiff_t i=0; i<n; ++i) a[i] = binary_op(a[i], x);
+	}
+	else if (s == 1 && sw == 1){
+		for (std::ptrdiff_t i=0; i<n; ++i) a[i] = binary_op(a[i], w[i]);	// this order is important, because the operator may not be commutative
+	}
+	else {
+		for (std::ptrdiff_t i=0; i<n; ++i) a[i*s] = binary_op(a[i*s], w[i*sw]);
+	}
+}
+
+/// @brief Set each element x of the strided array (data, dim, str) to binary_op(x, w[o]), where 
+/// the operand offset o advances by the strides wstr (0 along axes over which w is broadcast).
+/// Adjacent axes are merged where both strides allow it, and the innermost merged axis is 
+/// processed as rows with transform_row(), in parallel. E.g., for an operand along an outer axis 
+/// each contiguous block below that axis is a single row combined with one scalar.
+template <class T, class S, class BinOp>
+void transform_axes(T* data, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str, const S* w, const std::ptrdiff_t* wstr, BinOp binary_op){
+	assert(dim.size() <= size_t(max_reduce_rank));
+	if (checked_size(dim) == 0) return;
+
+	struct group{ std::ptrdiff_t n, s, sw; };
+	group g[max_reduce_rank+1];
+	int ng = 0;
+	for (size_t i=0; i<dim.size(); ++i){
+		if (dim[i] == 1) continue;
+		if (ng > 0 && g[ng-1].s == str[i]*dim[i] && g[ng-1].sw == wstr[i]*dim[i]){
+			g[ng-1].n *= dim[i];
+			g[ng-1].s = str[i];
+			g[ng-1].sw = wstr[i];
+		}
+		else g[ng++] = {dim[i], str[i], wstr[i]};
+	}
+	if (ng == 0) g[ng++] = {1, 1, 0};
+	group last = g[--ng];
+
+	std::ptrdiff_t nrows = 1;
+	for (int i=0; i<ng; ++i) nrows *= g[i].n;
+	parallel_for(nrows, last.n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+		for (std::ptrdiff_t r=b; r<e; ++r){
+			std::ptrdiff_t oi = 0, ow = 0;
+			for (std::ptrdiff_t i=ng-1, k=r; i>=0; --i){
+				oi += (k % g[i].n)*g[i].s;
+				ow += (k % g[i].n)*g[i].sw;
+				k /= g[i].n;
+			}
+			transform_row(binary_op, data+oi, last.s, w+ow, last.sw, last.n);
+		}
+	});
+}
+
+/// Address range [lo, hi) of the elements of the strided array (data, dim, str), as integers.
+template <class T>
+std::pair<std::uintptr_t, std::uintptr_t> strided_extent(const T* data, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str){
+	std::ptrdiff_t lo = 0, hi = 0;
+	for (size_t i=0; i<dim.size(); ++i){
+		if (dim[i] == 0) return std::make_pair(std::uintptr_t(0), std::uintptr_t(0));
+		(str[i] < 0? lo : hi) += (dim[i]-1)*str[i];
+	}
+	std::uintptr_t p = reinterpret_cast<std::uintptr_t>(data);
+	return std::make_pair(p + lo*std::ptrdiff_t(sizeof(T)), p + (hi+1)*sizeof(T));
+}
+
+/// Side of the square tiles in which strided_copy() transposes (a source and a destination tile of double fit in L1).
+const std::ptrdiff_t copy_tile = 32;
+
+template <class T, class S>
+void transpose_block(const S* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, std::ptrdiff_t rows, std::ptrdiff_t cols){
+	for (std::ptrdiff_t i=0; i<rows; ++i) for (std::ptrdiff_t j=0; j<cols; ++j) b[j*ldb + i] = a[i*lda + j];
+}
+
+template <class T>
+void transpose_block(const T* a, std::ptrdiff_t lda, T* b, std::ptrdiff_t ldb, std::ptrdiff_t rows, std::ptrdiff_t cols){
+	if (simd::transpose_tile(a, lda, b, ldb, rows, cols)) return;
+	for (std::ptrdiff_t i=0; i<rows; ++i) for (std::ptrdiff_t j=0; j<cols; ++j) b[j*ldb + i] = a[i*lda + j];
+}
+
+/// @brief Copy the strided array (src, dim, sstr) into the contiguous row-major array dst, converting 
+/// elements to T. Adjacent axes that are contiguous in the source are merged. If the merged inner 
+/// axis is contiguous in the source (e.g. slices), or no axis is, rows are copied. Otherwise (e.g. 
+/// permuted views) the plane of the inner axis and the axis that is contiguous in the source is 
+/// transposed in copy_tile x copy_tile tiles, with the vector kernels for float and double. 
+/// Rows or (outer index, tile) pairs are processed in parallel.
+template <class T, class S>
+void strided_copy(T* dst, const std::vector<std::ptrdiff_t>& dim, const S* src, const std::vector<std::ptrdiff_t>& sstr){
+	assert(dim.size() <= size_t(max_reduce_rank));
+	if (checked_size(dim) == 0) return;
+
+	struct group{ std::ptrdiff_t n, s, d; };	// size, source stride, destination stride
+	group g[max_reduce_rank+1];
+	int ng = 0;
+	for (size_t i=0; i<dim.size(); ++i){
+		if (dim[i] == 1) continue;
+		if (ng > 0 && g[ng-1].s == sstr[i]*dim[i]){
+			g[ng-1].n *= dim[i];
+			g[ng-1].s = sstr[i];
+		}
+		else g[ng++] = {dim[i], sstr[i], 0};
+	}
+	if (ng == 0) g[ng++] = {1, 1, 0};
+	std::ptrdiff_t p = 1;
+	for (int i=ng-1; i>=0; --i){
+		g[i].d = p;
+		p *= g[i].n;
+	}
+
+	// axis (other than the inner one) along which the source is contiguous
+	int c = -1;
+	for (int i=0; i<ng-1; ++i) if (g[i].s == 1) c = i;
+	group last = g[ng-1];
+
+	if (c < 0 || last.s == 1){
+		auto copy_rows = [&](std::ptrdiff_t b, std::ptrdiff_t e, std::ptrdiff_t j0, std::ptrdiff_t j1){
+			for (std::ptrdiff_t r=b; r<e; ++r){
+				std::ptrdiff_t os = 0;
+				for (int i=ng-2, k=r; i>=0; --i){
+					os += (k % g[i].n)*g[i].s;
+					k /= g[i].n;
+				}
+				const S* a = src + os;
+				T* out = dst + r*last.n;
+				if (last.s == 1) std::copy(a+j0, a+j1, out+j0);
+				else for (std::ptrdiff_t j=j0; j<j1; ++j) out[j] = a[j*last.s];
+			}
+		};
+		std::ptrdiff_t nrows = p/last.n;
+		if (nrows == 1) parallel_for(last.n, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){ copy_rows(0, 1, b, e); });
+		else parallel_for(nrows, last.n, [&](std::ptrdiff_t b, std::ptrdiff_t e){ copy_rows(b, e, 0, last.n); });
+		return;
+	}
+
+	// tiles of the (c, inner) plane, for each combination of the other axes
+	std::ptrdiff_t tc = (g[c].n + copy_tile-1)/copy_tile, tl = (last.n + copy_tile-1)/copy_tile;
+	std::ptrdiff_t nouter = p/(g[c].n*last.n);
+	parallel_for(nouter*tc*tl, copy_tile*copy_tile, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+		for (std::ptrdiff_t t=b; t<e; ++t){
+			std::ptrdiff_t il = (t % tl)*copy_tile, ic = (t/tl % tc)*copy_tile;
+			std::ptrdiff_t os = 0, od = 0;
+			for (int i=ng-2, k=t/(tl*tc); i>=0; --i){
+				if (i == c) continue;
+				os += (k % g[i].n)*g[i].s;
+				od += (k % g[i].n)*g[i].d;
+				k /= g[i].n;
+			}
+			transpose_block(src + os + ic + il*last.s, last.s, dst + od + ic*g[c].d + il, g[c].d, 
+			                std::min(copy_tile, last.n-il), std::min(copy_tile, g[c].n-ic));
+		}
+	});
+}
+
+
+/// @brief Set a = binary_op(a, b) elementwise for same-shaped strided arrays, with transform_axes() 
+/// (merged axes, row kernels, in parallel) unless a has repeated (0-stride) elements, which are 
+/// updated element by element in order, as strided_zip(). If b overlaps a, it is copied first, so 
+/// that every element of a is combined with the value b had before the call (as for a = a + b).
+template <class T, class S, class BinOp>
+void zip_transform(T* a, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& sa, const S* b, const std::vector<std::ptrdiff_t>& sb, BinOp binary_op){
+	auto ra = strided_extent(a, dim, sa), rb = strided_extent(b, dim, sb);
+	std::vector<S> copy;
+	std::vector<std::ptrdiff_t> sc;
+	bool same = static_cast<const void*>(a) == static_cast<const void*>(b) && sa == sb;	// each element reads only itself
+	if (!same && ra.first < rb.second && rb.first < ra.second){
+		copy.resize(checked_size(dim));
+		strided_copy(copy.data(), dim, b, sb);
+		sc = contiguous_strides(dim);
+		b = copy.data();
+	}
+	const std::vector<std::ptrdiff_t>& sbb = copy.empty()? sb : sc;
+	bool safe = dim.size() <= size_t(max_reduce_rank);
+	for (size_t i=0; i<dim.size(); ++i) safe = safe && (sa[i] != 0 || dim[i] <= 1);
+	if (safe) transform_axes(a, dim, sa, b, sbb.data(), binary_op);
+	else strided_zip(dim, a, sa, b, sbb, [&binary_op](T& x, const S& y){ x = binary_op(x, y); });
+}
+
+
+// matrix products
+
+/// Whether tensor.h was included with TENSOR_BLAS defined, i.e. matrix products of float and double go to CBLAS.
+#ifdef TENSOR_BLAS
+const bool blas_enabled = true;
+#else
+const bool blas_enabled = false;
+#endif
+
+/// @brief How BLAS takes the rows x cols matrix with element (i,j) at i*rs + j*cs: as a row-major 
+/// matrix (trans = false) or as the transpose of one (trans = true), with leading dimension ld. 
+/// Returns false if it can't, e.g. if neither stride is 1 or the matrix is broadcast.
+inline bool blas_layout(std::ptrdiff_t rows, std::ptrdiff_t cols, std::ptrdiff_t rs, std::ptrdiff_t cs, bool& trans, int& ld){
+	// the stride along a dimension of size 1 is arbitrary
+	if (rows == 1) rs = (cs == 1)? std::max<std::ptrdiff_t>(cols, 1) : 1;
+	if (cols == 1) cs = (rs == 1)? std::max<std::ptrdiff_t>(rows, 1) : 1;
+	std::ptrdiff_t l;
+	if (cs == 1 && rs >= std::max<std::ptrdiff_t>(cols, 1)){
+		trans = false;
+		l = rs;
+	}
+	else if (rs == 1 && cs >= std::max<std::ptrdiff_t>(rows, 1)){
+		trans = true;
+		l = cs;
+	}
+	else return false;
+	if (l > std::numeric_limits<int>::max()) return false;
+	ld = int(l);
+	return true;
+}
+
+#ifdef TENSOR_BLAS
+inline void blas_gemm(bool ta, bool tb, int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc, float alpha){
+	cblas_sgemm(CblasRowMajor, ta? CblasTrans : CblasNoTrans, tb? CblasTrans : CblasNoTrans, m, n, k, alpha, a, lda, b, ldb, 0.0f, c, ldc);
+}
+
+inline void blas_gemm(bool ta, bool tb, int m, int n, int k, const double* a, int lda, const double* b, int ldb, double* c, int ldc, double alpha){
+	cblas_dgemm(CblasRowMajor, ta? CblasTrans : CblasNoTrans, tb? CblasTrans : CblasNoTrans, m, n, k, alpha, a, lda, b, ldb, 0.0, c, ldc);
+}
+
+// y = alpha A x for the m x k matrix A (stored transposed if ta)
+inline void blas_gemv(bool ta, int m, int k, const float* a, int lda, const float* x, int incx, float* y, int incy, float alpha){
+	cblas_sgemv(CblasRowMajor, ta? CblasTrans : CblasNoTrans, ta? k : m, ta? m : k, alpha, a, lda, x, incx, 0.0f, y, incy);
+}
+
+inline void blas_gemv(bool ta, int m, int k, const double* a, int lda, const double* x, int incx, double* y, int incy, double alpha){
+	cblas_dgemv(CblasRowMajor, ta? CblasTrans : CblasNoTrans, ta? k : m, ta? m : k, alpha, a, lda, x, incx, 0.0, y, incy);
+}
+#endif
+
+template <class T> struct is_blas_type : std::integral_constant<bool, blas_enabled && simd::is_simd_type<T>::value> {};
+
+/// @brief C = alpha*A*B with BLAS, without copying, as in gemm(). Returns false (and does nothing) if 
+/// T is not float or double, TENSOR_BLAS is not defined, or BLAS can't take the strides as they are.
+template <class T>
+typename std::enable_if<!is_blas_type<T>::value, bool>::type
+gemm_blas(std::ptrdiff_t, std::ptrdiff_t, std::ptrdiff_t, const T*, std::ptrdiff_t, std::ptrdiff_t, const T*, std::ptrdiff_t, std::ptrdiff_t, T*, std::ptrdiff_t, T = 1){
+	return false;
+}
+
+template <class T>
+typename std::enable_if<is_blas_type<T>::value, bool>::type
+gemm_blas(std::ptrdiff_t M, std::ptrdiff_t N, std::ptrdiff_t K, const T* a, std::ptrdiff_t ras, std::ptrdiff_t acs, 
+          const T* b, std::ptrdiff_t rbs, std::ptrdiff_t bcs, T* c, std::ptrdiff_t ldc, T alpha = 1){
+#ifdef TENSOR_BLAS
+	const std::ptrdiff_t imax = std::numeric_limits<int>::max();
+	bool ta, tb;
+	int lda, ldb;
+	if (M > imax || N > imax || K > imax || !blas_layout(M, K, ras, acs, ta, lda)) return false;
+	if (N == 1){
+		if (K == 1) rbs = 1;
+		if (M == 1) ldc = 1;
+		if (rbs <= 0 || rbs > imax || ldc <= 0 || ldc > imax) return false;
+		blas_gemv(ta, int(M), int(K), a, lda, b, int(rbs), c, int(ldc), alpha);
+		return true;
+	}
+	if (M == 1) ldc = N;
+	if (!blas_layout(K, N, rbs, bcs, tb, ldb) || ldc < N || ldc > imax) return false;
+	blas_gemm(ta, tb, int(M), int(N), int(K), a, lda, b, ldb, c, int(ldc), alpha);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/// @brief Weights of a reduction as a vector of T for BLAS: the weights themselves for double, 
+/// otherwise a copy in a per-thread buffer that is only reallocated when it grows.
+template <class T>
+typename std::enable_if<std::is_same<T,double>::value, const T*>::type
+blas_weights(const std::vector<double>& w){
+	return w.data();
+}
+
+template <class T>
+typename std::enable_if<!std::is_same<T,double>::value, const T*>::type
+blas_weights(const std::vector<double>& w){
+	static thread_local std::vector<T> buf;
+	if (buf.size() < w.size()) buf.resize(w.size());
+	std::copy(w.begin(), w.end(), buf.begin());
+	return buf.data();
+}
+
+/// Blocks of the built-in matrix product: a gemm_block_k x gemm_block_n panel of B stays in L2 while the rows of C are updated.
+const std::ptrdiff_t gemm_block_k = 128, gemm_block_n = 512;
+
+/// @brief Blocked C = A*B, without BLAS, as in gemm(). Rows of C are computed in parallel, each as 
+/// a sum of rows of B (copied first if they are not contiguous) scaled by elements of A, with the 
+/// vector kernels. Matrix-vector products (N = 1) are dot products accumulated in double, like the 
+/// weighted reductions.
+template <class T>
+void gemm_builtin(std::ptrdiff_t M, std::ptrdiff_t N, std::ptrdiff_t K, const T* a, std::ptrdiff_t ras, std::ptrdiff_t acs, 
+                  const T* b, std::ptrdiff_t rbs, std::ptrdiff_t bcs, T* c, std::ptrdiff_t ldc){
+	if (N == 1){
+		std::vector<double> w(K);
+		for (std::ptrdiff_t k=0; k<K; ++k) w[k] = b[k*rbs];
+		parallel_for(M, K, [&](std::ptrdiff_t i0, std::ptrdiff_t i1){
+			for (std::ptrdiff_t i=i0; i<i1; ++i){
+				const T* r = a + i*ras;
+				double s = 0;
+				if (acs != 1 || !simd::reduce<std::plus<double>>(r, K, w.data(), s)){
+					s = 0;
+					for (std::ptrdiff_t k=0; k<K; ++k) s += w[k]*r[k*acs];
+				}
+				c[i*ldc] = T(s);
+			}
+		});
+		return;
+	}
+
+	std::vector<T> bp;
+	if (bcs != 1){
+		bp.resize(K*N);
+		strided_copy(bp.data(), {K, N}, b, {rbs, bcs});
+		b = bp.data();
+		rbs = N;
+	}
+	parallel_for(M, N*K, [&](std::ptrdiff_t i0, std::ptrdiff_t i1){
+		for (std::ptrdiff_t i=i0; i<i1; ++i) std::fill(c + i*ldc, c + i*ldc + N, T(0));
+		for (std::ptrdiff_t k0=0; k0<K; k0 += gemm_block_k){
+			std::ptrdiff_t k1 = std::min(K, k0 + gemm_block_k);
+			for (std::ptrdiff_t j0=0; j0<N; j0 += gemm_block_n){
+				std::ptrdiff_t nj = std::min(N-j0, gemm_block_n);
+				for (std::ptrdiff_t i=i0; i<i1; ++i){
+					T* ci = c + i*ldc + j0;
+					for (std::ptrdiff_t k=k0; k<k1; ++k) simd::madd_row(ci, b + k*rbs + j0, a[i*ras + k*acs], nj);
+				}
+			}
+		}
+	});
+}
+
+/// @brief C = A*B for the M x K matrix A with element (i,k) at a[i*ras + k*acs], the K x N matrix B 
+/// with element (k,j) at b[k*rbs + j*bcs], and C with element (i,j) at c[i*ldc + j]. C must not 
+/// overlap A or B. With TENSOR_BLAS, float and double go to cblas_?gemm (cblas_?gemv if N = 1), 
+/// after copying operands whose strides BLAS can't take; otherwise gemm_builtin() is used.
+template <class T>
+void gemm(std::ptrdiff_t M, std::ptrdiff_t N, std::ptrdiff_t K, const T* a, std::ptrdiff_t ras, std::ptrdiff_t acs, 
+          const T* b, std::ptrdiff_t rbs, std::ptrdiff_t bcs, T* c, std::ptrdiff_t ldc){
+	if (M == 0 || N == 0) return;
+	if (K == 0){
+		for (std::ptrdiff_t i=0; i<M; ++i) for (std::ptrdiff_t j=0; j<N; ++j) c[i*ldc + j] = T(0);
+		return;
+	}
+	if (gemm_blas(M, N, K, a, ras, acs, b, rbs, bcs, c, ldc)) return;
+	if (is_blas_type<T>::value){
+		std::vector<T> ac, bc;
+		bool t;
+		int ld;
+		if (!blas_layout(M, K, ras, acs, t, ld)){
+			ac.resize(M*K);
+			strided_copy(ac.data(), {M, K}, a, {ras, acs});
+			a = ac.data();
+			ras = K;
+			acs = 1;
+		}
+		if (!blas_layout(K, N, rbs, bcs, t, ld)){
+			bc.resize(K*N);
+			strided_copy(bc.data(), {K, N}, b, {rbs, bcs});
+			b = bc.data();
+			rbs = N;
+			bcs = 1;
+		}
+		if (gemm_blas(M, N, K, a, ras, acs, b, rbs, bcs, c, ldc)) return;
+	}
+	gemm_builtin(M, N, K, a, ras, acs, b, rbs, bcs, c, ldc);
+}
+
+/// @brief fs such that the dimensions of (dim, str) other than position p (all if p < 0) can be 
+/// traversed in row-major order as a single axis with stride fs. Returns false if they can't.
+inline bool merged_stride(const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str, int p, std::ptrdiff_t& fs){
+	fs = 1;
+	std::ptrdiff_t next = 0;
+	bool first = true;
+	for (int i=dim.size()-1; i>=0; --i){
+		if (i == p || dim[i] == 1) continue;
+		if (first) fs = str[i];
+		else if (str[i] != next) return false;
+		next = str[i]*dim[i];
+		first = false;
+	}
+	return true;
+}
+
+} // namespace tensor_detail
+
+
+// ---- profiling ----
+
+/// Counters of one operation, as collected by TensorProfiler.
+struct TensorOpStats{
+	std::string name;
+	std::uint64_t calls = 0;
+	double seconds = 0;                 ///< wall time, including nested operations
+	std::uint64_t elements = 0;         ///< elements processed
+	std::uint64_t bytes_allocated = 0;  ///< bytes of tensor storage allocated
+	std::uint64_t temporaries = 0;      ///< tensors allocated (including returned results)
+};
+
+/**
+ TensorProfiler. Per-operation counters for Tensor operations
+
+ If TENSOR_PROFILE is defined before including tensor.h, the constructors, arithmetic operators,
+ reductions, transform() and repeat_*() of Tensor record their call count, wall time, number
+ of elements and the tensor storage they allocate. An operation called by another one
+ (e.g. the constructor of the tensor returned by accumulate()) is counted as part of the
+ outer operation, so time is not counted twice, and the allocation shows up as a temporary of
+ the operation that caused it. Without TENSOR_PROFILE nothing is recorded and the hooks
+ compile to nothing.
+ ```
+ TensorProfiler::print();                        // summary table, by total time
+ TensorProfiler::start_trace();
+ ...
+ TensorProfiler::write_trace("trace.json");      // for chrome://tracing or ui.perfetto.dev
+ ```
+ The counters are global and thread safe.
+ */
+class TensorProfiler{
+	public:
+	/// Whether the library was compiled with TENSOR_PROFILE.
+	static bool enabled(){
+#ifdef TENSOR_PROFILE
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/// Counters of all operations called so far, by decreasing total time.
+	static std::vector<TensorOpStats> stats(){
+		std::lock_guard<std::mutex> lock(get().mutex);
+		std::vector<TensorOpStats> v;
+		for (const auto& s : get().ops) v.push_back(s.second);
+		std::stable_sort(v.begin(), v.end(), [](const TensorOpStats& a, const TensorOpStats& b){ return a.seconds > b.seconds; });
+		return v;
+	}
+
+	/// Clear the counters and any recorded trace.
+	static void reset(){
+		std::lock_guard<std::mutex> lock(get().mutex);
+		get().ops.clear();
+		get().events.clear();
+	}
+
+	/// Print a summary table of stats().
+	static void print(std::ostream& out = std::cout){
+		std::vector<TensorOpStats> v = stats();
+		double total = 0;
+		for (const auto& s : v) total += s.seconds;
+		char line[256];
+		std::snprintf(line, sizeof(line), "%-28s %10s %12s %7s %14s %10s %12s %8s\n", "operation", "calls", "time [ms]", "%", "elements", "Melem/s", "alloc [MB]", "temps");
+		out << line;
+		for (const auto& s : v){
+			std::snprintf(line, sizeof(line), "%-28s %10llu %12.3f %7.1f %14llu %10.1f %12.3f %8llu\n", s.name.c_str(), 
+			              (unsigned long long)s.calls, s.seconds*1e3, (total > 0)? 100*s.seconds/total : 0.0, (unsigned long long)s.elements, 
+			              (s.seconds > 0)? s.elements/s.seconds*1e-6 : 0.0, s.bytes_allocated/1048576.0, (unsigned long long)s.temporaries);
+			out << line;
+		}
+	}
+
+	/// Start recording each (outermost) operation as a trace event, in addition to the counters.
+	static void start_trace(){
+		std::lock_guard<std::mutex> lock(get().mutex);
+		get().tracing = true;
+	}
+
+	static void stop_trace(){
+		std::lock_guard<std::mutex> lock(get().mutex);
+		get().tracing = false;
+	}
+
+	/// Write the recorded trace events in the Chrome trace event format (JSON).
+	static void write_trace(std::ostream& out){
+		std::lock_guard<std::mutex> lock(get().mutex);
+		out << "{\"traceEvents\":[\n";
+		char line[512];
+		for (size_t i=0; i<get().events.size(); ++i){
+			const event& e = get().events[i];
+			std::snprintf(line, sizeof(line), "{\"name\":\"%s\",\"cat\":\"tensor\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d,"
+			              "\"args\":{\"elements\":%llu,\"bytes_allocated\":%llu,\"temporaries\":%llu}}%s\n", e.name, e.start_us, e.duration_us, e.thread, 
+			              (unsigned long long)e.elements, (unsigned long long)e.bytes, (unsigned long long)e.temporaries, (i+1 < get().events.size())? "," : "");
+			out << line;
+		}
+		out << "],\"displayTimeUnit\":\"ms\"}\n";
+	}
+
+	static void write_trace(const std::string& filename){
+		std::ofstream out(filename);
+		if (!out) throw std::runtime_error("Tensor: cannot open " + filename + " for writing");
+		write_trace(out);
+		if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+	}
+
+	/// Record one call of operation 'name' (a string literal). Used by tensor_detail::profile_scope.
+	static void record(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, 
+	                   std::uint64_t elements, std::uint64_t bytes, std::uint64_t temporaries){
+		thread_local int thread = next_thread()++;
+		std::lock_guard<std::mutex> lock(get().mutex);
+		TensorOpStats& s = get().ops[name];
+		if (s.calls == 0) s.name = name;
+		++s.calls;
+		s.seconds += std::chrono::duration<double>(end-start).count();
+		s.elements += elements;
+		s.bytes_allocated += bytes;
+		s.temporaries += temporaries;
+		if (get().tracing){
+			get().events.push_back({name, std::chrono::duration<double, std::micro>(start-epoch()).count(), std::chrono::duration<double, std::micro>(end-start).count(), 
+			                        thread, elements, bytes, temporaries});
+		}
+	}
+
+	/// Time origin of the trace: the start of the first profiled operation.
+	static std::chrono::steady_clock::time_point epoch(){
+		static const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		return t0;
+	}
+
+	private:
+	struct event{
+		const char* name;
+		double start_us, duration_us;
+		int thread;
+		std::uint64_t elements, bytes, temporaries;
+	};
+
+	struct state{
+		std::mutex mutex;
+		std::map<std::string, TensorOpStats> ops;
+		std::vector<event> events;
+		bool tracing = false;
+	};
+
+	static state& get(){
+		static state s;
+		return s;
+	}
+
+	static std::atomic<int>& next_thread(){
+		static std::atomic<int> n{0};
+		return n;
+	}
+};
+
+
+namespace tensor_detail{
+
+/// @brief Times an operation from construction to destruction and reports it to TensorProfiler. 
+/// Only the outermost scope on each thread records; nested ones just run.
+class profile_scope{
+	public:
+	profile_scope(const char* _name, std::ptrdiff_t _elements) : name(_name), elements(_elements){
+		profile_scope*& cur = current();
+		if (cur) return;
+		cur = this;
+		outer = true;
+		TensorProfiler::epoch();
+		start = std::chrono::steady_clock::now();
+	}
+
+	~profile_scope(){
+		if (!outer) return;
+		current() = nullptr;
+		TensorProfiler::record(name, start, std::chrono::steady_clock::now(), elements, bytes, temporaries);
+	}
+
+	profile_scope(const profile_scope&) = delete;
+	profile_scope& operator=(const profile_scope&) = delete;
+
+	/// Attribute an allocation of 'b' bytes of tensor storage to the current operation.
+	static void allocated(std::size_t b){
+		profile_scope* cur = current();
+		if (!cur) return;
+		cur->bytes += b;
+		++cur->temporaries;
+	}
+
+	private:
+	const char* name;
+	std::uint64_t elements;
+	std::uint64_t bytes = 0, temporaries = 0;
+	bool outer = false;
+	std::chrono::steady_clock::time_point start;
+
+	static profile_scope*& current(){
+		thread_local profile_scope* p = nullptr;
+		return p;
+	}
+};
+
+} // namespace tensor_detail
+
+#ifdef TENSOR_PROFILE
+/// Profile the enclosing block as operation 'name' (a string literal) processing 'elements' elements.
+#define TENSOR_PROFILE_OP(name, elements) tensor_detail::profile_scope tensor_profile_scope_(name, elements)
+/// Count an allocation of 'bytes' bytes of tensor storage in the current operation.
+#define TENSOR_PROFILE_ALLOC(bytes) tensor_detail::profile_scope::allocated(bytes)
+#else
+#define TENSOR_PROFILE_OP(name, elements) ((void)0)
+#define TENSOR_PROFILE_ALLOC(bytes) ((void)0)
+#endif
+
+
+/**
+ TensorIndexRange. Coordinates of the elements of a tensor or view, in traversal order
+
+ Iterating yields a TensorCoord with the coordinates ix of each element and its location,
+ i.e., its index in Tensor::vec (or its offset from TensorView::data). Successive coordinates
+ are obtained by odometer increments (as in strided_for_each()), so a step costs no division
+ and nothing is allocated after begin().
+ ```
+ for (const auto& c : t.indices()) t[c.loc] = c.ix[0] + 10*c.ix[1];
+ ```
+ A range can be split into subranges of the traversal, e.g., one per thread:
+ ```
+ auto all = t.indices();
+ std::thread th([&]{ for (const auto& c : all.subrange(0, all.size()/2)) ...; });
+ for (const auto& c : all.subrange(all.size()/2, all.size())) ...;
+ ```
+ Only the start of each subrange is computed with divisions.
+ */
+
+/// Element of a TensorIndexRange: the coordinates of an element and its location.
+struct TensorCoord{
+	std::ptrdiff_t loc;
+	std::vector<std::ptrdiff_t> ix;
+};
+
+class TensorIndexRange{
+	public:
+	class iterator{
+		public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef TensorCoord value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const TensorCoord* pointer;
+		typedef const TensorCoord& reference;
+
+		iterator() = default;
+
+		const TensorCoord& operator*() const { return c; }
+		const TensorCoord* operator->() const { return &c; }
+
+		iterator& operator++(){
+			++count;
+			int k = int(c.ix.size())-1;
+			while (k >= 0){
+				c.loc += (*str)[k];
+				if (++c.ix[k] < (*dim)[k]) break;
+				c.loc -= c.ix[k]*(*str)[k];
+				c.ix[k] = 0;
+				--k;
+			}
+			return *this;
+		}
+
+		iterator operator++(int){ iterator i = *this; ++*this; return i; }
+
+		/// Position in the traversal order of the whole tensor.
+		std::ptrdiff_t position() const { return count; }
+
+		bool operator==(const iterator& o) const { return count == o.count; }
+		bool operator!=(const iterator& o) const { return count != o.count; }
+
+		private:
+		friend class TensorIndexRange;
+		TensorCoord c{0, {}};
+		std::ptrdiff_t count = 0;
+		const std::vector<std::ptrdiff_t>* dim = nullptr;
+		const std::vector<std::ptrdiff_t>* str = nullptr;
+	};
+
+	/// All elements of the array with dimensions dim and strides str.
+	TensorIndexRange(std::vector<std::ptrdiff_t> _dim, std::vector<std::ptrdiff_t> _str) : dim(std::move(_dim)), str(std::move(_str)){
+		assert(dim.size() == str.size());
+		first = 0;
+		last = 1;
+		for (std::ptrdiff_t d : dim) last *= d;
+	}
+
+	/// Number of elements in the range.
+	std::ptrdiff_t size() const { return last-first; }
+
+	/// The elements at positions [b, e) of this range.
+	TensorIndexRange subrange(std::ptrdiff_t b, std::ptrdiff_t e) const {
+		assert(0 <= b && b <= e && e <= size());
+		TensorIndexRange r = *this;
+		r.first = first+b;
+		r.last = first+e;
+		return r;
+	}
+
+	iterator begin() const {
+		iterator it;
+		it.dim = &dim;
+		it.str = &str;
+		it.count = first;
+		if (first == last) return it;
+		it.c.ix.resize(dim.size());
+		std::ptrdiff_t i = first;
+		for (int k=int(dim.size())-1; k>=0; --k){
+			it.c.ix[k] = i % dim[k];
+			i /= dim[k];
+			it.c.loc += it.c.ix[k]*str[k];
+		}
+		return it;
+	}
+
+	iterator end() const {
+		iterator it;
+		it.count = last;
+		return it;
+	}
+
+	private:
+	std::vector<std::ptrdiff_t> dim, str;
+	std::ptrdiff_t first, last;
+};
+
+
+/// @brief Tag requesting a Tensor whose elements are left uninitialised, for results that are 
+/// about to be fully overwritten. It only takes effect with allocators whose construct() 
+/// default-initialises (see tensor_default_init_allocator), such as TensorArenaAllocator. 
+/// With std::allocator, std::vector always zero-fills.
+struct tensor_uninitialized_t { explicit tensor_uninitialized_t() = default; };
+constexpr tensor_uninitialized_t tensor_uninitialized{};
+
+/// @brief Pool of 64-byte aligned memory blocks. Freed blocks are kept in free lists by size 
+/// class and handed out again to later requests of the same class, so that tensors that are 
+/// repeatedly created and destroyed with the same sizes do not go back to the system allocator.
+/// Size classes are spaced 4 per power of two, i.e., a block is at most 25% larger than requested.
+/// At most max_cached_bytes() are held in the free lists; blocks beyond that are freed. Thread safe.
+class TensorArena{
+	public:
+	static const std::size_t alignment = 64;
+
+	explicit TensorArena(std::size_t max_cached = std::size_t(1) << 30) : max_cached(max_cached){}
+	~TensorArena(){ release(); }
+	TensorArena(const TensorArena&) = delete;
+	TensorArena& operator = (const TensorArena&) = delete;
+
+	/// The arena used by default-constructed TensorArenaAllocators. It is never destroyed, 
+	/// so tensors with static storage duration can safely release into it at exit.
+	static TensorArena& global(){
+		static TensorArena* arena = new TensorArena();
+		return *arena;
+	}
+
+	void* allocate(std::size_t bytes){
+		std::size_t sz = size_class(bytes);
+		{
+			std::lock_guard<std::mutex> lock(m);
+			auto it = free_lists.find(sz);
+			if (it != free_lists.end() && !it->second.empty()){
+				void* p = it->second.back();
+				it->second.pop_back();
+				cached -= sz;
+				return p;
+			}
+		}
+		return aligned_malloc(sz);
+	}
+
+	void deallocate(void* p, std::size_t bytes) noexcept {
+		if (p == nullptr) return;
+		std::size_t sz = size_class(bytes);
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if (cached + sz <= max_cached){
+				try{
+					free_lists[sz].push_back(p);
+					cached += sz;
+					return;
+				}
+				catch (const std::bad_alloc&){}
+			}
+		}
+		aligned_free(p);
+	}
+
+	/// Return all cached blocks to the system.
+	void release(){
+		std::lock_guard<std::mutex> lock(m);
+		for (auto& fl : free_lists) for (void* p : fl.second) aligned_free(p);
+		free_lists.clear();
+		cached = 0;
+	}
+
+	std::size_t cached_bytes() const {
+		std::lock_guard<std::mutex> lock(m);
+		return cached;
+	}
+
+	std::size_t max_cached_bytes() const {
+		std::lock_guard<std::mutex> lock(m);
+		return max_cached;
+	}
+
+	/// Limit the memory held in the free lists. Already cached blocks are kept.
+	void set_max_cached_bytes(std::size_t bytes){
+		std::lock_guard<std::mutex> lock(m);
+		max_cached = bytes;
+	}
+
+	/// Size actually reserved for a request of 'bytes' bytes (a multiple of the alignment).
+	static std::size_t size_class(std::size_t bytes){
+		if (bytes <= alignment) return alignment;
+		int e = 0;	// floor(log2(bytes-1))
+		while (((bytes-1) >> (e+1)) != 0) ++e;
+		std::size_t step = (std::size_t(1) << e) / 4;
+		if (step < alignment) step = alignment;
+		return (bytes + step-1) / step * step;
+	}
+
+	private:
+	mutable std::mutex m;
+	std::unordered_map<std::size_t, std::vector<void*>> free_lists;
+	std::size_t cached = 0;
+	std::size_t max_cached;
+
+	// The pointer returned by malloc is stored just before the aligned block.
+	static void* aligned_malloc(std::size_t bytes){
+		void* raw = std::malloc(bytes + alignment);
+		if (raw == nullptr) throw std::bad_alloc();
+		std::uintptr_t a = (reinterpret_cast<std::uintptr_t>(raw) + alignment) & ~std::uintptr_t(alignment-1);
+		void* p = reinterpret_cast<void*>(a);
+		static_cast<void**>(p)[-1] = raw;
+		return p;
+	}
+
+	static void aligned_free(void* p){
+		std::free(static_cast<void**>(p)[-1]);
+	}
+};
+
+/// @brief Allocator drawing 64-byte aligned storage from a TensorArena (the global one by default).
+/// Elements are default-initialised rather than value-initialised, so a Tensor of arithmetic 
+/// type created with tensor_uninitialized is not zero-filled. Use it like
+/// ```
+/// Tensor<double, dynamic_rank, TensorArenaAllocator<double>> t({nlat, nlon});
+/// ArenaTensor<double> r = a*b + c;
+/// ```
+template <class T>
+class TensorArenaAllocator{
+	public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	TensorArena* arena;
+
+	TensorArenaAllocator() noexcept : arena(&TensorArena::global()){}
+	explicit TensorArenaAllocator(TensorArena& a) noexcept : arena(&a){}
+	template <class U>
+	TensorArenaAllocator(const TensorArenaAllocator<U>& other) noexcept : arena(other.arena){}
+
+	T* allocate(std::size_t n){
+		if (n > max_size()) throw std::bad_alloc();
+		return static_cast<T*>(arena->allocate(n*sizeof(T)));
+	}
+
+	void deallocate(T* p, std::size_t n) noexcept {
+		arena->deallocate(p, n*sizeof(T));
+	}
+
+	std::size_t max_size() const noexcept {
+		return std::size_t(std::numeric_limits<std::ptrdiff_t>::max()) / 2 / sizeof(T);
+	}
+
+	template <class U>
+	void construct(U* p){ ::new(static_cast<void*>(p)) U; }
+
+	template <class U, class... ARGS>
+	void construct(U* p, ARGS&&... args){ ::new(static_cast<void*>(p)) U(std::forward<ARGS>(args)...); }
+};
+
+template <class T, class U>
+bool operator == (const TensorArenaAllocator<T>& a, const TensorArenaAllocator<U>& b){ return a.arena == b.arena; }
+
+template <class T, class U>
+bool operator != (const TensorArenaAllocator<T>& a, const TensorArenaAllocator<U>& b){ return a.arena != b.arena; }
+
+/// @brief True for allocators whose construct(p) default-initialises. Tensors then zero-fill 
+/// explicitly, unless created with tensor_uninitialized. Specialise it for custom allocators.
+template <class A> struct tensor_default_init_allocator : std::false_type {};
+template <class T> struct tensor_default_init_allocator<TensorArenaAllocator<T>> : std::true_type {};
+
+/// Dynamic-rank tensor with storage from the global TensorArena.
+template <class T>
+using ArenaTensor = Tensor<T, dynamic_rank, TensorArenaAllocator<T>>;
+
+// ---- binary tensor files ----
+
+#if !defined(TENSOR_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define TENSOR_HAVE_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+template <class T> class MappedTensor;
+
+namespace tensor_detail{
+
+/*
+ Layout of a tensor file (integers in the byte order of the machine that wrote it):
+   0    char[8]        magic "TENSORLB"
+   8    uint32         format version
+   12   uint32         byte order mark, 0x01020304 as stored by the writer
+   16   char           element kind: 'f' floating point, 'i' signed, 'u' unsigned integer
+   17   uint8          element size in bytes
+   18   uint16         reserved (0)
+   20   uint32         rank
+   24   uint64         offset of the data from the start of the file (a multiple of 64)
+   32   uint64         size of the data in bytes
+   40   int64[rank]    dim
+        int64[rank]    strides, in elements
+   data elements, aligned so that they can be used in place from a memory-mapped file.
+*/
+struct tensor_file_header{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	char kind;
+	std::uint8_t elem_size;
+	std::uint16_t reserved;
+	std::uint32_t rank;
+	std::uint64_t data_offset;
+	std::uint64_t data_bytes;
+};
+static_assert(sizeof(tensor_file_header) == 40, "unexpected padding in tensor_file_header");
+
+const char tensor_file_magic[9] = "TENSORLB";
+const std::uint32_t tensor_file_version = 1;
+const std::uint32_t tensor_file_byte_order = 0x01020304;
+const std::uint64_t tensor_file_alignment = 64;
+
+template <class T>
+constexpr char tensor_file_kind(){
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T,bool>::value, "tensor files store arithmetic element types only");
+	return std::is_floating_point<T>::value? 'f' : std::is_signed<T>::value? 'i' : 'u';
+}
+
+template <> constexpr char tensor_file_kind<TensorHalf>(){ return 'f'; }
+template <> constexpr char tensor_file_kind<TensorBFloat16>(){ return 'V'; }
+
+/// Element types of tensor and .npy files: those of tensor_file_kind().
+template <class T> struct is_file_type : std::integral_constant<bool, (std::is_arithmetic<T>::value && !std::is_same<T,bool>::value) || 
+	std::is_same<T,TensorHalf>::value || std::is_same<T,TensorBFloat16>::value> {};
+
+/// Reverse the byte order of each of the n elements of size 'size' at p.
+inline void byteswap(void* p, std::size_t size, std::size_t n){
+	char* c = static_cast<char*>(p);
+	for (std::size_t i=0; i<n; ++i, c+=size) std::reverse(c, c+size);
+}
+
+/// Write the header of a tensor file with contiguous row-major data of shape dim, up to the start of the data.
+template <class T>
+void write_tensor_header(std::ostream& out, const std::vector<std::ptrdiff_t>& dim){
+	tensor_file_header h = {};
+	std::memcpy(h.magic, tensor_file_magic, 8);
+	h.version = tensor_file_version;
+	h.byte_order = tensor_file_byte_order;
+	h.kind = tensor_file_kind<T>();
+	h.elem_size = sizeof(T);
+	h.rank = dim.size();
+	std::uint64_t meta = sizeof(h) + 2*sizeof(std::int64_t)*dim.size();
+	h.data_offset = (meta + tensor_file_alignment-1) / tensor_file_alignment * tensor_file_alignment;
+	h.data_bytes = std::uint64_t(checked_size(dim))*sizeof(T);
+
+	std::vector<std::int64_t> shape(dim.begin(), dim.end());
+	std::vector<std::ptrdiff_t> str = contiguous_strides(dim);
+	shape.insert(shape.end(), str.begin(), str.end());
+	char pad[tensor_file_alignment] = {};
+	out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	out.write(reinterpret_cast<const char*>(shape.data()), shape.size()*sizeof(std::int64_t));
+	out.write(pad, h.data_offset - meta);
+}
+
+/// @brief Write a tensor file with contiguous row-major data of shape dim. write_data(out) must 
+/// write the elements in row-major order. Throws std::runtime_error if the file cannot be written.
+template <class T, class F>
+void save_tensor_file(const std::string& filename, const std::vector<std::ptrdiff_t>& dim, F write_data){
+	std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+	if (!out) throw std::runtime_error("Tensor: cannot open " + filename + " for writing");
+	write_tensor_header<T>(out, dim);
+	write_data(out);
+	out.flush();
+	if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+}
+
+/// Shape and location of the data of a tensor file, from its header.
+struct tensor_file_info{
+	std::vector<std::ptrdiff_t> dim, str;
+	std::uint64_t data_offset;
+	bool swapped;	// written with the opposite byte order
+};
+
+/// A tensor file opened for use in place: the elements of shape dim and strides str start at data.
+struct tensor_file_map : tensor_file_info{
+	std::shared_ptr<void> mapping;	// keeps the file mapped (or, without mmap, the bytes read)
+	char* data;
+};
+
+/// @brief Map the whole file into memory: shared and writable (changes go to the file), or 
+/// private (changes stay in memory, copy-on-write). Without mmap support, the file is read.
+inline std::shared_ptr<void> map_file(const std::string& filename, bool writable, std::size_t& size){
+#ifdef TENSOR_HAVE_MMAP
+	int fd = ::open(filename.c_str(), writable? O_RDWR : O_RDONLY);
+	if (fd < 0) throw std::runtime_error("Tensor: cannot open " + filename);
+	struct stat st;
+	if (::fstat(fd, &st) != 0){ ::close(fd); throw std::runtime_error("Tensor: cannot stat " + filename); }
+	size = st.st_size;
+	if (size == 0){ ::close(fd); throw std::runtime_error("Tensor: " + filename + " is empty"); }
+	void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, writable? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	::close(fd);	// the mapping stays valid
+	if (p == MAP_FAILED) throw std::runtime_error("Tensor: cannot map " + filename);
+	return std::shared_ptr<void>(p, [size](void* q){ ::munmap(q, size); });
+#else
+	if (writable) throw std::runtime_error("Tensor: writable mappings need mmap support");
+	std::ifstream in(filename, std::ios::binary | std::ios::ate);
+	if (!in) throw std::runtime_error("Tensor: cannot open " + filename);
+	size = in.tellg();
+	std::shared_ptr<void> buf(::operator new(size), [](void* q){ ::operator delete(q); });
+	in.seekg(0);
+	in.read(static_cast<char*>(buf.get()), size);
+	if (!in) throw std::runtime_error("Tensor: error reading " + filename);
+	return buf;
+#endif
+}
+
+/// Number of elements of a tensor with dimensions read from a file. A negative dimension or an 
+/// overflowing product means the file is corrupt, and is reported with fail(what) as for other errors.
+template <class F>
+std::ptrdiff_t checked_file_size(const std::vector<std::ptrdiff_t>& dim, F fail){
+	for (std::ptrdiff_t d : dim) if (d < 0) throw fail("negative dimension " + std::to_string(d));
+	try { return checked_size(dim); }
+	catch (std::length_error&){ throw fail("number of elements overflows std::ptrdiff_t"); }
+}
+
+/// @brief Read and validate the header of a tensor file of 'size' bytes with elements of type T. 
+/// read(dst, offset, n) must copy n bytes at offset in the file to dst. Files written with the 
+/// opposite byte order are only accepted with allow_swapped (and then flagged).
+/// Throws std::runtime_error if the file is not a valid tensor file of type T.
+template <class T, class R>
+tensor_file_info read_tensor_header(const std::string& filename, std::uint64_t size, bool allow_swapped, R read){
+	tensor_file_info m;
+	m.swapped = false;
+	auto fail = [&](const std::string& what){ return std::runtime_error("Tensor: " + filename + ": " + what); };
+
+	tensor_file_header h;
+	if (size < sizeof(h)) throw fail("too short for a tensor file");
+	read(&h, 0, sizeof(h));
+	if (std::memcmp(h.magic, tensor_file_magic, 8) != 0) throw fail("not a tensor file");
+	if (h.byte_order != tensor_file_byte_order){
+		byteswap(&h.byte_order, 4, 1);
+		if (h.byte_order != tensor_file_byte_order) throw fail("invalid byte order mark");
+		if (!allow_swapped) throw fail("written with a different byte order, use Tensor::load()");
+		m.swapped = true;
+		byteswap(&h.version, 4, 1); byteswap(&h.rank, 4, 1);
+		byteswap(&h.data_offset, 8, 1); byteswap(&h.data_bytes, 8, 1);
+	}
+	if (h.version > tensor_file_version) throw fail("unsupported format version " + std::to_string(h.version));
+	if (h.kind != tensor_file_kind<T>() || h.elem_size != sizeof(T)){
+		throw fail(std::string("stores elements of kind '") + h.kind + "' and size " + std::to_string(h.elem_size) + 
+		           ", expected '" + tensor_file_kind<T>() + "' and size " + std::to_string(sizeof(T)));
+	}
+	if (h.rank > size/16 || sizeof(h) + 16*std::uint64_t(h.rank) > size) throw fail("truncated header");
+
+	std::vector<std::int64_t> shape(2*h.rank);
+	read(shape.data(), sizeof(h), shape.size()*sizeof(std::int64_t));
+	if (m.swapped) byteswap(shape.data(), 8, shape.size());
+	m.dim.assign(shape.begin(), shape.begin()+h.rank);
+	m.str.assign(shape.begin()+h.rank, shape.end());
+	std::ptrdiff_t n = checked_file_size(m.dim, fail);
+
+	if (h.data_offset % alignof(T) != 0 || h.data_offset > size || h.data_bytes > size - h.data_offset) throw fail("truncated data");
+	std::uint64_t avail = h.data_bytes/sizeof(T), extent = (n > 0)? 1 : 0;	// elements spanned by the strides
+	for (std::uint32_t i=0; i<h.rank && n > 0; ++i){
+		if (m.str[i] < 0) throw fail("negative stride");
+		if (m.dim[i] > 1 && std::uint64_t(m.str[i]) > (avail - std::min(avail, extent))/(m.dim[i]-1)) throw fail("strides exceed the data");
+		extent += std::uint64_t(m.dim[i]-1)*m.str[i];
+	}
+	if (extent > avail) throw fail("strides exceed the data");
+	m.data_offset = h.data_offset;
+	return m;
+}
+
+/// Open a tensor file with elements of type T for use in place (see map_file() and read_tensor_header()).
+template <class T>
+tensor_file_map open_tensor_file(const std::string& filename, bool writable, bool allow_swapped){
+	std::size_t size = 0;
+	std::shared_ptr<void> mapping = map_file(filename, writable, size);
+	char* base = static_cast<char*>(mapping.get());
+	tensor_file_map m;
+	static_cast<tensor_file_info&>(m) = read_tensor_header<T>(filename, size, allow_swapped, [base](void* dst, std::uint64_t off, std::size_t n){ std::memcpy(dst, base+off, n); });
+	m.mapping = std::move(mapping);
+	m.data = base + m.data_offset;
+	return m;
+}
+
+} // namespace tensor_detail
+
+
+// ---- formatted output ----
+
+/// Output formats of Tensor::write().
+enum class TensorFormat {
+	text,	///< rows (along the innermost axis) on lines, blocks separated by blank lines; large tensors are summarised
+	csv,	///< one line of comma-separated values per row, outer axes flattened; never summarised
+	npy 	///< NumPy .npy file: a header and the raw elements in row-major order
+};
+
+/// Options for Tensor::write(), to_string() and print().
+struct TensorWriteOptions{
+	TensorFormat format = TensorFormat::text;
+	int precision = 6;	///< significant digits of floating-point values (text and csv)
+	std::ptrdiff_t threshold = 1000;	///< text tensors with more elements than this are summarised, ...
+	std::ptrdiff_t edge_items = 3;	///< ... showing only the first and last edge_items indices along each axis
+};
+
+namespace tensor_detail{
+
+/// CRC-32 (as used by zip) of the n bytes at p, continuing from the CRC crc of the preceding bytes.
+inline std::uint32_t crc32_update(std::uint32_t crc, const char* p, std::size_t n){
+	static const std::array<std::uint32_t, 256> table = [](){
+		std::array<std::uint32_t, 256> t;
+		for (std::uint32_t i=0; i<256; ++i){
+			std::uint32_t c = i;
+			for (int k=0; k<8; ++k) c = (c & 1)? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (std::size_t i=0; i<n; ++i) crc = table[(crc ^ static_cast<unsigned char>(p[i])) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/// @brief Output buffer that goes to the stream in large blocks, so that formatting values does not 
+/// go through the stream one by one. If crc is given, it is updated with the bytes written.
+class write_buffer{
+	private:
+	std::ostream& out;
+	std::string buf;
+	std::uint32_t* crc;
+	static const std::size_t block = std::size_t(1) << 16;
+
+	public:
+	explicit write_buffer(std::ostream& out, std::uint32_t* crc = nullptr) : out(out), crc(crc){
+		buf.reserve(block + 256);
+	}
+
+	~write_buffer(){
+		flush();
+	}
+
+	void put(const char* s, std::size_t n){
+		buf.append(s, n);
+		if (buf.size() >= block) flush();
+	}
+
+	void put(const char* s){
+		put(s, std::strlen(s));
+	}
+
+	void put(char c){
+		buf.push_back(c);
+		if (buf.size() >= block) flush();
+	}
+
+	void flush(){
+		if (crc) *crc = crc32_update(*crc, buf.data(), buf.size());
+		out.write(buf.data(), buf.size());
+		buf.clear();
+	}
+};
+
+/// Append x in text form: with 'precision' significant digits (%g) for floating-point types.
+template <class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type format_value(write_buffer& b, T x, int precision){
+	char s[64];
+	int n = std::snprintf(s, sizeof(s), "%.*Lg", precision, static_cast<long double>(x));
+	b.put(s, std::min<std::size_t>(n, sizeof(s)-1));
+}
+
+template <class T>
+typename std::enable_if<std::is_integral<T>::value>::type format_value(write_buffer& b, T x, int){
+	char s[32];
+	int n = std::is_signed<T>::value? std::snprintf(s, sizeof(s), "%lld", static_cast<long long>(x)) 
+	                                : std::snprintf(s, sizeof(s), "%llu", static_cast<unsigned long long>(x));
+	b.put(s, n);
+}
+
+/// Other element types are formatted with their operator<<.
+template <class T>
+typename std::enable_if<!std::is_arithmetic<T>::value>::type format_value(write_buffer& b, const T& x, int precision){
+	std::ostringstream ss;
+	ss.precision(precision);
+	ss << x;
+	b.put(ss.str().c_str());
+}
+
+/// Text format of the sub-array of axis k and above at p (see TensorFormat::text).
+template <class T>
+void write_text_axis(write_buffer& b, const T* p, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str, int k, 
+                     bool summarise, const TensorWriteOptions& opt, const char* indent){
+	int nd = dim.size();
+	std::ptrdiff_t n = dim[k], e = std::max<std::ptrdiff_t>(opt.edge_items, 1);
+	bool skip = summarise && n > 2*e;
+	if (k == nd-1){
+		b.put(indent);
+		for (std::ptrdiff_t i=0; i<n; ++i){
+			if (i > 0) b.put(' ');
+			if (skip && i == e){ b.put("... "); i = n-e; }
+			format_value(b, p[i*str[k]], opt.precision);
+		}
+		b.put('\n');
+		return;
+	}
+	for (std::ptrdiff_t i=0; i<n; ++i){
+		if (i > 0) for (int j=k; j<nd-2; ++j) b.put('\n');
+		if (skip && i == e){
+			b.put(indent); b.put("...\n");
+			for (int j=k; j<nd-2; ++j) b.put('\n');
+			i = n-e;
+		}
+		write_text_axis(b, p + i*str[k], dim, str, k+1, summarise, opt, indent);
+	}
+}
+
+/// Native-endian NumPy dtype string of T, e.g. '<f8'.
+template <class T>
+std::string npy_descr(){
+	const std::uint16_t one = 1;
+	char little;
+	std::memcpy(&little, &one, 1);
+	std::string d;
+	d += (sizeof(T) == 1)? '|' : little? '<' : '>';
+	d += tensor_file_kind<T>();
+	d += std::to_string(sizeof(T));
+	return d;
+}
+
+/// Write a NumPy format 1.0 header for a C-ordered array of shape dim with elements of type T.
+template <class T>
+void write_npy_header(write_buffer& b, const std::vector<std::ptrdiff_t>& dim){
+	std::string h = "{'descr': '" + npy_descr<T>() + "', 'fortran_order': False, 'shape': (";
+	for (size_t i=0; i<dim.size(); ++i) h += ((i > 0)? ", " : "") + std::to_string(dim[i]);
+	h += (dim.size() == 1)? ",), }" : "), }";
+	h.append(63 - (10 + h.size()) % 64, ' ');	// the data start at a multiple of 64 bytes
+	h += '\n';
+	assert(h.size() <= 65535);
+	char pre[10] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0, char(h.size() & 0xff), char(h.size() >> 8)};
+	b.put(pre, 10);
+	b.put(h.data(), h.size());
+}
+
+/// Header and elements of the .npy format (arithmetic and 16-bit float element types only).
+template <class T>
+typename std::enable_if<is_file_type<T>::value>::type write_npy(write_buffer& b, const T* data, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str){
+	write_npy_header<T>(b, dim);
+	strided_for_each(dim, data, str, [&b](const T& x){ b.put(reinterpret_cast<const char*>(&x), sizeof(T)); });
+}
+
+template <class T>
+typename std::enable_if<!is_file_type<T>::value>::type write_npy(write_buffer&, const T*, const std::vector<std::ptrdiff_t>&, const std::vector<std::ptrdiff_t>&){
+	throw std::invalid_argument("Tensor: the npy format needs an arithmetic element type");
+}
+
+/// @brief Write the strided array (data, dim, str) to out in the format given by opt (see TensorFormat). 
+/// Each line of text output starts with indent.
+template <class T>
+void write_tensor(std::ostream& out, const T* data, const std::vector<std::ptrdiff_t>& dim, const std::vector<std::ptrdiff_t>& str, 
+                  const TensorWriteOptions& opt, const char* indent = ""){
+	write_buffer b(out);
+	std::ptrdiff_t n = checked_size(dim);
+	int nd = dim.size();
+	if (opt.format == TensorFormat::npy) write_npy(b, data, dim, str);
+	else if (n == 0) return;
+	else if (nd == 0){
+		b.put(indent);
+		format_value(b, *data, opt.precision);
+		b.put('\n');
+	}
+	else if (opt.format == TensorFormat::csv){
+		for_each_row(dim, [&](const std::vector<std::ptrdiff_t>& ix){
+			const T* p = data;
+			for (int k=0; k<nd-1; ++k) p += ix[k]*str[k];
+			b.put(indent);
+			for (std::ptrdiff_t j=0; j<dim[nd-1]; ++j){
+				if (j > 0) b.put(',');
+				format_value(b, p[j*str[nd-1]], opt.precision);
+			}
+			b.put('\n');
+		});
+	}
+	else write_text_axis(b, data, dim, str, 0, n > opt.threshold, opt, indent);
+}
+
+} // namespace tensor_detail
+
+
+// ---- NumPy files ----
+
+namespace tensor_detail{
+
+/// @brief Read and validate the header of a NumPy .npy array of 'size' bytes with elements of type T 
+/// (read() as in read_tensor_header()). C-ordered arrays get row-major strides, Fortran-ordered ones 
+/// column-major strides, so that both can be used in place. Non-native byte order is only accepted 
+/// with allow_swapped. Throws std::runtime_error if the array cannot be used as a tensor of type T.
+template <class T, class R>
+tensor_file_info read_npy_header(const std::string& filename, std::uint64_t size, bool allow_swapped, R read){
+	auto fail = [&](const std::string& what){ return std::runtime_error("Tensor: " + filename + ": " + what); };
+	unsigned char pre[12];
+	if (size < 10) throw fail("too short for a .npy file");
+	read(pre, 0, 10);
+	if (std::memcmp(pre, "\x93NUMPY", 6) != 0) throw fail("not a .npy file");
+	std::uint64_t hlen, hstart;
+	if (pre[6] == 1){
+		hlen = pre[8] | (pre[9] << 8);
+		hstart = 10;
+	}
+	else if (pre[6] == 2 || pre[6] == 3){
+		if (size < 12) throw fail("truncated header");
+		read(pre, 0, 12);
+		hlen = pre[8] | (pre[9] << 8) | (std::uint64_t(pre[10]) << 16) | (std::uint64_t(pre[11]) << 24);
+		hstart = 12;
+	}
+	else throw fail("unsupported .npy format version " + std::to_string(int(pre[6])));
+	if (hlen > size - hstart) throw fail("truncated header");
+	std::string h(hlen, ' ');
+	read(&h[0], hstart, hlen);
+
+	// the header is a Python dict literal: {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+	auto value = [&](const char* key){
+		std::size_t k = h.find(std::string("'") + key + "'");
+		if (k == std::string::npos) throw fail(std::string("no '") + key + "' in the header");
+		k = h.find(':', k);
+		if (k == std::string::npos) throw fail("malformed header");
+		return h.find_first_not_of(' ', k+1);
+	};
+	std::size_t d = value("descr");
+	if (d == std::string::npos || h[d] != '\'') throw fail("structured dtypes are not supported");
+	std::string descr = h.substr(d+1, h.find('\'', d+1) - d-1);
+	std::size_t f = value("fortran_order");
+	bool fortran = (f != std::string::npos && h.compare(f, 4, "True") == 0);
+	std::size_t s = value("shape");
+	if (s == std::string::npos || h[s] != '(') throw fail("malformed shape");
+	std::size_t e = h.find(')', s);
+	if (e == std::string::npos) throw fail("malformed shape");
+
+	tensor_file_info m;
+	for (std::size_t i=s+1; i<e; ){
+		std::size_t j = i;
+		while (j < e && h[j] != ',') ++j;
+		std::size_t a = h.find_first_not_of(' ', i);
+		if (a < j){
+			char* end;
+			long long v = std::strtoll(h.c_str()+a, &end, 10);
+			if (end == h.c_str()+a) throw fail("malformed shape");
+			m.dim.push_back(v);
+		}
+		i = j+1;
+	}
+	std::ptrdiff_t n = checked_file_size(m.dim, fail);
+
+	std::string native = npy_descr<T>();
+	if (descr.size() < 2) throw fail("invalid dtype '" + descr + "'");
+	char order = descr[0];
+	if (order == '=' || order == '|') order = native[0];
+	if (descr.substr(1) != native.substr(1) || (order != '<' && order != '>')){
+		throw fail("stores elements of dtype '" + descr + "', expected '" + native + "'");
+	}
+	m.swapped = (sizeof(T) > 1 && order != native[0]);
+	if (m.swapped && !allow_swapped) throw fail("stored in non-native byte order, use Tensor::from_npy()");
+
+	m.str = contiguous_strides(m.dim);
+	if (fortran){
+		std::ptrdiff_t p = 1;
+		for (std::size_t i=0; i<m.dim.size(); ++i){ m.str[i] = p; p *= m.dim[i]; }
+	}
+	m.data_offset = hstart + hlen;
+	if (std::uint64_t(n) > (size - m.data_offset)/sizeof(T)) throw fail("truncated data");
+	return m;
+}
+
+/// Read a .npy array of 'size' bytes at offset base in the stream 'in' into a new tensor of type Tens.
+template <class T, class Tens, class Alloc>
+Tens load_npy(std::istream& in, std::uint64_t base, std::uint64_t size, const std::string& filename, const Alloc& alloc){
+	auto read = [&](void* dst, std::uint64_t off, std::size_t n){
+		in.seekg(base + off);
+		in.read(static_cast<char*>(dst), n);
+		if (!in) throw std::runtime_error("Tensor: error reading " + filename);
+	};
+	tensor_file_info h = read_npy_header<T>(filename, size, true, read);
+	Tens tens(h.dim, tensor_uninitialized, alloc);
+	std::size_t n = tens.vec.size();
+	if (h.str == contiguous_strides(h.dim)) read(tens.vec.data(), h.data_offset, n*sizeof(T));
+	else {
+		std::vector<T> buf(n);
+		read(buf.data(), h.data_offset, n*sizeof(T));
+		strided_zip(h.dim, tens.vec.data(), contiguous_strides(h.dim), buf.data(), h.str, [](T& a, const T& b){ a = b; });
+	}
+	if (h.swapped) byteswap(tens.vec.data(), sizeof(T), n);
+	return tens;
+}
+
+/// Open a .npy file with elements of type T for use in place (see open_tensor_file()).
+template <class T>
+tensor_file_map open_npy_file(const std::string& filename, bool writable){
+	std::size_t size = 0;
+	std::shared_ptr<void> mapping = map_file(filename, writable, size);
+	char* base = static_cast<char*>(mapping.get());
+	tensor_file_map m;
+	static_cast<tensor_file_info&>(m) = read_npy_header<T>(filename, size, false, [base](void* dst, std::uint64_t off, std::size_t n){ std::memcpy(dst, base+off, n); });
+	if (m.data_offset % alignof(T) != 0) throw std::runtime_error("Tensor: " + filename + ": data are not aligned for use in place");
+	m.mapping = std::move(mapping);
+	m.data = base + m.data_offset;
+	return m;
+}
+
+} // namespace tensor_detail
+
+
+template <class T, class Alloc>
+class Tensor<T, dynamic_rank, Alloc>{
+	template <class, int, class> friend class Tensor;	// reductions write into outputs with other allocators
+
+	private:
+	std::vector<std::ptrdiff_t> offsets;
+	std::ptrdiff_t nelem;
+	
+	public:
+	std::vector<std::ptrdiff_t> dim;
+	std::vector<T, Alloc> vec;
+
+	/// Create a tensor with specified dimensions.
+	/// This function also allocates space for the tensor, and calculates the offsets used for indexing.
+	/// Throws std::length_error if a dimension is negative, or if the number of elements overflows.
+	Tensor(std::vector<std::ptrdiff_t> _dim, const Alloc& alloc = Alloc()) : vec(alloc){
+		TENSOR_PROFILE_OP("Tensor(dim)", tensor_detail::checked_size(_dim));
+		allocate(std::move(_dim));
+		if (tensor_default_init_allocator<Alloc>::value) std::fill(vec.begin(), vec.end(), T());
+	}
+
+	/// Create a tensor whose elements are left uninitialised if the allocator allows it 
+	/// (see tensor_uninitialized_t). Use it when every element is about to be overwritten.
+	Tensor(std::vector<std::ptrdiff_t> _dim, tensor_uninitialized_t, const Alloc& alloc = Alloc()) : vec(alloc){
+		TENSOR_PROFILE_OP("Tensor(dim)", tensor_detail::checked_size(_dim));
+		allocate(std::move(_dim));
+	}
+
+#ifdef TENSOR_PROFILE
+	// with profiling, copies are counted as allocations (moves are free)
+	Tensor(const Tensor& t) : offsets(t.offsets), nelem(t.nelem), dim(t.dim), vec(std::allocator_traits<Alloc>::select_on_container_copy_construction(t.vec.get_allocator())){
+		TENSOR_PROFILE_OP("Tensor(copy)", nelem);
+		TENSOR_PROFILE_ALLOC(nelem*sizeof(T));
+		vec.assign(t.vec.begin(), t.vec.end());
+	}
+
+	Tensor& operator = (const Tensor& t){
+		TENSOR_PROFILE_OP("Tensor(copy)", t.nelem);
+		if (vec.capacity() < t.vec.size()) TENSOR_PROFILE_ALLOC(t.nelem*sizeof(T));
+		offsets = t.offsets;
+		nelem = t.nelem;
+		dim = t.dim;
+		vec = t.vec;
+		return *this;
+	}
+
+	Tensor(Tensor&&) = default;
+	Tensor& operator = (Tensor&&) = default;
+#endif
+
+	/// Create a tensor with dimensions given as a vector of any integer type (e.g. std::vector<int>).
+	template <class I, class = typename std::enable_if<std::is_integral<I>::value && !std::is_same<I, std::ptrdiff_t>::value>::type>
+	Tensor(const std::vector<I>& _dim) : Tensor(std::vector<std::ptrdiff_t>(_dim.begin(), _dim.end())){
+	}
+
+	/// Create a tensor by copying the elements of a view (materialises strided and broadcast views).
+	template <class S>
+	explicit Tensor(const TensorView<S>& v, const Alloc& alloc = Alloc()) : vec(alloc){
+		TENSOR_PROFILE_OP("Tensor(view)", v.size());
+		allocate(v.dim);
+		tensor_detail::strided_copy(vec.data(), dim, v.data, v.offsets);
+	}
+
+	/// Create a tensor by evaluating an expression (e.g. `a*b + c`) in a single fused pass.
+	template <class E>
+	Tensor(const TensorExpr<E>& e, const Alloc& alloc = Alloc()) : vec(alloc){
+		TENSOR_PROFILE_OP("Tensor(expr)", tensor_detail::checked_size(e.self().shape()));
+		allocate(e.self().shape());
+		tensor_detail::assign_expr(view(), e, tensor_detail::assign_value());
+	}
+
+	/// @brief Same as above, but if the expression owns a temporary tensor of the result type and 
+	/// shape (e.g. f(x) in `f(x)*2.0 + y`), it is evaluated in place and its buffer is taken over.
+	template <class E>
+	Tensor(TensorExpr<E>&& e, const Alloc& alloc = Alloc()) : Tensor(eval_reusing(static_cast<E&>(e), alloc)){
+	}
+
+	/// Evaluate an expression into this tensor. The storage is reused if the dimensions match.
+	template <class E>
+	Tensor& operator = (const TensorExpr<E>& e){
+		TENSOR_PROFILE_OP("operator=(expr)", tensor_detail::checked_size(e.self().shape()));
+		if (dim != e.self().shape()) return *this = Tensor(e, vec.get_allocator());
+		tensor_detail::assign_expr(view(), e, tensor_detail::assign_value());
+		return *this;
+	}
+
+	private:
+	template <class E>
+	static Tensor eval_reusing(E& e, const Alloc& alloc){
+		TENSOR_PROFILE_OP("Tensor(expr)", tensor_detail::checked_size(e.shape()));
+		Tensor* t = e.template reusable<T, Alloc>(e.shape());
+		if (!t || !(t->vec.get_allocator() == alloc)) return Tensor(static_cast<const TensorExpr<E>&>(e), alloc);
+		tensor_detail::assign_expr(t->view(), e, tensor_detail::assign_value());
+		return std::move(*t);
+	}
+
+	/// Set the dimensions and strides, and allocate storage for them.
+	void allocate(std::vector<std::ptrdiff_t> _dim){
+		dim = std::move(_dim);
+		nelem = tensor_detail::checked_size(dim);
+		TENSOR_PROFILE_ALLOC(nelem*sizeof(T));
+		vec.resize(nelem);
+
+		int ndim = dim.size();
+		offsets.resize(ndim,0);
+		std::ptrdiff_t p = 1;
+		for (int i=ndim-1; i>=0; --i){
+			offsets[i] = p;
+			p *= dim[i];
+		}
+	}
+
+	public:
+	/// Get a non-owning view of the whole tensor. The view remains valid as long as the tensor is not resized or destroyed.
+	TensorView<T> view(){
+		return TensorView<T>(vec.data(), dim, offsets);
+	}
+
+	TensorView<const T> view() const {
+		return TensorView<const T>(vec.data(), dim, offsets);
+	}
+
+
+	/// Print the tensor.
+	/// If vals is true, then values are also printed. Otherwise, only metadata is printed.
+	void print(bool vals = true, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+	    std::cout << "Tensor:\n";
+	    std::cout << "   dims = "; for (auto d : dim) std::cout << d << " "; std::cout << "\n";
+	    std::cout << "   offs = "; for (auto d : offsets) std::cout << d << " "; std::cout << "\n";
+		if (vals){
+			std::cout << "   vals = \n";
+			tensor_detail::write_tensor(std::cout, vec.data(), dim, offsets, opt, "      ");
+		}
+		std::cout << "\n";
+	}
+
+	/// @brief Write the elements to out in the format given by opt: as text (summarised if large), 
+	/// CSV, or a NumPy .npy file. Output is buffered and formatted without per-element allocations.
+	void write(std::ostream& out, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		tensor_detail::write_tensor(out, vec.data(), dim, offsets, opt);
+	}
+
+	/// Same as write(out, opt), into a new file. Throws std::runtime_error if the file cannot be written.
+	void write(const std::string& filename, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		view().write(filename, opt);
+	}
+
+	/// Same as write(out, opt), into a string.
+	std::string to_string(const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		return view().to_string(opt);
+	}
+
+	/// @brief Write the tensor to a binary file (see tensor_detail::tensor_file_header for the 
+	/// layout), to be read back with load() or used in place with mmap().
+	void save(const std::string& filename) const {
+		tensor_detail::save_tensor_file<T>(filename, dim, [this](std::ostream& out){
+			out.write(reinterpret_cast<const char*>(vec.data()), vec.size()*sizeof(T));
+		});
+	}
+
+	/// Read a tensor written by save(), converting from the byte order of the writing machine if needed.
+	static Tensor load(const std::string& filename, const Alloc& alloc = Alloc()){
+		tensor_detail::tensor_file_map m = tensor_detail::open_tensor_file<T>(filename, false, true);
+		Tensor tens(TensorView<const T>(reinterpret_cast<const T*>(m.data), m.dim, m.str), alloc);
+		if (m.swapped) tensor_detail::byteswap(tens.vec.data(), sizeof(T), tens.vec.size());
+		return tens;
+	}
+
+	/// Use a file written by save() in place, without reading it (see MappedTensor).
+	static MappedTensor<T> mmap(const std::string& filename, bool writable = false){
+		return MappedTensor<T>(filename, writable);
+	}
+
+	/// @brief Write the tensor as a NumPy .npy file. dim is the shape and the data are in row-major 
+	/// (C) order, so numpy.load() gives an array with the same indexing.
+	void to_npy(const std::string& filename) const {
+		view().to_npy(filename);
+	}
+
+	/// @brief Read a NumPy .npy file with elements of type T (e.g. '<f8' for double), in C or 
+	/// Fortran order and in either byte order. Throws std::runtime_error if it cannot be read as such.
+	static Tensor from_npy(const std::string& filename, const Alloc& alloc = Alloc()){
+		std::ifstream in(filename, std::ios::binary | std::ios::ate);
+		if (!in) throw std::runtime_error("Tensor: cannot open " + filename);
+		std::uint64_t size = in.tellg();
+		return tensor_detail::load_npy<T, Tensor>(in, 0, size, filename, alloc);
+	}
+
+	/// @brief Use a .npy file in place, without reading it (see MappedTensor). The array must be in 
+	/// native byte order; Fortran-ordered arrays give a view with column-major strides.
+	static MappedTensor<T> mmap_npy(const std::string& filename, bool writable = false){
+		return MappedTensor<T>(tensor_detail::open_npy_file<T>(filename, writable));
+	}
+	
+//	TODO: 
+//	This function can be private
+	/// Convert coordinates (specified as a vector of indices) to 1D index where the value resides in the underlying vector.
+	std::ptrdiff_t location(const std::vector<std::ptrdiff_t>& ix) const {
+		std::ptrdiff_t loc = 0;
+		int ndim = dim.size();
+		for (int i=ndim-1; i>=0; --i){
+			loc += offsets[i]*ix[i];
+		}
+		return loc;
+	}
+
+	template<class... ARGS>
+	std::ptrdiff_t location(ARGS... ids) const {
+		return location({std::ptrdiff_t(ids)...});
+	}
+
+	/// Same as location(), but throws std::out_of_range if the coordinates are invalid.
+	std::ptrdiff_t checked_location(const std::vector<std::ptrdiff_t>& ix) const {
+		if (ix.size() != dim.size()) throw std::out_of_range("Tensor: expected " + std::to_string(dim.size()) + " coordinates, got " + std::to_string(ix.size()));
+		for (size_t i=0; i<ix.size(); ++i){
+			if (ix[i] < 0 || ix[i] >= dim[i]) throw std::out_of_range("Tensor: coordinate " + std::to_string(ix[i]) + " out of range [0, " + std::to_string(dim[i]) + ") in dimension " + std::to_string(i));
+		}
+		return location(ix);
+	}
+
+
+	/// @brief Get the value at coordinates specified as a comma separated list. 
+	///        The order of coordinates is \f$\{i_n, i_{n-1}, ..., i_0\}\f$
+	template<class... ARGS>
+	T& operator() (ARGS... ids){
+		return vec[location({std::ptrdiff_t(ids)...})];
+	}
+
+	template<class... ARGS>
+	const T& operator() (ARGS... ids) const {
+		return vec[location({std::ptrdiff_t(ids)...})];
+	}
+
+	/// @brief Get the value at coordinates specified as an integer vector. 
+	///        The order of coordinates is \f$\{i_n, i_{n-1}, ..., i_0\}\f$.
+	T& operator() (const std::vector<std::ptrdiff_t>& ix){
+		return vec[location(ix)];
+	}
+
+	const T& operator() (const std::vector<std::ptrdiff_t>& ix) const {
+		return vec[location(ix)];
+	}
+
+	/// @brief Same as operator(), but checks the number of coordinates and their ranges, 
+	/// throwing std::out_of_range if they are invalid.
+	template<class... ARGS>
+	T& at(ARGS... ids){
+		return vec[checked_location({std::ptrdiff_t(ids)...})];
+	}
+
+	template<class... ARGS>
+	const T& at(ARGS... ids) const {
+		return vec[checked_location({std::ptrdiff_t(ids)...})];
+	}
+
+	T& at(const std::vector<std::ptrdiff_t>& ix){
+		return vec[checked_location(ix)];
+	}
+
+	const T& at(const std::vector<std::ptrdiff_t>& ix) const {
+		return vec[checked_location(ix)];
+	}
+
+	/// Unchecked access by 1D index (see location()). Use this or data() in hot loops.
+	T& operator[] (std::ptrdiff_t loc){
+		return vec[loc];
+	}
+
+	const T& operator[] (std::ptrdiff_t loc) const {
+		return vec[loc];
+	}
+
+	/// Pointer to the contiguous storage.
+	T* data(){
+		return vec.data();
+	}
+
+	const T* data() const {
+		return vec.data();
+	}
+
+	/// Convert 1D index to coordinates (Inverse of location())
+	std::vector<std::ptrdiff_t> index(std::ptrdiff_t loc) const {
+		int ndim = dim.size();
+		std::vector<std::ptrdiff_t> id(ndim);
+		for (int i=ndim-1; i>=0; --i){
+			std::ptrdiff_t ix = loc % dim[i];
+			loc = (loc-ix)/dim[i];
+			id[i]=ix;
+		}
+		return id;
+	}
+
+	/// Coordinates and locations of all elements, in storage order (see TensorIndexRange). 
+	/// Use this rather than calling index() for each element of a sweep.
+	TensorIndexRange indices() const {
+		return TensorIndexRange(dim, offsets);
+	}
+
+	/// A utility function for testing purposes. Fills the tensor with incremental integers. 
+	void fill_sequence(){
+		for(size_t i=0; i<vec.size(); ++i) vec[i]=i;
+	}
+
+	
+	/// @brief generate a list of 1D indices corresponding to all points on the hyperplane 
+	/// perpendicular to 'axis' located at index 'k' on the axis. The axis is specified
+	/// as the index of the corresponding dimension, i.e., between [0, n-1].
+	std::vector<std::ptrdiff_t> plane(int axis, std::ptrdiff_t k = 0) const {
+		std::vector<std::ptrdiff_t> locs;
+		plane(locs, axis, k);
+		return locs;
+	}
+
+	/// @brief Same as plane(axis, k), but writes the indices into a caller-provided buffer. 
+	/// The buffer is only reallocated if its capacity is insufficient, so it can be reused across calls.
+	void plane(std::vector<std::ptrdiff_t>& locs, int axis, std::ptrdiff_t k = 0) const {
+		locs.clear();
+		locs.reserve(nelem/dim[dim.size()-1-axis]);
+		for_each_plane(axis, k, [&locs](std::ptrdiff_t loc){locs.push_back(loc);});
+	}
+
+	/// @brief Call f(loc) for each 1D index on the hyperplane perpendicular to 'axis' at index 'k', 
+	/// in increasing order of loc. 
+	/// The plane is walked directly via the outer and inner strides, so each point costs O(1), 
+	/// and nothing is allocated.
+	template <class F>
+	void for_each_plane(int axis, std::ptrdiff_t k, F f) const {
+		axis = dim.size()-1-axis;
+		std::ptrdiff_t inner = offsets[axis];          // number of contiguous elements below axis
+		std::ptrdiff_t outer_step = inner*dim[axis];   // distance between successive blocks above axis
+		std::ptrdiff_t nouter = 1;
+		for (int i=0; i<axis; ++i) nouter *= dim[i];
+
+		for (std::ptrdiff_t o=0, base=k*inner; o<nouter; ++o, base += outer_step){
+			for (std::ptrdiff_t j=0; j<inner; ++j) f(base+j);
+		}
+	}
+
+	/// @brief 1D index of the i-th point (in the order of for_each_plane()) on the hyperplane 
+	/// perpendicular to 'axis' at index 'k'. Used to split the lines of a plane across threads.
+	std::ptrdiff_t plane_location(int axis, std::ptrdiff_t k, std::ptrdiff_t i) const {
+		axis = dim.size()-1-axis;
+		std::ptrdiff_t inner = offsets[axis];
+		return (i/inner)*inner*dim[axis] + k*inner + i%inner;
+	}
+
+	// axis is counted from the right
+	// [..., 2, 1, 0]
+	//          ^
+	//           axis
+	template <class BinOp>
+	void transform_dim(std::ptrdiff_t loc, int axis, BinOp binary_op, const std::vector<double>& w){
+		TENSOR_PROFILE_OP("transform_dim", dim[dim.size()-1-axis]);
+		assert(std::ptrdiff_t(w.size()) == dim[dim.size()-1-axis]);
+		
+		axis = dim.size()-1-axis;
+		tensor_detail::transform_row(binary_op, vec.data()+loc, offsets[axis], w.data(), 1, dim[axis]);
+	}
+
+	// axis is counted from the right
+	// [..., 2, 1, 0]
+	//          ^
+	//           axis
+	/// @brief vec[i] = binary_op(vec[i], w[count]), where count is the index of element i along 'axis'. 
+	/// Along axis 0 this runs as vectorised row operations; along outer axes, each contiguous 
+	/// block below 'axis' is combined with a single w[count].
+	template <class BinOp>
+	void transform(int axis, BinOp binary_op, const std::vector<double>& w){
+		TENSOR_PROFILE_OP("transform", nelem);
+		int a = dim.size()-1-axis;
+		assert(std::ptrdiff_t(w.size()) == dim[a]);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = 1;
+		tensor_detail::transform_axes(vec.data(), dim, offsets, w.data(), wstr, binary_op);
+	}
+
+	/// Same as transform(axis, binary_op, w), with the operand taken from a 1-D view (e.g. a column 
+	/// or slice of another tensor), without copying it.
+	template <class BinOp, class W>
+	void transform(int axis, BinOp binary_op, const TensorView<W>& w){
+		TENSOR_PROFILE_OP("transform", nelem);
+		int a = dim.size()-1-axis;
+		assert(w.dim.size() == 1 && w.dim[0] == dim[a]);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = w.offsets[0];
+		tensor_detail::transform_axes(vec.data(), dim, offsets, w.data, wstr, binary_op);
+	}
+
+	/// @brief vec[i] = binary_op(vec[i], w[i]) with the operand w broadcast to the shape of this 
+	/// tensor (dimensions are right-aligned; missing and 1-sized dimensions are repeated). 
+	/// E.g., for a tensor of shape {3,4,5}, w may have shape {5}, {4,1} or {3,1,5}.
+	template <class BinOp, class W>
+	void transform(BinOp binary_op, const TensorView<W>& w){
+		TENSOR_PROFILE_OP("transform", nelem);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank];
+		tensor_detail::broadcast_strides(w, dim, wstr);
+		tensor_detail::transform_axes(vec.data(), dim, offsets, w.data, wstr, binary_op);
+	}
+
+	template <class BinOp, class W, class A>
+	void transform(BinOp binary_op, const Tensor<W, dynamic_rank, A>& w){
+		TENSOR_PROFILE_OP("transform", nelem);
+		transform(binary_op, w.view());
+	}
+	
+	
+	// axis is counted from the right
+	// [..., 2, 1, 0]
+	//          ^
+	//           axis
+	template <class BinOp>
+	double accumulate_dim(double v0, std::ptrdiff_t loc, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("accumulate_dim", dim[dim.size()-1-axis]);
+		assert(weights.size() == 0 || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		
+		axis = dim.size()-1-axis;
+		std::ptrdiff_t off = offsets[axis], n = dim[axis];
+		const double* w = weights.empty()? nullptr : weights.data();
+		if (n == 0) return v0;
+		if (off == 1){
+			if (w) return tensor_detail::reduce_line<true>(binary_op, v0, &vec[loc], w, 1, n);
+			else   return tensor_detail::reduce_line<false>(binary_op, v0, &vec[loc], w, 1, n);
+		}
+
+		double v = v0;
+		if (w) for (std::ptrdiff_t i=loc, count=0; count<n; i+= off, ++count) v = binary_op(v, w[count]*vec[i]);
+		else   for (std::ptrdiff_t i=loc, count=0; count<n; i+= off, ++count) v = binary_op(v, vec[i]);
+		return v;
+	}
+
+
+	// axis is counted from the right
+	// [..., 2, 1, 0]
+	//          ^
+	//           axis
+	/// The reduction starts from v0, and elements are multiplied by weights[i] (i along the axis) 
+	/// if weights are given. Along the innermost axis each output reduces a contiguous line, 
+	/// along outer axes whole rows are combined at once (see tensor_detail::reduce_axes()).
+	template <class BinOp>
+	Tensor accumulate(T v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		Tensor tens(reduced_dim(axis), tensor_uninitialized, vec.get_allocator());
+		accumulate(tens.view(), v0, axis, binary_op, weights);
+		return tens;
+	}
+
+	/// Same as accumulate(), with the weights given as a 1D view (e.g. a strided column of another tensor).
+	template <class BinOp, class W>
+	Tensor accumulate(T v0, int axis, BinOp binary_op, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		Tensor tens(reduced_dim(axis), tensor_uninitialized, vec.get_allocator());
+		accumulate(tens.view(), v0, axis, binary_op, weights);
+		return tens;
+	}
+
+	/// Same as accumulate(), but writes the result into out, which must have the dimensions 
+	/// of this tensor without the axis, and must not overlap it. Nothing is allocated.
+	template <class BinOp>
+	void accumulate(const TensorView<T>& out, T v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		reduce_into(out.data, out.dim, out.offsets, v0, axis, binary_op, weights.empty()? nullptr : weights.data(), 1, 1);
+	}
+
+	template <class BinOp, class W>
+	void accumulate(const TensorView<T>& out, T v0, int axis, BinOp binary_op, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		assert(weights.dim.size() == 1 && weights.dim[0] == dim[dim.size()-1-axis]);
+		reduce_into(out.data, out.dim, out.offsets, v0, axis, binary_op, weights.data, weights.offsets[0], 1);
+	}
+
+	template <class A, class BinOp>
+	void accumulate(Tensor<T, dynamic_rank, A>& out, T v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		reduce_into(out.vec.data(), out.dim, out.offsets, v0, axis, binary_op, weights.empty()? nullptr : weights.data(), 1, 1);
+	}
+
+
+	private:
+	std::vector<std::ptrdiff_t> reduced_dim(int axis) const {
+		std::vector<std::ptrdiff_t> dim_new = dim;
+		dim_new.erase(dim_new.begin()+dim_new.size()-1-axis);
+		return dim_new;
+	}
+
+	/// Reduce along axis into the strided array (out, odim, ostr), with element i along the axis 
+	/// weighted by w[i*ws] if w is not null, and dividing each result by div before it is stored 
+	/// (used to fuse the division of avg_dim() into the reduction).
+	template <class BinOp>
+	void reduce_into(T* out, const std::vector<std::ptrdiff_t>& odim, const std::vector<std::ptrdiff_t>& ostr, T v0, int axis, BinOp binary_op, 
+	                 const double* w, std::ptrdiff_t ws, double div) const {
+		int a = dim.size()-1-axis;
+		assert(tensor_detail::is_reduced_shape(dim, std::uint64_t(1) << a, odim));
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = ws;
+		tensor_detail::reduce_axes(vec.data(), dim, offsets, std::uint64_t(1) << a, w, wstr, out, odim, ostr, v0, binary_op, div);
+	}
+
+	/// out = (this tensor as a matrix with axis as columns) * (scale*weights) with BLAS, if it 
+	/// takes the strides as they are. Returns false otherwise.
+	bool gemv_into(T* out, const std::vector<std::ptrdiff_t>& odim, const std::vector<std::ptrdiff_t>& ostr, int axis, const std::vector<double>& weights, double scale) const {
+		if (!tensor_detail::blas_enabled || !tensor_detail::is_blas_type<T>::value) return false;
+		int a = dim.size()-1-axis;
+		assert(tensor_detail::is_reduced_shape(dim, std::uint64_t(1) << a, odim));
+		std::ptrdiff_t fs, ldc;
+		if (!tensor_detail::merged_stride(dim, offsets, a, fs) || !tensor_detail::merged_stride(odim, ostr, -1, ldc)) return false;
+		const T* w = tensor_detail::blas_weights<T>(weights);
+		return tensor_detail::gemm_blas(tensor_detail::checked_size(odim), 1, dim[a], vec.data(), fs, offsets[a], w, 1, 1, out, ldc, T(scale));
+	}
+
+	public:
+	/// Maximum along axis.
+	Tensor max_dim(int axis) const {
+		TENSOR_PROFILE_OP("max_dim", nelem);
+		return accumulate(tensor_detail::extreme_value<T,true>(), axis, tensor_detail::max_op<T>());
+	}
+
+	/// Same as max_dim(), but writes the result into out (see accumulate()).
+	void max_dim(const TensorView<T>& out, int axis) const {
+		TENSOR_PROFILE_OP("max_dim", nelem);
+		reduce_into(out.data, out.dim, out.offsets, tensor_detail::extreme_value<T,true>(), axis, tensor_detail::max_op<T>(), nullptr, 0, 1);
+	}
+
+	template <class A>
+	void max_dim(Tensor<T, dynamic_rank, A>& out, int axis) const {
+		TENSOR_PROFILE_OP("max_dim", nelem);
+		reduce_into(out.vec.data(), out.dim, out.offsets, tensor_detail::extreme_value<T,true>(), axis, tensor_detail::max_op<T>(), nullptr, 0, 1);
+	}
+
+	/// Mean along axis. The division is applied as each result is stored, in the same pass.
+	Tensor avg_dim(int axis, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("avg_dim", nelem);
+		Tensor tens(reduced_dim(axis), tensor_uninitialized, vec.get_allocator());
+		avg_dim(tens.view(), axis, weights);
+		return tens;
+	}
+
+	/// Same as avg_dim(), but writes the result into out (see accumulate()). With TENSOR_BLAS, 
+	/// weighted means of float and double tensors over an axis that leaves the other dimensions 
+	/// (and those of out) with a single stride, e.g. the innermost or outermost axis, are 
+	/// matrix-vector products done by BLAS (in T rather than in double, with a scaled copy of the weights).
+	void avg_dim(const TensorView<T>& out, int axis, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("avg_dim", nelem);
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		if (!weights.empty() && gemv_into(out.data, out.dim, out.offsets, axis, weights, 1.0/dim[dim.size()-1-axis])) return;
+		reduce_into(out.data, out.dim, out.offsets, 0, axis, std::plus<T>(), weights.empty()? nullptr : weights.data(), 1, dim[dim.size()-1-axis]);
+	}
+
+	template <class A>
+	void avg_dim(Tensor<T, dynamic_rank, A>& out, int axis, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("avg_dim", nelem);
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		if (!weights.empty() && gemv_into(out.vec.data(), out.dim, out.offsets, axis, weights, 1.0/dim[dim.size()-1-axis])) return;
+		reduce_into(out.vec.data(), out.dim, out.offsets, 0, axis, std::plus<T>(), weights.empty()? nullptr : weights.data(), 1, dim[dim.size()-1-axis]);
+	}
+
+	/// @brief Reduce a sliding window of `window` consecutive elements along axis: element k of 
+	/// the result along axis reduces elements k, ..., k+window-1, so the result has dim-window+1 
+	/// elements along axis. Each line along the axis is reduced in a single pass, in O(1) per 
+	/// element for sums, max_op and min_op (see tensor_detail::rolling_line()), and lines are 
+	/// processed in parallel. E.g. the 30-step running mean of a {time, lat, lon} tensor is 
+	/// `t.rolling_mean(2, 30)`.
+	template <class BinOp>
+	Tensor rolling(int axis, std::ptrdiff_t window, BinOp binary_op) const {
+		TENSOR_PROFILE_OP("rolling", nelem);
+		return rolling_scaled(axis, window, binary_op, 1);
+	}
+
+	Tensor rolling_sum(int axis, std::ptrdiff_t window) const {
+		TENSOR_PROFILE_OP("rolling_sum", nelem);
+		return rolling_scaled(axis, window, std::plus<double>(), 1);
+	}
+
+	Tensor rolling_mean(int axis, std::ptrdiff_t window) const {
+		TENSOR_PROFILE_OP("rolling_mean", nelem);
+		return rolling_scaled(axis, window, std::plus<double>(), 1.0/window);
+	}
+
+	Tensor rolling_max(int axis, std::ptrdiff_t window) const {
+		TENSOR_PROFILE_OP("rolling_max", nelem);
+		return rolling_scaled(axis, window, tensor_detail::max_op<T>(), 1);
+	}
+
+	Tensor rolling_min(int axis, std::ptrdiff_t window) const {
+		TENSOR_PROFILE_OP("rolling_min", nelem);
+		return rolling_scaled(axis, window, tensor_detail::min_op<T>(), 1);
+	}
+
+	private:
+	template <class BinOp>
+	Tensor rolling_scaled(int axis, std::ptrdiff_t window, BinOp binary_op, double scale) const {
+		int a = dim.size()-1-axis;
+		std::ptrdiff_t n = dim[a], m = n-window+1, inner = offsets[a];
+		assert(window >= 1 && window <= n);
+		std::vector<std::ptrdiff_t> dim_new = dim;
+		dim_new[a] = m;
+		Tensor tens(dim_new, tensor_uninitialized, vec.get_allocator());
+
+		// line l starts at element l % inner of block l / inner, in both tensors
+		tensor_detail::parallel_for(nelem/n, n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			tensor_detail::rolling_buffers buf;
+			for (std::ptrdiff_t l=b; l<e; ++l){
+				std::ptrdiff_t o = l/inner, i = l%inner;
+				tensor_detail::rolling_line(binary_op, vec.data() + o*n*inner + i, inner, n, window, tens.vec.data() + o*m*inner + i, inner, scale, buf);
+			}
+		});
+		return tens;
+	}
+
+	public:
+
+	/// @brief Reduce over several axes (counted from the right) at once, in a single pass over 
+	/// the data (see tensor_detail::reduce_axes()). The result has the remaining axes, in order.
+	/// E.g., the spatial mean of a {time, lat, lon} tensor is `t.mean({0,1})`.
+	template <class BinOp>
+	Tensor accumulate(T v0, const std::vector<int>& axes, BinOp binary_op) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		Tensor tens(reduced_dim(axes), tensor_uninitialized, vec.get_allocator());
+		reduce_into(tens.vec.data(), tens.dim, tens.offsets, v0, axes, binary_op, 1);
+		return tens;
+	}
+
+	template <class BinOp>
+	void accumulate(const TensorView<T>& out, T v0, const std::vector<int>& axes, BinOp binary_op) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		reduce_into(out.data, out.dim, out.offsets, v0, axes, binary_op, 1);
+	}
+
+	template <class A, class BinOp>
+	void accumulate(Tensor<T, dynamic_rank, A>& out, T v0, const std::vector<int>& axes, BinOp binary_op) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		reduce_into(out.vec.data(), out.dim, out.offsets, v0, axes, binary_op, 1);
+	}
+
+	/// @brief Weighted reduction over several axes, in which each element is multiplied by its 
+	/// weight. The weights are broadcast to the shape of this tensor (NumPy rules), e.g. area weights 
+	/// of shape {nlat, 1} for a {time, lat, lon} tensor, or a full-shape mask. 
+	template <class BinOp, class W>
+	Tensor accumulate(T v0, const std::vector<int>& axes, BinOp binary_op, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		Tensor tens(reduced_dim(axes), tensor_uninitialized, vec.get_allocator());
+		accumulate(tens.view(), v0, axes, binary_op, weights);
+		return tens;
+	}
+
+	template <class BinOp, class W>
+	void accumulate(const TensorView<T>& out, T v0, const std::vector<int>& axes, BinOp binary_op, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("accumulate", nelem);
+		reduce_into(out.data, out.dim, out.offsets, v0, axes, binary_op, weights, 1);
+	}
+
+	Tensor sum(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("sum", nelem);
+		return accumulate(0, axes, std::plus<double>());
+	}
+
+	/// Weighted sum, see accumulate().
+	template <class W>
+	Tensor sum(const std::vector<int>& axes, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("sum", nelem);
+		return accumulate(0, axes, std::plus<double>(), weights);
+	}
+
+	Tensor mean(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("mean", nelem);
+		Tensor tens(reduced_dim(axes), tensor_uninitialized, vec.get_allocator());
+		reduce_into(tens.vec.data(), tens.dim, tens.offsets, 0, axes, std::plus<double>(), double(nelem)/tens.nelem);
+		return tens;
+	}
+
+	/// @brief Weighted mean, i.e. the weighted sum divided by the sum of the weights over the 
+	/// reduced axes. The weight totals are computed from the weights alone, which are usually 
+	/// much smaller than the tensor.
+	template <class W>
+	Tensor mean(const std::vector<int>& axes, const TensorView<W>& weights) const {
+		TENSOR_PROFILE_OP("mean", nelem);
+		typedef typename std::remove_const<W>::type D;
+		Tensor tens = sum(axes, weights);
+		// bring the weights to the rank of this tensor, and total them over the reduced axes
+		TensorView<const D> w(weights);
+		while (w.dim.size() < dim.size()) w = w.unsqueeze(w.dim.size());
+		double count = 1;	// extent of the reduced axes along which the weights are broadcast
+		for (int axis : axes) if (w.dim[w.dim.size()-1-axis] == 1) count *= dim[dim.size()-1-axis];
+		Tensor<D> wsum = Tensor<D>(w).sum(axes);
+		for (auto& x : wsum.vec) x = 1/(count*x);
+		tens.view() *= wsum.view().broadcast(tens.dim);
+		return tens;
+	}
+
+	Tensor max(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("max", nelem);
+		return accumulate(tensor_detail::extreme_value<T,true>(), axes, tensor_detail::max_op<T>());
+	}
+
+	Tensor min(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("min", nelem);
+		return accumulate(tensor_detail::extreme_value<T,false>(), axes, tensor_detail::min_op<T>());
+	}
+
+	/// @brief Reductions over all elements. Sums are computed pairwise in double, with the 
+	/// top levels spread over the threads, so that results are accurate for very large tensors
+	/// and do not depend on the number of threads.
+	T sum() const { return reduce_all(0, std::plus<double>(), 1); }
+	T mean() const { return reduce_all(0, std::plus<double>(), nelem); }
+	T max() const { return reduce_all(tensor_detail::extreme_value<T,true>(), tensor_detail::max_op<T>(), 1); }
+	T min() const { return reduce_all(tensor_detail::extreme_value<T,false>(), tensor_detail::min_op<T>(), 1); }
+
+	private:
+	// bit i is set if dim[i] is reduced
+	std::uint64_t reduced_mask(const std::vector<int>& axes) const {
+		std::uint64_t mask = 0;
+		for (int axis : axes){
+			assert(axis >= 0 && axis < int(dim.size()));
+			std::uint64_t bit = std::uint64_t(1) << (dim.size()-1-axis);
+			assert(!(mask & bit));
+			mask |= bit;
+		}
+		return mask;
+	}
+
+	std::vector<std::ptrdiff_t> reduced_dim(const std::vector<int>& axes) const {
+		std::uint64_t mask = reduced_mask(axes);
+		std::vector<std::ptrdiff_t> dim_new;
+		for (size_t i=0; i<dim.size(); ++i) if (!((mask >> i) & 1)) dim_new.push_back(dim[i]);
+		return dim_new;
+	}
+
+	template <class BinOp>
+	void reduce_into(T* out, const std::vector<std::ptrdiff_t>& odim, const std::vector<std::ptrdiff_t>& ostr, T v0, const std::vector<int>& axes, BinOp binary_op, double div) const {
+		assert(tensor_detail::is_reduced_shape(dim, reduced_mask(axes), odim));
+		tensor_detail::reduce_axes(vec.data(), dim, offsets, reduced_mask(axes), nullptr, nullptr, out, odim, ostr, v0, binary_op, div);
+	}
+
+	template <class BinOp, class W>
+	void reduce_into(T* out, const std::vector<std::ptrdiff_t>& odim, const std::vector<std::ptrdiff_t>& ostr, T v0, const std::vector<int>& axes, BinOp binary_op, 
+	                 const TensorView<W>& weights, double div) const {
+		static_assert(std::is_same<typename std::remove_const<W>::type, double>::value, "weights must be double");
+		assert(tensor_detail::is_reduced_shape(dim, reduced_mask(axes), odim));
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank];
+		tensor_detail::broadcast_strides(weights, dim, wstr);
+		tensor_detail::reduce_axes(vec.data(), dim, offsets, reduced_mask(axes), weights.data, wstr, out, odim, ostr, v0, binary_op, div);
+	}
+
+	template <class BinOp>
+	T reduce_all(T v0, BinOp binary_op, double div) const {
+		T r;
+		const std::vector<std::ptrdiff_t> none;
+		std::uint64_t all = (dim.size() < 64)? (std::uint64_t(1) << dim.size()) - 1 : ~std::uint64_t(0);
+		tensor_detail::reduce_axes(vec.data(), dim, offsets, all, nullptr, nullptr, &r, none, none, v0, binary_op, div);
+		return r;
+	}
+
+	public:
+
+
+	/// @brief Copy each element n times into a new innermost dimension. 
+	/// To use the result as an operand without materialising it, use repeat_inner_view().
+	Tensor repeat_inner(std::ptrdiff_t n) const {
+		TENSOR_PROFILE_OP("repeat_inner", nelem*n);
+		std::vector<std::ptrdiff_t> dim_new = dim;
+		dim_new.push_back(n);
+		
+		Tensor tout(dim_new, tensor_uninitialized, vec.get_allocator());
+		tensor_detail::parallel_for(nelem, n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			std::ptrdiff_t count = b*n;
+			for (std::ptrdiff_t i=b; i<e; ++i){
+				for (std::ptrdiff_t j=0; j<n; ++j){
+					tout.vec[count++] = vec[i];
+				}
+			}
+		});
+
+		return tout;
+	}
+
+	/// @brief Copy the whole tensor n times into a new outermost dimension. 
+	/// To use the result as an operand without materialising it, use repeat_outer_view().
+	Tensor repeat_outer(std::ptrdiff_t n) const {
+		TENSOR_PROFILE_OP("repeat_outer", nelem*n);
+		std::vector<std::ptrdiff_t> dim_new = dim;
+		dim_new.insert(dim_new.begin(), n);
+		
+		Tensor tout(dim_new, tensor_uninitialized, vec.get_allocator());
+		tensor_detail::parallel_for(n, nelem, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t j=b; j<e; ++j){
+				std::copy(vec.begin(), vec.end(), tout.vec.begin() + j*nelem);
+			}
+		});
+
+		return tout;
+	}
+
+	/// Zero-copy repeat_inner(): a view with a stride-0 innermost dimension of size n.
+	TensorView<const T> repeat_inner_view(std::ptrdiff_t n) const { return view().repeat_inner(n); }
+
+	/// Zero-copy repeat_outer(): a view with a stride-0 outermost dimension of size n.
+	TensorView<const T> repeat_outer_view(std::ptrdiff_t n) const { return view().repeat_outer(n); }
+
+	/// @brief A copy with reordered dimensions, laid out contiguously in the new order. order is as in 
+	/// TensorView::permute() (positions in dim), e.g. permute({2,1,0}) turns [lon, lat, time] into 
+	/// [time, lat, lon]. The copy is done in cache-sized tiles (see tensor_detail::strided_copy()). 
+	/// For a zero-copy strided view in the new order, use view().permute(order).
+	Tensor permute(const std::vector<int>& order) const {
+		TENSOR_PROFILE_OP("permute", nelem);
+		return Tensor(view().permute(order), vec.get_allocator());
+	}
+
+
+	// operators
+	public: 	
+	// see https://stackoverflow.com/questions/4421706/what-are-the-basic-rules-and-idioms-for-operator-overloading/4421719#4421719
+	template <class S, class A>
+	Tensor& operator += (const Tensor<S, dynamic_rank, A>& rhs){
+		TENSOR_PROFILE_OP("operator+=(Tensor)", nelem);
+		if (dim != rhs.dim) return *this += rhs.view();
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary<tensor_detail::simd::add>(vec.data()+b, rhs.vec.data()+b, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, rhs.vec.begin()+b, vec.begin()+b, std::plus<T>());
+		});
+		return *this;
+	}
+	
+	template <class S, class A>
+	Tensor& operator -= (const Tensor<S, dynamic_rank, A>& rhs){
+		TENSOR_PROFILE_OP("operator-=(Tensor)", nelem);
+		if (dim != rhs.dim) return *this -= rhs.view();
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary<tensor_detail::simd::sub>(vec.data()+b, rhs.vec.data()+b, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, rhs.vec.begin()+b, vec.begin()+b, std::minus<T>());
+		});
+		return *this;
+	}
+
+	template <class S, class A>
+	Tensor& operator *= (const Tensor<S, dynamic_rank, A>& rhs){
+		TENSOR_PROFILE_OP("operator*=(Tensor)", nelem);
+		if (dim != rhs.dim) return *this *= rhs.view();
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary<tensor_detail::simd::mul>(vec.data()+b, rhs.vec.data()+b, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, rhs.vec.begin()+b, vec.begin()+b, std::multiplies<T>());
+		});
+		return *this;
+	}
+
+	template <class S, class A>
+	Tensor& operator /= (const Tensor<S, dynamic_rank, A>& rhs){
+		TENSOR_PROFILE_OP("operator/=(Tensor)", nelem);
+		if (dim != rhs.dim) return *this /= rhs.view();
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary<tensor_detail::simd::div>(vec.data()+b, rhs.vec.data()+b, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, rhs.vec.begin()+b, vec.begin()+b, std::divides<>());
+		});
+		return *this;
+	}
+
+	template <class S>
+	Tensor& operator += (const TensorView<S>& rhs){
+		TENSOR_PROFILE_OP("operator+=(TensorView)", nelem);
+		tensor_detail::zip_transform(vec.data(), dim, offsets, rhs.data, rhs.broadcast(dim).offsets, std::plus<>());
+		return *this;
+	}
+
+	template <class S>
+	Tensor& operator -= (const TensorView<S>& rhs){
+		TENSOR_PROFILE_OP("operator-=(TensorView)", nelem);
+		tensor_detail::zip_transform(vec.data(), dim, offsets, rhs.data, rhs.broadcast(dim).offsets, std::minus<>());
+		return *this;
+	}
+
+	template <class S>
+	Tensor& operator *= (const TensorView<S>& rhs){
+		TENSOR_PROFILE_OP("operator*=(TensorView)", nelem);
+		tensor_detail::zip_transform(vec.data(), dim, offsets, rhs.data, rhs.broadcast(dim).offsets, std::multiplies<>());
+		return *this;
+	}
+
+	template <class S>
+	Tensor& operator /= (const TensorView<S>& rhs){
+		TENSOR_PROFILE_OP("operator/=(TensorView)", nelem);
+		tensor_detail::zip_transform(vec.data(), dim, offsets, rhs.data, rhs.broadcast(dim).offsets, std::divides<>());
+		return *this;
+	}
+
+	template <class E>
+	Tensor& operator += (const TensorExpr<E>& e){
+		TENSOR_PROFILE_OP("operator+=(expr)", nelem);
+		tensor_detail::assign_expr(view(), e, [](T& a, const T& b){a += b;});
+		return *this;
+	}
+
+	template <class E>
+	Tensor& operator -= (const TensorExpr<E>& e){
+		TENSOR_PROFILE_OP("operator-=(expr)", nelem);
+		tensor_detail::assign_expr(view(), e, [](T& a, const T& b){a -= b;});
+		return *this;
+	}
+
+	template <class E>
+	Tensor& operator *= (const TensorExpr<E>& e){
+		TENSOR_PROFILE_OP("operator*=(expr)", nelem);
+		tensor_detail::assign_expr(view(), e, [](T& a, const T& b){a *= b;});
+		return *this;
+	}
+
+	template <class E>
+	Tensor& operator /= (const TensorExpr<E>& e){
+		TENSOR_PROFILE_OP("operator/=(expr)", nelem);
+		tensor_detail::assign_expr(view(), e, [](T& a, const T& b){a /= b;});
+		return *this;
+	}
+
+	template<class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>	
+	Tensor& operator += (S s){
+		TENSOR_PROFILE_OP("operator+=(scalar)", nelem);
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary_scalar<tensor_detail::simd::add>(vec.data()+b, s, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, vec.begin()+b, [&s](const T& x){return x+s;});
+		});
+		return *this;
+	}
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator -= (S s){
+		TENSOR_PROFILE_OP("operator-=(scalar)", nelem);
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary_scalar<tensor_detail::simd::sub>(vec.data()+b, s, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, vec.begin()+b, [&s](const T& x){return x-s;});
+		});
+		return *this;
+	}
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator *= (S s){
+		TENSOR_PROFILE_OP("operator*=(scalar)", nelem);
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary_scalar<tensor_detail::simd::mul>(vec.data()+b, s, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, vec.begin()+b, [&s](const T& x){return x*s;});
+		});
+		return *this;
+	}
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator /= (S s){
+		TENSOR_PROFILE_OP("operator/=(scalar)", nelem);
+		tensor_detail::parallel_for(nelem, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			if (tensor_detail::simd::binary_scalar<tensor_detail::simd::div>(vec.data()+b, s, e-b)) return;
+			std::transform(vec.begin()+b, vec.begin()+e, vec.begin()+b, [&s](const T& x){return x/s;});
+		});
+		return *this;
+	}
+
+};
+
+
+/**
+ TensorView. Non-owning strided window onto tensor data
+
+ A view holds a pointer to the first element, the dimensions, and a signed stride
+ (offset) per dimension, all in units of elements. Element {i_n, ..., i_0} lives at
+ ```
+ data[ sum_k offsets[k]*i_k ]
+ ```
+ Slicing, permuting, squeezing and broadcasting only rewrite dim/offsets and never copy data.
+ A zero stride repeats the same element along that axis (broadcasting), so writes through a
+ broadcast view hit the same element several times.
+
+ As elsewhere in this library, axis numbers are counted from the right, i.e., axis 0 is the
+ innermost (fastest varying) dimension. permute() is the exception: it takes positions in dim.
+ */
+template <class T>
+class TensorView{
+	public:
+	typedef typename std::remove_const<T>::type value_type;
+
+	T* data;
+	std::vector<std::ptrdiff_t> dim;
+	std::vector<std::ptrdiff_t> offsets;
+
+	/// Create a view with explicit strides.
+	TensorView(T* _data, std::vector<std::ptrdiff_t> _dim, std::vector<std::ptrdiff_t> _offsets) : data(_data), dim(_dim), offsets(_offsets){
+		assert(dim.size() == offsets.size());
+	}
+
+	/// Create a view onto contiguous row-major data.
+	TensorView(T* _data, std::vector<std::ptrdiff_t> _dim) : TensorView(_data, _dim, tensor_detail::contiguous_strides(_dim)){
+	}
+
+	/// A view of a non-const type can always be used as a read-only view.
+	operator TensorView<const T>() const {
+		return TensorView<const T>(data, dim, offsets);
+	}
+
+	/// Number of elements addressed by the view.
+	std::ptrdiff_t size() const {
+		return std::accumulate(dim.begin(), dim.end(), std::ptrdiff_t(1), std::multiplies<std::ptrdiff_t>());
+	}
+
+	/// True if the elements are laid out contiguously in row-major order, i.e., the view 
+	/// could be replaced by a plain pointer. Strides of unit dimensions are ignored.
+	bool is_contiguous() const {
+		std::ptrdiff_t p = 1;
+		for (int i=dim.size()-1; i>=0; --i){
+			if (dim[i] != 1 && offsets[i] != p) return false;
+			p *= dim[i];
+		}
+		return true;
+	}
+
+	/// Convert coordinates to the offset of the element from data.
+	std::ptrdiff_t location(const std::vector<std::ptrdiff_t>& ix) const {
+		std::ptrdiff_t loc = 0;
+		for (int i=dim.size()-1; i>=0; --i) loc += offsets[i]*ix[i];
+		return loc;
+	}
+
+	/// Convert a position in the row-major traversal order of the view to coordinates.
+	std::vector<std::ptrdiff_t> index(std::ptrdiff_t i) const {
+		int ndim = dim.size();
+		std::vector<std::ptrdiff_t> id(ndim);
+		for (int k=ndim-1; k>=0; --k){
+			id[k] = i % dim[k];
+			i /= dim[k];
+		}
+		return id;
+	}
+
+	/// Coordinates of all elements in row-major order, with their offsets from data (see TensorIndexRange).
+	TensorIndexRange indices() const {
+		return TensorIndexRange(dim, offsets);
+	}
+
+	template<class... ARGS>
+	T& operator() (ARGS... ids) const {
+		return data[location({std::ptrdiff_t(ids)...})];
+	}
+
+	T& operator() (const std::vector<std::ptrdiff_t>& ix) const {
+		return data[location(ix)];
+	}
+
+	/// Call f(x) on each element in row-major order.
+	template <class F>
+	void for_each(F f) const {
+		tensor_detail::strided_for_each(dim, data, offsets, f);
+	}
+
+	/// Print the view metadata and (optionally) values.
+	void print(bool vals = true, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+	    std::cout << "TensorView:\n";
+	    std::cout << "   dims = "; for (auto d : dim) std::cout << d << " "; std::cout << "\n";
+	    std::cout << "   offs = "; for (auto d : offsets) std::cout << d << " "; std::cout << "\n";
+		if (vals){
+			std::cout << "   vals = \n";
+			tensor_detail::write_tensor(std::cout, data, dim, offsets, opt, "      ");
+		}
+		std::cout << "\n";
+	}
+
+	/// Same as Tensor::write().
+	void write(std::ostream& out, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		tensor_detail::write_tensor(out, data, dim, offsets, opt);
+	}
+
+	void write(const std::string& filename, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+		if (!out) throw std::runtime_error("Tensor: cannot open " + filename + " for writing");
+		write(out, opt);
+		out.flush();
+		if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+	}
+
+	std::string to_string(const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		std::ostringstream ss;
+		write(ss, opt);
+		return ss.str();
+	}
+
+	/// Same as Tensor::save(). The elements are written in row-major order, so the file holds a contiguous tensor.
+	void save(const std::string& filename) const {
+		tensor_detail::save_tensor_file<value_type>(filename, dim, [this](std::ostream& out){
+			if (is_contiguous()){
+				out.write(reinterpret_cast<const char*>(data), size()*sizeof(T));
+				return;
+			}
+			std::vector<value_type> buf;
+			buf.reserve(8192);
+			for_each([&](const T& x){
+				buf.push_back(x);
+				if (buf.size() == buf.capacity()){ out.write(reinterpret_cast<const char*>(buf.data()), buf.size()*sizeof(T)); buf.clear(); }
+			});
+			out.write(reinterpret_cast<const char*>(buf.data()), buf.size()*sizeof(T));
+		});
+	}
+
+	/// Same as Tensor::mmap().
+	static MappedTensor<value_type> mmap(const std::string& filename, bool writable = false){
+		return MappedTensor<value_type>(filename, writable);
+	}
+
+	/// Same as Tensor::to_npy(). The elements are written in row-major order.
+	void to_npy(const std::string& filename) const {
+		TensorWriteOptions opt;
+		opt.format = TensorFormat::npy;
+		write(filename, opt);
+	}
+
+	/// Same as Tensor::mmap_npy().
+	static MappedTensor<value_type> mmap_npy(const std::string& filename, bool writable = false){
+		return MappedTensor<value_type>(tensor_detail::open_npy_file<value_type>(filename, writable));
+	}
+
+
+	// ---- views of views ----
+
+	/// @brief Restrict 'axis' to the indices start, start+step, ... up to (but excluding) stop. 
+	/// A negative step walks the axis backwards (start is then the upper end).
+	TensorView<T> slice(int axis, std::ptrdiff_t start, std::ptrdiff_t stop, std::ptrdiff_t step = 1) const {
+		assert(step != 0);
+		int a = dim.size()-1-axis;
+		std::ptrdiff_t n = (step > 0)? (stop-start+step-1)/step : (start-stop-step-1)/(-step);
+		n = std::max<std::ptrdiff_t>(n, 0);
+		assert(n == 0 || (start >= 0 && start < dim[a] && start+(n-1)*step >= 0 && start+(n-1)*step < dim[a]));
+
+		TensorView<T> v = *this;
+		v.data = data + ((n > 0)? start*offsets[a] : 0);
+		v.dim[a] = n;
+		v.offsets[a] = offsets[a]*step;
+		return v;
+	}
+
+	/// Fix 'axis' at index k and drop it from the view, reducing the rank by 1.
+	TensorView<T> select(int axis, std::ptrdiff_t k) const {
+		int a = dim.size()-1-axis;
+		assert(k >= 0 && k < dim[a]);
+		TensorView<T> v = *this;
+		v.data = data + k*offsets[a];
+		v.dim.erase(v.dim.begin()+a);
+		v.offsets.erase(v.offsets.begin()+a);
+		return v;
+	}
+
+	/// @brief Reorder dimensions. order[i] is the position in dim (counted from the left, 
+	/// like coordinates) of the dimension that becomes the i-th dimension of the result.
+	/// E.g., for a 3D view, permute({2,1,0}) reverses the order of dimensions.
+	TensorView<T> permute(const std::vector<int>& order) const {
+		assert(order.size() == dim.size());
+		TensorView<T> v = *this;
+		for (size_t i=0; i<order.size(); ++i){
+			v.dim[i] = dim[order[i]];
+			v.offsets[i] = offsets[order[i]];
+		}
+		return v;
+	}
+
+	/// Remove all unit dimensions.
+	TensorView<T> squeeze() const {
+		TensorView<T> v(data, {}, {});
+		for (size_t i=0; i<dim.size(); ++i){
+			if (dim[i] != 1){
+				v.dim.push_back(dim[i]);
+				v.offsets.push_back(offsets[i]);
+			}
+		}
+		return v;
+	}
+
+	/// Remove the unit dimension 'axis'.
+	TensorView<T> squeeze(int axis) const {
+		assert(dim[dim.size()-1-axis] == 1);
+		return select(axis, 0);
+	}
+
+	/// Insert a unit dimension such that it becomes 'axis' in the result.
+	/// unsqueeze(0) appends an innermost dimension, unsqueeze(rank) prepends an outermost one.
+	TensorView<T> unsqueeze(int axis) const {
+		int a = dim.size()-axis;
+		TensorView<T> v = *this;
+		v.dim.insert(v.dim.begin()+a, 1);
+		v.offsets.insert(v.offsets.begin()+a, 0);
+		return v;
+	}
+
+	/// @brief Broadcast to the dimensions new_dim, following NumPy rules: dimensions are aligned
+	/// from the right, missing outer dimensions are added, and unit dimensions are stretched.
+	/// Broadcast dimensions get stride 0, so no data is copied.
+	TensorView<T> broadcast(const std::vector<std::ptrdiff_t>& new_dim) const {
+		assert(new_dim.size() >= dim.size());
+		int lead = new_dim.size()-dim.size();
+		TensorView<T> v(data, new_dim, std::vector<std::ptrdiff_t>(new_dim.size(), 0));
+		for (size_t i=0; i<dim.size(); ++i){
+			assert(dim[i] == new_dim[lead+i] || dim[i] == 1);
+			if (dim[i] == new_dim[lead+i]) v.offsets[lead+i] = offsets[i];
+		}
+		return v;
+	}
+
+	/// Lazy Tensor::repeat_inner(): a new innermost dimension of size n with stride 0, so every element is seen n times.
+	TensorView<T> repeat_inner(std::ptrdiff_t n) const {
+		TensorView<T> v = unsqueeze(0);
+		v.dim.back() = n;
+		return v;
+	}
+
+	/// Lazy Tensor::repeat_outer(): a new outermost dimension of size n with stride 0, so the whole view is seen n times.
+	TensorView<T> repeat_outer(std::ptrdiff_t n) const {
+		TensorView<T> v = unsqueeze(dim.size());
+		v.dim.front() = n;
+		return v;
+	}
+
+
+	// ---- axis operations ----
+
+	/// Same as Tensor::transform(): vec[i] = binary_op(vec[i], w[count]) along 'axis'.
+	template <class BinOp>
+	void transform(int axis, BinOp binary_op, const std::vector<double>& w) const {
+		int a = dim.size()-1-axis;
+		assert(std::ptrdiff_t(w.size()) == dim[a]);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = 1;
+		tensor_detail::transform_axes(data, dim, offsets, w.data(), wstr, binary_op);
+	}
+
+	/// Same as Tensor::transform(axis, binary_op, w) with a 1-D view as the operand.
+	template <class BinOp, class W>
+	void transform(int axis, BinOp binary_op, const TensorView<W>& w) const {
+		int a = dim.size()-1-axis;
+		assert(w.dim.size() == 1 && w.dim[0] == dim[a]);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = w.offsets[0];
+		tensor_detail::transform_axes(data, dim, offsets, w.data, wstr, binary_op);
+	}
+
+	/// Same as Tensor::transform(binary_op, w): the operand is broadcast to the shape of this view.
+	template <class BinOp, class W>
+	void transform(BinOp binary_op, const TensorView<W>& w) const {
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank];
+		tensor_detail::broadcast_strides(w, dim, wstr);
+		tensor_detail::transform_axes(data, dim, offsets, w.data, wstr, binary_op);
+	}
+
+	/// Same as Tensor::accumulate(): reduce along 'axis' into a new tensor.
+	template <class BinOp>
+	Tensor<value_type> accumulate(value_type v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		int a = dim.size()-1-axis;
+		assert(weights.size() == 0 || std::ptrdiff_t(weights.size()) == dim[a]);
+		Tensor<value_type> tens(select(axis, 0).dim, tensor_uninitialized);
+		TensorView<value_type> out = tens.view();
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = 1;
+		tensor_detail::reduce_axes(const_cast<const T*>(data), dim, offsets, std::uint64_t(1) << a, weights.empty()? nullptr : weights.data(), wstr, 
+		                           out.data, out.dim, out.offsets, v0, binary_op, 1);
+		return tens;
+	}
+
+
+	// ---- operators ----
+
+	template <class S>
+	TensorView<T>& operator += (const TensorView<S>& rhs) { return zip_assign(rhs, std::plus<>()); }
+
+	template <class S>
+	TensorView<T>& operator -= (const TensorView<S>& rhs) { return zip_assign(rhs, std::minus<>()); }
+
+	template <class S>
+	TensorView<T>& operator *= (const TensorView<S>& rhs) { return zip_assign(rhs, std::multiplies<>()); }
+
+	template <class S>
+	TensorView<T>& operator /= (const TensorView<S>& rhs) { return zip_assign(rhs, std::divides<>()); }
+
+	template <class S, int M, class A>
+	TensorView<T>& operator += (const Tensor<S,M,A>& rhs) { return *this += rhs.view(); }
+
+	template <class S, int M, class A>
+	TensorView<T>& operator -= (const Tensor<S,M,A>& rhs) { return *this -= rhs.view(); }
+
+	template <class S, int M, class A>
+	TensorView<T>& operator *= (const Tensor<S,M,A>& rhs) { return *this *= rhs.view(); }
+
+	template <class S, int M, class A>
+	TensorView<T>& operator /= (const Tensor<S,M,A>& rhs) { return *this /= rhs.view(); }
+
+	template <class E>
+	TensorView<T>& operator += (const TensorExpr<E>& e) { tensor_detail::assign_expr(*this, e, [](T& a, const value_type& b){a += b;}); return *this; }
+
+	template <class E>
+	TensorView<T>& operator -= (const TensorExpr<E>& e) { tensor_detail::assign_expr(*this, e, [](T& a, const value_type& b){a -= b;}); return *this; }
+
+	template <class E>
+	TensorView<T>& operator *= (const TensorExpr<E>& e) { tensor_detail::assign_expr(*this, e, [](T& a, const value_type& b){a *= b;}); return *this; }
+
+	template <class E>
+	TensorView<T>& operator /= (const TensorExpr<E>& e) { tensor_detail::assign_expr(*this, e, [](T& a, const value_type& b){a /= b;}); return *this; }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	TensorView<T>& operator += (S s) { return scalar_assign(s, std::plus<>()); }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	TensorView<T>& operator -= (S s) { return scalar_assign(s, std::minus<>()); }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	TensorView<T>& operator *= (S s) { return scalar_assign(s, std::multiplies<>()); }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	TensorView<T>& operator /= (S s) { return scalar_assign(s, std::divides<>()); }
+
+	private:
+	template <class S, class BinOp>
+	TensorView<T>& zip_assign(const TensorView<S>& rhs, BinOp binary_op){
+		tensor_detail::zip_transform(data, dim, offsets, rhs.data, rhs.broadcast(dim).offsets, binary_op);
+		return *this;
+	}
+
+	// x = binary_op(x, s) for each element, with the vector kernels and threads of transform_axes(), 
+	// unless the view repeats elements (0-stride axes), which are then updated in order
+	template <class S, class BinOp>
+	TensorView<T>& scalar_assign(S s, BinOp binary_op){
+		bool repeated = dim.size() > size_t(tensor_detail::max_reduce_rank);
+		for (size_t i=0; i<dim.size(); ++i) repeated = repeated || (offsets[i] == 0 && dim[i] > 1);
+		if (repeated) for_each([&](T& x){ x = binary_op(x, s); });
+		else {
+			const std::ptrdiff_t zero[tensor_detail::max_reduce_rank] = {};
+			tensor_detail::transform_axes(data, dim, offsets, &s, zero, binary_op);
+		}
+		return *this;
+	}
+
+};
+
+
+/**
+ View of a tensor file written by Tensor::save(), used in place
+
+ The file is memory-mapped, so opening it costs only the header check regardless of its 
+ size, and the data are paged in lazily as they are accessed. The mapping lives as long as 
+ any copy of the MappedTensor. By default the mapping is private: elements can be modified, 
+ but the changes are never written back. With writable = true, changes go to the file.
+ ```
+ MappedTensor<double> t = Tensor<double>::mmap("restart.tns");
+ Tensor<double> m = t.accumulate(0, 2, std::plus<double>());
+ MappedTensor<double> last = t.select(2, t.dim[0]-1);   // shares the mapping
+ ```
+ Views derived with slice(), select(), permute() etc. are MappedTensors again, so they keep 
+ the file mapped. view() and the conversion to TensorView give a plain view, which must not 
+ outlive the MappedTensor it came from.
+ Throws std::runtime_error if the file cannot be opened, is not a tensor file, stores a 
+ different element type, or was written with a different byte order (use Tensor::load()).
+ NumPy .npy files can be mapped in the same way with Tensor::mmap_npy().
+ Without mmap support (TENSOR_HAVE_MMAP), the file is read into memory instead.
+ */
+template <class T>
+class MappedTensor{
+	private:
+	std::shared_ptr<void> mapping;
+
+	MappedTensor(std::shared_ptr<void> m, const TensorView<T>& v) : mapping(std::move(m)), data(v.data), dim(v.dim), offsets(v.offsets){
+	}
+
+	/// A view derived from this one, sharing the mapping.
+	MappedTensor derived(const TensorView<T>& v) const {
+		return MappedTensor(mapping, v);
+	}
+
+	public:
+	typedef T value_type;
+
+	T* data;
+	std::vector<std::ptrdiff_t> dim;
+	std::vector<std::ptrdiff_t> offsets;
+
+	MappedTensor(const std::string& filename, bool writable = false) : MappedTensor(tensor_detail::open_tensor_file<T>(filename, writable, false)){
+	}
+
+	/// View of a file opened with tensor_detail::open_tensor_file() or open_npy_file().
+	explicit MappedTensor(tensor_detail::tensor_file_map m) : mapping(std::move(m.mapping)), data(reinterpret_cast<T*>(m.data)), dim(m.dim), offsets(m.str){
+	}
+
+	/// Plain view of the mapped data, valid as long as this MappedTensor (or a copy) exists.
+	TensorView<T> view() const {
+		return TensorView<T>(data, dim, offsets);
+	}
+
+	operator TensorView<T>() const { return view(); }
+	operator TensorView<const T>() const { return view(); }
+
+	std::ptrdiff_t size() const {
+		return std::accumulate(dim.begin(), dim.end(), std::ptrdiff_t(1), std::multiplies<std::ptrdiff_t>());
+	}
+
+	bool is_contiguous() const {
+		std::ptrdiff_t p = 1;
+		for (int i=dim.size()-1; i>=0; --i){
+			if (dim[i] != 1 && offsets[i] != p) return false;
+			p *= dim[i];
+		}
+		return true;
+	}
+
+	std::ptrdiff_t location(const std::vector<std::ptrdiff_t>& ix) const {
+		std::ptrdiff_t loc = 0;
+		for (int i=dim.size()-1; i>=0; --i) loc += offsets[i]*ix[i];
+		return loc;
+	}
+
+	std::vector<std::ptrdiff_t> index(std::ptrdiff_t i) const { return view().index(i); }
+	TensorIndexRange indices() const { return TensorIndexRange(dim, offsets); }
+
+	template<class... ARGS>
+	T& operator() (ARGS... ids) const {
+		return data[location({std::ptrdiff_t(ids)...})];
+	}
+
+	T& operator() (const std::vector<std::ptrdiff_t>& ix) const {
+		return data[location(ix)];
+	}
+
+	template <class F>
+	void for_each(F f) const { view().for_each(f); }
+
+	void print(bool vals = true, const TensorWriteOptions& opt = TensorWriteOptions()) const { view().print(vals, opt); }
+	void write(std::ostream& out, const TensorWriteOptions& opt = TensorWriteOptions()) const { view().write(out, opt); }
+	void write(const std::string& filename, const TensorWriteOptions& opt = TensorWriteOptions()) const { view().write(filename, opt); }
+	std::string to_string(const TensorWriteOptions& opt = TensorWriteOptions()) const { return view().to_string(opt); }
+	void save(const std::string& filename) const { view().save(filename); }
+	void to_npy(const std::string& filename) const { view().to_npy(filename); }
+
+	MappedTensor slice(int axis, std::ptrdiff_t start, std::ptrdiff_t stop, std::ptrdiff_t step = 1) const { return derived(view().slice(axis, start, stop, step)); }
+	MappedTensor select(int axis, std::ptrdiff_t k) const { return derived(view().select(axis, k)); }
+	MappedTensor permute(const std::vector<int>& order) const { return derived(view().permute(order)); }
+	MappedTensor squeeze() const { return derived(view().squeeze()); }
+	MappedTensor squeeze(int axis) const { return derived(view().squeeze(axis)); }
+	MappedTensor unsqueeze(int axis) const { return derived(view().unsqueeze(axis)); }
+	MappedTensor broadcast(const std::vector<std::ptrdiff_t>& new_dim) const { return derived(view().broadcast(new_dim)); }
+	MappedTensor repeat_inner(std::ptrdiff_t n) const { return derived(view().repeat_inner(n)); }
+	MappedTensor repeat_outer(std::ptrdiff_t n) const { return derived(view().repeat_outer(n)); }
+
+	template <class BinOp, class W>
+	void transform(int axis, BinOp binary_op, const W& w) const { view().transform(axis, binary_op, w); }
+
+	template <class BinOp, class W>
+	void transform(BinOp binary_op, const W& w) const { view().transform(binary_op, w); }
+
+	template <class BinOp>
+	Tensor<value_type> accumulate(value_type v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		return view().accumulate(v0, axis, binary_op, weights);
+	}
+
+	template <class S> MappedTensor& operator += (const S& rhs) { view() += rhs; return *this; }
+	template <class S> MappedTensor& operator -= (const S& rhs) { view() -= rhs; return *this; }
+	template <class S> MappedTensor& operator *= (const S& rhs) { view() *= rhs; return *this; }
+	template <class S> MappedTensor& operator /= (const S& rhs) { view() /= rhs; return *this; }
+};
+
+
+/**
+ Reader of a tensor in chunks of rows along the outermost axis
+
+ For tensors that do not fit in memory, e.g. a long time series {time, lat, lon}: the data come 
+ from a file written by Tensor::save() or TensorChunkWriter, or from a callback source(first, chunk), 
+ which must fill the view chunk with the rows first, first+1, ... of the tensor. Each call to 
+ next() returns a view of the next chunk, valid until the following call, while the chunk after 
+ it is already being read in the background. So at most two chunks are held in memory, and 
+ reading overlaps with the computation on the current chunk.
+ ```
+ TensorChunkReader<float> in("tas.tns", 64);   // 64 time steps at a time
+ Tensor<float> clim = in.avg_dim();            // mean over time
+ ```
+ Reductions along the outermost axis can also be fed chunk by chunk into a TensorChunkAccumulator.
+ */
+template <class T>
+class TensorChunkReader{
+	public:
+	/// Shape of the whole tensor. Chunks have the shape {n, dim[1], dim[2], ...}.
+	std::vector<std::ptrdiff_t> dim;
+
+	private:
+	std::function<void(std::ptrdiff_t, const TensorView<T>&)> source;
+	std::ptrdiff_t chunk_rows, row_size;
+	std::ptrdiff_t next_row = 0, pending_first = 0, pending_rows = 0;
+	std::vector<T> buf[2];
+	int cur = 0;
+	std::future<void> pending;
+
+	std::vector<std::ptrdiff_t> chunk_dim(std::ptrdiff_t n) const {
+		std::vector<std::ptrdiff_t> d = dim;
+		d[0] = n;
+		return d;
+	}
+
+	// start filling the buffer that is not in use with the next chunk
+	void prefetch(){
+		pending_first = next_row;
+		pending_rows = std::min(chunk_rows, dim[0] - next_row);
+		next_row += pending_rows;
+		if (pending_rows == 0) return;
+		std::vector<T>& b = buf[1-cur];
+		b.resize(pending_rows*row_size);
+		TensorView<T> v(b.data(), chunk_dim(pending_rows));
+		std::ptrdiff_t first = pending_first;
+		auto job = [this, v, first](){ source(first, v); };
+#ifndef TENSOR_NO_THREADS
+		pending = std::async(std::launch::async, job);
+#else
+		std::promise<void> done;	// errors surface in next(), as with background reads
+		try { job(); done.set_value(); }
+		catch (...){ done.set_exception(std::current_exception()); }
+		pending = done.get_future();
+#endif
+	}
+
+	void init(){
+		assert(dim.size() >= 1 && chunk_rows >= 1);
+		row_size = tensor_detail::checked_size(chunk_dim(1));
+		prefetch();
+	}
+
+	public:
+	/// @brief Read a file written by Tensor::save() or TensorChunkWriter, chunk_rows rows at a time. 
+	/// Throws std::runtime_error if it is not a tensor file of type T (see Tensor::load()).
+	TensorChunkReader(const std::string& filename, std::ptrdiff_t chunk_rows) : chunk_rows(chunk_rows){
+		auto in = std::make_shared<std::ifstream>(filename, std::ios::binary | std::ios::ate);
+		if (!*in) throw std::runtime_error("Tensor: cannot open " + filename);
+		std::uint64_t size = in->tellg();
+		tensor_detail::tensor_file_info h = tensor_detail::read_tensor_header<T>(filename, size, true, [&](void* dst, std::uint64_t off, std::size_t n){
+			in->seekg(off);
+			in->read(static_cast<char*>(dst), n);
+		});
+		if (!*in) throw std::runtime_error("Tensor: error reading " + filename);
+		if (!TensorView<T>(nullptr, h.dim, h.str).is_contiguous()) throw std::runtime_error("Tensor: " + filename + ": chunked reading needs contiguous data");
+		dim = h.dim;
+		source = [in, h, filename](std::ptrdiff_t first, const TensorView<T>& chunk){
+			std::ptrdiff_t n = chunk.size();
+			in->seekg(h.data_offset + first*(n/chunk.dim[0])*sizeof(T));
+			in->read(reinterpret_cast<char*>(chunk.data), n*sizeof(T));
+			if (!*in) throw std::runtime_error("Tensor: error reading " + filename);
+			if (h.swapped) tensor_detail::byteswap(chunk.data, sizeof(T), n);
+		};
+		init();
+	}
+
+	/// Generate a tensor of shape _dim with source(first, chunk), chunk_rows rows at a time (see above).
+	TensorChunkReader(std::vector<std::ptrdiff_t> _dim, std::ptrdiff_t chunk_rows, std::function<void(std::ptrdiff_t, const TensorView<T>&)> source) 
+		: dim(std::move(_dim)), source(std::move(source)), chunk_rows(chunk_rows){
+		init();
+	}
+
+	TensorChunkReader(const TensorChunkReader&) = delete;
+	TensorChunkReader& operator=(const TensorChunkReader&) = delete;
+
+	~TensorChunkReader(){
+		if (pending.valid()) pending.wait();
+	}
+
+	/// @brief Get the next chunk and the index of its first row along the outermost axis. 
+	/// Returns false after the last chunk. Rethrows exceptions from reading the chunk, after 
+	/// which the reader is exhausted and further calls return false.
+	bool next(TensorView<const T>& chunk, std::ptrdiff_t& first){
+		if (pending_rows == 0) return false;
+		if (pending.valid()){
+			try { pending.get(); }
+			catch (...){ pending_rows = 0; throw; }
+		}
+		cur = 1-cur;
+		std::ptrdiff_t f = pending_first, n = pending_rows;
+		prefetch();	// overlaps with the caller's work on this chunk
+		chunk = TensorView<const T>(buf[cur].data(), chunk_dim(n));
+		first = f;
+		return true;
+	}
+
+	/// @brief Same as Tensor::accumulate() along the outermost axis (dim.size()-1), over the 
+	/// remaining chunks, with weights indexed by the row along that axis.
+	template <class BinOp>
+	Tensor<T> accumulate(T v0, BinOp binary_op, const std::vector<double>& weights={}){
+		return reduce(v0, binary_op, weights, false);
+	}
+
+	/// Same as Tensor::avg_dim() along the outermost axis, over the remaining chunks.
+	Tensor<T> avg_dim(const std::vector<double>& weights={}){
+		return reduce(0, std::plus<T>(), weights, true);
+	}
+
+	private:
+	template <class BinOp>
+	Tensor<T> reduce(T v0, BinOp binary_op, const std::vector<double>& weights, bool mean);
+};
+
+
+/**
+ Incremental reduction along the outermost axis
+
+ Folds the rows of chunks of shape {n, row_dim...} into acc = binary_op(acc, w[i]*row_i) in the 
+ order of their index i along the outermost axis, starting from v0 and accumulating in double, 
+ i.e., with the same semantics as Tensor::accumulate(v0, dim.size()-1, binary_op, w). Chunks 
+ must be added in order; the result is available at any time.
+ */
+template <class T, class BinOp = std::plus<double>>
+class TensorChunkAccumulator{
+	private:
+	std::vector<std::ptrdiff_t> row_dim;
+	std::vector<double> acc;
+	BinOp binary_op;
+	std::vector<double> weights;
+	std::ptrdiff_t nrows = 0;
+
+	public:
+	TensorChunkAccumulator(std::vector<std::ptrdiff_t> row_dim, double v0, BinOp binary_op = BinOp(), std::vector<double> weights = {})
+		: row_dim(row_dim), acc(tensor_detail::checked_size(row_dim), v0), binary_op(binary_op), weights(std::move(weights)){
+	}
+
+	/// Fold in the rows of chunk, which are the rows first, first+1, ... along the outermost axis 
+	/// (first is only used to index the weights).
+	void add(const TensorView<const T>& chunk, std::ptrdiff_t first){
+		assert(chunk.dim.size() == row_dim.size()+1 && std::equal(row_dim.begin(), row_dim.end(), chunk.dim.begin()+1));
+		std::ptrdiff_t n = chunk.dim[0], m = acc.size();
+		assert(weights.empty() || first+n <= std::ptrdiff_t(weights.size()));
+		if (!chunk.is_contiguous()){
+			Tensor<T> tmp(chunk);
+			add(tmp.view(), first);
+			return;
+		}
+		const T* x = chunk.data;
+		const double* w = weights.empty()? nullptr : weights.data()+first;
+		tensor_detail::parallel_for(m, n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			const std::ptrdiff_t tile = 1024;
+			for (std::ptrdiff_t j0=b; j0<e; j0+=tile){
+				std::ptrdiff_t j1 = std::min(e, j0+tile);
+				for (std::ptrdiff_t i=0; i<n; ++i){
+					const T* row = x + i*m;
+					if (w) for (std::ptrdiff_t j=j0; j<j1; ++j) acc[j] = tensor_detail::reduce_combine<BinOp,T>(binary_op, acc[j], w[i]*row[j]);
+					else   for (std::ptrdiff_t j=j0; j<j1; ++j) acc[j] = tensor_detail::reduce_combine<BinOp,T>(binary_op, acc[j], row[j]);
+				}
+			}
+		});
+		nrows += n;
+	}
+
+	/// Number of rows folded in so far.
+	std::ptrdiff_t rows() const {
+		return nrows;
+	}
+
+	/// The reduction of the rows added so far, multiplied by scale.
+	Tensor<T> result(double scale = 1) const {
+		Tensor<T> tens(row_dim);
+		for (size_t j=0; j<acc.size(); ++j) tens.vec[j] = acc[j]*scale;
+		return tens;
+	}
+};
+
+template <class T>
+template <class BinOp>
+Tensor<T> TensorChunkReader<T>::reduce(T v0, BinOp binary_op, const std::vector<double>& weights, bool mean){
+	assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[0]);
+	TensorChunkAccumulator<T, BinOp> acc(std::vector<std::ptrdiff_t>(dim.begin()+1, dim.end()), v0, binary_op, weights);
+	TensorView<const T> chunk(nullptr, dim);
+	std::ptrdiff_t first;
+	while (next(chunk, first)) acc.add(chunk, first);
+	return acc.result(mean? 1.0/acc.rows() : 1);
+}
+
+
+/**
+ Writer of a tensor file in chunks of rows along the outermost axis
+
+ Writes a file in the format of Tensor::save() without holding the whole tensor in memory: 
+ the chunks passed to write() are the consecutive rows of a tensor of shape dim along its 
+ outermost axis, and may have any number of rows. Each chunk is copied and written in the 
+ background while the caller computes the next one. close() checks that all rows were written.
+ ```
+ TensorChunkWriter<float> out("anom.tns", in.dim);
+ while (in.next(chunk, first)) out.write(anomaly(chunk));
+ out.close();
+ ```
+ */
+template <class T>
+class TensorChunkWriter{
+	private:
+	std::string filename;
+	std::ofstream out;
+	std::vector<std::ptrdiff_t> dim;
+	std::ptrdiff_t rows_written = 0;
+	std::vector<T> buf;
+	std::future<void> pending;
+
+	void wait(){
+		if (pending.valid()) pending.get();
+	}
+
+	public:
+	/// Create the file, which will hold a tensor of shape _dim. Throws std::runtime_error if it cannot be created.
+	TensorChunkWriter(const std::string& _filename, std::vector<std::ptrdiff_t> _dim) : filename(_filename), out(_filename, std::ios::binary | std::ios::trunc), dim(std::move(_dim)){
+		assert(dim.size() >= 1);
+		if (!out) throw std::runtime_error("Tensor: cannot open " + filename + " for writing");
+		tensor_detail::write_tensor_header<T>(out, dim);
+	}
+
+	TensorChunkWriter(const TensorChunkWriter&) = delete;
+	TensorChunkWriter& operator=(const TensorChunkWriter&) = delete;
+
+	~TensorChunkWriter(){
+		if (pending.valid()) pending.wait();
+	}
+
+	/// Append the rows of chunk, of shape {n, dim[1], dim[2], ...}. Rethrows errors from writing the previous chunk.
+	void write(const TensorView<const T>& chunk){
+		assert(chunk.dim.size() == dim.size() && std::equal(dim.begin()+1, dim.end(), chunk.dim.begin()+1));
+		assert(rows_written + chunk.dim[0] <= dim[0]);
+		wait();
+		buf.resize(chunk.size());
+		if (chunk.is_contiguous()) std::copy(chunk.data, chunk.data+buf.size(), buf.begin());
+		else {
+			std::ptrdiff_t k = 0;
+			chunk.for_each([&](const T& x){ buf[k++] = x; });
+		}
+		rows_written += chunk.dim[0];
+		auto job = [this](){
+			out.write(reinterpret_cast<const char*>(buf.data()), buf.size()*sizeof(T));
+			if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+		};
+#ifndef TENSOR_NO_THREADS
+		pending = std::async(std::launch::async, job);
+#else
+		job();
+#endif
+	}
+
+	/// @brief Finish writing and close the file. Throws std::runtime_error if writing failed, or 
+	/// if fewer rows than dim[0] were written.
+	void close(){
+		wait();
+		if (rows_written != dim[0]) throw std::runtime_error("Tensor: " + filename + ": " + std::to_string(rows_written) + " of " + std::to_string(dim[0]) + " rows written");
+		out.close();
+		if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+	}
+};
+
+
+namespace tensor_detail{
+
+/// Append the n lowest bytes of v to s, little-endian (the byte order of zip archives).
+inline void put_le(std::string& s, std::uint64_t v, int n){
+	for (int i=0; i<n; ++i) s += char((v >> (8*i)) & 0xff);
+}
+
+inline std::uint64_t get_le(const unsigned char* p, int n){
+	std::uint64_t v = 0;
+	for (int i=n-1; i>=0; --i) v = (v << 8) | p[i];
+	return v;
+}
+
+} // namespace tensor_detail
+
+
+/**
+ Writer of NumPy .npz archives
+
+ Stores several tensors, each as the .npy file name.npy, in an uncompressed zip archive, as 
+ numpy.savez() does (numpy.load() returns them by name). Entries larger than 4 GiB use zip64.
+ ```
+ TensorNpzWriter npz("state.npz");
+ npz.add("temp", temp);
+ npz.add("mask", mask.view());
+ npz.close();
+ ```
+ */
+class TensorNpzWriter{
+	private:
+	struct entry{ std::string name; std::uint32_t crc; std::uint64_t size, offset; };
+	std::string filename;
+	std::ofstream out;
+	std::vector<entry> entries;
+	bool closed = false;
+
+	static const std::uint32_t max32 = 0xffffffffu;
+
+	public:
+	/// Create the archive. Throws std::runtime_error if it cannot be created.
+	explicit TensorNpzWriter(const std::string& _filename) : filename(_filename), out(_filename, std::ios::binary | std::ios::trunc){
+		if (!out) throw std::runtime_error("Tensor: cannot open " + filename + " for writing");
+	}
+
+	TensorNpzWriter(const TensorNpzWriter&) = delete;
+	TensorNpzWriter& operator=(const TensorNpzWriter&) = delete;
+
+	/// Finishes the archive if close() was not called, ignoring errors.
+	~TensorNpzWriter(){
+		try { if (!closed) close(); } catch (...) {}
+	}
+
+	/// Add the (row-major) elements of t as name.npy.
+	template <class T>
+	void add(const std::string& name, const TensorView<T>& t){
+		typedef typename std::remove_const<T>::type V;
+		entry e = {name + ".npy", 0, 0, std::uint64_t(out.tellp())};
+		std::ostringstream hs;
+		{
+			tensor_detail::write_buffer hb(hs);
+			tensor_detail::write_npy_header<V>(hb, t.dim);
+		}
+		e.size = hs.str().size() + std::uint64_t(t.size())*sizeof(V);
+		bool zip64 = (e.size >= max32);
+		std::string h;
+		tensor_detail::put_le(h, 0x04034b50, 4);
+		tensor_detail::put_le(h, zip64? 45 : 20, 2);	// version needed to extract
+		tensor_detail::put_le(h, 0, 2);	// flags
+		tensor_detail::put_le(h, 0, 2);	// stored
+		tensor_detail::put_le(h, 0, 2);	// time
+		tensor_detail::put_le(h, 0x21, 2);	// date: 1980-01-01
+		tensor_detail::put_le(h, 0, 4);	// crc, written below
+		tensor_detail::put_le(h, zip64? max32 : e.size, 4);
+		tensor_detail::put_le(h, zip64? max32 : e.size, 4);
+		tensor_detail::put_le(h, e.name.size(), 2);
+		tensor_detail::put_le(h, zip64? 20 : 0, 2);
+		h += e.name;
+		if (zip64){
+			tensor_detail::put_le(h, 1, 2);
+			tensor_detail::put_le(h, 16, 2);
+			tensor_detail::put_le(h, e.size, 8);
+			tensor_detail::put_le(h, e.size, 8);
+		}
+		out.write(h.data(), h.size());
+		{
+			tensor_detail::write_buffer b(out, &e.crc);
+			tensor_detail::write_npy(b, t.data, t.dim, t.offsets);
+		}
+		std::string crc;
+		tensor_detail::put_le(crc, e.crc, 4);
+		std::streampos end = out.tellp();
+		out.seekp(e.offset + 14);
+		out.write(crc.data(), 4);
+		out.seekp(end);
+		if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+		entries.push_back(e);
+	}
+
+	template <class T, class A>
+	void add(const std::string& name, const Tensor<T, dynamic_rank, A>& t){
+		add(name, t.view());
+	}
+
+	/// Write the central directory and close the file. Throws std::runtime_error if writing failed.
+	void close(){
+		closed = true;
+		std::uint64_t cd_offset = out.tellp();
+		std::string cd;
+		for (const entry& e : entries){
+			bool big = (e.size >= max32), far = (e.offset >= max32);
+			std::string extra;
+			if (big){ tensor_detail::put_le(extra, e.size, 8); tensor_detail::put_le(extra, e.size, 8); }
+			if (far) tensor_detail::put_le(extra, e.offset, 8);
+			if (!extra.empty()){
+				std::string x;
+				tensor_detail::put_le(x, 1, 2);
+				tensor_detail::put_le(x, extra.size(), 2);
+				extra = x + extra;
+			}
+			tensor_detail::put_le(cd, 0x02014b50, 4);
+			tensor_detail::put_le(cd, 45, 2);	// version made by
+			tensor_detail::put_le(cd, (big || far)? 45 : 20, 2);
+			tensor_detail::put_le(cd, 0, 2);
+			tensor_detail::put_le(cd, 0, 2);
+			tensor_detail::put_le(cd, 0, 2);
+			tensor_detail::put_le(cd, 0x21, 2);
+			tensor_detail::put_le(cd, e.crc, 4);
+			tensor_detail::put_le(cd, big? max32 : e.size, 4);
+			tensor_detail::put_le(cd, big? max32 : e.size, 4);
+			tensor_detail::put_le(cd, e.name.size(), 2);
+			tensor_detail::put_le(cd, extra.size(), 2);
+			tensor_detail::put_le(cd, 0, 2);	// comment
+			tensor_detail::put_le(cd, 0, 2);	// disk
+			tensor_detail::put_le(cd, 0, 2);	// internal attributes
+			tensor_detail::put_le(cd, 0, 4);	// external attributes
+			tensor_detail::put_le(cd, far? max32 : e.offset, 4);
+			cd += e.name;
+			cd += extra;
+		}
+		std::uint64_t n = entries.size(), cd_size = cd.size();
+		if (n >= 0xffff || cd_size >= max32 || cd_offset >= max32){
+			std::uint64_t eocd64 = cd_offset + cd_size;
+			tensor_detail::put_le(cd, 0x06064b50, 4);
+			tensor_detail::put_le(cd, 44, 8);
+			tensor_detail::put_le(cd, 45, 2);
+			tensor_detail::put_le(cd, 45, 2);
+			tensor_detail::put_le(cd, 0, 4);
+			tensor_detail::put_le(cd, 0, 4);
+			tensor_detail::put_le(cd, n, 8);
+			tensor_detail::put_le(cd, n, 8);
+			tensor_detail::put_le(cd, cd_size, 8);
+			tensor_detail::put_le(cd, cd_offset, 8);
+			tensor_detail::put_le(cd, 0x07064b50, 4);
+			tensor_detail::put_le(cd, 0, 4);
+			tensor_detail::put_le(cd, eocd64, 8);
+			tensor_detail::put_le(cd, 1, 4);
+			n = 0xffff; cd_size = std::min<std::uint64_t>(cd_size, max32); cd_offset = max32;
+		}
+		tensor_detail::put_le(cd, 0x06054b50, 4);
+		tensor_detail::put_le(cd, 0, 2);
+		tensor_detail::put_le(cd, 0, 2);
+		tensor_detail::put_le(cd, n, 2);
+		tensor_detail::put_le(cd, n, 2);
+		tensor_detail::put_le(cd, cd_size, 4);
+		tensor_detail::put_le(cd, cd_offset, 4);
+		tensor_detail::put_le(cd, 0, 2);
+		out.write(cd.data(), cd.size());
+		out.close();
+		if (!out) throw std::runtime_error("Tensor: error writing " + filename);
+	}
+};
+
+
+/**
+ Reader of NumPy .npz archives
+
+ Lists and reads the arrays of an archive written by numpy.savez() or TensorNpzWriter, by name 
+ (without the .npy extension). Only stored entries can be read: archives from 
+ numpy.savez_compressed() are rejected, since they would need a deflate decoder.
+ */
+class TensorNpzReader{
+	private:
+	struct entry{ std::string name; std::uint64_t offset, size; int method; };
+	std::string filename;
+	std::shared_ptr<std::ifstream> in;
+	std::vector<entry> entries;
+
+	std::runtime_error fail(const std::string& what) const {
+		return std::runtime_error("Tensor: " + filename + ": " + what);
+	}
+
+	void read(void* dst, std::uint64_t off, std::size_t n){
+		in->seekg(off);
+		in->read(static_cast<char*>(dst), n);
+		if (!*in) throw fail("truncated archive");
+	}
+
+	const entry& find(const std::string& name) const {
+		for (const entry& e : entries) if (e.name == name) return e;
+		throw fail("no array named '" + name + "'");
+	}
+
+	public:
+	/// Open the archive and read its directory. Throws std::runtime_error if it is not a valid zip archive.
+	explicit TensorNpzReader(const std::string& _filename) : filename(_filename), in(std::make_shared<std::ifstream>(_filename, std::ios::binary | std::ios::ate)){
+		if (!*in) throw std::runtime_error("Tensor: cannot open " + filename);
+		std::uint64_t size = in->tellg();
+		const std::uint64_t max32 = 0xffffffffu;
+
+		// the end of central directory record is within the last 64 KiB (+ its own 22 bytes)
+		std::uint64_t tail = std::min<std::uint64_t>(size, 65557);
+		std::vector<unsigned char> t(tail);
+		read(t.data(), size-tail, tail);
+		std::ptrdiff_t p = std::ptrdiff_t(tail) - 22;
+		while (p >= 0 && tensor_detail::get_le(&t[p], 4) != 0x06054b50) --p;
+		if (p < 0) throw fail("not a zip archive");
+		std::uint64_t n = tensor_detail::get_le(&t[p+10], 2), cd_size = tensor_detail::get_le(&t[p+12], 4), cd_offset = tensor_detail::get_le(&t[p+16], 4);
+		if (n == 0xffff || cd_size == max32 || cd_offset == max32){
+			std::uint64_t loc = size-tail+p-20;
+			unsigned char l[20], r[56];
+			read(l, loc, 20);
+			if (tensor_detail::get_le(l, 4) != 0x07064b50) throw fail("missing zip64 end of central directory");
+			read(r, tensor_detail::get_le(l+8, 8), 56);
+			if (tensor_detail::get_le(r, 4) != 0x06064b50) throw fail("invalid zip64 end of central directory");
+			n = tensor_detail::get_le(r+32, 8); cd_size = tensor_detail::get_le(r+40, 8); cd_offset = tensor_detail::get_le(r+48, 8);
+		}
+		if (cd_offset > size || cd_size > size - cd_offset) throw fail("invalid central directory");
+		std::vector<unsigned char> cd(cd_size);
+		read(cd.data(), cd_offset, cd_size);
+
+		for (std::uint64_t i=0, q=0; i<n; ++i){
+			if (q + 46 > cd_size || tensor_detail::get_le(&cd[q], 4) != 0x02014b50) throw fail("invalid central directory");
+			entry e;
+			e.method = tensor_detail::get_le(&cd[q+10], 2);
+			std::uint64_t csize = tensor_detail::get_le(&cd[q+20], 4);
+			e.size = tensor_detail::get_le(&cd[q+24], 4);
+			e.offset = tensor_detail::get_le(&cd[q+42], 4);
+			std::size_t nlen = tensor_detail::get_le(&cd[q+28], 2), xlen = tensor_detail::get_le(&cd[q+30], 2), clen = tensor_detail::get_le(&cd[q+32], 2);
+			if (q + 46 + nlen + xlen + clen > cd_size) throw fail("invalid central directory");
+			e.name.assign(reinterpret_cast<const char*>(&cd[q+46]), nlen);
+			for (std::size_t x=q+46+nlen, xend=x+xlen; x+4 <= xend; ){	// zip64 extended information
+				std::size_t id = tensor_detail::get_le(&cd[x], 2), len = tensor_detail::get_le(&cd[x+2], 2), f = x+4;
+				if (id == 1){
+					if (e.size == max32 && f+8 <= xend){ e.size = tensor_detail::get_le(&cd[f], 8); f += 8; }
+					if (csize == max32 && f+8 <= xend){ csize = tensor_detail::get_le(&cd[f], 8); f += 8; }
+					if (e.offset == max32 && f+8 <= xend){ e.offset = tensor_detail::get_le(&cd[f], 8); f += 8; }
+				}
+				x += 4 + len;
+			}
+			if (e.name.size() > 4 && e.name.compare(e.name.size()-4, 4, ".npy") == 0) e.name.resize(e.name.size()-4);
+			entries.push_back(e);
+			q += 46 + nlen + xlen + clen;
+		}
+	}
+
+	/// Names of the arrays in the archive, in the order in which they are stored.
+	std::vector<std::string> names() const {
+		std::vector<std::string> v;
+		for (const entry& e : entries) v.push_back(e.name);
+		return v;
+	}
+
+	bool contains(const std::string& name) const {
+		for (const entry& e : entries) if (e.name == name) return true;
+		return false;
+	}
+
+	/// @brief Read the array 'name' into a tensor of type T (see Tensor::from_npy()). Throws 
+	/// std::runtime_error if there is no such array, if it is compressed, or if it does not hold elements of type T.
+	template <class T>
+	Tensor<T> get(const std::string& name){
+		const entry& e = find(name);
+		if (e.method != 0) throw fail("array '" + name + "' is compressed, which is not supported");
+		unsigned char h[30];
+		read(h, e.offset, 30);
+		if (tensor_detail::get_le(h, 4) != 0x04034b50) throw fail("invalid local header of '" + name + "'");
+		std::uint64_t data = e.offset + 30 + tensor_detail::get_le(h+26, 2) + tensor_detail::get_le(h+28, 2);
+		return tensor_detail::load_npy<T, Tensor<T>>(*in, data, e.size, filename + ":" + name, std::allocator<T>());
+	}
+};
+
+
+
+/**
+ Tensor with a rank fixed at compile time
+
+ Same storage layout as the dynamic-rank Tensor, but the dimensions and offsets are 
+ std::arrays, so element access with N coordinates compiles to an unrolled multiply-add with
+ no allocation and no loop over the rank. Use it for stencil-like code that accesses 
+ elements individually:
+ ```
+ Tensor<double,3> t({nt, nlat, nlon});
+ t(i,j,k) = ...;
+ ```
+ Axis operations (accumulate, transform, ...) are available through view() or dynamic().
+ */
+template <class T, int N, class Alloc>
+class Tensor{
+	static_assert(N >= 0, "rank of a fixed-rank Tensor must be non-negative");
+
+	public:
+	typedef std::array<std::ptrdiff_t, N> index_type;
+
+	index_type dim;
+	index_type offsets;
+	std::vector<T, Alloc> vec;
+
+	/// Create a tensor with specified dimensions.
+	Tensor(const index_type& _dim, const Alloc& alloc = Alloc()) : Tensor(_dim, tensor_uninitialized, alloc){
+		if (tensor_default_init_allocator<Alloc>::value) std::fill(vec.begin(), vec.end(), T());
+	}
+
+	/// Create a tensor whose elements are left uninitialised if the allocator allows it (see tensor_uninitialized_t).
+	Tensor(const index_type& _dim, tensor_uninitialized_t, const Alloc& alloc = Alloc()) : dim(_dim), vec(alloc){
+		std::ptrdiff_t n = tensor_detail::checked_size(to_vector(dim));
+		TENSOR_PROFILE_OP("Tensor(dim)", n);
+		TENSOR_PROFILE_ALLOC(n*sizeof(T));
+		vec.resize(n);
+		std::ptrdiff_t p = 1;
+		for (int i=N-1; i>=0; --i){
+			offsets[i] = p;
+			p *= dim[i];
+		}
+	}
+
+	/// Copy a dynamic-rank tensor of rank N.
+	template <class A>
+	explicit Tensor(const Tensor<T, dynamic_rank, A>& t, const Alloc& alloc = Alloc()) : Tensor(to_index(t.dim), tensor_uninitialized, alloc){
+		std::copy(t.vec.begin(), t.vec.end(), vec.begin());
+	}
+
+	/// Create a tensor by evaluating an expression.
+	template <class E>
+	Tensor(const TensorExpr<E>& e, const Alloc& alloc = Alloc()) : Tensor(to_index(e.self().shape()), tensor_uninitialized, alloc){
+		tensor_detail::assign_expr(view(), e, tensor_detail::assign_value());
+	}
+
+	template <class E>
+	Tensor& operator = (const TensorExpr<E>& e){
+		if (to_vector(dim) != e.self().shape()) return *this = Tensor(e, vec.get_allocator());
+		tensor_detail::assign_expr(view(), e, tensor_detail::assign_value());
+		return *this;
+	}
+
+	std::ptrdiff_t size() const {
+		return vec.size();
+	}
+
+	/// Convert coordinates to the 1D index of the element in vec.
+	template<class... ARGS>
+	std::ptrdiff_t location(ARGS... ids) const {
+		static_assert(sizeof...(ARGS) == N, "number of coordinates must match the rank");
+		return location_impl(std::make_index_sequence<N>(), ids...);
+	}
+
+	std::ptrdiff_t location(const index_type& ix) const {
+		std::ptrdiff_t loc = 0;
+		for (int i=0; i<N; ++i) loc += offsets[i]*ix[i];
+		return loc;
+	}
+
+	/// Convert a 1D index to coordinates (inverse of location()).
+	index_type index(std::ptrdiff_t loc) const {
+		index_type id;
+		for (int i=N-1; i>=0; --i){
+			id[i] = loc % dim[i];
+			loc /= dim[i];
+		}
+		return id;
+	}
+
+	/// Coordinates and locations of all elements, in storage order (see TensorIndexRange).
+	TensorIndexRange indices() const {
+		return TensorIndexRange(to_vector(dim), to_vector(offsets));
+	}
+
+	template<class... ARGS>
+	T& operator() (ARGS... ids){
+		return vec[location(ids...)];
+	}
+
+	template<class... ARGS>
+	const T& operator() (ARGS... ids) const {
+		return vec[location(ids...)];
+	}
+
+	T& operator() (const index_type& ix){
+		return vec[location(ix)];
+	}
+
+	const T& operator() (const index_type& ix) const {
+		return vec[location(ix)];
+	}
+
+	/// Same as operator(), but throws std::out_of_range if a coordinate is out of range.
+	template<class... ARGS>
+	T& at(ARGS... ids){
+		static_assert(sizeof...(ARGS) == N, "number of coordinates must match the rank");
+		return vec[checked_location({std::ptrdiff_t(ids)...})];
+	}
+
+	template<class... ARGS>
+	const T& at(ARGS... ids) const {
+		static_assert(sizeof...(ARGS) == N, "number of coordinates must match the rank");
+		return vec[checked_location({std::ptrdiff_t(ids)...})];
+	}
+
+	/// Unchecked access by 1D index.
+	T& operator[] (std::ptrdiff_t loc){
+		return vec[loc];
+	}
+
+	const T& operator[] (std::ptrdiff_t loc) const {
+		return vec[loc];
+	}
+
+	T* data(){
+		return vec.data();
+	}
+
+	const T* data() const {
+		return vec.data();
+	}
+
+	/// A utility function for testing purposes. Fills the tensor with incremental integers.
+	void fill_sequence(){
+		for (size_t i=0; i<vec.size(); ++i) vec[i] = i;
+	}
+
+	void print(bool vals = true, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		view().print(vals, opt);
+	}
+
+	/// Same as the dynamic-rank Tensor::write().
+	void write(std::ostream& out, const TensorWriteOptions& opt = TensorWriteOptions()) const {
+		view().write(out, opt);
+	}
+
+	/// Get a (dynamic-rank) view of the tensor, which provides the axis operations.
+	TensorView<T> view(){
+		return TensorView<T>(vec.data(), to_vector(dim), to_vector(offsets));
+	}
+
+	TensorView<const T> view() const {
+		return TensorView<const T>(vec.data(), to_vector(dim), to_vector(offsets));
+	}
+
+	/// Copy into a dynamic-rank tensor.
+	Tensor<T, dynamic_rank, Alloc> dynamic() const {
+		Tensor<T, dynamic_rank, Alloc> t(to_vector(dim), tensor_uninitialized, vec.get_allocator());
+		std::copy(vec.begin(), vec.end(), t.vec.begin());
+		return t;
+	}
+
+	template <class S, class A>
+	Tensor& operator += (const Tensor<S,N,A>& rhs){ view() += rhs.view(); return *this; }
+
+	template <class S, class A>
+	Tensor& operator -= (const Tensor<S,N,A>& rhs){ view() -= rhs.view(); return *this; }
+
+	template <class S, class A>
+	Tensor& operator *= (const Tensor<S,N,A>& rhs){ view() *= rhs.view(); return *this; }
+
+	template <class S, class A>
+	Tensor& operator /= (const Tensor<S,N,A>& rhs){ view() /= rhs.view(); return *this; }
+
+	template <class E>
+	Tensor& operator += (const TensorExpr<E>& e){ view() += e; return *this; }
+
+	template <class E>
+	Tensor& operator -= (const TensorExpr<E>& e){ view() -= e; return *this; }
+
+	template <class E>
+	Tensor& operator *= (const TensorExpr<E>& e){ view() *= e; return *this; }
+
+	template <class E>
+	Tensor& operator /= (const TensorExpr<E>& e){ view() /= e; return *this; }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator += (S s){ view() += s; return *this; }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator -= (S s){ view() -= s; return *this; }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator *= (S s){ view() *= s; return *this; }
+
+	template <class S, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	Tensor& operator /= (S s){ view() /= s; return *this; }
+
+	private:
+	template <size_t... K, class... ARGS>
+	std::ptrdiff_t location_impl(std::index_sequence<K...>, ARGS... ids) const {
+		std::ptrdiff_t loc = 0;
+		using expand = int[];
+		(void)expand{0, (loc += offsets[K]*std::ptrdiff_t(ids), 0)...};
+		return loc;
+	}
+
+	std::ptrdiff_t checked_location(const index_type& ix) const {
+		for (int i=0; i<N; ++i){
+			if (ix[i] < 0 || ix[i] >= dim[i]) throw std::out_of_range("Tensor: coordinate " + std::to_string(ix[i]) + " out of range [0, " + std::to_string(dim[i]) + ") in dimension " + std::to_string(i));
+		}
+		return location(ix);
+	}
+
+	template <class I>
+	static index_type to_index(const std::vector<I>& v){
+		assert(v.size() == N);
+		index_type a;
+		std::copy(v.begin(), v.end(), a.begin());
+		return a;
+	}
+
+	static std::vector<std::ptrdiff_t> to_vector(const index_type& a){
+		return std::vector<std::ptrdiff_t>(a.begin(), a.end());
+	}
+};
+
+/**
+ Expression templates
+
+ The free arithmetic operators do not compute anything. They return lightweight expression
+ nodes that record the operands (by reference for lvalue tensors and views, by value for
+ temporaries and scalars). The whole expression is evaluated in one fused loop when it is 
+ assigned to a Tensor, used in a compound assignment, or reduced with accumulate(). Thus
+ ```
+ Tensor<double> r = a*b + c*2.0 - d;
+ ```
+ allocates only r and streams each operand through memory once.
+
+ Operands are broadcast following NumPy rules: shapes are aligned from the right, and missing 
+ or 1-sized dimensions are repeated, so a [lat, lon] field combines with a [time, lat, lon] 
+ tensor without copies. The compound operators broadcast their right operand in the same way.
+ 
+ Since nodes may hold references, an expression must not outlive its tensor operands. 
+ Use eval() to get a Tensor from an expression explicitly.
+ */
+template <class E>
+class TensorExpr{
+	public:
+	const E& self() const {
+		return static_cast<const E&>(*this);
+	}
+
+	/// Evaluate the expression into a new tensor.
+	auto eval() const & {
+		return Tensor<typename E::value_type>(self());
+	}
+
+	/// Evaluate a temporary expression, reusing the buffer of a temporary operand where possible.
+	auto eval() && {
+		return Tensor<typename E::value_type>(static_cast<E&&>(*this));
+	}
+
+	/// @brief Same as Tensor::accumulate(), but evaluates the expression on the fly while 
+	/// reducing along 'axis', so no intermediate tensor is created. The expression is evaluated 
+	/// a row tile at a time and reduced with the same kernels, in parallel (see tensor_detail::reduce_expr()).
+	template <class BinOp>
+	auto accumulate(double v0, int axis, BinOp binary_op, const std::vector<double>& weights={}) const {
+		typedef typename E::value_type value_type;
+		std::vector<std::ptrdiff_t> dim = self().shape();
+		int a = dim.size()-1-axis;
+		assert(weights.size() == 0 || std::ptrdiff_t(weights.size()) == dim[a]);
+
+		std::vector<std::ptrdiff_t> dim_new = dim;
+		dim_new.erase(dim_new.begin()+a);
+		Tensor<value_type> tens(dim_new, tensor_uninitialized);
+		TENSOR_PROFILE_OP("accumulate(expr)", tensor_detail::checked_size(dim));
+		tensor_detail::reduce_expr(self().bind(dim, false), dim, a, weights.empty()? nullptr : weights.data(), tens.vec.data(), v0, binary_op);
+		return tens;
+	}
+};
+
+
+namespace tensor_detail{
+
+/// Evaluator for a tensor operand: a base pointer and the strides aligned to the index space
+/// being evaluated. seek() positions it at the start of a row, operator[] reads along the row.
+template <class T>
+struct LeafEval{
+	const T* base;
+	const T* row;
+	std::vector<std::ptrdiff_t> str;
+	std::ptrdiff_t inner;
+
+	void seek(const std::vector<std::ptrdiff_t>& ix){
+		std::ptrdiff_t o = 0;
+		for (int k=0; k<int(ix.size())-1; ++k) o += ix[k]*str[k];
+		row = base + o;
+		inner = str.back();
+	}
+
+	T operator[](std::ptrdiff_t j) const {
+		return row[j*inner];
+	}
+
+	/// Write elements [j0, j1) of the row to the contiguous out[0..j1-j0).
+	template <class V>
+	void fill_row(V* out, std::ptrdiff_t j0, std::ptrdiff_t j1) const {
+		if (inner == 1) std::copy(row+j0, row+j1, out);
+		else if (inner == 0) std::fill(out, out+(j1-j0), row[0]);
+		else for (std::ptrdiff_t j=j0; j<j1; ++j) *out++ = row[j*inner];
+	}
+
+	void permute(const std::vector<int>& order){
+		std::vector<std::ptrdiff_t> s(order.size());
+		for (size_t i=0; i<order.size(); ++i) s[i] = str[order[i]];
+		str = s;
+	}
+};
+
+template <class S>
+struct ScalarEval{
+	S s;
+	void seek(const std::vector<std::ptrdiff_t>&){}
+	S operator[](std::ptrdiff_t) const { return s; }
+	template <class V>
+	void fill_row(V* out, std::ptrdiff_t j0, std::ptrdiff_t j1) const { std::fill(out, out+(j1-j0), s); }
+	void permute(const std::vector<int>&){}
+};
+
+/// @brief out[j-j0] = binary_op(out[j-j0], r[j]) for j in [j0, j1). Leaf and scalar operands 
+/// are combined with transform_row(), so that inner broadcasts and contiguous rows use the vector kernels.
+template <class Op, class V, class E>
+void apply_row(Op binary_op, V* out, const E& r, std::ptrdiff_t j0, std::ptrdiff_t j1){
+	for (std::ptrdiff_t j=j0; j<j1; ++j, ++out) *out = binary_op(*out, r[j]);
+}
+
+template <class Op, class V, class T>
+void apply_row(Op binary_op, V* out, const LeafEval<T>& r, std::ptrdiff_t j0, std::ptrdiff_t j1){
+	transform_row(binary_op, out, 1, r.row + j0*r.inner, r.inner, j1-j0);
+}
+
+template <class Op, class V, class S>
+void apply_row(Op binary_op, V* out, const ScalarEval<S>& r, std::ptrdiff_t j0, std::ptrdiff_t j1){
+	transform_row(binary_op, out, 1, &r.s, 0, j1-j0);
+}
+
+template <class L, class R, class Op, class V>
+struct BinaryEval{
+	L l;
+	R r;
+	Op op;
+
+	void seek(const std::vector<std::ptrdiff_t>& ix){
+		l.seek(ix);
+		r.seek(ix);
+	}
+
+	V operator[](std::ptrdiff_t j) const {
+		return op(l[j], r[j]);
+	}
+
+	/// @brief Write elements [j0, j1) of the row to out, a row at a time: first the left operand, 
+	/// then combined with the right one. This gives the same values as operator[] if out and the 
+	/// left operand have type V (it is otherwise a scalar), else it falls back to operator[].
+	template <class W>
+	void fill_row(W* out, std::ptrdiff_t j0, std::ptrdiff_t j1) const {
+		if (!std::is_same<W, V>::value || !std::is_same<decltype(l[0]), V>::value){
+			for (std::ptrdiff_t j=j0; j<j1; ++j) *out++ = (*this)[j];
+			return;
+		}
+		l.fill_row(out, j0, j1);
+		apply_row(op, out, r, j0, j1);
+	}
+
+	void permute(const std::vector<int>& order){
+		l.permute(order);
+		r.permute(order);
+	}
+};
+
+/// Bind a view to the index space 'dim'. If flat is true, the index space is the 1D 
+/// traversal of contiguous data, otherwise it is the view's own dimensions.
+template <class T>
+LeafEval<T> bind_view(const TensorView<const T>& v, const std::vector<std::ptrdiff_t>& dim, bool flat){
+	LeafEval<T> ev;
+	ev.base = ev.row = v.data;
+	ev.inner = 0;
+	ev.str.assign(dim.size(), 0);
+	if (flat){
+		ev.str.back() = 1;
+		return ev;
+	}
+	int lead = dim.size()-v.dim.size();
+	for (size_t i=0; i<v.dim.size(); ++i){
+		assert(v.dim[i] == dim[lead+i] || v.dim[i] == 1);
+		if (v.dim[i] == dim[lead+i]) ev.str[lead+i] = v.offsets[i];	// else broadcast with stride 0
+	}
+	return ev;
+}
+
+/// Range of element offsets (relative to data) addressed by a view, as [lo, hi].
+template <class T>
+void view_extent(const TensorView<T>& v, std::ptrdiff_t& lo, std::ptrdiff_t& hi){
+	lo = hi = 0;
+	for (size_t i=0; i<v.dim.size(); ++i){
+		std::ptrdiff_t span = (v.dim[i]-1)*v.offsets[i];
+		if (span < 0) lo += span; 
+		else hi += span;
+	}
+}
+
+/// @brief Evaluate expression e into dst, calling f(dst_element, value) for each element. 
+/// The shape of e must broadcast to that of dst. If the expression reads the memory of dst 
+/// through a differently laid-out view, it is first evaluated into a temporary, so that results 
+/// do not depend on the traversal order. Plain assignments (assign_value) to contiguous rows 
+/// not read by the expression are evaluated a row at a time with fill_row().
+template <class T, class E, class F> 
+void assign_expr(const TensorView<T>& dst, const TensorExpr<E>& ex, F f){
+	typedef typename E::value_type value_type;
+	const E& e = ex.self();
+	assert(broadcast_shape(dst.dim, e.shape()) == dst.dim);
+
+	std::ptrdiff_t dlo, dhi;
+	view_extent(dst, dlo, dhi);
+	const void* dbegin = dst.data + dlo;
+	const void* dend = dst.data + dhi + 1;
+	bool aliased = false, in_place = false;
+	bool flat = dst.is_contiguous();
+	e.for_each_leaf([&](const auto& v){
+		std::ptrdiff_t lo, hi;
+		view_extent(v, lo, hi);
+		const void* begin = v.data + lo;
+		const void* end = v.data + hi + 1;
+		bool same = (static_cast<const void*>(v.data) == static_cast<const void*>(dst.data) && v.dim == dst.dim && v.offsets == dst.offsets);
+		if (begin < dend && dbegin < end && !same) aliased = true;
+		in_place = in_place || same;
+		flat = flat && v.dim == dst.dim && v.is_contiguous();
+	});
+
+	if (aliased){
+		Tensor<value_type> tmp(e);
+		strided_zip(dst.dim, dst.data, dst.offsets, tmp.vec.data(), tmp.view().broadcast(dst.dim).offsets, f);
+		return;
+	}
+
+	std::vector<std::ptrdiff_t> edim, dstr;
+	if (flat){
+		edim = {dst.size()};
+		dstr = {1};
+	}
+	else if (dst.dim.empty()){
+		edim = {1};
+		dstr = {0};
+	}
+	else {
+		edim = dst.dim;
+		dstr = dst.offsets;
+	}
+
+	for (std::ptrdiff_t d : edim) if (d == 0) return;
+	std::ptrdiff_t n = edim.back(), dinner = dstr.back();
+	std::ptrdiff_t nrows = 1;
+	for (int k=0; k<int(edim.size())-1; ++k) nrows *= edim[k];
+
+	// fill_row() writes parts of the result before reading all operands, so an operand must not be dst itself
+	const bool by_row = std::is_same<F, assign_value>::value && dinner == 1 && !in_place;
+	auto bound = e.bind(edim, flat);
+	auto eval_block = [&](std::ptrdiff_t r0, std::ptrdiff_t r1, std::ptrdiff_t j0, std::ptrdiff_t j1){
+		auto ev = bound;	// each thread positions its own copy
+		for_each_row(edim, r0, r1, [&](const std::vector<std::ptrdiff_t>& ix){
+			ev.seek(ix);
+			std::ptrdiff_t o = 0;
+			for (int k=0; k<int(ix.size())-1; ++k) o += ix[k]*dstr[k];
+			T* drow = dst.data + o;
+			if (by_row) ev.fill_row(drow + j0, j0, j1);
+			else for (std::ptrdiff_t j=j0; j<j1; ++j) f(drow[j*dinner], ev[j]);
+		});
+	};
+
+	// split over rows, or over the single (flat) row, unless dst repeats elements (0-stride axes, e.g. 
+	// repeat views), which different threads would then update at once
+	bool repeated = false;
+	for (size_t k=0; k<edim.size(); ++k) repeated = repeated || (dstr[k] == 0 && edim[k] > 1);
+	if (repeated) eval_block(0, nrows, 0, n);
+	else if (nrows == 1) parallel_for(n, 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){ eval_block(0, 1, b, e); });
+	else parallel_for(nrows, n, [&](std::ptrdiff_t b, std::ptrdiff_t e){ eval_block(b, e, 0, n); });
+}
+
+/// @brief Reduce an expression, bound to the index space dim as 'bound', along dim[a] into the 
+/// contiguous out (dim without axis a), starting from v0, with element k along the axis weighted 
+/// by w[k] if w is not null. Rows of the expression are evaluated with fill_row() a tile at a 
+/// time into a buffer on the stack, which is reduced with the kernels of reduce_axes(): along the 
+/// innermost axis, each output element reduces the tiles of its row (pairwise for built-in 
+/// reductions, with the tiles spread over the threads for a full reduction); along an outer axis, 
+/// the rows for k = 0, 1, ... are accumulated into a tile of accumulators, so the expression is 
+/// read row by row instead of with the stride of the axis. Outputs or tiles run in parallel.
+template <class Ev, class U, class BinOp>
+void reduce_expr(const Ev& bound, const std::vector<std::ptrdiff_t>& dim, int a, const double* w, U* out, double v0, BinOp binary_op){
+	const std::ptrdiff_t tile = 1024;
+	const int kind = simd::reduction_kind<BinOp,U>::value;
+	int nd = dim.size();
+	std::ptrdiff_t n = dim[a], nout = 1;
+	for (int i=0; i<nd; ++i) if (i != a) nout *= dim[i];
+	if (nout == 0) return;
+
+	// coordinates of the kept axes up to 'last' (excluding a) for position k in their row-major order
+	auto set_index = [&](std::vector<std::ptrdiff_t>& ix, std::ptrdiff_t k, int last){
+		for (int i=last; i>=0; --i){
+			if (i == a) continue;
+			ix[i] = k % dim[i];
+			k /= dim[i];
+		}
+	};
+
+	if (a == nd-1){
+		std::ptrdiff_t ntiles = (n+tile-1)/tile;
+		// partial results of the tiles of the row at coordinates ix, combined in order
+		auto reduce_tile = [&](Ev& ev, U* buf, std::ptrdiff_t t, double v){
+			std::ptrdiff_t j0 = t*tile, len = std::min(tile, n-j0);
+			ev.fill_row(buf, j0, j0+len);
+			return w? reduce_line<true>(binary_op, v, buf, w+j0, 1, len) : reduce_line<false>(binary_op, v, buf, w, 1, len);
+		};
+		if (nout == 1 && ntiles > 1 && kind != 0 && (!w || kind == 1)){
+			// a full reduction: pairwise partial results of the tiles, in parallel
+			std::vector<double> part(ntiles);
+			parallel_for(ntiles, tile, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+				Ev ev = bound;
+				std::vector<std::ptrdiff_t> ix(nd, 0);
+				ev.seek(ix);
+				U buf[tile];
+				for (std::ptrdiff_t t=b; t<e; ++t){
+					std::ptrdiff_t j0 = t*tile, len = std::min(tile, n-j0);
+					ev.fill_row(buf, j0, j0+len);
+					part[t] = reduce_pairwise(binary_op, buf, w? w+j0 : w, len);
+				}
+			});
+			double v = v0;
+			for (double p : part) v = reduce_combine<BinOp,U>(binary_op, v, p);
+			out[0] = U(v);
+			return;
+		}
+		parallel_for(nout, n, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			Ev ev = bound;	// each thread positions its own copy
+			std::vector<std::ptrdiff_t> ix(nd, 0);
+			U buf[tile];
+			for (std::ptrdiff_t k=b; k<e; ++k){
+				set_index(ix, k, nd-2);
+				ev.seek(ix);
+				double v = v0;
+				for (std::ptrdiff_t t=0; t<ntiles; ++t) v = reduce_tile(ev, buf, t, v);
+				out[k] = U(v);
+			}
+		});
+		return;
+	}
+
+	// the innermost axis is kept: accumulate the rows along axis a, one tile of the output row at a time
+	std::ptrdiff_t inner = dim[nd-1], ntiles = (inner+tile-1)/tile, nrows = nout/inner;
+	parallel_for(nrows*ntiles, n*std::min(inner, tile), [&](std::ptrdiff_t b, std::ptrdiff_t e){
+		Ev ev = bound;
+		std::vector<std::ptrdiff_t> ix(nd, 0);
+		U buf[tile];
+		double acc[tile];
+		for (std::ptrdiff_t t=b; t<e; ++t){
+			std::ptrdiff_t r = t/ntiles, j0 = (t%ntiles)*tile, len = std::min(tile, inner-j0);
+			set_index(ix, r, nd-2);
+			std::fill(acc, acc+len, v0);
+			for (std::ptrdiff_t k=0; k<n; ++k){
+				ix[a] = k;
+				ev.seek(ix);
+				ev.fill_row(buf, j0, j0+len);
+				double wk = w? w[k] : 1;
+				if (simd::reduce_row<BinOp>(acc, buf, wk, w != nullptr, len)) continue;
+				for (std::ptrdiff_t j=0; j<len; ++j) acc[j] = reduce_combine<BinOp,U>(binary_op, acc[j], w? wk*buf[j] : double(buf[j]));
+			}
+			U* o = out + r*inner + j0;
+			for (std::ptrdiff_t j=0; j<len; ++j) o[j] = U(acc[j]);
+		}
+	});
+}
+
+} // namespace tensor_detail
+
+
+/// Expression leaf referring to an existing tensor or view.
+template <class T>
+class TensorRef : public TensorExpr<TensorRef<T>>{
+	public:
+	typedef T value_type;
+	static const bool is_scalar = false;
+	TensorView<const T> v;
+
+	TensorRef(const TensorView<const T>& _v) : v(_v){}
+
+	const std::vector<std::ptrdiff_t>& shape() const { return v.dim; }
+
+	tensor_detail::LeafEval<T> bind(const std::vector<std::ptrdiff_t>& dim, bool flat) const {
+		return tensor_detail::bind_view(v, dim, flat);
+	}
+
+	template <class F>
+	void for_each_leaf(F f) const { f(v); }
+
+	template <class V, class B>
+	Tensor<V, dynamic_rank, B>* reusable(const std::vector<std::ptrdiff_t>&){ return nullptr; }
+};
+
+namespace tensor_detail{
+
+template <class V, class B, class U, class C>
+typename std::enable_if<!std::is_same<V,U>::value || !std::is_same<B,C>::value, Tensor<V, dynamic_rank, B>*>::type 
+reusable_tensor(Tensor<U, dynamic_rank, C>&, const std::vector<std::ptrdiff_t>&){
+	return nullptr;
+}
+
+template <class V, class B, class U, class C>
+typename std::enable_if<std::is_same<V,U>::value && std::is_same<B,C>::value, Tensor<V, dynamic_rank, B>*>::type 
+reusable_tensor(Tensor<U, dynamic_rank, C>& t, const std::vector<std::ptrdiff_t>& dim){
+	return (t.dim == dim)? &t : nullptr;
+}
+
+} // namespace tensor_detail
+
+/// Expression leaf that owns a temporary tensor, so that expressions built from rvalues stay valid.
+template <class T, class Alloc = std::allocator<T>>
+class TensorTemp : public TensorExpr<TensorTemp<T, Alloc>>{
+	public:
+	typedef T value_type;
+	static const bool is_scalar = false;
+	Tensor<T, dynamic_rank, Alloc> t;
+
+	TensorTemp(Tensor<T, dynamic_rank, Alloc>&& _t) : t(std::move(_t)){}
+
+	const std::vector<std::ptrdiff_t>& shape() const { return t.dim; }
+
+	tensor_detail::LeafEval<T> bind(const std::vector<std::ptrdiff_t>& dim, bool flat) const {
+		return tensor_detail::bind_view(t.view(), dim, flat);
+	}
+
+	template <class F>
+	void for_each_leaf(F f) const { f(t.view()); }
+
+	/// The owned tensor, if it is a Tensor<V, dynamic_rank, B> of dimensions dim, else nullptr.
+	template <class V, class B>
+	Tensor<V, dynamic_rank, B>* reusable(const std::vector<std::ptrdiff_t>& dim){ return tensor_detail::reusable_tensor<V,B>(t, dim); }
+};
+
+/// Expression leaf holding a scalar, which is broadcast to every element.
+template <class S>
+class ScalarRef : public TensorExpr<ScalarRef<S>>{
+	public:
+	typedef S value_type;
+	static const bool is_scalar = true;
+	S s;
+
+	ScalarRef(S _s) : s(_s){}
+
+	const std::vector<std::ptrdiff_t>& shape() const { static const std::vector<std::ptrdiff_t> empty; return empty; }
+
+	tensor_detail::ScalarEval<S> bind(const std::vector<std::ptrdiff_t>&, bool) const {
+		return {s};
+	}
+
+	template <class F>
+	void for_each_leaf(F) const {}
+
+	template <class V, class B>
+	Tensor<V, dynamic_rank, B>* reusable(const std::vector<std::ptrdiff_t>&){ return nullptr; }
+};
+
+/// @brief Expression node applying a binary operator elementwise. The result has the value 
+/// type of the (first) tensor operand, and per-element values are converted to it, like 
+/// the compound operators do.
+template <class L, class R, class Op>
+class BinaryExpr : public TensorExpr<BinaryExpr<L,R,Op>>{
+	public:
+	typedef typename std::conditional<L::is_scalar, typename R::value_type, typename L::value_type>::type value_type;
+	static const bool is_scalar = false;
+	L l;
+	R r;
+	Op op;
+	std::vector<std::ptrdiff_t> dim;
+
+	BinaryExpr(L _l, R _r, Op _op) : l(std::move(_l)), r(std::move(_r)), op(_op), dim(tensor_detail::broadcast_shape(l.shape(), r.shape())){
+	}
+
+	/// Shape of the result: the operand shapes broadcast against each other.
+	const std::vector<std::ptrdiff_t>& shape() const { 
+		return dim; 
+	}
+
+	auto bind(const std::vector<std::ptrdiff_t>& dim, bool flat) const {
+		typedef decltype(l.bind(dim, flat)) LE;
+		typedef decltype(r.bind(dim, flat)) RE;
+		return tensor_detail::BinaryEval<LE, RE, Op, value_type>{l.bind(dim, flat), r.bind(dim, flat), op};
+	}
+
+	template <class F>
+	void for_each_leaf(F f) const {
+		l.for_each_leaf(f);
+		r.for_each_leaf(f);
+	}
+
+	/// A temporary operand that the result can be evaluated into (see TensorTemp::reusable()).
+	template <class V, class B>
+	Tensor<V, dynamic_rank, B>* reusable(const std::vector<std::ptrdiff_t>& dim){
+		Tensor<V, dynamic_rank, B>* t = l.template reusable<V,B>(dim);
+		return t? t : r.template reusable<V,B>(dim);
+	}
+};
+
+
+namespace tensor_detail{
+
+// Convert operands to expression nodes: lvalues are referenced, rvalue tensors are moved into the node
+template <class T, class A>
+TensorTemp<T,A> as_expr(Tensor<T,dynamic_rank,A>&& t){ return TensorTemp<T,A>(std::move(t)); }
+
+template <class T, int N, class A>
+TensorRef<T> as_expr(const Tensor<T,N,A>& t){ return TensorRef<T>(t.view()); }
+
+// fixed-rank temporaries are not supported as operands, because the expression would dangle
+template <class T, int N, class A>
+TensorRef<T> as_expr(Tensor<T,N,A>&& t) = delete;
+
+template <class T>
+TensorRef<typename std::remove_const<T>::type> as_expr(const TensorView<T>& v){ return TensorRef<typename std::remove_const<T>::type>(v); }
+
+template <class E>
+E as_expr(const TensorExpr<E>& e){ return e.self(); }
+
+template <class E>
+E as_expr(TensorExpr<E>&& e){ return static_cast<E&&>(e); }
+
+template <class S, class = typename std::enable_if<!is_tensor_operand<S>::value>::type>
+ScalarRef<S> as_expr(S s){ return ScalarRef<S>(s); }
+
+template <class X>
+using expr_t = decltype(as_expr(std::declval<X>()));
+
+template <class L, class R, class Op>
+BinaryExpr<expr_t<L>, expr_t<R>, Op> make_expr(L&& l, R&& r, Op op){
+	return BinaryExpr<expr_t<L>, expr_t<R>, Op>(as_expr(std::forward<L>(l)), as_expr(std::forward<R>(r)), op);
+}
+
+// enable operators if the left operand is a tensor and the right one a tensor or scalar
+template <class L, class R>
+using enable_tensor_op = typename std::enable_if<is_tensor_operand<L>::value>::type;
+
+// enable operators with a scalar on the left and a tensor on the right
+template <class S, class R>
+using enable_scalar_op = typename std::enable_if<!is_tensor_operand<S>::value && is_tensor_operand<R>::value>::type;
+
+} // namespace tensor_detail
+
+
+template<class L, class R, class = tensor_detail::enable_tensor_op<L,R>>
+auto operator + (L&& lhs, R&& rhs){
+	return tensor_detail::make_expr(std::forward<L>(lhs), std::forward<R>(rhs), std::plus<>());
+}
+
+template<class L, class R, class = tensor_detail::enable_tensor_op<L,R>>
+auto operator - (L&& lhs, R&& rhs){
+	return tensor_detail::make_expr(std::forward<L>(lhs), std::forward<R>(rhs), std::minus<>());
+}
+
+template<class L, class R, class = tensor_detail::enable_tensor_op<L,R>>
+auto operator * (L&& lhs, R&& rhs){
+	return tensor_detail::make_expr(std::forward<L>(lhs), std::forward<R>(rhs), std::multiplies<>());
+}
+
+template<class L, class R, class = tensor_detail::enable_tensor_op<L,R>>
+auto operator / (L&& lhs, R&& rhs){
+	return tensor_detail::make_expr(std::forward<L>(lhs), std::forward<R>(rhs), std::divides<>());
+}
+
+template<class S, class R, class = tensor_detail::enable_scalar_op<S,R>>
+auto operator + (S s, R&& t){
+	return tensor_detail::make_expr(s, std::forward<R>(t), std::plus<>());
+}
+
+template<class S, class R, class = tensor_detail::enable_scalar_op<S,R>>
+auto operator - (S s, R&& t){
+	return tensor_detail::make_expr(s, std::forward<R>(t), std::minus<>());
+}
+
+template<class S, class R, class = tensor_detail::enable_scalar_op<S,R>>
+auto operator * (S s, R&& t){
+	return tensor_detail::make_expr(s, std::forward<R>(t), std::multiplies<>());
+}
+
+template<class S, class R, class = tensor_detail::enable_scalar_op<S,R>>
+auto operator / (S s, R&& t){
+	return tensor_detail::make_expr(s, std::forward<R>(t), std::divides<>());
+}
+
+
+// ---- contraction ----
+
+namespace tensor_detail{
+
+/// @brief An operand of contract() as a matrix of (free index, contracted index), where the free 
+/// index runs over the other dimensions in row-major order. Refers to the view if its free 
+/// dimensions have a single stride, and to a copy otherwise, with the contracted axis innermost 
+/// (or outermost if axis_outer, as the built-in product prefers for the right operand).
+template <class T>
+struct contract_operand{
+	std::vector<T> copy;
+	const T* data;
+	std::ptrdiff_t n = 1, k, fs, ks;	// free and contracted sizes, and their strides
+
+	contract_operand(const TensorView<const T>& v, int axis, bool axis_outer){
+		int p = v.dim.size()-1-axis;
+		assert(p >= 0 && p < int(v.dim.size()));
+		k = v.dim[p];
+		for (size_t i=0; i<v.dim.size(); ++i) if (int(i) != p) n *= v.dim[i];
+		if (merged_stride(v.dim, v.offsets, p, fs)){
+			data = v.data;
+			ks = v.offsets[p];
+			return;
+		}
+		std::vector<int> order;
+		if (axis_outer) order.push_back(p);
+		for (int i=0; i<int(v.dim.size()); ++i) if (i != p) order.push_back(i);
+		if (!axis_outer) order.push_back(p);
+		TensorView<const T> pv = v.permute(order);
+		copy.resize(n*k);
+		strided_copy(copy.data(), pv.dim, pv.data, pv.offsets);
+		data = copy.data();
+		fs = axis_outer? 1 : k;
+		ks = axis_outer? n : 1;
+	}
+};
+
+template <class T, class A>
+Tensor<T,dynamic_rank,A> contract_views(const TensorView<const T>& a, int axis_a, const TensorView<const T>& b, int axis_b, const A& alloc){
+	TENSOR_PROFILE_OP("contract", a.size() + b.size());
+	std::vector<std::ptrdiff_t> dim;
+	int pa = a.dim.size()-1-axis_a, pb = b.dim.size()-1-axis_b;
+	for (int i=0; i<int(a.dim.size()); ++i) if (i != pa) dim.push_back(a.dim[i]);
+	for (int i=0; i<int(b.dim.size()); ++i) if (i != pb) dim.push_back(b.dim[i]);
+	Tensor<T,dynamic_rank,A> out(dim, tensor_uninitialized, alloc);
+	contract_operand<T> x(a, axis_a, false), y(b, axis_b, true);
+	assert(x.k == y.k);
+	gemm(x.n, y.n, x.k, x.data, x.fs, x.ks, y.data, y.ks, y.fs, out.vec.data(), y.n);
+	return out;
+}
+
+} // namespace tensor_detail
+
+
+/// @brief Contract axis_a of a with axis_b of b (axes counted from the right, of equal size): 
+/// the sum over k of a[..., k, ...]*b[..., k, ...]. The result has the other dimensions of a 
+/// followed by the other dimensions of b, in order. E.g., a {time, lev, lat, lon} field 
+/// contracted along lev (axis 2) with an {nz, lev} interpolation matrix along lev (axis 0) 
+/// gives {time, lat, lon, nz}. The product is a single matrix product on the data as it is 
+/// laid out when the remaining dimensions of each operand have a single stride (e.g. for the 
+/// innermost or outermost axis of a tensor); otherwise that operand is first copied with the 
+/// axis moved. See tensor_detail::gemm() for how it is computed (BLAS with TENSOR_BLAS).
+template <class T, class A, class B>
+Tensor<T,dynamic_rank,A> contract(const Tensor<T,dynamic_rank,A>& a, int axis_a, const Tensor<T,dynamic_rank,B>& b, int axis_b){
+	return tensor_detail::contract_views(TensorView<const T>(a.view()), axis_a, TensorView<const T>(b.view()), axis_b, a.vec.get_allocator());
+}
+
+/// Same as contract() for tensors, with the operands given as (e.g. strided or permuted) views.
+template <class S, class U>
+Tensor<typename std::remove_const<S>::type> contract(const TensorView<S>& a, int axis_a, const TensorView<U>& b, int axis_b){
+	typedef typename std::remove_const<S>::type T;
+	static_assert(std::is_same<T, typename std::remove_const<U>::type>::value, "contract: operands must have the same element type");
+	return tensor_detail::contract_views(TensorView<const T>(a.data, a.dim, a.offsets), axis_a, TensorView<const T>(b.data, b.dim, b.offsets), axis_b, std::allocator<T>());
+}
+
+/// Matrix product of two rank-2 tensors, {m, k} x {k, n} -> {m, n}.
+template <class T, class A, class B>
+Tensor<T,dynamic_rank,A> matmul(const Tensor<T,dynamic_rank,A>& a, const Tensor<T,dynamic_rank,B>& b){
+	assert(a.dim.size() == 2 && b.dim.size() == 2);
+	return contract(a, 0, b, 1);
+}
+
+template <class T, class A, class B>
+Tensor<T,2,A> matmul(const Tensor<T,2,A>& a, const Tensor<T,2,B>& b){
+	TENSOR_PROFILE_OP("matmul", a.size() + b.size());
+	assert(a.dim[1] == b.dim[0]);
+	Tensor<T,2,A> out({a.dim[0], b.dim[1]}, tensor_uninitialized, a.vec.get_allocator());
+	tensor_detail::gemm(a.dim[0], b.dim[1], a.dim[1], a.vec.data(), a.dim[1], 1, b.vec.data(), b.dim[1], 1, out.vec.data(), b.dim[1]);
+	return out;
+}
+
+
+// ---- masked tensors ----
+
+namespace tensor_detail{
+
+/// Value that marks missing elements in dense tensors: NaN if T has one, T() otherwise.
+template <class T>
+T missing_value(){
+	return std::numeric_limits<T>::has_quiet_NaN? std::numeric_limits<T>::quiet_NaN() : T();
+}
+
+} // namespace tensor_detail
+
+
+/**
+ MaskedTensor. A tensor with missing elements, which stores only the valid ones
+
+ The mask marks the valid cells of the innermost mask_rank dimensions, e.g. the ocean points of 
+ a {lat, lon} grid, and applies at every index of the outer dimensions, e.g. time. A mask with 
+ all the dimensions marks individual elements (see the constructor from missing values). Only 
+ valid elements are stored: values has the outer dimensions followed by one dimension that runs 
+ over the valid cells in order of location, so a {nt, nlat, nlon} tensor on a grid with nv valid 
+ cells stores nt x nv elements, and operations read and write only those.
+ ```
+ MaskedTensor<float> sst(sst_dense, ocean);     // ocean: {nlat, nlon}, nonzero where valid
+ auto clim     = sst.avg_dim(2);                // {nlat, nlon}: mean over time of each cell
+ auto zonal    = sst.avg_dim(0);                // {nt, nlat}: mean over the valid cells of each row
+ auto series   = sst.mean({0,1});               // {nt}: mean over the ocean
+ Tensor<float> map = clim.unpack();             // dense, with NaN on land
+ ```
+ Reductions over masked dimensions skip the missing elements, and means divide by the number of 
+ valid elements. Arithmetic between masked tensors requires the same mask. The list of valid 
+ cells is shared by copies, by results that keep the same cells, and by tensors packed with 
+ pack(), e.g. all the variables on the same grid.
+ */
+template <class T, class Alloc = std::allocator<T>>
+class MaskedTensor{
+	template <class U, class B> friend class MaskedTensor;
+
+	public:
+	std::vector<std::ptrdiff_t> dim;      ///< dimensions of the full tensor
+	int mask_rank;                        ///< number of innermost dimensions covered by the mask
+	Tensor<T, dynamic_rank, Alloc> values;  ///< valid elements: {outer dimensions..., valid cells}
+
+	/// Keep the elements of t in the cells where mask is nonzero. The dimensions of mask must be 
+	/// the innermost dimensions of t.
+	template <class M, class MA>
+	MaskedTensor(const Tensor<T, dynamic_rank, Alloc>& t, const Tensor<M, dynamic_rank, MA>& mask) 
+	  : MaskedTensor(t.dim, mask.dim.size(), nonzero_cells(mask.vec), t.vec.get_allocator()){
+		TENSOR_PROFILE_OP("MaskedTensor(mask)", t.vec.size());
+		assert(std::equal(mask.dim.begin(), mask.dim.end(), t.dim.end()-mask_rank));
+		gather(t.vec.data());
+	}
+
+	/// Keep the elements of t that are neither NaN nor equal to missing (a mask of all dimensions).
+	MaskedTensor(const Tensor<T, dynamic_rank, Alloc>& t, T missing) 
+	  : MaskedTensor(t.dim, t.dim.size(), present_cells(t.vec, missing), t.vec.get_allocator()){
+		TENSOR_PROFILE_OP("MaskedTensor(missing)", t.vec.size());
+		gather(t.vec.data());
+	}
+
+	/// Locations of the valid cells in the (row-major) innermost mask_rank dimensions, in increasing order.
+	const std::vector<std::ptrdiff_t>& valid_cells() const { return *cells; }
+
+	/// True if o has the same dimensions and valid cells, so that its values line up with these.
+	template <class U, class B>
+	bool same_mask(const MaskedTensor<U,B>& o) const {
+		return dim == o.dim && mask_rank == o.mask_rank && (cells == o.cells || *cells == *o.cells);
+	}
+
+	/// @brief Mask t (of any type, and any outer dimensions) with the mask of this tensor. The 
+	/// result shares the list of valid cells.
+	template <class U, class B>
+	MaskedTensor<U,B> pack(const Tensor<U, dynamic_rank, B>& t) const {
+		TENSOR_PROFILE_OP("MaskedTensor::pack", t.vec.size());
+		assert(t.dim.size() >= size_t(mask_rank) && std::equal(dim.end()-mask_rank, dim.end(), t.dim.end()-mask_rank));
+		MaskedTensor<U,B> m(t.dim, mask_rank, cells, t.vec.get_allocator());
+		m.gather(t.vec.data());
+		return m;
+	}
+
+	/// A dense tensor of dimensions dim, with fill (by default NaN, or T() for types without NaN) where elements are missing.
+	Tensor<T, dynamic_rank, Alloc> unpack(T fill = tensor_detail::missing_value<T>()) const {
+		TENSOR_PROFILE_OP("MaskedTensor::unpack", values.vec.size());
+		Tensor<T, dynamic_rank, Alloc> t(dim, tensor_uninitialized, values.vec.get_allocator());
+		std::fill(t.vec.begin(), t.vec.end(), fill);
+		const std::vector<std::ptrdiff_t>& c = *cells;
+		std::ptrdiff_t nc = c.size(), plane = plane_size();
+		tensor_detail::parallel_for(outer_size(), nc, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t o=b; o<e; ++o){
+				for (std::ptrdiff_t j=0; j<nc; ++j) t.vec[o*plane + c[j]] = values.vec[o*nc + j];
+			}
+		});
+		return t;
+	}
+
+	/// Same as Tensor::transform(axis, binary_op, w), applied to the valid elements.
+	template <class BinOp>
+	void transform(int axis, BinOp binary_op, const std::vector<double>& w){
+		TENSOR_PROFILE_OP("MaskedTensor::transform", values.vec.size());
+		int p = dim.size()-1-axis;
+		assert(std::ptrdiff_t(w.size()) == dim[p]);
+		if (axis >= mask_rank) return values.transform(axis-mask_rank+1, binary_op, w);
+
+		// along a masked dimension, w is gathered to the cells
+		const std::vector<std::ptrdiff_t>& c = *cells;
+		std::ptrdiff_t inner = 1;
+		for (size_t i=p+1; i<dim.size(); ++i) inner *= dim[i];
+		std::vector<double> wc(c.size());
+		for (size_t j=0; j<c.size(); ++j) wc[j] = w[c[j]/inner % dim[p]];
+		values.transform(0, binary_op, wc);
+	}
+
+	/// @brief Reduce over axes (counted from the right), skipping missing elements: each element 
+	/// of the result folds the valid elements that map to it, starting from v0. Cells of the 
+	/// result that no valid element maps to are missing. If no masked dimension is reduced, this 
+	/// is Tensor::accumulate() on values and all cells are kept.
+	template <class BinOp>
+	MaskedTensor accumulate(T v0, const std::vector<int>& axes, BinOp binary_op) const {
+		TENSOR_PROFILE_OP("MaskedTensor::accumulate", values.vec.size());
+		if (!reduces_cells(axes)) return keep_cells(axes, values.accumulate(v0, value_axes(axes), binary_op));
+		return reduce_cells(v0, axes, binary_op, nullptr, false);
+	}
+
+	template <class BinOp>
+	MaskedTensor accumulate(T v0, int axis, BinOp binary_op) const {
+		return accumulate(v0, std::vector<int>{axis}, binary_op);
+	}
+
+	MaskedTensor sum(const std::vector<int>& axes) const {
+		return accumulate(0, axes, std::plus<double>());
+	}
+
+	/// Mean over axes of the valid elements, i.e., the sum divided by the number of valid elements.
+	MaskedTensor mean(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("MaskedTensor::mean", values.vec.size());
+		if (!reduces_cells(axes)) return keep_cells(axes, values.mean(value_axes(axes)));
+		return reduce_cells(0, axes, std::plus<double>(), nullptr, true);
+	}
+
+	/// @brief Mean along axis of the valid elements, with element i along the axis multiplied 
+	/// by weights[i] if given. As in Tensor::avg_dim(), the weighted sum is divided by the count, 
+	/// here the number of valid elements.
+	MaskedTensor avg_dim(int axis, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("MaskedTensor::avg_dim", values.vec.size());
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == dim[dim.size()-1-axis]);
+		if (!reduces_cells({axis})) return keep_cells({axis}, values.avg_dim(axis-mask_rank+1, weights));
+		return reduce_cells(0, {axis}, std::plus<double>(), weights.empty()? nullptr : weights.data(), true);
+	}
+
+	// operators on the valid elements; masked operands must have the same mask (see same_mask())
+	template <class U, class B>
+	MaskedTensor& operator += (const MaskedTensor<U,B>& rhs){ assert(same_mask(rhs)); values += rhs.values; return *this; }
+
+	template <class U, class B>
+	MaskedTensor& operator -= (const MaskedTensor<U,B>& rhs){ assert(same_mask(rhs)); values -= rhs.values; return *this; }
+
+	template <class U, class B>
+	MaskedTensor& operator *= (const MaskedTensor<U,B>& rhs){ assert(same_mask(rhs)); values *= rhs.values; return *this; }
+
+	template <class U, class B>
+	MaskedTensor& operator /= (const MaskedTensor<U,B>& rhs){ assert(same_mask(rhs)); values /= rhs.values; return *this; }
+
+	template <class S, class = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+	MaskedTensor& operator += (S s){ values += s; return *this; }
+
+	template <class S, class = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+	MaskedTensor& operator -= (S s){ values -= s; return *this; }
+
+	template <class S, class = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+	MaskedTensor& operator *= (S s){ values *= s; return *this; }
+
+	template <class S, class = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+	MaskedTensor& operator /= (S s){ values /= s; return *this; }
+
+	private:
+	typedef std::shared_ptr<const std::vector<std::ptrdiff_t>> cell_list;
+	cell_list cells;
+
+	/// values are left uninitialised (see gather())
+	MaskedTensor(std::vector<std::ptrdiff_t> _dim, int _mask_rank, cell_list _cells, const Alloc& alloc) 
+	  : dim(std::move(_dim)), mask_rank(_mask_rank), values(value_dim(dim, _mask_rank, _cells->size()), tensor_uninitialized, alloc), cells(std::move(_cells)){
+	}
+
+	MaskedTensor(std::vector<std::ptrdiff_t> _dim, int _mask_rank, cell_list _cells, Tensor<T, dynamic_rank, Alloc>&& _values) 
+	  : dim(std::move(_dim)), mask_rank(_mask_rank), values(std::move(_values)), cells(std::move(_cells)){
+	}
+
+	static std::vector<std::ptrdiff_t> value_dim(const std::vector<std::ptrdiff_t>& dim, int mask_rank, std::ptrdiff_t ncells){
+		assert(mask_rank >= 0 && size_t(mask_rank) <= dim.size());
+		std::vector<std::ptrdiff_t> vdim(dim.begin(), dim.end()-mask_rank);
+		vdim.push_back(ncells);
+		return vdim;
+	}
+
+	template <class M, class MA>
+	static cell_list nonzero_cells(const std::vector<M, MA>& mask){
+		auto c = std::make_shared<std::vector<std::ptrdiff_t>>();
+		for (size_t i=0; i<mask.size(); ++i) if (mask[i] != M(0)) c->push_back(i);
+		return c;
+	}
+
+	static cell_list present_cells(const std::vector<T, Alloc>& v, T missing){
+		auto c = std::make_shared<std::vector<std::ptrdiff_t>>();
+		for (size_t i=0; i<v.size(); ++i) if (v[i] == v[i] && !(v[i] == missing)) c->push_back(i);
+		return c;
+	}
+
+	std::ptrdiff_t plane_size() const {
+		return std::accumulate(dim.end()-mask_rank, dim.end(), std::ptrdiff_t(1), std::multiplies<std::ptrdiff_t>());
+	}
+
+	std::ptrdiff_t outer_size() const {
+		return std::accumulate(dim.begin(), dim.end()-mask_rank, std::ptrdiff_t(1), std::multiplies<std::ptrdiff_t>());
+	}
+
+	/// values from the dense array full of dimensions dim
+	template <class U>
+	void gather(const U* full){
+		const std::vector<std::ptrdiff_t>& c = *cells;
+		std::ptrdiff_t nc = c.size(), plane = plane_size();
+		tensor_detail::parallel_for(outer_size(), nc, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t o=b; o<e; ++o){
+				for (std::ptrdiff_t j=0; j<nc; ++j) values.vec[o*nc + j] = full[o*plane + c[j]];
+			}
+		});
+	}
+
+	bool reduces_cells(const std::vector<int>& axes) const {
+		for (int axis : axes) if (axis < mask_rank) return true;
+		return false;
+	}
+
+	/// axes of values for outer axes
+	std::vector<int> value_axes(const std::vector<int>& axes) const {
+		std::vector<int> va;
+		for (int axis : axes) va.push_back(axis-mask_rank+1);
+		return va;
+	}
+
+	/// the result of reducing the outer axes of values
+	MaskedTensor keep_cells(const std::vector<int>& axes, Tensor<T, dynamic_rank, Alloc>&& v) const {
+		std::vector<std::ptrdiff_t> dim_new;
+		for (int p=0; p<int(dim.size()); ++p){
+			if (std::find(axes.begin(), axes.end(), int(dim.size())-1-p) == axes.end()) dim_new.push_back(dim[p]);
+		}
+		return MaskedTensor(dim_new, mask_rank, cells, std::move(v));
+	}
+
+	/// @brief Reduction over axes that include masked dimensions. The valid cells of the result are 
+	/// those that some valid cell maps to. Elements are folded in order of location, in parallel 
+	/// over outer indices if no outer axis is reduced and over the cells of the result otherwise. 
+	/// If w is not null, element i along axes[0] is multiplied by w[i]. If mean, results are 
+	/// divided by the number of valid elements folded into them.
+	template <class BinOp>
+	MaskedTensor reduce_cells(T v0, const std::vector<int>& axes, BinOp binary_op, const double* w, bool mean) const {
+		int rank = dim.size(), nod = rank-mask_rank;
+		std::vector<char> red(rank, 0);
+		for (int axis : axes){
+			assert(axis >= 0 && axis < rank);
+			red[rank-1-axis] = 1;
+		}
+		int wp = w? rank-1-axes[0] : -1;
+		std::vector<std::ptrdiff_t> dim_new;
+		for (int p=0; p<rank; ++p) if (!red[p]) dim_new.push_back(dim[p]);
+		int mask_rank_new = 0;
+		for (int p=nod; p<rank; ++p) mask_rank_new += !red[p];
+
+		// position of each valid cell in the kept masked dimensions, and its weight
+		const std::vector<std::ptrdiff_t>& c = *cells;
+		std::ptrdiff_t nc = c.size(), plane_new = 1;
+		std::vector<std::ptrdiff_t> q(nc);
+		std::vector<double> wc(nc, 1.0);
+		for (std::ptrdiff_t j=0; j<nc; ++j){
+			std::ptrdiff_t loc = c[j], ql = 0, stride = 1;
+			for (int p=rank-1; p>=nod; --p){
+				std::ptrdiff_t x = loc % dim[p];
+				loc /= dim[p];
+				if (!red[p]){
+					ql += x*stride;
+					stride *= dim[p];
+				}
+				if (p == wp) wc[j] = w[x];
+			}
+			q[j] = ql;
+		}
+		for (int p=nod; p<rank; ++p) if (!red[p]) plane_new *= dim[p];
+
+		// valid cells of the result, and the cells that map to each (jc: cell -> result cell; 
+		// group g holds cells gcell[gstart[g]], ..., gcell[gstart[g+1]-1], in order)
+		std::vector<std::ptrdiff_t> slot(plane_new, -1);
+		for (std::ptrdiff_t j=0; j<nc; ++j) slot[q[j]] = 0;
+		auto cells_new = std::make_shared<std::vector<std::ptrdiff_t>>();
+		for (std::ptrdiff_t l=0; l<plane_new; ++l){
+			if (slot[l] < 0) continue;
+			slot[l] = cells_new->size();
+			cells_new->push_back(l);
+		}
+		std::ptrdiff_t ncn = cells_new->size();
+		std::vector<std::ptrdiff_t> jc(nc), gstart(ncn+1, 0), gcell(nc);
+		for (std::ptrdiff_t j=0; j<nc; ++j){
+			jc[j] = slot[q[j]];
+			++gstart[jc[j]+1];
+		}
+		for (std::ptrdiff_t g=0; g<ncn; ++g) gstart[g+1] += gstart[g];
+		std::vector<std::ptrdiff_t> fillpos(gstart.begin(), gstart.end()-1);
+		for (std::ptrdiff_t j=0; j<nc; ++j) gcell[fillpos[jc[j]]++] = j;
+
+		// index of each outer index among the kept outer dimensions, and its weight
+		std::ptrdiff_t no = outer_size(), nfold = 1;
+		std::vector<std::ptrdiff_t> ko(no);
+		std::vector<double> wo(no, 1.0);
+		for (std::ptrdiff_t o=0; o<no; ++o){
+			std::ptrdiff_t rest = o, k = 0, stride = 1;
+			for (int p=nod-1; p>=0; --p){
+				std::ptrdiff_t x = rest % dim[p];
+				rest /= dim[p];
+				if (!red[p]){
+					k += x*stride;
+					stride *= dim[p];
+				}
+				if (p == wp) wo[o] = w[x];
+			}
+			ko[o] = k;
+		}
+		for (int p=0; p<nod; ++p) if (red[p]) nfold *= dim[p];
+
+		MaskedTensor out(dim_new, mask_rank_new, cells_new, values.vec.get_allocator());
+		std::vector<double> acc(out.values.vec.size(), double(v0));
+		const T* v = values.vec.data();
+		if (nfold == 1){
+			// each outer index has its own results
+			tensor_detail::parallel_for(no, nc, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+				for (std::ptrdiff_t o=b; o<e; ++o){
+					double* a = acc.data() + ko[o]*ncn;
+					const T* x = v + o*nc;
+					for (std::ptrdiff_t j=0; j<nc; ++j) a[jc[j]] = binary_op(a[jc[j]], wo[o]*wc[j]*x[j]);
+				}
+			});
+		}
+		else {
+			tensor_detail::parallel_for(ncn, no*nc/std::max<std::ptrdiff_t>(ncn, 1), [&](std::ptrdiff_t b, std::ptrdiff_t e){
+				for (std::ptrdiff_t g=b; g<e; ++g){
+					for (std::ptrdiff_t o=0; o<no; ++o){
+						double& a = acc[ko[o]*ncn + g];
+						for (std::ptrdiff_t i=gstart[g]; i<gstart[g+1]; ++i){
+							std::ptrdiff_t j = gcell[i];
+							a = binary_op(a, wo[o]*wc[j]*v[o*nc + j]);
+						}
+					}
+				}
+			});
+		}
+		for (size_t i=0; i<acc.size(); ++i){
+			std::ptrdiff_t g = i % ncn;
+			out.values.vec[i] = T(mean? acc[i]/((gstart[g+1]-gstart[g])*nfold) : acc[i]);
+		}
+		return out;
+	}
+};
+
+
+// ---- packed tensors ----
+
+/**
+ PackedTensor. A tensor stored as 16-bit integers with a scale and an offset
+
+ Element i is offset + scale*data.vec[i], as in the scale_factor/add_offset packing of netCDF 
+ archives. Packing a tensor with values in [lo, hi] maps the range onto [-32767, 32767], so 
+ that the error of each element is at most scale/2 = (hi-lo)/131068, at half the memory of 
+ float and a quarter of that of double.
+ ```
+ PackedTensor<float> p(t);               // t must not contain NaN (see MaskedTensor)
+ Tensor<float> zonal = p.avg_dim(0);     // = t.avg_dim(0), up to the packing error
+ ```
+ Reductions convert the packed integers (exactly) to float in blocks of 256 elements on the 
+ stack, and accumulate in double; the scale and offset are applied once to each result.
+ */
+template <class T = float>
+class PackedTensor{
+	public:
+	Tensor<std::int16_t> data;  ///< packed elements
+	double scale;               ///< element = offset + scale*packed element
+	double offset;
+
+	/// Pack t with the given scale and offset. Values outside the range of the packing are clamped.
+	template <class A>
+	PackedTensor(const Tensor<T, dynamic_rank, A>& t, double _scale, double _offset) 
+	  : data(t.dim, tensor_uninitialized), scale(_scale), offset(_offset){
+		TENSOR_PROFILE_OP("PackedTensor", t.vec.size());
+		assert(scale != 0);
+		double inv = 1/scale;
+		tensor_detail::parallel_for(t.vec.size(), 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t i=b; i<e; ++i){
+				double x = (double(t.vec[i]) - offset)*inv;
+				assert(x == x);
+				x = std::min(std::max(x, -32767.0), 32767.0);
+				data.vec[i] = std::int16_t((x < 0)? x-0.5 : x+0.5);
+			}
+		});
+	}
+
+	/// Pack t with the scale and offset that fit its range.
+	template <class A>
+	explicit PackedTensor(const Tensor<T, dynamic_rank, A>& t) : PackedTensor(t, fit(t.vec)) {}
+
+	const std::vector<std::ptrdiff_t>& dim() const { return data.dim; }
+
+	Tensor<T> unpack() const {
+		TENSOR_PROFILE_OP("PackedTensor::unpack", data.vec.size());
+		Tensor<T> t(data.dim, tensor_uninitialized);
+		tensor_detail::parallel_for(data.vec.size(), 1, [&](std::ptrdiff_t b, std::ptrdiff_t e){
+			for (std::ptrdiff_t i=b; i<e; ++i) t.vec[i] = T(offset + scale*data.vec[i]);
+		});
+		return t;
+	}
+
+	/// Same as Tensor::sum(axes), mean(axes), max(axes) and min(axes) of the unpacked tensor.
+	Tensor<T> sum(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("PackedTensor::sum", data.vec.size());
+		double n;
+		Tensor<double> r = reduce(axes, std::plus<double>(), 0, nullptr, nullptr, n);
+		return unscale(r, n*offset, scale);
+	}
+
+	Tensor<T> mean(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("PackedTensor::mean", data.vec.size());
+		double n;
+		Tensor<double> r = reduce(axes, std::plus<double>(), 0, nullptr, nullptr, n);
+		return unscale(r, offset, scale/n);
+	}
+
+	Tensor<T> max(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("PackedTensor::max", data.vec.size());
+		return extremum(axes, scale > 0);
+	}
+
+	Tensor<T> min(const std::vector<int>& axes) const {
+		TENSOR_PROFILE_OP("PackedTensor::min", data.vec.size());
+		return extremum(axes, scale < 0);
+	}
+
+	/// Same as Tensor::avg_dim(axis, weights) of the unpacked tensor.
+	Tensor<T> avg_dim(int axis, const std::vector<double>& weights={}) const {
+		TENSOR_PROFILE_OP("PackedTensor::avg_dim", data.vec.size());
+		int a = data.dim.size()-1-axis;
+		assert(weights.empty() || std::ptrdiff_t(weights.size()) == data.dim[a]);
+		std::ptrdiff_t wstr[tensor_detail::max_reduce_rank] = {};
+		wstr[a] = 1;
+		double n, wsum = weights.empty()? data.dim[a] : std::accumulate(weights.begin(), weights.end(), 0.0);
+		Tensor<double> r = reduce({axis}, std::plus<double>(), 0, weights.empty()? nullptr : weights.data(), wstr, n);
+		return unscale(r, wsum/n*offset, scale/n);
+	}
+
+	private:
+	template <class V>
+	PackedTensor(const Tensor<T, dynamic_rank, V>& t, std::pair<double,double> so) : PackedTensor(t, so.first, so.second) {}
+
+	// scale and offset mapping the range of v onto [-32767, 32767]
+	template <class V>
+	static std::pair<double,double> fit(const V& v){
+		if (v.empty()) return {1, 0};
+		auto r = std::minmax_element(v.begin(), v.end());
+		double lo = *r.first, hi = *r.second;
+		return {(hi > lo)? (hi-lo)/65534 : 1, (hi > lo)? lo/2 + hi/2 : lo};
+	}
+
+	// reduction of the packed elements over axes in double (n is set to the number of elements combined per result)
+	template <class BinOp>
+	Tensor<double> reduce(const std::vector<int>& axes, BinOp binary_op, double v0, const double* w, const std::ptrdiff_t* wstr, double& n) const {
+		std::uint64_t mask = 0;
+		n = 1;
+		for (int axis : axes){
+			assert(axis >= 0 && axis < int(data.dim.size()));
+			mask |= std::uint64_t(1) << (data.dim.size()-1-axis);
+			n *= data.dim[data.dim.size()-1-axis];
+		}
+		std::vector<std::ptrdiff_t> dim_new;
+		for (size_t i=0; i<data.dim.size(); ++i) if (!((mask >> i) & 1)) dim_new.push_back(data.dim[i]);
+		Tensor<double> r(dim_new, tensor_uninitialized);
+		TensorView<const std::int16_t> v = data.view();
+		TensorView<double> out = r.view();
+		tensor_detail::reduce_axes(v.data, v.dim, v.offsets, mask, w, wstr, out.data, out.dim, out.offsets, v0, binary_op, 1);
+		return r;
+	}
+
+	Tensor<T> extremum(const std::vector<int>& axes, bool max_packed) const {
+		double n;
+		Tensor<double> r = max_packed? reduce(axes, tensor_detail::max_op<std::int16_t>(), -32768, nullptr, nullptr, n)
+		                             : reduce(axes, tensor_detail::min_op<std::int16_t>(), 32767, nullptr, nullptr, n);
+		return unscale(r, offset, scale);
+	}
+
+	// a + b*r
+	static Tensor<T> unscale(const Tensor<double>& r, double a, double b){
+		Tensor<T> t(r.dim, tensor_uninitialized);
+		for (size_t i=0; i<r.vec.size(); ++i) t.vec[i] = T(a + b*r.vec[i]);
+		return t;
+	}
+};
+
+// ---- deferred execution ----
+
+namespace tensor_detail{
+
+/// Elements per block of a fused elementwise chain: each block goes through all the operations 
+/// of the chain while it is in cache.
+const std::ptrdiff_t fuse_block = 4096;
+
+/// Address range [begin, end) of memory read or written by an operation of a TensorGraph.
+struct graph_region{
+	std::uintptr_t begin, end;
+	bool overlaps(const graph_region& o) const { return begin < o.end && o.begin < end; }
+};
+
+template <class T>
+graph_region region_of(const TensorView<T>& v){
+	std::ptrdiff_t lo, hi;
+	view_extent(v, lo, hi);
+	if (v.size() == 0) return {0, 0};
+	return {reinterpret_cast<std::uintptr_t>(v.data + lo), reinterpret_cast<std::uintptr_t>(v.data + hi + 1)};
+}
+
+/// @brief One operation of a TensorGraph. Elementwise operations (n > 0) are a chain of 
+/// functions on element ranges [b, e) of n elements, fused with the elementwise operations 
+/// recorded after them when possible, and split into parts run concurrently; other operations 
+/// are a single call.
+struct graph_task{
+	std::function<void()> call;
+	std::vector<std::function<void(std::ptrdiff_t, std::ptrdiff_t)>> chain;
+	std::ptrdiff_t n = 0;
+	std::vector<graph_region> reads, writes;
+	std::vector<int> deps;   ///< earlier tasks whose memory accesses conflict with this one's
+
+	// state of an evaluation
+	int nparts = 1;
+	std::vector<int> succs;
+	std::atomic<int> waiting{0}, parts_left{0};
+
+	graph_task() = default;
+	graph_task(graph_task&& o) : call(std::move(o.call)), chain(std::move(o.chain)), n(o.n), reads(std::move(o.reads)), 
+	                             writes(std::move(o.writes)), deps(std::move(o.deps)) {}
+
+	bool conflicts(const graph_task& o) const {
+		for (const auto& w : writes){
+			for (const auto& r : o.reads) if (w.overlaps(r)) return true;
+			for (const auto& x : o.writes) if (w.overlaps(x)) return true;
+		}
+		for (const auto& r : reads) for (const auto& w : o.writes) if (r.overlaps(w)) return true;
+		return false;
+	}
+
+	/// Run part p of nparts: a range of the elements through the whole chain, a block at a time.
+	void run(int p){
+		if (n == 0){ call(); return; }
+		TENSOR_PROFILE_OP("TensorGraph(elementwise)", n/nparts);
+		std::ptrdiff_t b = n*p/nparts, e = n*(p+1)/nparts;
+		for (std::ptrdiff_t i=b; i<e; i += fuse_block){
+			std::ptrdiff_t j = std::min(e, i+fuse_block);
+			for (const auto& f : chain) f(i, j);
+		}
+	}
+};
+
+/// @brief Runs the tasks of a graph on the thread pool. Each thread keeps a deque of ready 
+/// (task, part) items: it takes work from the back of its own and steals from the front of the 
+/// others' when it runs out. Finishing the last part of a task releases its successors onto the 
+/// deque of the thread that finished it. Threads that find no work sleep until successors are 
+/// released or all tasks are done.
+class graph_executor{
+	public:
+	graph_executor(std::vector<graph_task>& _tasks, int nthreads) : tasks(_tasks), queues(nthreads), remaining(_tasks.size()){
+		for (size_t t=0, q=0; t<tasks.size(); ++t){
+			if (tasks[t].waiting != 0) continue;
+			for (int p=0; p<tasks[t].nparts; ++p, ++q) queues[q % nthreads].items.push_back({int(t), p});
+		}
+	}
+
+	/// The scheduling loop of thread q, which returns when all tasks are done.
+	void work(int q){
+		int nq = queues.size();
+		while (remaining > 0){
+			std::uint64_t seen = releases;	// read before looking, so no release is missed
+			item it;
+			bool found = queues[q].pop_back(it);
+			for (int k=1; k<nq && !found; ++k) found = queues[(q+k) % nq].pop_front(it);
+			if (found){
+				execute(q, it);
+				continue;
+			}
+			std::unique_lock<std::mutex> lk(idle_mutex);
+			idle_cv.wait(lk, [&](){ return releases != seen || remaining == 0; });
+		}
+	}
+
+	/// The first exception thrown by a task (later tasks still run).
+	std::exception_ptr error;
+
+	private:
+	struct item{ int task, part; };
+
+	struct work_queue{
+		std::mutex m;
+		std::deque<item> items;
+
+		void push(const item& it){
+			std::lock_guard<std::mutex> lk(m);
+			items.push_back(it);
+		}
+
+		bool pop_back(item& it){
+			std::lock_guard<std::mutex> lk(m);
+			if (items.empty()) return false;
+			it = items.back();
+			items.pop_back();
+			return true;
+		}
+
+		bool pop_front(item& it){
+			std::lock_guard<std::mutex> lk(m);
+			if (items.empty()) return false;
+			it = items.front();
+			items.pop_front();
+			return true;
+		}
+	};
+
+	std::vector<graph_task>& tasks;
+	std::vector<work_queue> queues;
+	std::atomic<std::ptrdiff_t> remaining;
+	std::mutex error_mutex;
+	std::atomic<std::uint64_t> releases{0};	// counts wake-ups of idle threads
+	std::mutex idle_mutex;
+	std::condition_variable idle_cv;
+
+	void wake(){
+		{
+			std::lock_guard<std::mutex> lk(idle_mutex);
+			++releases;
+		}
+		idle_cv.notify_all();
+	}
+
+	void execute(int q, const item& it){
+		graph_task& t = tasks[it.task];
+		try {
+			t.run(it.part);
+		}
+		catch (...){
+			std::lock_guard<std::mutex> lk(error_mutex);
+			if (!error) error = std::current_exception();
+		}
+		if (--t.parts_left > 0) return;
+		bool released = false;
+		for (int s : t.succs){
+			graph_task& u = tasks[s];
+			if (--u.waiting == 0){
+				for (int p=0; p<u.nparts; ++p) queues[q].push({s, p});
+				released = true;
+			}
+		}
+		if (--remaining == 0 || released) wake();
+	}
+};
+
+} // namespace tensor_detail
+
+/**
+ TensorGraph. Deferred execution of many small tensor operations
+
+ Operations recorded on a graph do not run until eval(). Each one records the memory it reads 
+ and writes, and waits only for the earlier operations whose accesses conflict with its own 
+ (read after write, write after read or write), so that independent operations run concurrently 
+ on the thread pool, with work stealing between the threads. This pays off for the many small 
+ operations of a model timestep, which are too small to be parallelised one at a time:
+ ```
+ TensorGraph g;
+ g.add(u, du);                              // u += du
+ g.mul(u, damping);                         // fused with the line above: one pass over u
+ g.assign(ke, 0.5*(u*u + v*v));             // independent of the lines below
+ g.avg_dim(zonal, t, 0);
+ g.accumulate(total, (t - t0)*(t - t0), 0.0, 2, std::plus<double>());  // no temporary tensor
+ g.eval();                                  // can be called again, e.g. every timestep
+ ```
+ Consecutive elementwise operations on tensors with the same number of elements (add(), sub(), 
+ mul() and div() with a tensor of the same dimensions or a scalar) that depend only on each 
+ other are fused into one chain, which runs a cache-sized block at a time through all of its 
+ operations, and whose blocks are spread over the threads. Expressions are fused into their 
+ assignment or reduction as usual (see TensorExpr). A reduction of a tensor written by a chain 
+ is not fused into the chain: it runs after the whole chain, as a second pass over the tensor 
+ (recording the reduction of an expression instead avoids that pass). Other operations run on 
+ a single thread each. Without threads (or with tensor_set_num_threads(1)), operations run in recording order.
+
+ The graph refers to its tensors, which must stay alive (and keep their size) until the last 
+ eval(). Fixed-rank tensors are recorded through their views, with call().
+ */
+class TensorGraph{
+	public:
+	/// Memory accessed by an operation recorded with call(): a tensor's elements or a view's.
+	struct access{
+		tensor_detail::graph_region region;
+
+		template <class T, class A>
+		access(const Tensor<T, dynamic_rank, A>& t) : region(tensor_detail::region_of(t.view())) {}
+
+		template <class T>
+		access(const TensorView<T>& v) : region(tensor_detail::region_of(v)) {}
+	};
+
+	/// t += x, t -= x, t *= x, t /= x, for x a tensor of the same dimensions as t, or a scalar.
+	template <class T, class A, class X>
+	TensorGraph& add(Tensor<T, dynamic_rank, A>& t, const X& x){ return elementwise(t, x, std::plus<>()); }
+
+	template <class T, class A, class X>
+	TensorGraph& sub(Tensor<T, dynamic_rank, A>& t, const X& x){ return elementwise(t, x, std::minus<>()); }
+
+	template <class T, class A, class X>
+	TensorGraph& mul(Tensor<T, dynamic_rank, A>& t, const X& x){ return elementwise(t, x, std::multiplies<>()); }
+
+	template <class T, class A, class X>
+	TensorGraph& div(Tensor<T, dynamic_rank, A>& t, const X& x){ return elementwise(t, x, std::divides<>()); }
+
+	/// t = e, where e broadcasts to the dimensions of t.
+	template <class T, class A, class E>
+	TensorGraph& assign(Tensor<T, dynamic_rank, A>& t, const TensorExpr<E>& e){
+		E ex = e.self();
+		tensor_detail::graph_task task;
+		task.call = [&t, ex](){ tensor_detail::assign_expr(t.view(), ex, tensor_detail::assign_value()); };
+		ex.for_each_leaf([&](const auto& v){ task.reads.push_back(tensor_detail::region_of(v)); });
+		task.writes.push_back(tensor_detail::region_of(t.view()));
+		return record(std::move(task));
+	}
+
+	/// Same as t.transform(axis, binary_op, w).
+	template <class T, class A, class BinOp>
+	TensorGraph& transform(Tensor<T, dynamic_rank, A>& t, int axis, BinOp binary_op, const std::vector<double>& w){
+		return call([&t, axis, binary_op, w](){ t.transform(axis, binary_op, w); }, {t}, {t});
+	}
+
+	/// Same as t.accumulate(out, v0, axis, binary_op) and t.accumulate(out, v0, axes, binary_op).
+	template <class T, class A, class B, class BinOp>
+	TensorGraph& accumulate(Tensor<T, dynamic_rank, B>& out, const Tensor<T, dynamic_rank, A>& t, T v0, int axis, BinOp binary_op){
+		return call([&out, &t, v0, axis, binary_op](){ t.accumulate(out, v0, axis, binary_op); }, {t}, {out});
+	}
+
+	template <class T, class A, class B, class BinOp>
+	TensorGraph& accumulate(Tensor<T, dynamic_rank, B>& out, const Tensor<T, dynamic_rank, A>& t, T v0, const std::vector<int>& axes, BinOp binary_op){
+		return call([&out, &t, v0, axes, binary_op](){ t.accumulate(out, v0, axes, binary_op); }, {t}, {out});
+	}
+
+	/// @brief out = e.accumulate(v0, axis, binary_op, weights): the reduction evaluates the 
+	/// expression on the fly, so the elementwise operations feeding it need no temporary tensor.
+	template <class T, class B, class E, class BinOp>
+	TensorGraph& accumulate(Tensor<T, dynamic_rank, B>& out, const TensorExpr<E>& e, double v0, int axis, BinOp binary_op, const std::vector<double>& weights={}){
+		E ex = e.self();
+		tensor_detail::graph_task task;
+		task.call = [&out, ex, v0, axis, binary_op, weights](){
+			auto r = ex.accumulate(v0, axis, binary_op, weights);
+			assert(r.dim == out.dim);
+			std::copy(r.vec.begin(), r.vec.end(), out.vec.begin());
+		};
+		ex.for_each_leaf([&](const auto& v){ task.reads.push_back(tensor_detail::region_of(v)); });
+		task.writes.push_back(tensor_detail::region_of(out.view()));
+		return record(std::move(task));
+	}
+
+	/// Same as t.avg_dim(out, axis, weights).
+	template <class T, class A, class B>
+	TensorGraph& avg_dim(Tensor<T, dynamic_rank, B>& out, const Tensor<T, dynamic_rank, A>& t, int axis, const std::vector<double>& weights={}){
+		return call([&out, &t, axis, weights](){ t.avg_dim(out, axis, weights); }, {t}, {out});
+	}
+
+	/// @brief Record f(), which reads the memory of the tensors or views in 'reads' and writes 
+	/// that of those in 'writes' (and nothing else).
+	template <class F>
+	TensorGraph& call(F f, std::initializer_list<access> reads, std::initializer_list<access> writes){
+		tensor_detail::graph_task task;
+		task.call = std::move(f);
+		for (const access& a : reads) task.reads.push_back(a.region);
+		for (const access& a : writes) task.writes.push_back(a.region);
+		return record(std::move(task));
+	}
+
+	/// Number of tasks to run (after fusion).
+	size_t size() const {
+		return tasks.size();
+	}
+
+	void clear(){
+		tasks.clear();
+	}
+
+	/// @brief Run all recorded operations. Rethrows the first exception thrown by an operation, 
+	/// after the others have run.
+	void eval(){
+		auto& ps = tensor_detail::parallel_settings();
+		int nthreads = ps.nthreads;
+		std::ptrdiff_t total = 0;
+		for (auto& t : tasks){
+			std::ptrdiff_t work = t.n*t.chain.size();
+			total += (t.n > 0)? work : 1;
+			t.nparts = (t.n > 0)? int(std::max<std::ptrdiff_t>(1, std::min<std::ptrdiff_t>({t.n, work/ps.grain, 4*std::ptrdiff_t(nthreads)}))) : 1;
+		}
+#ifndef TENSOR_NO_THREADS
+		if (nthreads > 1 && tasks.size() + total/ps.grain > 1 && !tensor_detail::ThreadPool::in_worker()){
+			for (auto& t : tasks) t.succs.clear();
+			for (size_t i=0; i<tasks.size(); ++i){
+				tasks[i].waiting = tasks[i].deps.size();
+				tasks[i].parts_left = tasks[i].nparts;
+				for (int d : tasks[i].deps) tasks[d].succs.push_back(i);
+			}
+			std::shared_ptr<tensor_detail::ThreadPool> pool = ps.get_pool();
+			tensor_detail::graph_executor ex(tasks, pool->size());
+			auto worker = [&ex](int q){ ex.work(q); };
+			pool->run(pool->size(), std::ref(worker));
+			if (ex.error) std::rethrow_exception(ex.error);
+			return;
+		}
+#endif
+		// serially, in recording order (a topological order)
+		std::exception_ptr error;
+		for (auto& t : tasks){
+			for (int p=0; p<t.nparts; ++p){
+				try { t.run(p); }
+				catch (...){ if (!error) error = std::current_exception(); }
+			}
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	private:
+	std::vector<tensor_detail::graph_task> tasks;
+
+	// t op= x, elementwise with a tensor of the same dimensions, or with a scalar
+	template <class T, class A, class S, class B, class Op>
+	TensorGraph& elementwise(Tensor<T, dynamic_rank, A>& t, const Tensor<S, dynamic_rank, B>& x, Op op){
+		if (x.dim != t.dim) return call([&t, &x, op](){ tensor_detail::zip_transform(t.vec.data(), t.dim, t.view().offsets, x.view().data, x.view().broadcast(t.dim).offsets, op); }, {t, x}, {t});
+		tensor_detail::graph_task task;
+		task.n = t.vec.size();
+		task.chain.push_back([&t, &x, op](std::ptrdiff_t b, std::ptrdiff_t e){ tensor_detail::transform_row(op, t.vec.data()+b, 1, x.vec.data()+b, 1, e-b); });
+		task.reads = {tensor_detail::region_of(t.view()), tensor_detail::region_of(x.view())};
+		task.writes = {tensor_detail::region_of(t.view())};
+		return record(std::move(task));
+	}
+
+	template <class T, class A, class S, class Op, class = typename std::enable_if<!tensor_detail::is_tensor_operand<S>::value>::type>
+	TensorGraph& elementwise(Tensor<T, dynamic_rank, A>& t, const S& s, Op op){
+		tensor_detail::graph_task task;
+		task.n = t.vec.size();
+		task.chain.push_back([&t, s, op](std::ptrdiff_t b, std::ptrdiff_t e){ tensor_detail::transform_row(op, t.vec.data()+b, 1, &s, 0, e-b); });
+		task.reads = task.writes = {tensor_detail::region_of(t.view())};
+		return record(std::move(task));
+	}
+
+	// add a task after the conflicting ones, or fuse it into the last task
+	TensorGraph& record(tensor_detail::graph_task&& task){
+		for (size_t i=0; i<tasks.size(); ++i) if (task.conflicts(tasks[i])) task.deps.push_back(i);
+		if (task.n > 0 && !tasks.empty() && tasks.back().n == task.n){
+			// the chain runs block by block, so the new operation may wait only for the chain 
+			// itself (elementwise, on the same elements) and for what the chain waits for
+			tensor_detail::graph_task& last = tasks.back();
+			int li = tasks.size()-1;
+			bool fusable = true;
+			for (int d : task.deps) fusable = fusable && (d == li || std::find(last.deps.begin(), last.deps.end(), d) != last.deps.end());
+			if (fusable){
+				for (auto& f : task.chain) last.chain.push_back(std::move(f));
+				last.reads.insert(last.reads.end(), task.reads.begin(), task.reads.end());
+				last.writes.insert(last.writes.end(), task.writes.begin(), task.writes.end());
+				return *this;
+			}
+		}
+		tasks.push_back(std::move(task));
+		return *this;
+	}
+};
 
 
 #endif
@@ -1,9 +1,12 @@
 #include "../include/tensor.h"
 #include <iostream>
+#include <cmath>
+#include <fstream>
+#include <cstdio>
 
 using namespace std;
 
-// compile:  g++ -Wall -Wextra -o 1 test.cpp 
+// compile:  g++ -Wall -Wextra -pthread -o 1 test.cpp 
 
 bool equals(double x1, double x2, double tol=1e-6){
 	return (abs(x1-x2) < tol);
@@ -16,6 +19,17 @@ bool equals(vector<T> x1, vector<T> x2, double tol=1e-6){
 	return true;
 }
 
+// every allocation with operator new is counted, to check operations that should not allocate
+std::atomic<long> allocations{0};
+
+__attribute__((noinline)) void* operator new(std::size_t n){
+	++allocations;
+	if (void* p = std::malloc(n? n : 1)) return p;
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
 
 int main(){
 
@@ -49,8 +63,8 @@ int main(){
 	if (!equals(d,33)) return 1;
 
 
-	vector<int> x = u.plane(0);
-	vector<int> expected;
+	vector<ptrdiff_t> x = u.plane(0);
+	vector<ptrdiff_t> expected;
 	expected = {0,5,10, 15,20,25};
 	cout << "starts dim 0: "; for (auto xx : x) cout << xx << " "; cout << "\n";  
 	if (!equals(x, expected)) return 1;
@@ -75,6 +89,19 @@ int main(){
 	cout << "starts dim 2, off 1: "; for (auto xx : x) cout << xx << " "; cout << "\n";	
 	if (!equals(x, expected)) return 1;
 
+	// plane() into a reused buffer must agree with a brute-force scan over index()
+	Tensor<double> w4({3,2,4,5});
+	vector<ptrdiff_t> buf;
+	for (int axis=0; axis<4; ++axis){
+		for (int k=0; k<w4.dim[3-axis]; ++k){
+			w4.plane(buf, axis, k);
+			expected.clear();
+			for (int i=0; i<int(w4.vec.size()); ++i) if (w4.index(i)[3-axis] == k) expected.push_back(i);
+			if (!equals(buf, expected)) return 1;
+		}
+	}
+	cout << "plane buffer: ok\n";
+
 	
 	Tensor<double> v = u.accumulate(0, 0, std::plus<double>());
 	vector<double> expected1;
@@ -96,6 +123,1256 @@ int main(){
 	v2.print();
 	if (!equals(v2.vec, expected1)) return 1;
 
+	// views: slicing, permutation, broadcasting
+	TensorView<double> uv = u.view();
+	TensorView<double> s1 = uv.slice(0, 1, 5, 2);   // columns 1 and 3
+	s1.print();
+	expected1 = {1,3, 6,8, 11,13, 16,18, 21,23, 26,28};
+	if (!equals(Tensor<double>(s1).vec, expected1)) return 1;
+
+	TensorView<double> s2 = uv.select(2, 1).slice(1, 2, -1, -1);   // second block, rows reversed
+	expected1 = {25,26,27,28,29, 20,21,22,23,24, 15,16,17,18,19};
+	if (!equals(Tensor<double>(s2).vec, expected1)) return 1;
+
+	TensorView<double> pt = uv.permute({2,0,1});   // [5,2,3]
+	if (pt.dim != vector<ptrdiff_t>({5,2,3})) return 1;
+	if (!equals(pt(3,1,2), u(1,2,3))) return 1;
+	if (pt.is_contiguous() || !uv.is_contiguous()) return 1;
+
+	Tensor<double> row({5});
+	row.fill_sequence();
+	TensorView<double> bc = row.view().broadcast({2,3,5});
+	Tensor<double> r1 = u;
+	r1 += bc;
+	for (int i=0; i<30; ++i) if (!equals(r1.vec[i], u.vec[i] + i%5)) return 1;
+
+	Tensor<double> col({3});
+	col.fill_sequence();
+	Tensor<double> r2 = u;
+	r2 -= col.view().unsqueeze(0).broadcast({2,3,5});
+	for (int i=0; i<30; ++i) if (!equals(r2.vec[i], u.vec[i] - (i/5)%3)) return 1;
+	if (r2.view().unsqueeze(3).squeeze().dim != u.dim) return 1;
+
+	Tensor<double> a1 = pt.accumulate(0, 0, std::plus<double>());   // sum over dim 1 of u
+	if (!equals(Tensor<double>(a1.view().permute({1,0})).vec, v1.vec)) return 1;
+	cout << "views: ok\n";
+
+	// expression templates
+	Tensor<double> ea({2,3,5}), eb({2,3,5}), ec({2,3,5});
+	ea.fill_sequence(); eb.fill_sequence(); ec.fill_sequence();
+	eb += 1; ec *= 0.5;
+	Tensor<double> e1 = ea*eb + ec*2.0 - u;
+	for (int i=0; i<30; ++i) if (!equals(e1.vec[i], i*(i+1.0) + i - i)) return 1;
+
+	e1 = 2.0*(ea+eb) - ea.accumulate(0, 0, std::plus<double>()).view().unsqueeze(0).broadcast({2,3,5});
+	for (int i=0; i<30; ++i) if (!equals(e1.vec[i], 2*(2*i+1) - (25*(i/5)+10))) return 1;
+	Tensor<double> e2 = ea.avg_dim(1) + 1.0;   // rvalue operand
+	if (!equals(e2.vec, (ea.avg_dim(1)+1.0).eval().vec)) return 1;
+
+	e1 = ea;
+	e1 += e1.view().slice(0, 4, -1, -1)*1.0;   // aliased, reversed rows
+	for (int i=0; i<30; ++i) if (!equals(e1.vec[i], 5*(i/5)*2 + 4)) return 1;
+
+	Tensor<double> e3 = (ea*2.0 + eb).accumulate(0, 1, std::plus<double>());
+	Tensor<double> e4 = Tensor<double>(ea*2.0 + eb).accumulate(0, 1, std::plus<double>());
+	if (!equals(e3.vec, e4.vec)) return 1;
+
+	// reductions of expressions along every axis, in tiles and in parallel, match those of the evaluated tensor
+	{
+		int nthreads0 = tensor_num_threads();
+		ptrdiff_t grain0 = tensor_grain_size();
+		Tensor<double> p({3,5,2100}), q({5,1});
+		for (size_t i=0; i<p.vec.size(); ++i) p.vec[i] = double((i*7)%23) - 11;
+		q.fill_sequence();
+		Tensor<double> pq = p*2.0 + q;
+		for (int nt : {1, 4}){
+			tensor_set_num_threads(nt);
+			tensor_set_grain_size(64);
+			for (int axis=0; axis<3; ++axis){
+				vector<double> w(p.dim[2-axis]);
+				for (size_t k=0; k<w.size(); ++k) w[k] = 0.5 + k%3;
+				auto maxop = [](double a, double b){ return std::max(a, b); };
+				if (!equals((p*2.0 + q).accumulate(0, axis, plus<double>()).vec, pq.accumulate(0, axis, plus<double>()).vec, 1e-9)) return 1;
+				if (!equals((p*2.0 + q).accumulate(1, axis, plus<double>(), w).vec, pq.accumulate(1, axis, plus<double>(), w).vec, 1e-9)) return 1;
+				if ((p*2.0 + q).accumulate(-1e300, axis, maxop).vec != pq.accumulate(-1e300, axis, maxop).vec) return 1;
+			}
+			Tensor<double> row({5000});
+			row.fill_sequence();
+			if ((row - 1.0).accumulate(0, 0, plus<double>()).vec[0] != 5000.0*4999/2 - 5000) return 1;
+		}
+		tensor_set_num_threads(nthreads0);
+		tensor_set_grain_size(grain0);
+	}
+
+	Tensor<int> ei({4});
+	ei.fill_sequence();
+	Tensor<int> ei2 = ei*0.5 + 1;   // value type of the tensor operand, like the compound operators
+	if (ei2.vec != vector<int>({1,1,2,2})) return 1;
+
+	// 64-bit integer tensors are combined exactly, beyond the 53 bits of a double
+	Tensor<std::int64_t> big64({3}), one64({3});
+	big64.vec.assign(3, (std::int64_t(1) << 60) + 3);
+	one64.vec.assign(3, 1);
+	big64 -= one64;
+	if (big64.vec != vector<std::int64_t>(3, (std::int64_t(1) << 60) + 2)) return 1;
+	cout << "expressions: ok\n";
+
+	// vector kernels must agree with the scalar path on every supported instruction set
+	for (TensorSimd level : {TensorSimd::scalar, TensorSimd::neon, TensorSimd::avx2, TensorSimd::avx512}){
+		if (!tensor_simd_supported(level)) continue;
+		tensor_set_simd_level(level);
+		Tensor<float> f({3,7,67});
+		Tensor<double> g({3,7,67});
+		for (int i=0; i<int(f.vec.size()); ++i) f.vec[i] = g.vec[i] = (i*37)%101 - 50.5;
+		Tensor<float> f2 = f;
+		f2 *= f; f2 -= f; f2 += 2; f2 /= 4.f;
+		for (int i=0; i<int(f.vec.size()); ++i) if (!equals(f2.vec[i], (f.vec[i]*f.vec[i]-f.vec[i]+2)/4, 1e-3)) return 1;
+		vector<double> wts(67);
+		for (int i=0; i<67; ++i) wts[i] = 1.0/(i+1);
+		Tensor<double> gs = g.accumulate(0, 0, std::plus<double>(), wts);
+		Tensor<float> fm = f.max_dim(0);
+		int k = 0;
+		for (int i=0; i<3; ++i) for (int j=0; j<7; ++j, ++k){
+			double sum = 0, mx = -1e300;
+			for (int l=0; l<67; ++l){ sum += wts[l]*g(i,j,l); mx = max(mx, g(i,j,l)); }
+			if (!equals(gs.vec[k], sum, 1e-9) || !equals(fm.vec[k], mx)) return 1;
+		}
+
+		// outer axes are reduced row-wise, in tiles (inner block of 3*1500 > tile size)
+		Tensor<float> h({4,3,1500});
+		for (int i=0; i<int(h.vec.size()); ++i) h.vec[i] = (i*13)%29 - 14;
+		vector<double> w4 = {0.1, 0.2, 0.3, 0.4};
+		Tensor<float> hs = h.accumulate(0, 2, std::plus<double>(), w4);
+		Tensor<float> hm = h.max_dim(1);
+		Tensor<float> hp = h.accumulate(0, 2, [](double a, double b){return a-b;});   // generic path
+		for (int j=0; j<3; ++j) for (int l=0; l<1500; ++l){
+			double sum = 0, diff = 0, mx = -1e300;
+			for (int i=0; i<4; ++i){ sum += w4[i]*h.vec[h.location(i,j,l)]; diff -= h.vec[h.location(i,j,l)]; }
+			for (int i=0; i<3; ++i) mx = max(mx, double(h.vec[h.location(j%4,i,l)]));
+			int k = hs.location(j,l), km = hm.location(j%4,l);
+			if (!equals(hs.vec[k], sum, 1e-4) || !equals(hp.vec[k], diff) || !equals(hm.vec[km], mx)) return 1;
+		}
+	}
+	tensor_set_simd_level(tensor_simd_detect());
+	cout << "simd: ok\n";
+
+	// multi-threaded results must match the serial ones
+	{
+		Tensor<double> big({6,50,70});
+		for (int i=0; i<int(big.vec.size()); ++i) big.vec[i] = (i*7)%23;
+		vector<double> w50(50, 0.5);
+		vector<Tensor<double>> res[2];
+		for (int nt : {1, 4}){
+			tensor_set_num_threads(nt);
+			tensor_set_grain_size(64);
+			vector<Tensor<double>>& r = res[nt > 1];
+			for (int axis=0; axis<3; ++axis) r.push_back(big.avg_dim(axis));
+			r.push_back(big.accumulate(0, 1, [](double a, double b){return a+2*b;}, w50));
+			Tensor<double> t = big;
+			t.transform(1, std::multiplies<double>(), w50);
+			t += big; t *= 2.0;
+			t = t*big - 1.0;
+			r.push_back(t);
+			r.push_back(big.repeat_inner(3));
+			r.push_back(big.repeat_outer(3));
+		}
+		for (size_t i=0; i<res[0].size(); ++i) if (!equals(res[0][i].vec, res[1][i].vec, 0)) return 1;
+
+		// an exception thrown by any chunk reaches the caller, and the pool stays usable
+		tensor_set_num_threads(4);
+		bool caught = false;
+		try {
+			tensor_detail::parallel_for(1000, 1000, [](std::ptrdiff_t, std::ptrdiff_t){ throw std::runtime_error("chunk"); });
+		}
+		catch (const std::runtime_error&){ caught = true; }
+		if (!caught || !equals(big.avg_dim(1).vec, res[0][1].vec, 0)) return 1;
+
+		// application threads making their first parallel calls at once share one pool
+		tensor_set_num_threads(4);
+		vector<Tensor<double>> sums(2, Tensor<double>({0}));
+		std::thread th([&](){ sums[0] = big.avg_dim(0); });
+		sums[1] = big.avg_dim(0);
+		th.join();
+		if (!equals(sums[0].vec, res[0][0].vec, 0) || !equals(sums[1].vec, res[0][0].vec, 0)) return 1;
+
+		// rows of a repeat view alias each other, so they are updated serially
+		Tensor<int> acc({50});
+		Tensor<int> ones({64,50});
+		ones += 1;
+		acc.view().repeat_outer(64) += ones + 1;
+		for (int v : acc.vec) if (v != 128) return 1;
+
+		tensor_set_num_threads(1);
+		tensor_set_grain_size(32768);
+	}
+	cout << "threads: ok\n";
+
+	// fixed-rank tensors
+	Tensor<double,3> s3({2,3,5});
+	s3.fill_sequence();
+	for (int i=0; i<2; ++i) for (int j=0; j<3; ++j) for (int k=0; k<5; ++k){
+		if (s3.location(i,j,k) != u.location(i,j,k) || !equals(s3(i,j,k), u.vec[u.location(i,j,k)])) return 1;
+		if (s3.index(s3.location(i,j,k)) != Tensor<double,3>::index_type({i,j,k})) return 1;
+	}
+	s3(1,2,3) = -1;
+	const Tensor<double,3>& s3c = s3;
+	if (!equals(s3c(1,2,3), -1)) return 1;
+	s3 += 1.0;
+	Tensor<double,3> s3b = s3*2.0 - s3;
+	if (!equals(s3b.vec, s3.vec)) return 1;
+	if (!equals(Tensor<double,3>(u).dynamic().vec, u.vec)) return 1;
+	if (!equals(s3.view().accumulate(0, 2, std::plus<double>()).vec, s3.dynamic().accumulate(0, 2, std::plus<double>()).vec)) return 1;
+	{	// scalar compound operators on fixed-rank tensors and strided views go through the row kernels
+		Tensor<float,3> f3({4,3,70});
+		f3.vec.assign(f3.vec.size(), 3.f);
+		f3 *= 2.f;
+		f3 -= 1;
+		f3 /= 2.0;
+		for (float v : f3.vec) if (v != 2.5f) return 1;
+		Tensor<int> i2({5,6});
+		i2.fill_sequence();
+		Tensor<int> e2 = i2;
+		i2.view().permute({1,0}).slice(1, 1, 6, 2) += 100;
+		for (int i=0; i<5; ++i) for (int j=1; j<6; j+=2) e2(i,j) += 100;
+		if (i2.vec != e2.vec) return 1;
+		Tensor<int> r2({3});
+		r2.view().repeat_inner(4) += 1;	// repeated elements are updated once per repeat
+		if (r2.vec != vector<int>({4,4,4})) return 1;
+	}
+	cout << "fixed rank: ok\n";
+
+	// typed and checked element access
+	{
+		Tensor<float> tf({2,3,5});
+		tf.fill_sequence();
+		tf(1,2,3) = 0.5f;
+		float& ref = tf(1,0,0);
+		ref = 7;
+		const Tensor<float>& tfc = tf;
+		if (!equals(tfc(1,2,3), 0.5) || !equals(tfc.at(1,0,0), 7) || !equals(tfc[tf.location(1,2,3)], 0.5)) return 1;
+		if (tfc.data() != tf.vec.data()) return 1;
+		bool thrown = false;
+		try { tf.at(0,3,0); } catch (const std::out_of_range&){ thrown = true; }
+		if (!thrown) return 1;
+		thrown = false;
+		try { tf.at(0,0); } catch (const std::out_of_range&){ thrown = true; }
+		if (!thrown) return 1;
+		thrown = false;
+		try { s3c.at(2,0,0); } catch (const std::out_of_range&){ thrown = true; }
+		if (!thrown) return 1;
+		Tensor<float> tfm = tfc.avg_dim(1);
+		if (!equals(tfm(1,3), (18+23+0.5)/3.0, 1e-5)) return 1;
+	}
+	cout << "element access: ok\n";
+
+	// sizes and offsets beyond 2^31
+	{
+		TensorView<double> hv(nullptr, {3650, 720, 1440});
+		ptrdiff_t last = hv.location({3649, 719, 1439});
+		if (hv.size() != 3784320000LL || last != 3784320000LL-1) return 1;
+		if (hv.index(last) != vector<ptrdiff_t>({3649, 719, 1439})) return 1;
+		bool thrown = false;
+		try { Tensor<double> t({1<<20, 1<<20, 1<<20, 1<<20}); } catch (const std::length_error&){ thrown = true; }
+		if (!thrown) return 1;
+		thrown = false;
+		try { Tensor<double> t(vector<int>{2, -3}); } catch (const std::length_error&){ thrown = true; }
+		if (!thrown) return 1;
+		thrown = false;
+		try { Tensor<double,3> t({ptrdiff_t(1)<<40, ptrdiff_t(1)<<30, ptrdiff_t(1)<<20}); } catch (const std::length_error&){ thrown = true; }
+		if (!thrown) return 1;
+	}
+	cout << "64-bit sizes: ok\n";
+
+	// arena allocator
+	{
+		TensorArena arena;
+		TensorArenaAllocator<double> alloc(arena);
+		typedef Tensor<double, dynamic_rank, TensorArenaAllocator<double>> PTensor;
+		const double* p0;
+		{
+			PTensor a({3,4,50}, alloc);
+			if (reinterpret_cast<uintptr_t>(a.data()) % 64 != 0) return 1;
+			for (double x : a.vec) if (x != 0) return 1;
+			p0 = a.data();
+		}
+		if (arena.cached_bytes() != TensorArena::size_class(600*sizeof(double))) return 1;
+		PTensor b({4,3,50}, tensor_uninitialized, alloc);	// same size class: recycled
+		if (b.data() != p0 || arena.cached_bytes() != 0) return 1;
+		b.fill_sequence();
+		PTensor s = b.accumulate(0, 1, plus<double>());
+		if (s.vec.get_allocator() != alloc || s(2,7) != Tensor<double>(b.view()).accumulate(0, 1, plus<double>())(2,7)) return 1;
+
+		Tensor<double> d({4,3,50});
+		d.fill_sequence();
+		b += d;
+		PTensor r = b*2.0 - d;
+		if (r(3,2,49) != 3*599.0) return 1;
+		ArenaTensor<double> g = d + d;
+		Tensor<double,3,TensorArenaAllocator<double>> f(g);
+		if (f(1,1,1) != 2*d(1,1,1) || f.dynamic().vec.get_allocator() != TensorArenaAllocator<double>()) return 1;
+		if (TensorArena::size_class(1) != 64 || TensorArena::size_class(1025) != 1280 || TensorArena::size_class(2048) != 2048) return 1;
+	}
+	cout << "arena allocator: ok\n";
+
+	// reductions into caller-provided outputs
+	{
+		Tensor<double> x({6,5,40});
+		x.fill_sequence();
+		Tensor<double> out({6,40});
+		vector<double> w = {1,0,2,0,1};
+		for (int step=0; step<3; ++step){
+			x += 1.0;
+			x.accumulate(out, 0, 1, plus<double>(), w);
+			if (out.vec != x.accumulate(0, 1, plus<double>(), w).vec) return 1;
+			x.avg_dim(out, 1);
+			Tensor<double> m = x.accumulate(0, 1, plus<double>());
+			for (size_t i=0; i<m.vec.size(); ++i) if (out.vec[i] != m.vec[i]/5) return 1;	// sum/n, as before the fused division
+		}
+		Tensor<double> mx({6,5});
+		x.max_dim(mx, 0);
+		if (mx.vec != x.max_dim(0).vec) return 1;
+
+		// a step loop that reduces into preallocated outputs allocates nothing
+		// (with TENSOR_BLAS, weighted means over the innermost or outermost axis go to gemv)
+		ArenaTensor<double> aout({6,40});
+		vector<int> axes = {1};
+		Tensor<double> y({6,40}), yin({6}), yout({40});
+		Tensor<float> yf({6,40}), yfin({6});
+		y.fill_sequence();
+		yf.fill_sequence();
+		vector<double> w40(40, 0.5), w6(6, 2.0);
+		yf.avg_dim(yfin, 0, w40);	// sizes the per-thread buffer of float weights
+		long before = allocations;
+		for (int step=0; step<3; ++step){
+			x.accumulate(out, 0, 1, plus<double>(), w);
+			x.avg_dim(out, 1, w);
+			x.avg_dim(aout, 1);
+			x.max_dim(mx, 0);
+			x.accumulate(out, 0, axes, plus<double>());
+			y.avg_dim(yin, 0, w40);
+			y.avg_dim(yout, 1, w6);
+			yf.avg_dim(yfin, 0, w40);
+		}
+		if (allocations != before) return 1;
+		if (!equals(yin.vec, y.avg_dim(0, w40).vec, 1e-9) || !equals(yout.vec, y.avg_dim(1, w6).vec, 1e-9)) return 1;
+		if (!equals(yfin.vec, yf.avg_dim(0, w40).vec, 1e-3)) return 1;
+
+		// strided output: the transpose of a 5x6 buffer
+		Tensor<double> tr({5,6});
+		x.avg_dim(tr.view().permute({1,0}), 0);
+		Tensor<double> ref = x.avg_dim(0);
+		for (int i=0; i<6; ++i) for (int j=0; j<5; ++j) if (!equals(tr(j,i), ref(i,j), 1e-12)) return 1;
+		Tensor<double> tr2({40,6});
+		x.accumulate(tr2.view().permute({1,0}), 0, 1, plus<double>());
+		if (tr2(7,3) != x.accumulate(0, 1, plus<double>())(3,7)) return 1;
+	}
+	cout << "output reductions: ok\n";
+
+	// multi-axis and full reductions
+	{
+		Tensor<double> x({4,5,6,7});
+		x.fill_sequence();
+		for (auto& v : x.vec) v = sin(v);
+		Tensor<double> s = x.sum({0,2});
+		Tensor<double> s2 = x.accumulate(0, 2, plus<double>()).accumulate(0, 0, plus<double>());
+		if (s.dim != vector<ptrdiff_t>({4,6}) || !equals(s.vec, s2.vec, 1e-12)) return 1;
+		Tensor<double> m = x.mean({1,2});
+		Tensor<double> m2 = x.avg_dim(1).avg_dim(1);
+		if (m.dim != vector<ptrdiff_t>({4,7}) || !equals(m.vec, m2.vec, 1e-12)) return 1;
+		Tensor<double> mx = x.max({3,1}), mn = x.min({0,1,2,3});
+		for (int j=0; j<5; ++j) for (int k=0; k<7; ++k){
+			double r = -1e300;
+			for (int i=0; i<4; ++i) for (int l=0; l<6; ++l) r = std::max(r, x(i,j,l,k));
+			if (mx(j,k) != r) return 1;
+		}
+		if (mn.dim.size() != 0 || mn.vec[0] != x.min() || x.min() != *min_element(x.vec.begin(), x.vec.end())) return 1;
+		if (x.max() != *max_element(x.vec.begin(), x.vec.end())) return 1;
+		if (!equals(x.sum(), accumulate(x.vec.begin(), x.vec.end(), 0.0), 1e-10)) return 1;
+
+		// into a transposed output, and with a generic operator
+		Tensor<double> tr({7,5});
+		x.accumulate(tr.view().permute({1,0}), 0, {1,3}, plus<double>());
+		Tensor<double> ref = x.sum({1,3});
+		for (int i=0; i<5; ++i) for (int j=0; j<7; ++j) if (!equals(tr(j,i), ref(i,j), 1e-12)) return 1;
+		Tensor<double> p = x.accumulate(1.0, {0,2}, [](double a, double b){return a*(1+b/8);});
+		double p0 = 1;
+		for (int j=0; j<5; ++j) for (int k=0; k<7; ++k) p0 *= 1+x(2,j,3,k)/8;
+		if (!equals(p(2,3), p0, 1e-12)) return 1;
+
+		// large full sums are accurate and independent of the number of threads
+		Tensor<float> big({3, 1<<20});
+		for (auto& v : big.vec) v = 0.1f;
+		float b1 = big.sum();
+		tensor_set_num_threads(4);
+		float b4 = big.sum();
+		tensor_set_num_threads(1);
+		if (b1 != b4 || !equals(b1, 3*(1<<20)*double(0.1f), 0.05) || !equals(big.mean(), 0.1f, 1e-7)) return 1;
+
+		Tensor<double> empty({3,0});
+		if (empty.sum() != 0 || empty.max() != -numeric_limits<double>::infinity() || empty.sum({0}).vec != vector<double>(3, 0.0) || empty.max({1}).vec.size() != 0) return 1;
+	}
+	cout << "multi-axis reductions: ok\n";
+
+	// weighted reductions, and reductions starting from v0
+	{
+		Tensor<double> x({3,8,10});	// {time, lat, lon}
+		x.fill_sequence();
+		for (auto& v : x.vec) v = cos(v);
+		Tensor<double> lat({8,2});	// weights in the first column
+		for (int j=0; j<8; ++j){ lat(j,0) = cos(0.2*j); lat(j,1) = -1; }
+		TensorView<double> wcol = lat.view().select(0, 0);
+		vector<double> wvec(8);
+		for (int j=0; j<8; ++j) wvec[j] = lat(j,0);
+
+		Tensor<double> s1 = x.accumulate(0, 1, plus<double>(), wvec);
+		Tensor<double> s2 = x.accumulate(0, 1, plus<double>(), wcol);
+		if (!equals(s1.vec, s2.vec, 1e-12)) return 1;
+
+		Tensor<double> wl(lat.view().slice(0, 0, 1));
+		Tensor<double> ws = x.sum({2,1}, wl.view());	// {nlat, 1} broadcast over time and lon
+		Tensor<double> wm = x.mean({1,2}, wl.view());
+		for (int k=0; k<10; ++k){
+			double num = 0, den = 0;
+			for (int i=0; i<3; ++i) for (int j=0; j<8; ++j){ num += wvec[j]*x(i,j,k); den += wvec[j]; }
+			if (!equals(ws(k), num, 1e-12) || !equals(wm(k), num/den, 1e-12)) return 1;
+		}
+		Tensor<double> wfull(x.dim);	// weights varying along the kept innermost axis
+		wfull.fill_sequence();
+		Tensor<double> wf = x.accumulate(0, vector<int>{1}, plus<double>(), wfull.view()), wt = x.sum({2,0}, wfull.view());
+		double r1 = 0, r2 = 0;
+		for (int j=0; j<8; ++j) r1 += wfull(2,j,5)*x(2,j,5);
+		for (int i=0; i<3; ++i) for (int k=0; k<10; ++k) r2 += wfull(i,4,k)*x(i,4,k);
+		if (!equals(wf(2,5), r1, 1e-9) || !equals(wt(4), r2, 1e-9)) return 1;
+
+		// v0 is the starting value: all-negative lines have a negative max
+		Tensor<double> neg = x;
+		neg -= 2.0;
+		if (neg.max_dim(0)(1,3) >= 0 || neg.max_dim(1)(2,3) >= 0) return 1;
+		if (!equals(x.accumulate(10, 0, plus<double>())(1,2), 10 + x.accumulate(0, 0, plus<double>())(1,2), 1e-12)) return 1;
+		if (!equals(x.view().accumulate(10, 2, plus<double>())(1,2), 10 + x.sum({2})(1,2), 1e-12)) return 1;
+		if (!equals(x.accumulate_dim(5, x.location(1,2,0), 0, plus<double>()), 5 + x.sum({0})(1,2), 1e-12)) return 1;
+	}
+	cout << "weighted reductions: ok\n";
+
+	// transform along an axis, and with broadcast operands
+	{
+		Tensor<double> x({4,5,6});
+		x.fill_sequence();
+		vector<double> w6 = {1,2,3,4,5,6}, w4 = {2,-1,0,3};
+		Tensor<double> a = x, b = x;
+		a.transform(0, minus<double>(), w6);
+		b.transform(2, [](double p, double q){return p/2 + q;}, w4);
+		for (int i=0; i<4; ++i) for (int j=0; j<5; ++j) for (int k=0; k<6; ++k){
+			if (a(i,j,k) != x(i,j,k) - w6[k] || b(i,j,k) != x(i,j,k)/2 + w4[i]) return 1;
+		}
+
+		// a column of another tensor as the operand, and a float tensor with the vector kernels
+		Tensor<double> cols({5,3});
+		for (int j=0; j<5; ++j) cols(j,1) = j+0.5;
+		Tensor<double> c = x;
+		c.transform(1, multiplies<double>(), cols.view().select(0, 1));
+		Tensor<float> f({3,40});
+		f.fill_sequence();
+		Tensor<float> fw({40});
+		for (int k=0; k<40; ++k) fw(k) = 0.25f*k;
+		Tensor<float> g = f;
+		g.transform(0, plus<float>(), fw.view());
+		for (int i=0; i<3; ++i) for (int k=0; k<40; ++k) if (g(i,k) != f(i,k) + fw(k)) return 1;
+
+		// broadcast operands of shape {6}, {5,1} and {4,1,6}, into a tensor and into a strided view
+		Tensor<double> r1({5,1}), r2({4,1,6});
+		r1.fill_sequence(); r2.fill_sequence(); r2 += 1.0;
+		Tensor<double> d = x, e = x, h = x;
+		d.transform(plus<double>(), r1);
+		e.transform(divides<double>(), r2.view());
+		h.view().permute({0,2,1}).slice(1,2,5).transform(minus<double>(), r1.view().permute({1,0}));
+		for (int i=0; i<4; ++i) for (int j=0; j<5; ++j) for (int k=0; k<6; ++k){
+			if (c(i,j,k) != x(i,j,k)*(j+0.5) || d(i,j,k) != x(i,j,k) + j || e(i,j,k) != x(i,j,k)/r2(i,0,k)) return 1;
+			if (h(i,j,k) != ((k>=2 && k<5)? x(i,j,k) - j : x(i,j,k))) return 1;
+		}
+	}
+	cout << "transform: ok\n";
+
+	// binary files: save, load and use in place
+	{
+		Tensor<float> x({3,4,5});
+		x.fill_sequence();
+		x.save("test_io.tns");
+		if (Tensor<float>::load("test_io.tns").vec != x.vec) return 1;
+		MappedTensor<float> m = Tensor<float>::mmap("test_io.tns");
+		if (m.dim != x.dim || !m.is_contiguous() || m(2,1,3) != x(2,1,3)) return 1;
+		if (!equals(Tensor<float>(m.accumulate(0, 1, plus<double>())).vec, x.accumulate(0, 1, plus<double>()).vec)) return 1;
+
+		// derived views keep the file mapped after the original is gone
+		MappedTensor<float> ms = Tensor<float>::mmap("test_io.tns").permute({2,0,1}).slice(0, 1, 3);
+		size_t i4 = 4, i2 = 2;	// unsigned coordinates, as for Tensor and TensorView
+		if (ms.size() != 30 || ms.is_contiguous() || ms(i4, i2, 1) != x(2,2,4)) return 1;
+		if (ms.dim != vector<ptrdiff_t>({5,3,2}) || ms(4,2,1) != x(2,2,4) || Tensor<float>(ms.view()).vec != Tensor<float>(x.view().permute({2,0,1}).slice(0, 1, 3)).vec) return 1;
+
+		// strided views are written in row-major order
+		x.view().permute({2,0,1}).slice(0, 1, 3).save("test_io.tns");
+		Tensor<float> p = Tensor<float>::load("test_io.tns");
+		if (p.dim != vector<ptrdiff_t>({5,3,2}) || p(4,2,1) != x(2,2,4)) return 1;
+
+		// private mappings never change the file, writable ones do
+		Tensor<int> n({1000});
+		n.fill_sequence();
+		n.save("test_io.tns");
+		{
+			MappedTensor<int> a = TensorView<int>::mmap("test_io.tns");
+			a(10) = -1;
+			MappedTensor<int> b = a;	// shares the mapping
+			if (b(10) != -1 || Tensor<int>::load("test_io.tns")(10) != 10) return 1;
+#ifdef TENSOR_HAVE_MMAP
+			MappedTensor<int> c = Tensor<int>::mmap("test_io.tns", true);
+			c.for_each([](int& v){ v = 7; });
+#endif
+		}
+#ifdef TENSOR_HAVE_MMAP
+		Tensor<int> n7 = Tensor<int>::load("test_io.tns");
+		if (n7(10) != 7 || n7(999) != 7) return 1;
+#endif
+
+		// the element type, the byte order and the size are checked
+		bool thrown = false;
+		try { Tensor<double>::mmap("test_io.tns"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		n.save("test_io.tns");
+		{	// rewrite the file as if saved on a machine with the opposite byte order
+			std::fstream f("test_io.tns", std::ios::in | std::ios::out | std::ios::binary);
+			vector<char> bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+			auto flip = [&](size_t pos, size_t size, size_t count){ for (size_t i=0; i<count; ++i) std::reverse(&bytes[pos+i*size], &bytes[pos+(i+1)*size]); };
+			flip(8, 4, 2); flip(20, 4, 1); flip(24, 8, 4); flip(64, 4, 1000);
+			f.seekp(0);
+			f.write(bytes.data(), bytes.size());
+		}
+		if (Tensor<int>::load("test_io.tns").vec != n.vec) return 1;
+		thrown = false;
+		try { Tensor<int>::mmap("test_io.tns"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		n.save("test_io.tns");
+		{	// truncated data
+			std::ifstream in("test_io.tns", std::ios::binary);
+			vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			in.close();
+			std::ofstream("test_io.tns", std::ios::binary).write(bytes.data(), 500);
+		}
+		thrown = false;
+		try { Tensor<int>::load("test_io.tns"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		n.save("test_io.tns");
+		{	// corrupt (negative) dimension
+			std::fstream f("test_io.tns", std::ios::in | std::ios::out | std::ios::binary);
+			std::int64_t d = -1000;
+			f.seekp(40);
+			f.write(reinterpret_cast<char*>(&d), 8);
+		}
+		thrown = false;
+		try { Tensor<int>::mmap("test_io.tns"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+		std::remove("test_io.tns");
+	}
+	cout << "binary files: ok\n";
+
+	// chunked reading, reductions and writing along the outermost axis
+	{
+		Tensor<double> x({23,6,7});
+		x.fill_sequence();
+		for (auto& v : x.vec) v = sin(v);
+		x.save("test_io.tns");
+		vector<double> w(23);
+		for (int i=0; i<23; ++i) w[i] = 1 + i%3;
+
+		TensorChunkReader<double> in("test_io.tns", 5);
+		if (in.dim != x.dim || !equals(in.avg_dim(w).vec, x.avg_dim(2, w).vec, 1e-12)) return 1;
+		TensorChunkReader<double> in2("test_io.tns", 4);
+		auto op = [](double a, double b){ return a - b/2; };
+		if (!equals(in2.accumulate(1, op).vec, x.accumulate(1, 2, op).vec, 1e-12)) return 1;
+
+		// a callback source, fed into an accumulator by hand
+		TensorChunkReader<float> gen({1000,3}, 64, [](ptrdiff_t first, const TensorView<float>& c){
+			for (ptrdiff_t i=0; i<c.dim[0]; ++i) for (int j=0; j<3; ++j) c(i,j) = (first+i)*j;
+		});
+		TensorChunkAccumulator<float> sum({3}, 0);
+		TensorView<const float> chunk(nullptr, gen.dim);
+		ptrdiff_t first, nchunks = 0;
+		while (gen.next(chunk, first)){
+			if (chunk(0,1) != first) return 1;
+			sum.add(chunk, first);
+			++nchunks;
+		}
+		if (nchunks != 16 || sum.rows() != 1000 || sum.result().vec != vector<float>({0, 499500, 999000})) return 1;
+
+		// writing in uneven and strided chunks
+		{
+			TensorChunkWriter<double> out("test_io2.tns", x.dim);
+			out.write(x.view().slice(2, 0, 10));
+			Tensor<double> rest(x.view().slice(2, 10, 23).permute({0,2,1}));
+			out.write(rest.view().permute({0,2,1}));
+			out.close();
+		}
+		if (Tensor<double>::load("test_io2.tns").vec != x.vec) return 1;
+		bool thrown = false;
+		try {
+			TensorChunkWriter<double> out("test_io2.tns", x.dim);
+			out.write(x.view().slice(2, 0, 10));
+			out.close();
+		} catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		// errors in the background reads surface in next()
+		thrown = false;
+		TensorChunkReader<int> bad({10}, 3, [](ptrdiff_t first, const TensorView<int>&){ if (first > 5) throw std::runtime_error("source failed"); });
+		TensorView<const int> c(nullptr, bad.dim);
+		ptrdiff_t rows = 0;
+		try { while (bad.next(c, first)) rows += c.dim[0]; } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown || rows != 6 || bad.next(c, first)) return 1;	// the failed chunk is never returned
+		std::remove("test_io.tns");
+		std::remove("test_io2.tns");
+	}
+	cout << "chunked streaming: ok\n";
+
+	// formatted output: text, csv and npy
+	{
+		Tensor<double> x({2,2,3});
+		x.fill_sequence();
+		x *= 0.5;
+		if (x.to_string() != "0 0.5 1\n1.5 2 2.5\n\n3 3.5 4\n4.5 5 5.5\n") return 1;
+		TensorWriteOptions opt;
+		opt.format = TensorFormat::csv;
+		opt.precision = 3;
+		Tensor<double> y({2,2});
+		y(0,0) = 1.0/3; y(0,1) = 2; y(1,0) = -1e-7; y(1,1) = 12345;
+		if (y.view().permute({1,0}).to_string(opt) != "0.333,-1e-07\n2,1.23e+04\n") return 1;
+
+		// large tensors are summarised along each axis
+		Tensor<int> big({100,1000});
+		big.fill_sequence();
+		string s = big.to_string();
+		if (s.size() > 400 || s.compare(0, 18, "0 1 2 ... 997 998 ") != 0 || s.find("\n...\n") == string::npos || s.find("99999\n") == string::npos) return 1;
+		opt.format = TensorFormat::text;
+		opt.threshold = 1<<30;
+		s = big.to_string(opt);
+		if (std::count(s.begin(), s.end(), '\n') != 100) return 1;
+
+		// npy: a 64-byte aligned header with the shape, then the raw data
+		opt.format = TensorFormat::npy;
+		string npy = x.view().slice(0, 1, 3).to_string(opt);
+		if (npy.compare(0, 6, "\x93NUMPY") != 0 || npy.size() != 128 + 8*8) return 1;
+		if (npy.find("{'descr': '<f8', 'fortran_order': False, 'shape': (2, 2, 2), }") != 10 || npy[127] != '\n') return 1;
+		double v;
+		memcpy(&v, &npy[128 + 8*7], 8);
+		if (v != x(1,1,2)) return 1;
+	}
+	cout << "formatted output: ok\n";
+
+	// NumPy .npy and .npz files
+	{
+		Tensor<double> x({3,4,5});
+		x.fill_sequence();
+		x.to_npy("test_io.npy");
+		Tensor<double> y = Tensor<double>::from_npy("test_io.npy");
+		MappedTensor<double> m = Tensor<double>::mmap_npy("test_io.npy");
+		if (y.dim != x.dim || y.vec != x.vec || m.dim != x.dim || m(2,3,4) != x(2,3,4)) return 1;
+		x.view().permute({2,1,0}).to_npy("test_io.npy");
+		if (Tensor<double>::from_npy("test_io.npy")(4,3,2) != x(2,3,4)) return 1;
+		bool thrown = false;
+		try { Tensor<float>::from_npy("test_io.npy"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		// Fortran order and big-endian data, as written by numpy
+		{
+			string h = "{'descr': '>i4', 'fortran_order': True, 'shape': (2, 3), }";
+			h.append(63 - (10 + h.size()) % 64, ' ');
+			h += '\n';
+			std::ofstream f("test_io.npy", std::ios::binary);
+			f.write("\x93NUMPY\x01\x00", 8);
+			f.put(char(h.size())); f.put(0);
+			f << h;
+			for (int i=0; i<6; ++i){ char b[4] = {0, 0, 0, char(i)}; f.write(b, 4); }   // column-major 0..5
+		}
+		Tensor<int> fi = Tensor<int>::from_npy("test_io.npy");
+		if (fi.dim != vector<ptrdiff_t>({2,3}) || fi.vec != vector<int>({0,2,4, 1,3,5})) return 1;
+		thrown = false;
+		try { Tensor<int>::mmap_npy("test_io.npy"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+
+		// several tensors in one archive
+		Tensor<float> z({7});
+		z.fill_sequence();
+		{
+			TensorNpzWriter npz("test_io.npz");
+			npz.add("x", x);
+			npz.add("zrev", z.view().slice(0, 6, -1, -1));
+			npz.close();
+		}
+		TensorNpzReader npz("test_io.npz");
+		if (npz.names() != vector<string>({"x", "zrev"}) || !npz.contains("x") || npz.contains("y")) return 1;
+		if (npz.get<double>("x").vec != x.vec || npz.get<float>("zrev")(0) != 6) return 1;
+		thrown = false;
+		try { npz.get<double>("y"); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown) return 1;
+		std::remove("test_io.npy");
+		std::remove("test_io.npz");
+	}
+	cout << "npy files: ok\n";
+
+	// lazy repeat: stride-0 views instead of materialised copies
+	{
+		Tensor<double> x({3,4});
+		x.fill_sequence();
+		if (Tensor<double>(x.repeat_inner_view(5)).vec != x.repeat_inner(5).vec) return 1;
+		if (Tensor<double>(x.repeat_outer_view(2)).vec != x.repeat_outer(2).vec) return 1;
+		if (x.view().slice(0,1,3).repeat_inner(2).dim != vector<ptrdiff_t>({3,2,2})) return 1;
+
+		Tensor<double> t({3,4,5});
+		t.fill_sequence();
+		Tensor<double> e = t;
+		t *= x.repeat_inner_view(5);
+		e *= x.repeat_inner(5);
+		if (t.vec != e.vec) return 1;
+		Tensor<double> w({4,5});
+		w.fill_sequence();
+		t += w.repeat_outer_view(3);
+		e += w.repeat_outer(3);
+		t.view().slice(1,0,2) -= x.view().slice(0,0,2).repeat_inner(5);
+		e.view().slice(1,0,2) -= x.view().slice(0,0,2).repeat_inner(5);
+		if (t.vec != e.vec) return 1;
+
+		// overlapping operands are read as they were before the update, as in a = a + b
+		Tensor<int> a({6});
+		a.fill_sequence();
+		a.view().slice(0,1,6) += a.view().slice(0,0,5);
+		if (a.vec != vector<int>({0,1,3,5,7,9})) return 1;
+		Tensor<double> sq({3,3}), sq2({3,3});
+		sq.fill_sequence();
+		sq2.fill_sequence();
+		sq += sq.view().permute({1,0});
+		sq2 = sq2 + sq2.view().permute({1,0});
+		if (sq.vec != sq2.vec || sq(1,0) != 4) return 1;
+		sq.view() -= sq.view().permute({1,0});
+		for (double v : sq.vec) if (v != 0) return 1;
+	}
+	cout << "lazy repeat: ok\n";
+
+	// broadcasting binary operators
+	{
+		Tensor<double> f({4,5}), g({3,4,5}), c({3,1,1});
+		f.fill_sequence();
+		g.fill_sequence();
+		c.fill_sequence();
+		c += 1.0;
+		Tensor<double> r = g + f;
+		Tensor<double> e = g;
+		e += f.repeat_outer(3);
+		if (r.dim != g.dim || r.vec != e.vec) return 1;
+		r = f - g;
+		if (r.dim != g.dim || r(2,3,4) != f(3,4) - g(2,3,4)) return 1;
+		r = g / c;
+		if (r(2,1,3) != g(2,1,3)/3) return 1;
+		r = g*c + f/2.0;
+		if (r(1,2,3) != g(1,2,3)*2 + f(2,3)/2) return 1;
+
+		// both operands broadcast: [3,1] x [4] -> [3,4]
+		Tensor<int> col({3,1}), row({4});
+		col.fill_sequence();
+		row.fill_sequence();
+		Tensor<int> outer = col*10 + row;
+		if (outer.dim != vector<ptrdiff_t>({3,4}) || outer(2,3) != 23 || outer(1,0) != 10) return 1;
+
+		// compound operators broadcast their right operand
+		Tensor<double> h = g;
+		h /= c;
+		if (h.vec != (g/c).eval().vec) return 1;
+		h = g;
+		h -= f;
+		h *= c.view();
+		h.view().slice(2,0,2) += f;
+		if (h(0,1,2) != (g(0,1,2)-f(1,2))*c(0,0,0) + f(1,2) || h(2,1,2) != (g(2,1,2)-f(1,2))*c(2,0,0)) return 1;
+		h = g;
+		h += f*2.0;
+		if (h(2,3,1) != g(2,3,1) + 2*f(3,1)) return 1;
+	}
+	cout << "broadcasting: ok\n";
+
+	// scalar-first operators and reuse of temporaries
+	{
+		Tensor<double> a({3,4}), b({3,4});
+		a.fill_sequence();
+		b.fill_sequence();
+		b += 1.0;
+		Tensor<double> r = 10.0 - a;
+		if (r(2,3) != 10 - a(2,3) || r(0,0) != 10) return 1;
+		r = 12.0 / b;
+		if (r(0,1) != 6 || r(2,3) != 1) return 1;
+		r = 2.0*(a + b) - 1.0;
+		if (r(1,2) != 2*(a(1,2) + b(1,2)) - 1) return 1;
+		Tensor<int> i({5});
+		i.fill_sequence();
+		if ((1 - i).eval().vec != vector<int>({1,0,-1,-2,-3})) return 1;
+
+		// a temporary operand's buffer becomes the result
+		Tensor<double> tmp = a;
+		const double* p = tmp.vec.data();
+		Tensor<double> q = 1.0 + std::move(tmp)*2.0 - b;
+		if (q.vec.data() != p || q(2,1) != 1 + 2*a(2,1) - b(2,1)) return 1;
+		tmp = a;
+		p = tmp.vec.data();
+		q = (b - std::move(tmp)).eval();
+		if (q.vec.data() != p || q(1,1) != 1) return 1;
+
+		// the destination may appear anywhere in the expression
+		r = a;
+		r = b - r;
+		if (r(1,1) != 1) return 1;
+		r = a;
+		r = 2.0 - r*r;
+		if (r(0,3) != -7) return 1;
+	}
+	cout << "scalar-first operators: ok\n";
+
+	// profiler: counters only with TENSOR_PROFILE, nothing otherwise
+	{
+		TensorProfiler::reset();
+		TensorProfiler::start_trace();
+		Tensor<double> x({20,30});
+		x.fill_sequence();
+		Tensor<double> y = x.accumulate(0.0, 1, std::plus<double>());
+		Tensor<double> z = x + x*2.0;
+		z += x;
+		z += 1.0;
+		Tensor<double> c = z;
+		TensorProfiler::stop_trace();
+		vector<TensorOpStats> st = TensorProfiler::stats();
+#ifdef TENSOR_PROFILE
+		auto find = [&st](const string& name){
+			for (const auto& s : st) if (s.name == name) return s;
+			return TensorOpStats();
+		};
+		if (!TensorProfiler::enabled()) return 1;
+		TensorOpStats acc = find("accumulate"), ctor = find("Tensor(dim)"), expr = find("Tensor(expr)");
+		if (acc.calls != 1 || acc.elements != 600 || acc.temporaries != 1 || acc.bytes_allocated != 30*8) return 1;
+		if (ctor.calls != 1 || ctor.bytes_allocated != 600*8 || expr.calls != 1 || expr.temporaries != 1) return 1;
+		if (find("operator+=(expr)").calls != 0 || find("operator+=(Tensor)").calls != 1 || find("operator+=(scalar)").calls != 1) return 1;
+		if (find("Tensor(copy)").bytes_allocated != 600*8) return 1;
+		std::ostringstream table, trace;
+		TensorProfiler::print(table);
+		TensorProfiler::write_trace(trace);
+		if (table.str().find("accumulate") == string::npos) return 1;
+		string tr = trace.str();
+		if (tr.compare(0, 15, "{\"traceEvents\":") != 0 || std::count(tr.begin(), tr.end(), '\n') != 8) return 1;
+#else
+		if (TensorProfiler::enabled() || !st.empty()) return 1;
+#endif
+		TensorProfiler::reset();
+		if (y.vec.size() != 30 || c.vec != z.vec) return 1;
+	}
+	cout << "profiler: ok\n";
+
+	// coordinate iteration
+	{
+		Tensor<int> x({3,4,5});
+		x.fill_sequence();
+		std::ptrdiff_t n = 0;
+		for (const auto& c : x.indices()){
+			if (c.loc != n || c.ix != x.index(n) || x(c.ix) != n) return 1;
+			++n;
+		}
+		if (n != 60) return 1;
+
+		// views visit their elements in row-major order, with offsets from data
+		auto v = x.view().permute({2,1,0}).slice(1, 1, 3).slice(0, 2, -1, -1);
+		n = 0;
+		for (const auto& c : v.indices()){
+			if (c.ix != v.index(n++) || v.data[c.loc] != v(c.ix)) return 1;
+		}
+		if (n != v.size()) return 1;
+
+		// subranges cover the traversal without overlap, e.g. for threads
+		TensorIndexRange all = v.indices();
+		std::ptrdiff_t total = 0, k = 0;
+		std::ptrdiff_t splits[] = {0, 7, 7, 19, all.size()};
+		for (int i=0; i<4; ++i){
+			auto r = all.subrange(splits[i], splits[i+1]);
+			for (auto it = r.begin(); it != r.end(); ++it){
+				if (it.position() != k++ || it->ix != v.index(it.position())) return 1;
+				total += v.data[it->loc];
+			}
+		}
+		if (k != all.size() || total != Tensor<int>(v).accumulate(0, {0,1,2}, std::plus<int>()).vec[0]) return 1;
+
+		Tensor<double,2> f({2,3});
+		int m = 0;
+		for (const auto& c : f.indices()) m += (c.loc == f.location(c.ix[0], c.ix[1]));
+		if (m != 6) return 1;
+	}
+	cout << "coordinate iteration: ok\n";
+
+	// tiled permute
+	{
+		// every element of the copy equals the element at the same coordinates in the view
+		auto same = [](const auto& t, const auto& v){
+			if (t.dim != v.dim) return false;
+			for (const auto& c : t.indices()) if (t.vec[c.loc] != v(c.ix)) return false;
+			return true;
+		};
+		Tensor<double> d({37,45});
+		d.fill_sequence();
+		if (!same(d.permute({1,0}), d.view().permute({1,0}))) return 1;
+
+		Tensor<float> f({3,33,70});
+		f.fill_sequence();
+		std::vector<std::vector<int>> orders = {{0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0}};
+		for (const auto& o : orders){
+			if (!same(f.permute(o), f.view().permute(o))) return 1;
+			if (!same(Tensor<double>(f.view().permute(o)), f.view().permute(o))) return 1;	// converted
+		}
+
+		Tensor<int> x({5,4,3,2,65});
+		x.fill_sequence();
+		if (!same(x.permute({4,2,0,3,1}), x.view().permute({4,2,0,3,1}))) return 1;
+
+		// reversed, stepped and broadcast views
+		auto r = f.view().slice(0, 69, -1, -1).slice(1, 1, 32, 2).permute({2,1,0});
+		if (!same(Tensor<float>(r), r)) return 1;
+		auto b = d.view().repeat_inner(3).permute({2,0,1});
+		if (!same(Tensor<double>(b), b)) return 1;
+		Tensor<double> p1 = d.permute({1,0}).permute({1,0});
+		if (p1.vec != d.vec) return 1;
+
+		// rows aligned to 64, 32 and 16 bytes and to none, for each block width of the vector kernels
+		ArenaTensor<double> ad({48,64});
+		ArenaTensor<float> af({48,80});
+		ad.fill_sequence();
+		af.fill_sequence();
+		for (int s : {0, 1, 2, 4, 8}){
+			auto vd = ad.view().slice(0, s, 64).permute({1,0});
+			auto vf = af.view().slice(0, 2*s, 80).permute({1,0});
+			if (!same(ArenaTensor<double>(vd), vd) || !same(ArenaTensor<float>(vf), vf)) return 1;
+		}
+	}
+	cout << "tiled permute: ok\n";
+
+	// contraction
+	{
+		// {time, lev, lon} along lev with an {nz, lev} matrix -> {time, lon, nz}
+		Tensor<double> f({4,150,9}), m({6,150});
+		f.fill_sequence();
+		m.fill_sequence();
+		f *= 0.01;
+		Tensor<double> c = contract(f, 1, m, 0);
+		if (c.dim != vector<std::ptrdiff_t>({4,9,6})) return 1;
+		for (const auto& e : c.indices()){
+			double s = 0;
+			for (int k=0; k<150; ++k) s += f(e.ix[0], k, e.ix[1])*m(e.ix[2], k);
+			if (fabs(c.vec[e.loc] - s) > 1e-9*fabs(s)) return 1;
+		}
+		// the same through views, with the matrix transposed and the field permuted
+		Tensor<double> mt = m.permute({1,0});
+		Tensor<double> c2 = contract(f.view().permute({1,0,2}), 2, mt.view(), 1);
+		if (c2.dim != c.dim) return 1;
+		for (size_t i=0; i<c.vec.size(); ++i) if (fabs(c2.vec[i] - c.vec[i]) > 1e-9*fabs(c.vec[i])) return 1;
+
+		// matrix products
+		Tensor<float> a({70,130}), b({130,600});
+		a.fill_sequence();
+		b.fill_sequence();
+		a *= 1e-3f;
+		b *= 1e-3f;
+		Tensor<float> p = matmul(a, b);
+		if (p.dim != vector<std::ptrdiff_t>({70,600})) return 1;
+		for (int i : {0, 33, 69}) for (int j : {0, 1, 511, 599}){
+			double s = 0;
+			for (int k=0; k<130; ++k) s += double(a(i,k))*b(k,j);
+			if (fabs(p(i,j) - s) > 1e-5*s) return 1;
+		}
+		Tensor<int,2> x({2,3}), y({3,2});
+		x.fill_sequence();
+		y.fill_sequence();
+		Tensor<int,2> z = matmul(x, y);
+		if (z.vec != vector<int>({10,13,28,40})) return 1;
+
+		// vectors: matrix-vector and dot products
+		Tensor<int> v({3}), w({2,3});
+		v.fill_sequence();
+		w.fill_sequence();
+		if (contract(w, 0, v, 0).vec != vector<int>({5,14}) || contract(v, 0, v, 0).vec != vector<int>({5})) return 1;
+	}
+	cout << "contraction: ok\n";
+
+	// rolling reductions
+	{
+		Tensor<double> t({40,3,5});
+		t.fill_sequence();
+		for (auto& x : t.vec) x = std::sin(x);
+		const int w = 7;
+		Tensor<double> rs = t.rolling_sum(2, w), rm = t.rolling_mean(2, w), rx = t.rolling_max(2, w), rn = t.rolling_min(2, w);
+		Tensor<double> rp = t.rolling(2, w, [](double a, double b){ return a + 2*b; });
+		if (rs.dim != vector<std::ptrdiff_t>({34,3,5})) return 1;
+		for (const auto& c : rs.indices()){
+			double s = 0, mx = -1e9, mn = 1e9, p = t(c.ix[0], c.ix[1], c.ix[2]);
+			for (int k=0; k<w; ++k){
+				double x = t(c.ix[0] + k, c.ix[1], c.ix[2]);
+				s += x;
+				mx = std::max(mx, x);
+				mn = std::min(mn, x);
+				if (k > 0) p += 2*x;
+			}
+			if (fabs(rs.vec[c.loc] - s) > 1e-12 || fabs(rm.vec[c.loc] - s/w) > 1e-12 || fabs(rp.vec[c.loc] - p) > 1e-12) return 1;
+			if (rx.vec[c.loc] != mx || rn.vec[c.loc] != mn) return 1;
+		}
+
+		// along the innermost axis, and with the window spanning the whole axis
+		Tensor<int> v({2,6});
+		v.vec = {3,1,4,1,5,9, 2,6,5,3,5,8};
+		if (v.rolling_max(0, 3).vec != vector<int>({4,4,5,9, 6,6,5,8})) return 1;
+		if (v.rolling_min(0, 2).vec != vector<int>({1,1,1,1,5, 2,5,3,3,5})) return 1;
+		if (v.rolling_sum(0, 6).vec != v.sum({0}).vec || v.rolling_sum(1, 1).vec != v.vec) return 1;
+	}
+	cout << "rolling reductions: ok\n";
+
+	// masked tensors
+	{
+		// {time, lat, lon} with a land-sea mask on {lat, lon}
+		Tensor<double> t({4,3,5});
+		t.fill_sequence();
+		Tensor<int> ocean({3,5});
+		ocean.vec = {1,1,0,0,1, 0,0,0,0,0, 1,0,1,1,1};
+		MaskedTensor<double> m(t, ocean);
+		if (m.values.dim != vector<std::ptrdiff_t>({4,7}) || m.valid_cells() != vector<std::ptrdiff_t>({0,1,4,10,12,13,14})) return 1;
+
+		// dense reference: land is NaN, reductions skip NaN and count the rest
+		Tensor<double> d = m.unpack();
+		for (int i=0; i<60; ++i) if ((ocean.vec[i%15] != 0)? d.vec[i] != t.vec[i] : d.vec[i] == d.vec[i]) return 1;
+		auto ref_mean = [&](const vector<int>& axes){
+			vector<std::ptrdiff_t> rdim;
+			for (int p=0; p<3; ++p) if (std::find(axes.begin(), axes.end(), 2-p) == axes.end()) rdim.push_back(d.dim[p]);
+			Tensor<double> s(rdim), n(rdim);
+			for (const auto& c : d.indices()){
+				if (d.vec[c.loc] != d.vec[c.loc]) continue;
+				vector<std::ptrdiff_t> r;
+				for (int p=0; p<3; ++p) if (std::find(axes.begin(), axes.end(), 2-p) == axes.end()) r.push_back(c.ix[p]);
+				s(r) += d.vec[c.loc];
+				n(r) += 1;
+			}
+			for (size_t i=0; i<s.vec.size(); ++i) s.vec[i] = (n.vec[i] > 0)? s.vec[i]/n.vec[i] : NAN;
+			return s;
+		};
+		auto same = [](const Tensor<double>& a, const Tensor<double>& b){
+			if (a.dim != b.dim) return false;
+			for (size_t i=0; i<a.vec.size(); ++i) if (!(fabs(a.vec[i] - b.vec[i]) < 1e-12 || (a.vec[i] != a.vec[i] && b.vec[i] != b.vec[i]))) return false;
+			return true;
+		};
+		vector<vector<int>> axes_sets = {{2}, {1}, {0}, {0,1}, {1,2}, {0,2}, {0,1,2}};
+		for (const auto& axes : axes_sets) if (!same(m.mean(axes).unpack(), ref_mean(axes))) return 1;
+		if (!same(m.avg_dim(0).unpack(), ref_mean({0})) || !same(m.avg_dim(2).unpack(), ref_mean({2}))) return 1;
+		MaskedTensor<double> row = m.avg_dim(0);
+		if (row.mask_rank != 1 || row.valid_cells() != vector<std::ptrdiff_t>({0,2})) return 1;	// lat 1 is all land
+		if (m.sum({0,1}).values.vec[0] != 0+1+4+10+12+13+14) return 1;
+		if (m.accumulate(-1e9, {0,1}, tensor_detail::max_op<double>()).values.vec[3] != 59) return 1;
+
+		// weighted mean along a masked axis: the weighted sum over the valid count
+		MaskedTensor<double> wm = m.avg_dim(1, {1, 2, 3});
+		if (fabs(wm.values(0, 0) - (0*1 + 10*3)/2.0) > 1e-12) return 1;
+
+		// transform and arithmetic on the valid elements, on a second variable of the same grid
+		MaskedTensor<double> u = m;
+		u.transform(0, std::multiplies<double>(), {1,2,3,4,5});
+		if (u.values(1, 2) != 19*5 || u.values(1, 3) != 25*1) return 1;
+		MaskedTensor<float> f = m.pack(Tensor<float>({2,3,5}));
+		if (&f.valid_cells() != &m.valid_cells() || f.values.dim != vector<std::ptrdiff_t>({2,7})) return 1;
+		u -= m;
+		u *= 2;
+		if (u.values(0, 2) != 2*(4*5-4)) return 1;
+
+		// a mask of all dimensions from missing values
+		Tensor<float> g({2,3});
+		g.vec = {1, NAN, 3, -999, 5, 6};
+		MaskedTensor<float> h(g, -999.f);
+		if (h.values.vec != vector<float>({1,3,5,6}) || h.mean({0}).values.vec != vector<float>({2,5.5})) return 1;
+		if (h.unpack(0).vec != vector<float>({1,0,3,0,5,6})) return 1;
+	}
+	cout << "masked tensors: ok\n";
+
+	// reduced-precision storage: 16-bit floats and scale-offset packing
+	{
+		auto hbits = [](float f){ return TensorHalf(f).bits; };
+		auto bbits = [](float f){ return TensorBFloat16(f).bits; };
+		auto from_bits = [](std::uint32_t u){ float f; memcpy(&f, &u, 4); return f; };
+		// rounding to nearest even, overflow, subnormals and NaN
+		if (hbits(1) != 0x3c00 || hbits(-2) != 0xc000 || hbits(65504) != 0x7bff || hbits(65519) != 0x7bff || hbits(65520) != 0x7c00) return 1;
+		if (hbits(1 + ldexp(1.f, -11)) != 0x3c00 || hbits(1 + 3*ldexp(1.f, -11)) != 0x3c02 || hbits(INFINITY) != 0x7c00) return 1;
+		if (hbits(ldexp(1.f, -24)) != 0x0001 || hbits(ldexp(1.f, -25)) != 0 || hbits(3*ldexp(1.f, -26)) != 0x0001 || hbits(-1e-10f) != 0x8000) return 1;
+		if (float(TensorHalf::from_bits(0x03ff)) != 1023*ldexp(1.f, -24) || float(TensorHalf::from_bits(0x7bff)) != 65504) return 1;
+		if (hbits(NAN) != 0x7e00 || float(TensorHalf::from_bits(0x7c01)) == float(TensorHalf::from_bits(0x7c01))) return 1;
+		if (bbits(1) != 0x3f80 || bbits(from_bits(0x3f808000)) != 0x3f80 || bbits(from_bits(0x3f818000)) != 0x3f82 || bbits(from_bits(0x3f808001)) != 0x3f81) return 1;
+		if (bbits(from_bits(0x7f7fffff)) != 0x7f80 || float(TensorBFloat16(NAN)) == float(TensorBFloat16(NAN)) || float(TensorBFloat16::from_bits(0x4049)) != 3.140625f) return 1;
+		if (std::numeric_limits<TensorHalf>::max().bits != 0x7bff || float(std::numeric_limits<TensorBFloat16>::lowest()) != -from_bits(0x7f7f0000)) return 1;
+
+		// the vector conversions give the bits of the scalar ones
+		vector<float> fv;
+		for (std::uint64_t u=0; u < (std::uint64_t(1) << 32); u += 196613) fv.push_back(from_bits(u));
+		for (float f : {65520.f, 65519.f, 1 + ldexp(1.f, -11), ldexp(1.f, -25), from_bits(0x3f808000), from_bits(0x7f7fffff)}) fv.push_back(f);
+		vector<std::uint16_t> hv(fv.size()), bv(fv.size()), all(65536);
+		std::iota(all.begin(), all.end(), 0);
+		vector<float> wide(65536);
+		vector<std::int16_t> iv(all.begin(), all.end());
+		for (TensorSimd level : {TensorSimd::scalar, TensorSimd::neon, TensorSimd::avx2, TensorSimd::avx512}){
+			if (!tensor_simd_supported(level)) continue;
+			tensor_set_simd_level(level);
+			const auto& cv = tensor_detail::simd::converters();
+			cv.to_half(hv.data(), fv.data(), fv.size());
+			cv.to_bf16(bv.data(), fv.data(), fv.size());
+			for (size_t i=0; i<fv.size(); ++i) if (hv[i] != hbits(fv[i]) || bv[i] != bbits(fv[i])) return 1;
+			cv.from_half(wide.data(), all.data(), 65536);
+			for (int i=0; i<65536; ++i){
+				float r = TensorHalf::from_bits(i);
+				if (memcmp(&wide[i], &r, 4) != 0) return 1;
+			}
+			cv.from_bf16(wide.data(), all.data(), 65536);
+			for (int i=0; i<65536; ++i) if (wide[i] != from_bits(std::uint32_t(i) << 16) && wide[i] == wide[i]) return 1;
+			cv.from_i16(wide.data(), iv.data(), 65536);
+			for (int i=0; i<65536; ++i) if (wide[i] != iv[i]) return 1;
+
+			// every half survives the widening and narrowing of the elementwise kernels
+			Tensor<TensorHalf> x({65536});
+			for (int i=0; i<65536; ++i) x.vec[i] = TensorHalf::from_bits(i);
+			x *= 1;
+			for (int i=0; i<65536; ++i) if (x.vec[i].bits != i && ((i & 0x7c00) != 0x7c00 || (i & 0x3ff) == 0)) return 1;
+		}
+		tensor_set_simd_level(tensor_simd_detect());
+
+		// reductions widen to float and accumulate in double, like those of a float tensor
+		Tensor<TensorHalf> h({3,7,300});
+		Tensor<TensorBFloat16> b({3,7,300});
+		Tensor<float> f({3,7,300});
+		for (int i=0; i<int(f.vec.size()); ++i){ f.vec[i] = (i*37)%101 - 50.5; h.vec[i] = f.vec[i]; b.vec[i] = f.vec[i]; }
+		auto same16 = [](const auto& r16, const Tensor<float>& r){
+			if (r16.dim != r.dim) return false;
+			typedef typename std::decay<decltype(r16.vec[0])>::type H;
+			for (size_t i=0; i<r.vec.size(); ++i) if (r16.vec[i].bits != H(r.vec[i]).bits) return false;
+			return true;
+		};
+		vector<vector<int>> axes_sets = {{0}, {2}, {0,1}, {1,2}, {0,1,2}};
+		for (const auto& axes : axes_sets){
+			if (!same16(h.sum(axes), f.sum(axes)) || !same16(h.mean(axes), f.mean(axes)) || !same16(h.max(axes), f.max(axes))) return 1;
+			if (!same16(b.sum(axes), f.sum(axes)) || !same16(b.min(axes), f.min(axes))) return 1;
+		}
+		vector<double> w(7);
+		for (int i=0; i<7; ++i) w[i] = 1.0/(i+1);
+		if (!same16(h.avg_dim(1, w), f.avg_dim(1, w)) || !same16(h.avg_dim(0), f.avg_dim(0)) || float(h.max()) != f.max()) return 1;
+
+		// elementwise arithmetic in float, rounded once
+		Tensor<TensorHalf> h2 = h;
+		h2.fill_sequence();
+		h2 /= 7;
+		Tensor<TensorHalf> h3 = h2;
+		h3 += h;
+		h3 *= 0.3f;
+		for (size_t i=0; i<h.vec.size(); ++i) if (h3.vec[i].bits != TensorHalf(TensorHalf(float(h2.vec[i]) + float(h.vec[i]))*0.3f).bits) return 1;
+
+		// files store the bits
+		h3.to_npy("test_io.npy");
+		if (Tensor<TensorHalf>::from_npy("test_io.npy").vec[4321].bits != h3.vec[4321].bits) return 1;
+		b.save("test_io.tns");
+		if (Tensor<TensorBFloat16>::load("test_io.tns").vec[4321].bits != b.vec[4321].bits) return 1;
+		std::remove("test_io.npy");
+		std::remove("test_io.tns");
+
+		// packed int16: reductions on the packed values match those of the unpacked tensor
+		Tensor<double> t({4,50,60});
+		for (int i=0; i<int(t.vec.size()); ++i) t.vec[i] = 280 + 20*sin(i*0.01) + (i%7);
+		PackedTensor<double> p(t);
+		Tensor<double> u = p.unpack();
+		for (size_t i=0; i<t.vec.size(); ++i) if (fabs(u.vec[i] - t.vec[i]) > p.scale/2*(1+1e-9)) return 1;
+		auto close = [](const Tensor<double>& a, const Tensor<double>& b){
+			if (a.dim != b.dim) return false;
+			for (size_t i=0; i<a.vec.size(); ++i) if (fabs(a.vec[i] - b.vec[i]) > 1e-9*fabs(b.vec[i])) return false;
+			return true;
+		};
+		for (const auto& axes : axes_sets){
+			if (!close(p.sum(axes), u.sum(axes)) || !close(p.mean(axes), u.mean(axes))) return 1;
+			if (!close(p.max(axes), u.max(axes)) || !close(p.min(axes), u.min(axes))) return 1;
+		}
+		vector<double> w50(50);
+		for (int i=0; i<50; ++i) w50[i] = cos(i*0.03);
+		if (!close(p.avg_dim(1, w50), u.avg_dim(1, w50)) || !close(p.avg_dim(0), u.avg_dim(0))) return 1;
+		PackedTensor<double> q(t, -0.01, 300);
+		if (!close(q.max({0,1}), q.unpack().max({0,1}))) return 1;
+	}
+	cout << "reduced-precision storage: ok\n";
+
+	// deferred execution: dependencies, fusion and concurrent tasks give the eager results
+	{
+		int nthreads0 = tensor_num_threads();
+		ptrdiff_t grain0 = tensor_grain_size();
+		Tensor<double> a({20,30}), b({20,30}), c({20,30}), d({20,30}), u({30}), v({20,30}), s({30}), m({20}), out({20}), r({20,30});
+		Tensor<double> big({300,200}), big2({300,200});
+		vector<Tensor<double>> small(100, Tensor<double>({5,7}));
+		vector<Tensor<double>> sums(100, Tensor<double>({}));
+		vector<double> w30(30);
+		for (int i=0; i<30; ++i) w30[i] = 1 + 0.1*i;
+		auto init = [&](){
+			for (int i=0; i<600; ++i){ a.vec[i] = i%17; b.vec[i] = i%5 - 2; c.vec[i] = 0.5*(i%3); v.vec[i] = i; }
+			u.fill_sequence();
+			for (int i=0; i<60000; ++i) big.vec[i] = big2.vec[i] = i%101;
+			for (int k=0; k<100; ++k) small[k].vec.assign(35, k);
+		};
+
+		TensorGraph g;
+		g.add(a, b).mul(a, 2.0).sub(a, c);                           // one fused chain
+		g.assign(d, a*b + 1.0);                                      // waits for the chain
+		g.add(a, 1.0);                                               // waits for d (write after read)
+		g.add(u, 1.0);                                               // independent
+		g.accumulate(s, a, 0.0, 1, std::plus<double>());
+		g.avg_dim(m, v, 0, w30);
+		g.accumulate(out, (a - c)*(a - c), 0.0, 0, std::plus<double>());
+		g.transform(v, 0, std::multiplies<double>(), w30);
+		g.call([&](){ r = v*2.0; }, {v}, {r});
+		g.add(big, big2).mul(big, 0.5).add(big, 1.0);                 // split into parts
+		for (int k=0; k<100; ++k) g.add(small[k], 1.0).accumulate(sums[k], small[k], 0.0, {0,1}, std::plus<double>());
+		if (g.size() != 9 + 1 + 200) return 1;
+
+		// eager reference
+		init();
+		Tensor<double> a2 = a; a2 += b; a2 *= 2.0; a2 -= c;
+		Tensor<double> d2 = a2*b + 1.0;
+		a2 += 1.0;
+		Tensor<double> s2 = a2.accumulate(0, 1, std::plus<double>()), m2 = v.avg_dim(0, w30), u2 = u + 1.0;
+		Tensor<double> out2 = ((a2 - c)*(a2 - c)).accumulate(0, 0, std::plus<double>());
+		Tensor<double> v2 = v; v2.transform(0, std::multiplies<double>(), w30);
+		Tensor<double> r2 = v2*2.0, big3 = big;
+		big3 += big2; big3 *= 0.5; big3 += 1.0;
+
+		for (int nt : {4, 1}){
+			tensor_set_num_threads(nt);
+			tensor_set_grain_size(64);
+			for (int rep=0; rep<2; ++rep){
+				init();
+				g.eval();
+				if (a.vec != a2.vec || d.vec != d2.vec || s.vec != s2.vec || m.vec != m2.vec || u.vec != u2.vec) return 1;
+				if (!equals(out.vec, out2.vec, 1e-9) || v.vec != v2.vec || r.vec != r2.vec || big.vec != big3.vec) return 1;
+				for (int k=0; k<100; ++k) if (sums[k].vec[0] != 35*(k+1)) return 1;
+			}
+		}
+
+		// the first exception is rethrown after the other tasks have run
+		tensor_set_num_threads(4);
+		TensorGraph h;
+		h.call([](){ throw std::runtime_error("failed"); }, {}, {u});
+		h.add(s, 1.0);
+		bool thrown = false;
+		s.vec.assign(30, 0.0);
+		try { h.eval(); } catch (std::runtime_error&){ thrown = true; }
+		if (!thrown || s.vec != vector<double>(30, 1.0)) return 1;
+		tensor_set_num_threads(nthreads0);
+		tensor_set_grain_size(grain0);
+	}
+	cout << "task graph: ok\n";
+
 	u += 0.1;
 	u.print();
 	